@@ -1,304 +1,914 @@
 #include "panmanUtils.hpp"
 
-std::string getNucleotideSequenceFromBlockCoordinates(std::tuple< int, int, int, int > start,
-        std::tuple< int, int, int, int > end, const sequence_t& sequence,
-        const blockExists_t& blockExists, const blockStrand_t& blockStrand) {
+// Codon table used for translation
+static const std::unordered_map< std::string, std::string > nucToAA = {
+    {"TTT", "Phe"},
+    {"TTC", "Phe"},
+    {"TTA", "Leu"},
+    {"TTG", "Leu"},
+    {"CTT", "Leu"},
+    {"CTC", "Leu"},
+    {"CTA", "Leu"},
+    {"CTG", "Leu"},
+    {"ATT", "Ile"},
+    {"ATC", "Ile"},
+    {"ATA", "Ile"},
+    {"ATG", "Met"},
+    {"GTT", "Val"},
+    {"GTC", "Val"},
+    {"GTA", "Val"},
+    {"GTG", "Val"},
+    {"TCT", "Ser"},
+    {"TCC", "Ser"},
+    {"TCA", "Ser"},
+    {"TCG", "Ser"},
+    {"CCT", "Pro"},
+    {"CCC", "Pro"},
+    {"CCA", "Pro"},
+    {"CCG", "Pro"},
+    {"ACT", "Thr"},
+    {"ACC", "Thr"},
+    {"ACA", "Thr"},
+    {"ACG", "Thr"},
+    {"GCT", "Ala"},
+    {"GCC", "Ala"},
+    {"GCA", "Ala"},
+    {"GCG", "Ala"},
+    {"TAT", "Tyr"},
+    {"TAC", "Tyr"},
+    {"TAA", "*"},
+    {"TAG", "*"},
+    {"CAT", "His"},
+    {"CAC", "His"},
+    {"CAA", "Gln"},
+    {"CAG", "Gln"},
+    {"AAT", "Asn"},
+    {"AAC", "Asn"},
+    {"AAA", "Lys"},
+    {"AAG", "Lys"},
+    {"GAT", "Asp"},
+    {"GAC", "Asp"},
+    {"GAA", "Glu"},
+    {"GAG", "Glu"},
+    {"TGT", "Cys"},
+    {"TGC", "Cys"},
+    {"TGA", "*"},
+    {"TGG", "Trp"},
+    {"CGT", "Arg"},
+    {"CGC", "Arg"},
+    {"CGA", "Arg"},
+    {"CGG", "Arg"},
+    {"AGT", "Ser"},
+    {"AGC", "Ser"},
+    {"AGA", "Arg"},
+    {"AGG", "Arg"},
+    {"GGT", "Gly"},
+    {"GGC", "Gly"},
+    {"GGA", "Gly"},
+    {"GGG", "Gly"}
+};
+
+// Nucleotide of a window as used for translation. Anything other than A, C, G and T is treated
+// as a gap
+static char getAminoAcidWindowBase(char c, bool reverseComplement) {
+    if(c != 'A' && c != 'G' && c != 'T' && c != 'C') {
+        return '-';
+    }
+    if(reverseComplement) {
+        return panmanUtils::getComplementCharacter(c);
+    }
+    return c;
+}
 
+// Part of a translation window that changes as the tree is traversed
+struct AminoAcidWindowState {
+    // Whether the window could be laid out in the current sequence
+    bool valid = false;
+
+    // Index within the window of each < primary block ID, nuc position, gap position > it spans
+    std::map< std::tuple< int32_t, int32_t, int32_t >, size_t > positionIndex;
+    // Strand of every block spanned by the window at the time it was laid out
+    std::map< int32_t, bool > layoutStrand;
+
+    // Nucleotides of the window in reading order, and the codons translated from them. Each
+    // codon spans the window indices [starts[i], ends[i]]
     std::string ntSequence;
+    std::vector< std::string > aaSequence;
+    std::vector< size_t > starts, ends;
+
+    // < reference codon, whether it is a match > that each codon is aligned to. A codon that is
+    // not a match is inserted before the reference codon
+    std::vector< std::pair< size_t, bool > > alignment;
+    // Records of the amino acid mutations keyed by < kind, index >. Substitutions (0) and
+    // deletions (2) are indexed by reference codon and insertions (1) by codon, so that the map
+    // is in output order
+    std::map< std::pair< int, size_t >, std::string > differences;
+
+    // Amino acid mutations with respect to the root translation
+    std::string mutations;
+};
+
+// Coding window translated incrementally during the depth first traversal
+struct AminoAcidWindow {
+    // < start, end > PanMAT coordinates in the root sequence of the segments that are joined to
+    // form the window, in genome order. The ends are exclusive
+    std::vector< std::pair< std::tuple< int, int, int, int >, std::tuple< int, int, int, int > > > segments;
+    // Whether the window is read from the reverse strand
+    bool reverseComplement = false;
+    // Whether the window could be placed in the root sequence
+    bool placed = false;
+
+    // Translation of the root sequence that mutations are reported against
+    std::vector< std::string > referenceAASequence;
+    std::vector< size_t > referenceStarts, referenceEnds;
+
+    AminoAcidWindowState current;
+
+    // < node ID, amino acid mutations > of every node that differs from the root
+    std::vector< std::pair< std::string, std::string > > nodeMutations;
+};
+
+// For backtracking the changes made to a window at a node
+struct AminoAcidWindowUndo {
+    // Full copy of the previous state if the window had to be rebuilt
+    bool rebuilt = false;
+    AminoAcidWindowState oldState;
+
+    // < window index, old nucleotide >
+    std::vector< std::pair< size_t, char > > ntChanges;
+    // < codon index, old amino acid > for codons re-translated in place
+    std::vector< std::pair< size_t, std::string > > codonChanges;
+    // Codons from tailStart onwards were re-translated after a frame shift
+    size_t tailStart = std::numeric_limits< size_t >::max();
+    std::vector< std::string > oldAASequence;
+    std::vector< size_t > oldStarts, oldEnds;
+    std::vector< std::pair< size_t, bool > > oldAlignment;
+
+    // < key, old record > of every changed difference. An empty record means there was none
+    std::vector< std::pair< std::pair< int, size_t >, std::string > > differenceChanges;
+    bool changed = false;
+    std::string oldMutations;
+};
+
+// Lay out the segment between start and end in reading order, following the block strands, and
+// append its nucleotides to the window. Returns false if end is not reached
+static bool layoutAminoAcidWindow(const std::tuple< int, int, int, int >& start,
+                                  const std::tuple< int, int, int, int >& end,
+                                  const sequence_t& sequence, const blockExists_t& blockExists,
+                                  const blockStrand_t& blockStrand, AminoAcidWindowState& state) {
+    int32_t startBlock = std::get<0>(start);
+    int32_t startPos = std::get<2>(start);
+    int32_t startGap = std::get<3>(start);
+
+    // Adds a position to the window. Returns true once the end is reached
+    auto addPosition = [&](int32_t blockId, int32_t pos, int32_t gapPos) {
+        if(std::make_tuple(blockId, -1, pos, gapPos) == end) {
+            return true;
+        }
+        state.positionIndex[std::make_tuple(blockId, pos, gapPos)] = state.ntSequence.size();
+        char c = (gapPos == -1) ? sequence[blockId].first[pos].first
+                 : sequence[blockId].first[pos].second[gapPos];
+        state.ntSequence += blockExists[blockId].first ? getAminoAcidWindowBase(c, false) : '-';
+        return false;
+    };
 
-    for(size_t i = (size_t)std::get<0>(start); i <= (size_t)std::get<0>(end); i++) {
+    for(int32_t i = startBlock; i <= std::get<0>(end); i++) {
+        const auto& block = sequence[i].first;
+        state.layoutStrand[i] = blockStrand[i].first;
         if(blockStrand[i].first) {
-            size_t startMainNuc = (i == (size_t)std::get<0>(start))? (size_t)std::get<2>(start): 0;
-
-            for(size_t j = startMainNuc; j < sequence[i].first.size(); j++) {
-                int startGapNuc = (i == (size_t)std::get<0>(start) && j == (size_t)startMainNuc)?
-                                  std::get<3>(start): 0;
-                if(startGapNuc != -1) {
-                    for(size_t k = (size_t)std::get<3>(start);
-                            k < sequence[i].first[j].second.size(); k++) {
-                        if(std::make_tuple((int)i, -1, (int)j, (int)k) == end) {
-                            return ntSequence;
-                        }
-                        if(blockExists[i].first) {
-                            ntSequence += sequence[i].first[j].second[k];
-                        } else {
-                            ntSequence += '-';
-                        }
-                    }
+            for(int32_t j = (i == startBlock) ? startPos : 0; j < (int32_t)block.size(); j++) {
+                int32_t firstGap = 0;
+                if(i == startBlock && j == startPos) {
+                    // Gap nucleotides come before the main nucleotide
+                    firstGap = (startGap == -1) ? block[j].second.size() : startGap;
                 }
-                if(std::make_tuple((int)i, -1, (int)j, -1) == end) {
-                    return ntSequence;
+                for(int32_t k = firstGap; k < (int32_t)block[j].second.size(); k++) {
+                    if(addPosition(i, j, k)) {
+                        return true;
+                    }
                 }
-                if(blockExists[i].first) {
-                    ntSequence += sequence[i].first[j].first;
-                } else {
-                    ntSequence += '-';
+                if(addPosition(i, j, -1)) {
+                    return true;
                 }
             }
         } else {
-            size_t startMainNuc = (i == (size_t)std::get<0>(start))? (size_t)std::get<2>(start):
-                                  sequence[0].first.size()-1;
-            for(size_t j = startMainNuc; j+1 > 0; j--) {
-                if(std::make_tuple((int)i, -1, (int)j, -1) == end) {
-                    return ntSequence;
+            for(int32_t j = (i == startBlock) ? startPos : (int32_t)block.size() - 1; j >= 0; j--) {
+                int32_t firstGap = (int32_t)block[j].second.size() - 1;
+                if(i == startBlock && j == startPos && startGap != -1) {
+                    // On the reverse strand the main nucleotide comes before the gap nucleotides
+                    firstGap = startGap;
+                } else if(addPosition(i, j, -1)) {
+                    return true;
                 }
-                if(blockExists[i].first) {
-                    ntSequence += sequence[i].first[j].first;
-                } else {
-                    ntSequence += '-';
-                }
-                size_t startGapNuc = (i == (size_t)(std::get<0>(start)) && j == startMainNuc) ?
-                                     (size_t)std::get<3>(start): sequence[i].first[j].second.size() - 1;
-                for(size_t k = startGapNuc; k+1 > 0; k--) {
-                    if(std::make_tuple((int)i, -1, (int)j, k) == end) {
-                        return ntSequence;
-                    }
-                    if(blockExists[i].first) {
-                        ntSequence += sequence[i].first[j].second[k];
-                    } else {
-                        ntSequence += '-';
+                for(int32_t k = firstGap; k >= 0; k--) {
+                    if(addPosition(i, j, k)) {
+                        return true;
                     }
                 }
             }
         }
     }
+    return false;
+}
+
+// Lay out and read a window by joining its segments. Reverse strand windows are read from end
+// to start and complemented
+static bool buildAminoAcidWindow(const AminoAcidWindow& window, const sequence_t& sequence,
+                                 const blockExists_t& blockExists,
+                                 const blockStrand_t& blockStrand, AminoAcidWindowState& state) {
+    state.positionIndex.clear();
+    state.layoutStrand.clear();
+    state.ntSequence.clear();
+    for(const auto& segment: window.segments) {
+        if(!layoutAminoAcidWindow(segment.first, segment.second, sequence, blockExists,
+                                  blockStrand, state)) {
+            return false;
+        }
+    }
+    if(window.reverseComplement) {
+        size_t length = state.ntSequence.size();
+        for(auto& position: state.positionIndex) {
+            position.second = length - 1 - position.second;
+        }
+        std::reverse(state.ntSequence.begin(), state.ntSequence.end());
+        for(auto& c: state.ntSequence) {
+            if(c != '-') {
+                c = panmanUtils::getComplementCharacter(c);
+            }
+        }
+    }
+    return true;
+}
 
-    return "ERROR";
+// Re-translate the window starting from the given codon
+static void translateAminoAcidWindow(AminoAcidWindowState& state, size_t fromCodon) {
+    state.aaSequence.resize(fromCodon);
+    state.starts.resize(fromCodon);
+    state.ends.resize(fromCodon);
+
+    std::string codon;
+    size_t codonStart = 0;
+    for(size_t i = (fromCodon ? state.ends[fromCodon - 1] + 1 : 0); i < state.ntSequence.size(); i++) {
+        if(state.ntSequence[i] == '-') {
+            continue;
+        }
+        if(codon.size() == 0) {
+            codonStart = i;
+        }
+        codon += state.ntSequence[i];
+        if(codon.size() == 3) {
+            state.starts.push_back(codonStart);
+            state.ends.push_back(i);
+            state.aaSequence.push_back(nucToAA.at(codon));
+            codon.clear();
+        }
+    }
 }
 
-std::tuple< std::vector< std::string >, std::vector< size_t >, std::vector< size_t > >
-getAminoAcidSequence(std::tuple< int, int, int, int > start,
-                     std::tuple< int, int, int, int > end, const sequence_t& sequence,
-                     const blockExists_t& blockExists,
-                     const blockStrand_t& blockStrand) {
-
-    std::string ntSequence = getNucleotideSequenceFromBlockCoordinates(start, end, sequence,
-                             blockExists, blockStrand);
-
-    if(ntSequence == "ERROR") {
-        panmanUtils::printError("Error in translating input coordinates to PanMAT coordinates."
-                                " Coordinates may be out of range.");
-        return std::make_tuple(std::vector< std::string >({"ERROR"}), std::vector<size_t>(),
-                               std::vector<size_t>());
-    }
-
-    for(size_t i = 0; i < ntSequence.size(); i++) {
-        if(ntSequence[i] != 'A' && ntSequence[i] != 'G' && ntSequence[i] != 'T'
-                && ntSequence[i] != 'C') {
-            ntSequence[i] = '-';
-        }
-    }
-
-    std::unordered_map< std::string, std::string > nucToAA = {
-        {"TTT", "Phe"},
-        {"TTC", "Phe"},
-        {"TTA", "Leu"},
-        {"TTG", "Leu"},
-        {"CTT", "Leu"},
-        {"CTC", "Leu"},
-        {"CTA", "Leu"},
-        {"CTG", "Leu"},
-        {"ATT", "Ile"},
-        {"ATC", "Ile"},
-        {"ATA", "Ile"},
-        {"ATG", "Met"},
-        {"GTT", "Val"},
-        {"GTC", "Val"},
-        {"GTA", "Val"},
-        {"GTG", "Val"},
-        {"TCT", "Ser"},
-        {"TCC", "Ser"},
-        {"TCA", "Ser"},
-        {"TCG", "Ser"},
-        {"CCT", "Pro"},
-        {"CCC", "Pro"},
-        {"CCA", "Pro"},
-        {"CCG", "Pro"},
-        {"ACT", "Thr"},
-        {"ACC", "Thr"},
-        {"ACA", "Thr"},
-        {"ACG", "Thr"},
-        {"GCT", "Ala"},
-        {"GCC", "Ala"},
-        {"GCA", "Ala"},
-        {"GCG", "Ala"},
-        {"TAT", "Tyr"},
-        {"TAC", "Tyr"},
-        {"TAA", "*"},
-        {"TAG", "*"},
-        {"CAT", "His"},
-        {"CAC", "His"},
-        {"CAA", "Gln"},
-        {"CAG", "Gln"},
-        {"AAT", "Asn"},
-        {"AAC", "Asn"},
-        {"AAA", "Lys"},
-        {"AAG", "Lys"},
-        {"GAT", "Asp"},
-        {"GAC", "Asp"},
-        {"GAA", "Glu"},
-        {"GAG", "Glu"},
-        {"TGT", "Cys"},
-        {"TGC", "Cys"},
-        {"TGA", "*"},
-        {"TGG", "Trp"},
-        {"CGT", "Arg"},
-        {"CGC", "Arg"},
-        {"CGA", "Arg"},
-        {"CGG", "Arg"},
-        {"AGT", "Ser"},
-        {"AGC", "Ser"},
-        {"AGA", "Arg"},
-        {"AGG", "Arg"},
-        {"GGT", "Gly"},
-        {"GGC", "Gly"},
-        {"GGA", "Gly"},
-        {"GGG", "Gly"}
+// Set the record of a difference, or remove it if the record is empty
+static void setAminoAcidDifference(AminoAcidWindowState& state, const std::pair< int, size_t >& key,
+                                   const std::string& record, AminoAcidWindowUndo* undo) {
+    auto it = state.differences.find(key);
+    std::string oldRecord = (it == state.differences.end()) ? "" : it->second;
+    if(oldRecord == record) {
+        return;
+    }
+    if(undo != nullptr) {
+        undo->differenceChanges.push_back(std::make_pair(key, oldRecord));
+    }
+    if(record.empty()) {
+        state.differences.erase(it);
+    } else {
+        state.differences[key] = record;
+    }
+}
+
+// Align the codons from fromCodon onwards to the root translation and update their differences.
+// Codons before fromCodon keep their alignment, so the walk resumes from the reference codon that
+// follows them
+static void alignAminoAcidWindow(AminoAcidWindow& window, size_t fromCodon,
+                                 AminoAcidWindowUndo* undo) {
+    auto& state = window.current;
+    const auto& referenceStarts = window.referenceStarts;
+    const auto& referenceEnds = window.referenceEnds;
+
+    size_t refItr = 0;
+    if(fromCodon) {
+        refItr = state.alignment[fromCodon - 1].first + (state.alignment[fromCodon - 1].second ? 1 : 0);
+    }
+    size_t altItr = fromCodon;
+
+    std::vector< std::pair< int, size_t > > stale;
+    for(auto key: {std::make_pair(0, refItr), std::make_pair(1, altItr), std::make_pair(2, refItr)}) {
+        for(auto it = state.differences.lower_bound(key);
+                it != state.differences.end() && it->first.first == key.first; it++) {
+            stale.push_back(it->first);
+        }
+    }
+    for(const auto& key: stale) {
+        setAminoAcidDifference(state, key, "", undo);
+    }
+    state.alignment.resize(fromCodon);
+
+    auto match = [&]() {
+        state.alignment.push_back(std::make_pair(refItr, true));
+        if(window.referenceAASequence[refItr] != state.aaSequence[altItr]) {
+            setAminoAcidDifference(state, std::make_pair(0, refItr),
+                                   "S:"+std::to_string(refItr)+":"+state.aaSequence[altItr]+";", undo);
+        }
+        altItr++;
+        refItr++;
+    };
+    auto insertion = [&]() {
+        state.alignment.push_back(std::make_pair(refItr, false));
+        setAminoAcidDifference(state, std::make_pair(1, altItr),
+                               "I:"+std::to_string(refItr)+":"+state.aaSequence[altItr]+";", undo);
+        altItr++;
+    };
+    auto deletion = [&]() {
+        setAminoAcidDifference(state, std::make_pair(2, refItr), "D:"+std::to_string(refItr)+";", undo);
+        refItr++;
     };
 
-    std::vector< std::string > aaSequence;
-    std::vector< size_t > starts, ends;
-    std::string currentString;
-    for(size_t i = 0; i < ntSequence.size(); i++) {
-        if(ntSequence[i] != '-') {
-            if(currentString.size() == 0) {
-                starts.push_back(i);
-            }
-            currentString += ntSequence[i];
+    while(altItr < state.starts.size() && refItr < referenceStarts.size()) {
+        if(state.starts[altItr] > referenceEnds[refItr]) {
+            deletion();
+        } else if(state.starts[altItr] < referenceStarts[refItr]) {
+            insertion();
+        } else {
+            match();
         }
-        if(currentString.size() == 3) {
-            ends.push_back(i);
-            aaSequence.push_back(nucToAA[currentString]);
-            currentString = "";
+    }
+    // Insert remaining Amino Acids
+    while(altItr < state.starts.size()) {
+        insertion();
+    }
+    // Delete remaining Amino Acids
+    while(refItr < referenceStarts.size()) {
+        deletion();
+    }
+}
+
+// Update the difference of a codon that was re-translated in place
+static void updateAminoAcidDifference(AminoAcidWindow& window, size_t codon, AminoAcidWindowUndo& undo) {
+    auto& state = window.current;
+    size_t refIndex = state.alignment[codon].first;
+    if(state.alignment[codon].second) {
+        std::string record;
+        if(window.referenceAASequence[refIndex] != state.aaSequence[codon]) {
+            record = "S:"+std::to_string(refIndex)+":"+state.aaSequence[codon]+";";
         }
+        setAminoAcidDifference(state, std::make_pair(0, refIndex), record, &undo);
+    } else {
+        setAminoAcidDifference(state, std::make_pair(1, codon),
+                               "I:"+std::to_string(refIndex)+":"+state.aaSequence[codon]+";", &undo);
     }
-    while(starts.size() > ends.size()) {
-        starts.pop_back();
+}
+
+// Amino acid mutations of the current translation with respect to the root translation
+static std::string getAminoAcidMutations(const AminoAcidWindowState& state) {
+    std::string mutations;
+    for(const auto& difference: state.differences) {
+        mutations += difference.second;
     }
+    return mutations;
+}
 
-    assert(starts.size() == ends.size() && starts.size() == aaSequence.size());
+// Bring a window up to date with the mutations of a node that have already been applied to the
+// sequence. Only the nucleotides touched by the node's mutations are re-read and only the codons
+// containing them are re-translated, unless a mutation changes the reading frame, in which case
+// every downstream codon is re-translated. The window is only laid out again if a block it spans
+// is present on a different strand than the one it was laid out with
+static void updateAminoAcidWindow(panmanUtils::Node* node, const sequence_t& sequence,
+                                  const blockExists_t& blockExists, const blockStrand_t& blockStrand,
+                                  AminoAcidWindow& window, AminoAcidWindowUndo& undo) {
+    auto& state = window.current;
+
+    bool rebuild = !state.valid;
+    std::vector< int32_t > changedBlocks;
+    for(const auto& mutation: node->blockMutation) {
+        if(rebuild) {
+            break;
+        }
+        if(mutation.secondaryBlockId != -1) {
+            continue;
+        }
+        auto strand = state.layoutStrand.find(mutation.primaryBlockId);
+        if(strand == state.layoutStrand.end()) {
+            continue;
+        }
+        if(blockExists[mutation.primaryBlockId].first && strand->second != blockStrand[mutation.primaryBlockId].first) {
+            rebuild = true;
+        }
+        changedBlocks.push_back(mutation.primaryBlockId);
+    }
 
-    return std::make_tuple(aaSequence, starts, ends);
+    if(rebuild) {
+        undo.rebuilt = true;
+        undo.oldState = state;
+        state.valid = buildAminoAcidWindow(window, sequence, blockExists, blockStrand, state);
+        if(!state.valid) {
+            panmanUtils::printError("Error in translating input coordinates to PanMAT coordinates"
+                                    " in sequence " + node->identifier
+                                    + ". Coordinates may be out of range");
+            return;
+        }
+        translateAminoAcidWindow(state, 0);
+        state.alignment.clear();
+        state.differences.clear();
+        alignAminoAcidWindow(window, 0, nullptr);
+        state.mutations = getAminoAcidMutations(state);
+        return;
+    }
 
-}
+    bool frameShift = false;
+    size_t firstChange = std::numeric_limits< size_t >::max();
+    // Re-read a nucleotide of the window
+    auto refresh = [&](int32_t primaryBlockId, int32_t nucPosition, int32_t nucGapPosition, size_t index) {
+        const auto& position = sequence[primaryBlockId].first[nucPosition];
+        char c = (nucGapPosition == -1) ? position.first : position.second[nucGapPosition];
+        char newVal = blockExists[primaryBlockId].first ?
+                      getAminoAcidWindowBase(c, window.reverseComplement) : '-';
+        char oldVal = state.ntSequence[index];
+        if(newVal == oldVal) {
+            return;
+        }
+        undo.ntChanges.push_back(std::make_pair(index, oldVal));
+        state.ntSequence[index] = newVal;
+        frameShift |= ((oldVal == '-') != (newVal == '-'));
+        firstChange = std::min(firstChange, index);
+    };
 
-void panmanUtils::Tree::extractAminoAcidTranslations(std::ostream& fout,
-        int64_t start, int64_t end) {
-    sequence_t referenceSequence;
-    blockExists_t referenceBlockExists;
-    blockStrand_t referenceBlockStrand;
+    for(auto primaryBlockId: changedBlocks) {
+        for(auto it = state.positionIndex.lower_bound(std::make_tuple(primaryBlockId,
+                std::numeric_limits< int32_t >::min(), std::numeric_limits< int32_t >::min()));
+                it != state.positionIndex.end() && std::get<0>(it->first) == primaryBlockId; it++) {
+            refresh(primaryBlockId, std::get<1>(it->first), std::get<2>(it->first), it->second);
+        }
+    }
+    for(const auto& mutation: node->nucMutation) {
+        if(mutation.secondaryBlockId != -1) {
+            continue;
+        }
+        for(int j = 0; j < mutation.length(); j++) {
+            panmanUtils::Coordinate coordinate(mutation, j);
+            auto it = state.positionIndex.find(std::make_tuple(coordinate.primaryBlockId,
+                                               coordinate.nucPosition, coordinate.nucGapPosition));
+            if(it == state.positionIndex.end()) {
+                continue;
+            }
+            refresh(coordinate.primaryBlockId, coordinate.nucPosition, coordinate.nucGapPosition, it->second);
+        }
+    }
 
-    if(end <= start) {
-        printError("End coordinate must be greater than start");
+    if(undo.ntChanges.size() == 0) {
+        // The parent's translation and mutations carry over unchanged
         return;
     }
 
-    // Get reference sequence in the PanMAT coordinate system
-    getSequenceFromReference(referenceSequence, referenceBlockExists, referenceBlockStrand,
-                             root->identifier);
+    if(frameShift) {
+        // First codon that can be affected is the one ending at or after the first change
+        size_t fromCodon = std::lower_bound(state.ends.begin(), state.ends.end(), firstChange)
+                           - state.ends.begin();
+        undo.tailStart = fromCodon;
+        undo.oldAASequence.assign(state.aaSequence.begin() + fromCodon, state.aaSequence.end());
+        undo.oldStarts.assign(state.starts.begin() + fromCodon, state.starts.end());
+        undo.oldEnds.assign(state.ends.begin() + fromCodon, state.ends.end());
+        undo.oldAlignment.assign(state.alignment.begin() + fromCodon, state.alignment.end());
+        translateAminoAcidWindow(state, fromCodon);
+        alignAminoAcidWindow(window, fromCodon, &undo);
+    } else {
+        // The reading frame is unchanged, so only the codons containing a change are affected
+        for(const auto& change: undo.ntChanges) {
+            size_t codon = std::upper_bound(state.starts.begin(), state.starts.end(), change.first)
+                           - state.starts.begin();
+            if(codon == 0 || state.ends[codon - 1] < change.first) {
+                continue;
+            }
+            codon--;
+            std::string codonSequence;
+            for(size_t i = state.starts[codon]; i <= state.ends[codon]; i++) {
+                if(state.ntSequence[i] != '-') {
+                    codonSequence += state.ntSequence[i];
+                }
+            }
+            undo.codonChanges.push_back(std::make_pair(codon, state.aaSequence[codon]));
+            state.aaSequence[codon] = nucToAA.at(codonSequence);
+            updateAminoAcidDifference(window, codon, undo);
+        }
+    }
 
-    // get PanMAT coordinates from global coordinates
-    std::tuple< int, int, int, int > panMATStart = globalCoordinateToBlockCoordinate(start,
-            referenceSequence, referenceBlockExists, referenceBlockStrand);
-    std::tuple< int, int, int, int > panMATEnd = globalCoordinateToBlockCoordinate(end,
-            referenceSequence, referenceBlockExists, referenceBlockStrand);
+    if(undo.differenceChanges.size()) {
+        undo.changed = true;
+        undo.oldMutations = std::move(state.mutations);
+        state.mutations = getAminoAcidMutations(state);
+    }
+}
 
-    if(std::get<0>(panMATStart) == -1 || std::get<0>(panMATEnd) == -1) {
-        printError("Error in translating input coordinates to PanMAT coordinates in reference"
-                   " sequence. Coordinates may be out of range");
+static void undoAminoAcidWindow(AminoAcidWindow& window, AminoAcidWindowUndo& undo) {
+    auto& state = window.current;
+    if(undo.rebuilt) {
+        state = std::move(undo.oldState);
         return;
     }
+    for(auto it = undo.differenceChanges.rbegin(); it != undo.differenceChanges.rend(); it++) {
+        if(it->second.empty()) {
+            state.differences.erase(it->first);
+        } else {
+            state.differences[it->first] = it->second;
+        }
+    }
+    for(auto it = undo.codonChanges.rbegin(); it != undo.codonChanges.rend(); it++) {
+        state.aaSequence[it->first] = it->second;
+    }
+    if(undo.tailStart != std::numeric_limits< size_t >::max()) {
+        state.aaSequence.resize(undo.tailStart);
+        state.starts.resize(undo.tailStart);
+        state.ends.resize(undo.tailStart);
+        state.alignment.resize(undo.tailStart);
+        state.aaSequence.insert(state.aaSequence.end(), undo.oldAASequence.begin(),
+                                undo.oldAASequence.end());
+        state.starts.insert(state.starts.end(), undo.oldStarts.begin(), undo.oldStarts.end());
+        state.ends.insert(state.ends.end(), undo.oldEnds.begin(), undo.oldEnds.end());
+        state.alignment.insert(state.alignment.end(), undo.oldAlignment.begin(), undo.oldAlignment.end());
+    }
+    for(auto it = undo.ntChanges.rbegin(); it != undo.ntChanges.rend(); it++) {
+        state.ntSequence[it->first] = it->second;
+    }
+    if(undo.changed) {
+        state.mutations = std::move(undo.oldMutations);
+    }
+}
 
-    auto aaSeq = getAminoAcidSequence(panMATStart, panMATEnd, referenceSequence,
-                                      referenceBlockExists, referenceBlockStrand);
+// State shared across the depth first traversal of the amino acid translation
+struct AminoAcidTranslationState {
+    sequence_t sequence;
+    blockExists_t blockExists;
+    blockStrand_t blockStrand;
+
+    std::vector< AminoAcidWindow > windows;
+};
+
+static void extractAminoAcidTranslationsHelper(panmanUtils::Tree* T, panmanUtils::Node* node,
+        AminoAcidTranslationState& state) {
+    blockMutationInfo_t blockMutationInfo;
+    mutationInfo_t mutationInfo;
+    T->applyMutations(node, state.sequence, state.blockExists, state.blockStrand,
+                      blockMutationInfo, mutationInfo);
+
+    std::vector< AminoAcidWindowUndo > undo(state.windows.size());
+    tbb::parallel_for((size_t)0, state.windows.size(), [&](size_t i) {
+        auto& window = state.windows[i];
+        if(!window.placed) {
+            return;
+        }
+        updateAminoAcidWindow(node, state.sequence, state.blockExists, state.blockStrand,
+                              window, undo[i]);
+        if(window.current.valid && window.current.mutations.length()) {
+            window.nodeMutations.push_back(std::make_pair(node->identifier,
+                                           window.current.mutations));
+        }
+    });
 
-    std::cout << std::get<0>(aaSeq).size() << " " << std::get<1>(aaSeq).size() << " " << std::get<2>(aaSeq).size() << std::endl;
+    for(auto child: node->children) {
+        extractAminoAcidTranslationsHelper(T, child, state);
+    }
 
-    std::vector< std::string > referenceAASequence = std::get<0>(aaSeq);
-    std::vector< size_t > referenceStarts = std::get<1>(aaSeq);
-    std::vector< size_t > referenceEnds = std::get<2>(aaSeq);
+    for(size_t i = 0; i < state.windows.size(); i++) {
+        if(state.windows[i].placed) {
+            undoAminoAcidWindow(state.windows[i], undo[i]);
+        }
+    }
+    T->undoMutations(state.sequence, state.blockExists, state.blockStrand, blockMutationInfo,
+                     mutationInfo);
+}
 
-    if(referenceAASequence.size() == 0) {
-        return;
+// Index from global coordinates of a sequence to PanMAT coordinates, with the same semantics as
+// Tree::globalCoordinateToBlockCoordinate. Only the offset of every present block is stored, so a
+// lookup scans a single block instead of the whole sequence
+struct GlobalCoordinateIndex {
+    // Present blocks in sequence order, and the global coordinate of their first nucleotide
+    std::vector< int32_t > blockIds;
+    std::vector< int64_t > blockOffsets;
+    int64_t length = 0;
+
+    GlobalCoordinateIndex(const sequence_t& sequence, const blockExists_t& blockExists) {
+        for(size_t i = 0; i < blockExists.size(); i++) {
+            if(!blockExists[i].first) {
+                continue;
+            }
+            blockIds.push_back(i);
+            blockOffsets.push_back(length);
+            for(const auto& position: sequence[i].first) {
+                for(auto c: position.second) {
+                    if(c != '-' && c != 'x') {
+                        length++;
+                    }
+                }
+                if(position.first != '-' && position.first != 'x') {
+                    length++;
+                }
+            }
+        }
     }
 
-    tbb::concurrent_unordered_map< std::string, std::string > aaMutations;
+    std::tuple< int, int, int, int > lookup(int64_t globalCoordinate, const sequence_t& sequence,
+                                            const blockStrand_t& blockStrand) const {
+        if(globalCoordinate >= length) {
+            globalCoordinate -= length;
+        }
+        if(globalCoordinate < 0 || globalCoordinate >= length) {
+            return std::make_tuple(-1, -1, -1, -1);
+        }
 
-    tbb::parallel_for_each(allNodes, [&](auto u) {
-        sequence_t altSequence;
-        blockExists_t altBlockExists;
-        blockStrand_t altBlockStrand;
+        size_t b = std::upper_bound(blockOffsets.begin(), blockOffsets.end(), globalCoordinate)
+                   - blockOffsets.begin() - 1;
+        int32_t i = blockIds[b];
+        int64_t ctr = blockOffsets[b];
+        const auto& block = sequence[i].first;
+        auto isBase = [](char c) {
+            return c != '-' && c != 'x';
+        };
 
-        // Get alternate sequence in the PanMAT coordinate system
-        getSequenceFromReference(altSequence, altBlockExists, altBlockStrand,
-                                 u.first);
+        if(blockStrand[i].first) {
+            for(size_t k = 0; k < block.size(); k++) {
+                for(size_t w = 0; w < block[k].second.size(); w++) {
+                    if(isBase(block[k].second[w]) && ctr++ == globalCoordinate) {
+                        return std::make_tuple(i, -1, k, w);
+                    }
+                }
+                if(isBase(block[k].first) && ctr++ == globalCoordinate) {
+                    return std::make_tuple(i, -1, k, -1);
+                }
+            }
+        } else {
+            for(size_t k = block.size(); k-- > 0;) {
+                if(isBase(block[k].first) && ctr++ == globalCoordinate) {
+                    return std::make_tuple(i, -1, k, -1);
+                }
+                for(size_t w = block[k].second.size(); w-- > 0;) {
+                    if(isBase(block[k].second[w]) && ctr++ == globalCoordinate) {
+                        return std::make_tuple(i, -1, k, w);
+                    }
+                }
+            }
+        }
+        return std::make_tuple(-1, -1, -1, -1);
+    }
+};
+
+// Translate a set of windows for every node in a single traversal. Each window is given as the
+// < start, end > global coordinates of its segments in the root sequence, in genome order, along
+// with the strand it is read from. Windows that can't be placed in the root sequence are
+// reported and left out
+static void translateAminoAcidWindows(panmanUtils::Tree* T,
+                                      const std::vector< std::pair< std::vector< std::pair< int64_t, int64_t > >, bool > >& coordinates,
+                                      AminoAcidTranslationState& state) {
+    // The windows are set up on the root sequence
+    blockMutationInfo_t blockMutationInfo;
+    mutationInfo_t mutationInfo;
+    T->getConsensusSequence(state.sequence, state.blockExists, state.blockStrand);
+    T->applyMutations(T->root, state.sequence, state.blockExists, state.blockStrand,
+                      blockMutationInfo, mutationInfo);
+    GlobalCoordinateIndex coordinateIndex(state.sequence, state.blockExists);
+
+    state.windows.resize(coordinates.size());
+    tbb::parallel_for((size_t)0, coordinates.size(), [&](size_t i) {
+        auto& window = state.windows[i];
+        window.reverseComplement = coordinates[i].second;
 
         // get PanMAT coordinates from global coordinates
-        std::tuple< int, int, int, int > altPanMATStart = globalCoordinateToBlockCoordinate(start,
-                altSequence, altBlockExists, altBlockStrand);
-        std::tuple< int, int, int, int > altPanMATEnd = globalCoordinateToBlockCoordinate(end,
-                altSequence, altBlockExists, altBlockStrand);
-
-        if(std::get<0>(altPanMATStart) == -1 || std::get<0>(altPanMATEnd) == -1) {
-            printError("Error in translating input coordinates to PanMAT coordinates in sequence "
-                       + u.first + ". Coordinates may be out of range");
+        bool placed = true;
+        for(const auto& segment: coordinates[i].first) {
+            window.segments.emplace_back(
+                coordinateIndex.lookup(segment.first, state.sequence, state.blockStrand),
+                coordinateIndex.lookup(segment.second, state.sequence, state.blockStrand));
+            placed &= (std::get<0>(window.segments.back().first) != -1
+                       && std::get<0>(window.segments.back().second) != -1);
+        }
+
+        if(!placed || !buildAminoAcidWindow(window, state.sequence, state.blockExists,
+                                            state.blockStrand, window.current)) {
+            panmanUtils::printError("Error in translating input coordinates ["
+                                    + std::to_string(coordinates[i].first.front().first) + ", "
+                                    + std::to_string(coordinates[i].first.back().second)
+                                    + ") to PanMAT coordinates in reference sequence."
+                                    " Coordinates may be out of range");
             return;
         }
+        window.placed = true;
+        window.current.valid = true;
+
+        translateAminoAcidWindow(window.current, 0);
+        window.referenceAASequence = window.current.aaSequence;
+        window.referenceStarts = window.current.starts;
+        window.referenceEnds = window.current.ends;
+        alignAminoAcidWindow(window, 0, nullptr);
+    });
 
-        auto aaSeq = getAminoAcidSequence(altPanMATStart, altPanMATEnd, altSequence,
-                                          altBlockExists, altBlockStrand);
+    for(auto child: T->root->children) {
+        extractAminoAcidTranslationsHelper(T, child, state);
+    }
+}
 
-        std::vector< std::string > altAASequence = std::get<0>(aaSeq);
-        std::vector< size_t > altStarts = std::get<1>(aaSeq);
-        std::vector< size_t > altEnds = std::get<2>(aaSeq);
+void panmanUtils::Tree::extractAminoAcidTranslations(std::ostream& fout,
+        int64_t start, int64_t end) {
+    if(end <= start) {
+        printError("End coordinate must be greater than start");
+        return;
+    }
 
-        std::vector< std::pair< size_t, std::string > > matches;
-        std::vector< std::pair< size_t, std::string > > insertions;
-        std::vector< size_t > deletions;
+    AminoAcidTranslationState state;
+    translateAminoAcidWindows(this, {std::make_pair(std::vector< std::pair< int64_t, int64_t > >{{start, end}}, false)}, state);
+    if(!state.windows[0].placed) {
+        return;
+    }
+
+    fout << "node_id\taa_mutations" << "\n";
+    for(const auto& u: state.windows[0].nodeMutations) {
+        fout << u.first << "\t" << u.second << "\n";
+    }
+}
 
-        size_t refItr = 0, altItr = 0;
+// Whether a field of an annotation file is a non-negative integer
+static bool isAnnotationCoordinate(const std::string& field) {
+    return field.length() && std::all_of(field.begin(), field.end(), [](char c) {
+        return std::isdigit((unsigned char)c);
+    });
+}
 
-        while(altItr < altStarts.size() && refItr < referenceStarts.size()) {
-            if(altStarts[altItr] > referenceEnds[refItr]) {
-                // deletions
-                deletions.push_back(refItr);
-                refItr++;
-            } else if(altStarts[altItr] < referenceStarts[refItr]) {
-                insertions.push_back(std::make_pair(refItr, altAASequence[altItr]));
-                altItr++;
+void panmanUtils::Tree::extractAminoAcidTranslations(std::ostream& fout, std::ifstream& fin) {
+    // Coding regions in the order they first appear. Segments are < start, end, GFF phase > with
+    // 0-based half open coordinates
+    struct CodingRegion {
+        std::string name;
+        bool reverseStrand;
+        std::vector< std::tuple< int64_t, int64_t, int > > segments;
+        bool valid = true;
+    };
+    std::vector< CodingRegion > regions;
+    // GFF CDS features are grouped into regions by their Parent, or ID if there is no parent
+    std::unordered_map< std::string, size_t > regionIndex;
+
+    // The format is fixed by the "##gff-version" header or by the first feature line. BED lines
+    // have integer start and end in columns 2 and 3, GFF lines in columns 4 and 5
+    enum { UNKNOWN, BED, GFF } format = UNKNOWN;
+
+    std::string line;
+    while(getline(fin, line)) {
+        if(line.length() && line.back() == '\r') {
+            line.pop_back();
+        }
+        if(line.rfind("##gff-version", 0) == 0) {
+            format = GFF;
+            continue;
+        }
+        if(line.length() == 0 || line[0] == '#' || line.rfind("track", 0) == 0
+                || line.rfind("browser", 0) == 0) {
+            continue;
+        }
+        std::vector< std::string > fields;
+        stringSplit(line, '\t', fields);
+
+        bool isBed = fields.size() >= 3 && isAnnotationCoordinate(fields[1])
+                     && isAnnotationCoordinate(fields[2]);
+        bool isGff = fields.size() >= 9 && isAnnotationCoordinate(fields[3])
+                     && isAnnotationCoordinate(fields[4]);
+        if(format == UNKNOWN) {
+            format = isBed ? BED : (isGff ? GFF : UNKNOWN);
+        }
+        if((format == BED && !isBed) || (format == GFF && !isGff) || format == UNKNOWN) {
+            printError("Skipping annotation line that is neither BED nor GFF: " + line);
+            continue;
+        }
+
+        try {
+            if(format == GFF) {
+                // Only CDS features are translated. Coordinates are 1-based and inclusive
+                if(fields[2] != "CDS") {
+                    continue;
+                }
+                std::unordered_map< std::string, std::string > attributes;
+                std::vector< std::string > pairs;
+                stringSplit(fields[8], ';', pairs);
+                for(const auto& pair: pairs) {
+                    size_t separator = pair.find('=');
+                    if(separator != std::string::npos) {
+                        attributes[stripString(pair.substr(0, separator))] = pair.substr(separator + 1);
+                    }
+                }
+
+                std::string name = fields[0] + ":" + fields[3] + "-" + fields[4];
+                for(const auto& key: {"Name", "gene", "ID"}) {
+                    if(attributes.count(key)) {
+                        name = attributes[key];
+                        break;
+                    }
+                }
+                std::string group = attributes.count("Parent") ? "Parent=" + attributes["Parent"]
+                                    : (attributes.count("ID") ? "ID=" + attributes["ID"] : line);
+                int phase = isAnnotationCoordinate(fields[7]) ? std::stoi(fields[7]) : 0;
+
+                auto it = regionIndex.emplace(group, regions.size());
+                if(it.second) {
+                    regions.push_back(CodingRegion{name, fields[6] == "-", {}});
+                }
+                auto& region = regions[it.first->second];
+                if(region.reverseStrand != (fields[6] == "-")) {
+                    printError("CDS segments of " + region.name + " are on different strands");
+                    region.valid = false;
+                }
+                region.segments.emplace_back(std::stoll(fields[3]) - 1, std::stoll(fields[4]), phase);
             } else {
-                // match found
-                matches.push_back(std::make_pair(refItr, altAASequence[altItr]));
-                altItr++;
-                refItr++;
+                // BED - chrom, start, end and optionally name, score, strand, thick start, thick
+                // end, color and blocks. BED12 records are translated over their blocks, clipped
+                // to the thick (coding) range if there is one
+                std::string name = (fields.size() >= 4) ? fields[3]
+                                   : fields[0] + ":" + fields[1] + "-" + fields[2];
+                int64_t start = std::stoll(fields[1]), end = std::stoll(fields[2]);
+                CodingRegion region{name, fields.size() >= 6 && fields[5] == "-", {}};
+                if(fields.size() >= 12) {
+                    int64_t thickStart = std::stoll(fields[6]), thickEnd = std::stoll(fields[7]);
+                    if(thickStart >= thickEnd) {
+                        thickStart = start;
+                        thickEnd = end;
+                    }
+                    std::vector< std::string > sizes, starts;
+                    stringSplit(fields[10], ',', sizes);
+                    stringSplit(fields[11], ',', starts);
+                    for(size_t i = 0; i < std::min(sizes.size(), starts.size()); i++) {
+                        if(sizes[i].empty() || starts[i].empty()) {
+                            continue;
+                        }
+                        int64_t blockStart = std::max< int64_t >(start + std::stoll(starts[i]), thickStart);
+                        int64_t blockEnd = std::min< int64_t >(start + std::stoll(starts[i]) + std::stoll(sizes[i]), thickEnd);
+                        if(blockStart < blockEnd) {
+                            region.segments.emplace_back(blockStart, blockEnd, 0);
+                        }
+                    }
+                } else {
+                    region.segments.emplace_back(start, end, 0);
+                }
+                regions.push_back(region);
             }
+        } catch(const std::exception& e) {
+            printError("Skipping annotation line with invalid coordinates: " + line);
+            continue;
         }
-        // Insert remaining Amino Acids
-        while(altItr < altStarts.size()) {
-            insertions.push_back(std::make_pair(refItr, altAASequence[altItr]));
-            altItr++;
+    }
+
+    // Join the segments of every region in genome order. The phase of the first segment in
+    // reading order gives the number of bases before its first codon
+    std::vector< std::string > names;
+    std::vector< std::pair< std::vector< std::pair< int64_t, int64_t > >, bool > > coordinates;
+    for(auto& region: regions) {
+        if(!region.valid) {
+            continue;
         }
-        // Delete remaining Amino Acids
-        while(refItr < referenceStarts.size()) {
-            deletions.push_back(refItr);
-            refItr++;
+        if(region.segments.empty()) {
+            printError("No coding segments found for " + region.name);
+            continue;
+        }
+        std::sort(region.segments.begin(), region.segments.end());
+        if(region.reverseStrand) {
+            std::get<1>(region.segments.back()) -= std::get<2>(region.segments.back());
+        } else {
+            std::get<0>(region.segments.front()) += std::get<2>(region.segments.front());
         }
 
-        for(auto i: matches) {
-            if(referenceAASequence[i.first] != i.second) {
-                aaMutations[u.first] += "S:"+std::to_string(i.first)+":"+i.second+";";
+        std::vector< std::pair< int64_t, int64_t > > segments;
+        for(const auto& segment: region.segments) {
+            if(std::get<1>(segment) <= std::get<0>(segment)) {
+                printError("End coordinate must be greater than start in " + region.name);
+                segments.clear();
+                break;
             }
+            if(segments.size() && std::get<0>(segment) < segments.back().second) {
+                printError("Overlapping coding segments in " + region.name);
+                segments.clear();
+                break;
+            }
+            segments.emplace_back(std::get<0>(segment), std::get<1>(segment));
         }
-        for(auto i: insertions) {
-            aaMutations[u.first] += "I:"+std::to_string(i.first)+":"+i.second+";";
-        }
-        for(auto i: deletions) {
-            aaMutations[u.first] += "D:"+std::to_string(i)+";";
+        if(segments.empty()) {
+            continue;
         }
-    });
+        names.push_back(region.name);
+        coordinates.emplace_back(segments, region.reverseStrand);
+    }
 
-    fout << "node_id\taa_mutations" << "\n";
-    for(auto u: aaMutations) {
-        fout << u.first << "\t" << u.second << "\n";
+    if(coordinates.size() == 0) {
+        printError("No coding regions found in the annotation file");
+        return;
+    }
+
+    AminoAcidTranslationState state;
+    translateAminoAcidWindows(this, coordinates, state);
+
+    fout << "gene\tnode_id\taa_mutations" << "\n";
+    for(size_t i = 0; i < names.size(); i++) {
+        for(const auto& u: state.windows[i].nodeMutations) {
+            fout << names[i] << "\t" << u.first << "\t" << u.second << "\n";
+        }
     }
 }
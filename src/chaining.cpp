@@ -7,6 +7,7 @@
 #include <utility>
 #include <limits>
 #include <chrono>
+#include <numeric>
 #include <tbb/task_scheduler_init.h>
 #include <tbb/parallel_for.h>
 #include <tbb/parallel_sort.h>
@@ -14,234 +15,153 @@
 
 #include "panman.hpp"
 
-std::pair <int,int> origin (-1,-1);
-std::pair <int,int> base (0,0);
-
-
 using namespace std;
 
 
-struct hashPair {
-    template <class T1, class T2>
-    size_t operator()(const pair<T1, T2>& p) const {
-        auto hash1 = hash<T1> {}(p.first);
-        auto hash2 = hash<T2> {}(p.second);
+// Flat segment tree over the seeds ranked by sample coordinate. A leaf holds
+// (score + x + y, seed index) while the seed is inside the chaining window, so
+// a range maximum returns the best predecessor of a seed.
+struct SeedRangeTree {
+    size_t size;
+    std::vector<std::pair<int,int>> tree;
 
-        if (hash1 != hash2) {
-            return hash1 ^ hash2;
-        }
+    SeedRangeTree(size_t n): size(n), tree(2 * n, std::make_pair(std::numeric_limits<int>::min(), -1)) {}
 
-        // If hash1 == hash2, their XOR is zero.
-        return hash1;
+    void update(size_t leaf, std::pair<int,int> value) {
+        leaf += size;
+        tree[leaf] = value;
+        for (leaf >>= 1; leaf > 0; leaf >>= 1) {
+            tree[leaf] = std::max(tree[2 * leaf], tree[2 * leaf + 1]);
+        }
     }
-};
-// Structure to represent a node in the range tree
-struct NodeRangeTree {
-    std::pair<int,int> point;
-    NodeRangeTree* left;
-    NodeRangeTree* right;
-    NodeRangeTree* parent;
-    int score;
-};
-
-NodeRangeTree* createNode(std::pair<int,int> point) {
-    NodeRangeTree* newNode = new NodeRangeTree;
-    newNode->point = point;
-    newNode->left = newNode->right = nullptr;
-    return newNode;
-}
-
-// Function to compare points based on x-coordinate
-bool compareX(const std::pair<int,int>& a, const std::pair<int,int>& b) {
-    return a.first < b.first;
-}
-
-bool comparePoint(const std::pair<int,int>& a, const std::pair<int,int>& b) {
-    if (a.first == b.first)
-        return (a.second < b.second);
-    return a.first < b.first;
-}
-
-// Function to compare points based on y-coordinate
-bool compareY(const std::pair<int,int>& a, const std::pair<int,int>& b) {
-    return a.second < b.second;
-}
-
-
-NodeRangeTree* constructRangeTree(tbb::concurrent_vector<std::pair<int,int>>& points, int start, int end) {
-    if (start > end)
-        return nullptr;
-
-    sort(points.begin() + start, points.begin() + end + 1, compareX);
-
-    int mid = (start + end) / 2;
-    NodeRangeTree* root = createNode(points[mid]);
 
-    root->left = constructRangeTree(points, start, mid - 1);
-    root->right = constructRangeTree(points, mid + 1, end);
-
-    return root;
-}
-
-
-
-// Function to perform range query on the 2D range tree
-void queryRange(NodeRangeTree* root, std::pair<int,int> rangeStart, std::pair<int,int> rangeEnd, vector<std::pair<int,int>>& result) {
-    if (root == nullptr)
-        return;
-
-    if (root->point.first >= rangeStart.first && root->point.first <= rangeEnd.first &&
-            root->point.second >= rangeStart.second && root->point.second <= rangeEnd.second) {
-        result.push_back(root->point);
+    // Maximum over leaves [l, r)
+    std::pair<int,int> query(size_t l, size_t r) const {
+        std::pair<int,int> best(std::numeric_limits<int>::min(), -1);
+        for (l += size, r += size; l < r; l >>= 1, r >>= 1) {
+            if (l & 1) {
+                best = std::max(best, tree[l++]);
+            }
+            if (r & 1) {
+                best = std::max(best, tree[--r]);
+            }
+        }
+        return best;
     }
+};
 
-    if (root->left != nullptr && rangeStart.first <= root->point.first)
-        queryRange(root->left, rangeStart, rangeEnd, result);
-
-    if (root->right != nullptr && rangeEnd.first >= root->point.first)
-        queryRange(root->right, rangeStart, rangeEnd, result);
-}
-
-void find_chain(NodeRangeTree* root, std::pair<int,int> point, std::unordered_map<std::pair<int,int>, std::pair<int, std::pair<int,int>>,hashPair>&map, int K, pair<int,int> &curr_base,pair<int,int> &max_score_point) {
 
-    std::vector<std::pair<int,int>> result;
-    std::pair<int,int> new_base ((point.first - K > 0 ? point.first - K: 0), (point.second - K > 0 ? point.second - K: 0));
-    std::pair<int,int> new_point (point.first - 1, point.second - 1);
+// Blocks are matched by label, which is either a block name or an interned integer ID
+template <typename Label>
+std::vector<std::pair<int,int>> chaining (std::vector<Label> &consensus, std::vector<Label> &sample) {
+    std::vector<std::pair<int,int>> chain;
+    int K = 4000;
     int match = 50;
-    if (point.first == 0 and point.second == 0) {
-        std::pair<int,int> p(-1,-1);
-        std::pair<int,std::pair<int,int>> temp_map (match, p);
-        map[point] = temp_map;
-        return;
-    }
-    queryRange(root, new_base, new_point, result);
-    // std::cout << new_base.first << " " << new_base.second << " " << point.first << " " << point.second  << " " << result.size()  << endl;
-
-    int temp_score = 10;
-    std::pair<int,int> temp_node = origin;
 
-    // Barrier
-    int x_b = -1;
-    int y_b = -1;
-    for (vector<std::pair<int,int>>::reverse_iterator i = result.rbegin(); i != result.rend(); ++i ) {
-        std::pair<int,int> p = *i;
+    // Hash index from block ID to its positions in the sample
+    std::unordered_map<Label, std::vector<int>> sampleIndex;
+    sampleIndex.reserve(sample.size());
+    for (size_t j = 0; j < sample.size(); j++) {
+        sampleIndex[sample[j]].push_back(j);
+    }
 
-        if (p.first <= x_b and p.second <= y_b) {
+    // Seeds are generated sorted by consensus and then sample coordinate
+    std::vector<std::pair<int,int>> points;
+    for (size_t i = 0; i < consensus.size(); i++) {
+        auto it = sampleIndex.find(consensus[i]);
+        if (it == sampleIndex.end()) {
             continue;
         }
-        // int cost = (std::min(point.first-p.first, point.second-p.second)) + (std::max(point.second-p.second,point.first-p.first));
-        int cost = -(point.first - p.first + point.second - p.second);
-        if (cost + map[p].first + match > temp_score) {
-            temp_score = cost + map[p].first + match ;
-            temp_node = p;
-        }
-        if (x_b < p.first) {
-            x_b = p.first - 1;
-        }
-        if (y_b < p.second) {
-            y_b = p.second - 1;
+        for (auto j: it->second) {
+            points.emplace_back(i, j);
         }
-
     }
 
-    std::pair<int,std::pair<int,int>> temp_map (temp_score, temp_node);
-    map[point] = temp_map;
-
-}
-
-
-std::vector<std::pair<int,int>> chaining (std::vector<std::string> &consensus, std::vector<std::string> &sample) {
-    std::vector<std::pair<int,int>> chain;
-    int K = 4000;
-
-    std::vector<std::pair<int,int>>  points;
-    // std::cout << "Finding seeds sequencial ";
-    auto start = std::chrono::high_resolution_clock::now();
-
-    // Concurrent Vector
-    tbb::concurrent_vector<std::pair<int,int>> points_conc;
-    tbb::parallel_for((size_t)0, consensus.size(),[&](size_t i) {
-        tbb::parallel_for((size_t)0, sample.size(),[&](size_t j) {
-            if (consensus[i]==sample[j]) {
-                std::pair<int,int> p (i,j);
-                points_conc.push_back(p);
-            }
-        });
-    });
-
-
-    auto end = std::chrono::high_resolution_clock::now();
-    std::chrono::nanoseconds time_ = (end-start);
-    // std::cout << time_.count() << "\n";
-
-    // Sort points by x-coordinate
-    std::vector<std::pair<int,int>> pointsX = points;
-    // cout << "Sorting ";
-    start = std::chrono::high_resolution_clock::now();
-    tbb::parallel_sort(points_conc.begin(), points_conc.end(), comparePoint);
-    end = std::chrono::high_resolution_clock::now();
-    time_ = (end-start);
-    // cout << time_.count() << "\n";
-
-
-    // Constructing the 2D range tree
-    // std::cout << "Range Tree Construction Function ";
-    start = std::chrono::high_resolution_clock::now();
-    NodeRangeTree* root = constructRangeTree(points_conc, 0, points_conc.size() - 1);
-    end = std::chrono::high_resolution_clock::now();
-    time_ = (end-start);
-    // cout << time_.count() << "\n";
-
-    if (points_conc.size() == 0) {
+    if (points.size() == 0) {
         return chain;
     }
 
-    std::unordered_map<std::pair<int,int>, std::pair<int,std::pair<int,int>>, hashPair> map;
-    for (auto point: points_conc) {
-        std::pair<int,std::pair<int,int>> h (-1, origin);
-        map[point] = h;
+    // Rank of every seed by sample coordinate
+    std::vector<int> byY(points.size());
+    std::iota(byY.begin(), byY.end(), 0);
+    tbb::parallel_sort(byY.begin(), byY.end(), [&](int a, int b) {
+        if (points[a].second == points[b].second)
+            return points[a].first < points[b].first;
+        return points[a].second < points[b].second;
+    });
+    std::vector<int> rank(points.size());
+    std::vector<int> ys(points.size());
+    for (size_t r = 0; r < byY.size(); r++) {
+        rank[byY[r]] = r;
+        ys[r] = points[byY[r]].second;
     }
 
-    pair<int,int> max_score_point = base;
-    pair<int,int> curr_base = base;
+    std::vector<int> score(points.size(), 10);
+    std::vector<int> previous(points.size(), -1);
+    SeedRangeTree tree(points.size());
+
+    // Seeds enter the tree once their consensus coordinate is behind the
+    // current one and leave it once they fall more than K behind
+    size_t inserted = 0;
+    size_t removed = 0;
+    for (size_t p = 0; p < points.size(); p++) {
+        const auto& point = points[p];
+        while (inserted < p && points[inserted].first < point.first) {
+            tree.update(rank[inserted], std::make_pair(score[inserted] + points[inserted].first + points[inserted].second, (int)inserted));
+            inserted++;
+        }
+        while (removed < inserted && points[removed].first < point.first - K) {
+            tree.update(rank[removed], std::make_pair(std::numeric_limits<int>::min(), -1));
+            removed++;
+        }
 
-    for (auto point: points_conc) {
-        find_chain(root, point, map, K, curr_base, max_score_point);
-    }
+        if (point.first == 0 and point.second == 0) {
+            score[p] = match;
+            continue;
+        }
 
-    int max_score = -1;
-    std::pair<int,int> max_score_seed = {};
-    for (auto m: map) {
-        if (m.second.first>max_score) {
-            max_score = m.second.first;
-            max_score_seed = m.first;
+        size_t l = std::lower_bound(ys.begin(), ys.end(), std::max(point.second - K, 0)) - ys.begin();
+        size_t r = std::lower_bound(ys.begin(), ys.end(), point.second) - ys.begin();
+        if (l >= r) {
+            continue;
+        }
+        std::pair<int,int> best = tree.query(l, r);
+        if (best.second == -1) {
+            continue;
+        }
+        int candidate = best.first + match - point.first - point.second;
+        if (candidate > score[p]) {
+            score[p] = candidate;
+            previous[p] = best.second;
         }
-        // cout << "Score of (" << m.first.first << "," << m.first.second << ") = " << m.second.first << std::endl;
     }
 
-    while (true) {
-        chain.push_back(max_score_seed);
-        // cout << max_score_seed.first << "," << max_score_seed.second << endl;
-        max_score_seed = map[max_score_seed].second;
-        if (max_score_seed == origin) {
-            break;
+    int max_seed = 0;
+    for (size_t p = 1; p < points.size(); p++) {
+        if (score[p] > score[max_seed]) {
+            max_seed = p;
         }
     }
 
+    for (int p = max_seed; p != -1; p = previous[p]) {
+        chain.push_back(points[p]);
+    }
+
     return chain;
 }
 
 
+template <typename Label>
 void build_consensus (
     std::vector<std::pair<int,int>> &chain,
-    std::vector<std::string> &consensus,
-    std::vector<std::string> &sample,
+    std::vector<Label> &consensus,
+    std::vector<Label> &sample,
     std::vector<int> &intSequenceConsensus,
     std::vector<int> &intSequenceSample,
     size_t &numBlocks,
-    std::vector<std::string> &consensus_new,
+    std::vector<Label> &consensus_new,
     std::vector<int> &intSequenceConsensus_new,
-    std::unordered_map<int,std::string> &intToString
+    std::unordered_map<int,Label> &intToString
 ) {
 
     int prev_consensus_coord = -1;
@@ -282,15 +202,16 @@ void build_consensus (
     }
 }
 
+template <typename Label>
 void chain_align (
-    std::vector<std::string> &consensus,
-    std::vector<std::string> &sample,
+    std::vector<Label> &consensus,
+    std::vector<Label> &sample,
     std::vector<int> &intSequenceConsensus,
     std::vector<int> &intSequenceSample,
     size_t &numBlocks,
-    std::vector<std::string> &consensus_new,
+    std::vector<Label> &consensus_new,
     std::vector<int> &intSequenceConsensus_new,
-    std::unordered_map<int,std::string> &intToString
+    std::unordered_map<int,Label> &intToString
 ) {
     // cout << "Entering chain Alignment Function\n";
     // if (consensus.size() != 0)
@@ -3,6 +3,7 @@
 #include <fstream>
 #include <unordered_map>
 #include <queue>
+#include <tuple>
 #include <atomic>
 #include <tbb/concurrent_unordered_map.h>
 #include <tbb/task_scheduler_init.h>
@@ -30,6 +31,13 @@ typedef  std::vector< std::pair< bool, std::vector< bool > > > blockExists_t;
 // Forward or reverse strand
 typedef  std::vector< std::pair< bool, std::vector< bool > > > blockStrand_t;
 
+// For reversing block mutations during a tree traversal - primary block id, secondary block id,
+// old mutation, old strand, new mutation, new strand
+typedef std::vector< std::tuple< int32_t, int32_t, bool, bool, bool, bool > > blockMutationInfo_t;
+// For reversing nuc mutations during a tree traversal - primary block id, secondary block id,
+// pos, gap pos, old char, new char
+typedef std::vector< std::tuple< int32_t, int32_t, int, int, char, char > > mutationInfo_t;
+
 namespace panmanUtils {
 
 enum FILE_TYPE {
@@ -1412,35 +1412,64 @@ void panmanUtils::Tree::printFASTAParallel(std::ostream& fout, bool aligned) {
 }
 
 void panmanUtils::Tree::printFASTAFromGFA(std::ifstream& fin, std::ofstream& fout) {
-    std::map< std::string, std::string > nodes;
+    std::unordered_map< std::string, std::string > nodes;
     std::map< std::string, std::vector< std::string > > paths;
-    std::string line;
-    while(getline(fin, line, '\n')) {
-        std::vector< std::string > separatedLine;
-        stringSplit(line, '\t', separatedLine);
-        if(separatedLine[0] == "S") {
-            nodes[separatedLine[1]] = separatedLine[2];
-        } else if(separatedLine[0] == "P") {
-            std::vector< std::string > v;
-            stringSplit(separatedLine[2], ',', paths[separatedLine[1]]);
+
+    // Only the S and P records are needed; fields are located without splitting the whole line
+    LineReader lines(fin);
+    std::string_view line;
+    while(lines.getLine(line)) {
+        if(line.length() < 2 || line[1] != '\t' || (line[0] != 'S' && line[0] != 'P')) {
+            continue;
+        }
+        size_t nameEnd = line.find('\t', 2);
+        if(nameEnd == std::string_view::npos) {
+            continue;
+        }
+        size_t valueEnd = line.find('\t', nameEnd + 1);
+        std::string name(line.substr(2, nameEnd - 2));
+        std::string_view value = line.substr(nameEnd + 1, (valueEnd == std::string_view::npos) ? std::string_view::npos : valueEnd - nameEnd - 1);
+        if(line[0] == 'S') {
+            nodes[name] = std::string(value);
+        } else {
+            stringSplit(std::string(value), ',', paths[name]);
         }
     }
-    for(auto p: paths) {
-        fout << ">" << p.first << "\n";
-        std::string sequence;
-        for(auto s: p.second) {
-            char strand = s[s.length()-1];
-            s.pop_back();
-            if(strand == '+') {
-                sequence += nodes[s];
-            } else {
-                for (std::string::reverse_iterator rit=nodes[s].rbegin(); rit!=nodes[s].rend(); ++rit) {
-                    sequence += getComplementCharacter(*rit);
+
+    // Path sequences are assembled in parallel, a few at a time, and written in name order
+    std::vector< const std::pair< const std::string, std::vector< std::string > >* > pathList;
+    for(const auto& p: paths) {
+        pathList.push_back(&p);
+    }
+    size_t batchSize = tbb::task_scheduler_init::default_num_threads();
+    std::vector< std::string > sequences(batchSize);
+    for(size_t batchStart = 0; batchStart < pathList.size(); batchStart += batchSize) {
+        size_t batchEnd = std::min(batchStart + batchSize, pathList.size());
+        tbb::parallel_for(batchStart, batchEnd, [&](size_t i) {
+            std::string& sequence = sequences[i - batchStart];
+            sequence.clear();
+            for(const auto& step: pathList[i]->second) {
+                char strand = step.back();
+                auto nodeIt = nodes.find(step.substr(0, step.length() - 1));
+                if(nodeIt == nodes.end()) {
+                    continue;
+                }
+                if(strand == '+') {
+                    sequence += nodeIt->second;
+                } else {
+                    for(auto rit = nodeIt->second.rbegin(); rit != nodeIt->second.rend(); ++rit) {
+                        sequence += getComplementCharacter(*rit);
+                    }
                 }
             }
-        }
-        for(size_t i = 0; i < sequence.size(); i+=70) {
-            fout << sequence.substr(i,std::min((size_t)70, sequence.size() - i)) << '\n';
+        });
+        for(size_t i = batchStart; i < batchEnd; i++) {
+            const std::string& sequence = sequences[i - batchStart];
+            fout << ">" << pathList[i]->first << "\n";
+            for(size_t j = 0; j < sequence.size(); j+=70) {
+                fout.write(sequence.data() + j, std::min((size_t)70, sequence.size() - j));
+                fout << '\n';
+            }
         }
     }
 }
@@ -221,92 +221,445 @@ void panmanUtils::Tree::nucFitchAssignMutationsOpt(
 }
 
 
-int panmanUtils::Tree::blockFitchForwardPassNew(Node* node,
-        std::unordered_map< std::string, int >& states) {
-    if(node->children.size() == 0) {
-        if(states.find(node->identifier) == states.end()) {
-            return states[node->identifier] = 0;
+// Flat view of the tree used by the column-batched parsimony kernels. Nodes are stored in
+// postorder with the root last, so a forward pass is one sweep over the array and a backward
+// pass is the reverse sweep. The children of node i are
+// childIndices[childOffsets[i]] ... childIndices[childOffsets[i+1] - 1]
+struct ParsimonyTreeLayout {
+    std::vector< panmanUtils::Node* > nodes;
+    std::vector< int32_t > parents;
+    std::vector< int32_t > childOffsets;
+    std::vector< int32_t > childIndices;
+    std::unordered_map< std::string, int32_t > nodeIndices;
+
+    ParsimonyTreeLayout(panmanUtils::Node* root) {
+        std::vector< std::pair< panmanUtils::Node*, bool > > stack;
+        stack.emplace_back(root, false);
+        while(!stack.empty()) {
+            auto current = stack.back();
+            stack.pop_back();
+            if(current.second || current.first->children.empty()) {
+                nodeIndices[current.first->identifier] = nodes.size();
+                nodes.push_back(current.first);
+                continue;
+            }
+            stack.emplace_back(current.first, true);
+            for(auto it = current.first->children.rbegin(); it != current.first->children.rend(); it++) {
+                stack.emplace_back(*it, false);
+            }
+        }
+
+        parents.assign(nodes.size(), -1);
+        childOffsets.push_back(0);
+        for(size_t i = 0; i < nodes.size(); i++) {
+            for(auto child: nodes[i]->children) {
+                int32_t childIndex = nodeIndices[child->identifier];
+                childIndices.push_back(childIndex);
+                parents[childIndex] = i;
+            }
+            childOffsets.push_back(childIndices.size());
         }
-        return states[node->identifier];
     }
-    std::vector< int > childStates;
-    for(auto child: node->children) {
-        childStates.push_back(blockFitchForwardPassNew(child, states));
+
+    size_t size() const {
+        return nodes.size();
     }
-    int orStates = 0, andStates = childStates[0];
-    for(auto u: childStates) {
-        orStates |= u;
-        andStates &= u;
+};
+
+// Nucleotide mutation found by the batched kernels, for column `column` of the batch
+struct NucParsimonyMutation {
+    int32_t node;
+    uint32_t column;
+    int8_t type;
+    int8_t nuc;
+};
+
+// Parsimony results keyed by the leaf-state pattern of a column, shared between workers.
+// Columns whose leaves and root constraints match an earlier column reuse its mutations instead
+// of running Fitch or Sankoff again. New patterns stop being stored once the keys held reach
+// `byteLimit`, so memory stays bounded on alignments with few repeated columns
+template< typename Result >
+class ParsimonyPatternCache {
+public:
+    ParsimonyPatternCache(size_t byteLimit = ((size_t)1 << 28)): byteLimit(byteLimit) {}
+
+    const Result* find(const std::string& pattern) {
+        auto it = entries.find(pattern);
+        if(it == entries.end()) {
+            missCount++;
+            return nullptr;
+        }
+        hitCount++;
+        return &it->second;
     }
-    if(andStates) {
-        return states[node->identifier] = andStates;
+
+    void insert(const std::string& pattern, const Result& result) {
+        if(storedBytes.load() >= byteLimit) {
+            return;
+        }
+        if(entries.insert({pattern, result}).second) {
+            storedBytes += pattern.size();
+        }
     }
-    return states[node->identifier] = orStates;
-}
 
-void panmanUtils::Tree::blockFitchBackwardPassNew(Node* node,
-        std::unordered_map< std::string, int >& states, int parentState, int defaultValue) {
-    if(node == root && defaultValue != (1 << 28)) {
-        states[node->identifier] = defaultValue;
+    void printStatistics(const std::string& label) const {
+        size_t hits = hitCount.load(), total = hits + missCount.load();
+        std::cout << label << ": " << hits << " of " << total << " columns reused a computed pattern ("
+                  << entries.size() << " distinct patterns stored)" << std::endl;
+    }
+
+private:
+    tbb::concurrent_unordered_map< std::string, Result > entries;
+    std::atomic< size_t > hitCount{0}, missCount{0}, storedBytes{0};
+    size_t byteLimit;
+};
+
+// Number of alignment columns processed together by nucFitchColumns. Must be a multiple of 16
+static const size_t NUC_FITCH_BATCH_WIDTH = 256;
+
+static inline void emitNucFitchMutation(std::vector< NucParsimonyMutation >& mutations, int32_t node,
+                                        size_t column, uint16_t parentState, uint16_t state) {
+    panmanUtils::NucMutationType type;
+    if(parentState == 1) {
+        type = panmanUtils::NucMutationType::NI;
+    } else if(state == 1) {
+        type = panmanUtils::NucMutationType::ND;
     } else {
-        if(states[node->identifier] == 0) {
-            return;
+        type = panmanUtils::NucMutationType::NS;
+    }
+    // Final states are single bits, so the nucleotide code is the bit index
+    mutations.push_back({node, (uint32_t)column, (int8_t)type, (int8_t)__builtin_ctz(state)});
+}
+
+static void nucFitchForwardColumns(const ParsimonyTreeLayout& layout, uint16_t* states, size_t width,
+                                   const uint16_t* rootStates) {
+    std::vector< uint16_t > orStates(width);
+    for(size_t i = 0; i < layout.size(); i++) {
+        int32_t childBegin = layout.childOffsets[i], childEnd = layout.childOffsets[i+1];
+        if(childBegin == childEnd) {
+            continue;
         }
-        if(parentState & states[node->identifier]) {
-            states[node->identifier] = parentState;
-        } else {
-            int currentState = 1;
-            while(!(states[node->identifier] & currentState)) {
-                currentState <<= 1;
+        uint16_t* current = states + i * width;
+        if(rootStates != nullptr && layout.parents[i] == -1) {
+            std::copy(rootStates, rootStates + width, current);
+            continue;
+        }
+        const uint16_t* first = states + layout.childIndices[childBegin] * width;
+        std::copy(first, first + width, current);
+        std::copy(first, first + width, orStates.begin());
+        for(int32_t k = childBegin + 1; k < childEnd; k++) {
+            const uint16_t* child = states + layout.childIndices[k] * width;
+            for(size_t c = 0; c < width; c++) {
+                current[c] &= child[c];
+                orStates[c] |= child[c];
             }
-            states[node->identifier] = currentState;
+        }
+        for(size_t c = 0; c < width; c++) {
+            current[c] = current[c] ? current[c] : orStates[c];
         }
     }
+}
 
-    for(auto child: node->children) {
-        blockFitchBackwardPassNew(child, states, states[node->identifier]);
+static void nucFitchBackwardColumns(const ParsimonyTreeLayout& layout, uint16_t* states, size_t width,
+                                    const uint16_t* rootDefaultStates) {
+    for(size_t i = layout.size(); i-- > 0;) {
+        uint16_t* current = states + i * width;
+        if(layout.parents[i] == -1) {
+            if(rootDefaultStates != nullptr) {
+                std::copy(rootDefaultStates, rootDefaultStates + width, current);
+            } else {
+                // The root takes any of its values and does not care about the parent state
+                for(size_t c = 0; c < width; c++) {
+                    current[c] &= -current[c];
+                }
+            }
+            continue;
+        }
+        const uint16_t* parent = states + layout.parents[i] * width;
+        for(size_t c = 0; c < width; c++) {
+            current[c] = (current[c] & parent[c]) ? parent[c] : (uint16_t)(current[c] & -current[c]);
+        }
     }
-
 }
 
-void panmanUtils::Tree::blockFitchAssignMutationsNew(Node* node,
-        std::unordered_map< std::string, int >& states,
-        std::unordered_map< std::string,
-        std::pair< panmanUtils::BlockMutationType, bool > >& mutations, int parentState) {
-    if(states[node->identifier] == 0) {
-        return;
+static void nucFitchAssignColumns(const ParsimonyTreeLayout& layout, const uint16_t* states, size_t width,
+                                  const uint16_t* rootParentStates, std::vector< NucParsimonyMutation >& mutations) {
+    for(size_t i = layout.size(); i-- > 0;) {
+        const uint16_t* current = states + i * width;
+        const uint16_t* parent = (layout.parents[i] == -1) ? rootParentStates : states + layout.parents[i] * width;
+        for(size_t c = 0; c < width; c++) {
+            if(current[c] != 0 && current[c] != parent[c]) {
+                emitNucFitchMutation(mutations, i, c, parent[c], current[c]);
+            }
+        }
     }
-    if(parentState != states[node->identifier]) {
-        if(parentState == 1) {
-            // insertion
-            int code = 0, currentState = states[node->identifier];
-            while(currentState > 0) {
-                currentState >>= 1;
-                code++;
+}
+
+#if defined(__GNUC__) && defined(__x86_64__)
+#define PANMAN_FITCH_AVX2
+
+__attribute__((target("avx2")))
+static void nucFitchForwardColumnsAVX2(const ParsimonyTreeLayout& layout, uint16_t* states, size_t width,
+                                       const uint16_t* rootStates) {
+    const __m256i zero = _mm256_setzero_si256();
+    for(size_t i = 0; i < layout.size(); i++) {
+        int32_t childBegin = layout.childOffsets[i], childEnd = layout.childOffsets[i+1];
+        if(childBegin == childEnd) {
+            continue;
+        }
+        uint16_t* current = states + i * width;
+        if(rootStates != nullptr && layout.parents[i] == -1) {
+            std::copy(rootStates, rootStates + width, current);
+            continue;
+        }
+        for(size_t c = 0; c < width; c += 16) {
+            __m256i andStates = _mm256_loadu_si256((const __m256i*)(states + layout.childIndices[childBegin] * width + c));
+            __m256i orStates = andStates;
+            for(int32_t k = childBegin + 1; k < childEnd; k++) {
+                __m256i child = _mm256_loadu_si256((const __m256i*)(states + layout.childIndices[k] * width + c));
+                andStates = _mm256_and_si256(andStates, child);
+                orStates = _mm256_or_si256(orStates, child);
             }
-            code--;
-            if(code == 2) {
-                // insertion of inverted block
-                mutations[node->identifier] = std::make_pair(BlockMutationType::BI, true);
+            __m256i emptyIntersection = _mm256_cmpeq_epi16(andStates, zero);
+            _mm256_storeu_si256((__m256i*)(current + c), _mm256_blendv_epi8(andStates, orStates, emptyIntersection));
+        }
+    }
+}
+
+__attribute__((target("avx2")))
+static void nucFitchBackwardColumnsAVX2(const ParsimonyTreeLayout& layout, uint16_t* states, size_t width,
+                                        const uint16_t* rootDefaultStates) {
+    const __m256i zero = _mm256_setzero_si256();
+    for(size_t i = layout.size(); i-- > 0;) {
+        uint16_t* current = states + i * width;
+        if(layout.parents[i] == -1) {
+            if(rootDefaultStates != nullptr) {
+                std::copy(rootDefaultStates, rootDefaultStates + width, current);
             } else {
-                // insertion of forward strand
-                mutations[node->identifier] = std::make_pair(BlockMutationType::BI, false);
+                for(size_t c = 0; c < width; c += 16) {
+                    __m256i state = _mm256_loadu_si256((const __m256i*)(current + c));
+                    state = _mm256_and_si256(state, _mm256_sub_epi16(zero, state));
+                    _mm256_storeu_si256((__m256i*)(current + c), state);
+                }
             }
+            continue;
+        }
+        const uint16_t* parent = states + layout.parents[i] * width;
+        for(size_t c = 0; c < width; c += 16) {
+            __m256i state = _mm256_loadu_si256((const __m256i*)(current + c));
+            __m256i parentState = _mm256_loadu_si256((const __m256i*)(parent + c));
+            __m256i lowestBit = _mm256_and_si256(state, _mm256_sub_epi16(zero, state));
+            __m256i disjoint = _mm256_cmpeq_epi16(_mm256_and_si256(state, parentState), zero);
+            _mm256_storeu_si256((__m256i*)(current + c), _mm256_blendv_epi8(parentState, lowestBit, disjoint));
+        }
+    }
+}
 
-        } else if(states[node->identifier] == 1) {
-            // deletion
-            mutations[node->identifier] = std::make_pair(BlockMutationType::BD, false);
-        } else {
-            // inversion
+__attribute__((target("avx2")))
+static void nucFitchAssignColumnsAVX2(const ParsimonyTreeLayout& layout, const uint16_t* states, size_t width,
+                                      const uint16_t* rootParentStates, std::vector< NucParsimonyMutation >& mutations) {
+    const __m256i zero = _mm256_setzero_si256();
+    for(size_t i = layout.size(); i-- > 0;) {
+        const uint16_t* current = states + i * width;
+        const uint16_t* parent = (layout.parents[i] == -1) ? rootParentStates : states + layout.parents[i] * width;
+        for(size_t c = 0; c < width; c += 16) {
+            __m256i state = _mm256_loadu_si256((const __m256i*)(current + c));
+            __m256i parentState = _mm256_loadu_si256((const __m256i*)(parent + c));
+            __m256i unchanged = _mm256_or_si256(_mm256_cmpeq_epi16(state, parentState), _mm256_cmpeq_epi16(state, zero));
+            // Two mask bits per 16-bit lane; keep one of them
+            uint32_t changed = ~(uint32_t)_mm256_movemask_epi8(unchanged) & 0x55555555u;
+            while(changed) {
+                size_t c2 = c + (__builtin_ctz(changed) >> 1);
+                emitNucFitchMutation(mutations, i, c2, parent[c2], current[c2]);
+                changed &= changed - 1;
+            }
+        }
+    }
+}
+#endif
+
+// Run Fitch on `width` alignment columns at once. `states` holds one 16-bit state set per node
+// and column (node-major, in layout order) with the leaves filled in. `rootStates` optionally
+// fixes the root state after the forward pass, `rootDefaultStates` optionally fixes it in the
+// backward pass, and `rootParentStates` is the consensus the root is compared against.
+// Mutations are appended with their column index within the batch
+static void nucFitchColumns(const ParsimonyTreeLayout& layout, uint16_t* states, size_t width,
+                            const uint16_t* rootStates, const uint16_t* rootDefaultStates,
+                            const uint16_t* rootParentStates, std::vector< NucParsimonyMutation >& mutations) {
+#ifdef PANMAN_FITCH_AVX2
+    static const bool avx2Supported = __builtin_cpu_supports("avx2");
+    if(avx2Supported && width % 16 == 0) {
+        nucFitchForwardColumnsAVX2(layout, states, width, rootStates);
+        nucFitchBackwardColumnsAVX2(layout, states, width, rootDefaultStates);
+        nucFitchAssignColumnsAVX2(layout, states, width, rootParentStates, mutations);
+        return;
+    }
+#endif
+    nucFitchForwardColumns(layout, states, width, rootStates);
+    nucFitchBackwardColumns(layout, states, width, rootDefaultStates);
+    nucFitchAssignColumns(layout, states, width, rootParentStates, mutations);
+}
 
-            mutations[node->identifier] = std::make_pair(BlockMutationType::BD, true);
+// Block mutation found by blockFitchBlocks for block `block` of the input
+struct BlockParsimonyMutation {
+    int32_t node;
+    uint32_t block;
+    std::pair< panmanUtils::BlockMutationType, bool > type;
+};
+
+// Number of blocks processed together by blockFitchBlocks
+static const size_t BLOCK_FITCH_BATCH_WIDTH = 256;
+
+// Block states are 1 (absent), 2 (forward strand) and 4 (reverse strand), so a state set fits in
+// one byte and the loops below vectorize over the blocks of a batch
+static void blockFitchForwardColumns(const ParsimonyTreeLayout& layout, uint8_t* states, size_t width) {
+    std::vector< uint8_t > orStates(width);
+    for(size_t i = 0; i < layout.size(); i++) {
+        int32_t childBegin = layout.childOffsets[i], childEnd = layout.childOffsets[i+1];
+        if(childBegin == childEnd) {
+            continue;
+        }
+        uint8_t* current = states + i * width;
+        const uint8_t* first = states + layout.childIndices[childBegin] * width;
+        std::copy(first, first + width, current);
+        std::copy(first, first + width, orStates.begin());
+        for(int32_t k = childBegin + 1; k < childEnd; k++) {
+            const uint8_t* child = states + layout.childIndices[k] * width;
+            for(size_t c = 0; c < width; c++) {
+                current[c] &= child[c];
+                orStates[c] |= child[c];
+            }
+        }
+        for(size_t c = 0; c < width; c++) {
+            current[c] = current[c] ? current[c] : orStates[c];
         }
     }
-    for(auto child: node->children) {
-        blockFitchAssignMutationsNew(child, states, mutations, states[node->identifier]);
+}
+
+static void blockFitchBackwardColumns(const ParsimonyTreeLayout& layout, uint8_t* states, size_t width,
+                                      const uint8_t* rootDefaultStates) {
+    for(size_t i = layout.size(); i-- > 0;) {
+        uint8_t* current = states + i * width;
+        if(layout.parents[i] == -1 && rootDefaultStates != nullptr) {
+            std::copy(rootDefaultStates, rootDefaultStates + width, current);
+            continue;
+        }
+        // The root is compared against an absent block, which is also its lowest possible state
+        for(size_t c = 0; c < width; c++) {
+            uint8_t parent = (layout.parents[i] == -1) ? 1 : states[layout.parents[i] * width + c];
+            current[c] = (current[c] & parent) ? parent : (uint8_t)(current[c] & -current[c]);
+        }
     }
 }
 
+static void blockFitchAssignColumns(const ParsimonyTreeLayout& layout, const uint8_t* states, size_t width,
+                                    std::vector< BlockParsimonyMutation >& mutations) {
+    for(size_t i = layout.size(); i-- > 0;) {
+        const uint8_t* current = states + i * width;
+        for(size_t c = 0; c < width; c++) {
+            uint8_t parent = (layout.parents[i] == -1) ? 1 : states[layout.parents[i] * width + c];
+            if(current[c] == 0 || current[c] == parent) {
+                continue;
+            }
+            if(parent == 1) {
+                // insertion, of an inverted block if the node has the reverse strand
+                mutations.push_back({(int32_t)i, (uint32_t)c, {panmanUtils::BlockMutationType::BI, current[c] == 4}});
+            } else if(current[c] == 1) {
+                // deletion
+                mutations.push_back({(int32_t)i, (uint32_t)c, {panmanUtils::BlockMutationType::BD, false}});
+            } else {
+                // inversion
+                mutations.push_back({(int32_t)i, (uint32_t)c, {panmanUtils::BlockMutationType::BD, true}});
+            }
+        }
+    }
+}
+
+// Run Fitch on the presence and strand of `numBlocks` blocks at once, in batches spread over
+// threads. `leafNodes[l]` is the layout index of leaf l and `leafStates[l * numBlocks + b]` its
+// state for block b; leaves of the tree that are not listed are treated as missing data.
+// `rootDefaultStates` optionally fixes the root state of each block. The mutations of each batch
+// are passed to consume() on the worker thread that found them, with their block index
+static void blockFitchBlocks(const ParsimonyTreeLayout& layout, const std::vector< int32_t >& leafNodes,
+                             const std::vector< uint8_t >& leafStates, size_t numBlocks,
+                             const std::vector< uint8_t >& rootDefaultStates,
+                             const std::function< void(const std::vector< BlockParsimonyMutation >&) >& consume) {
+    const size_t width = BLOCK_FITCH_BATCH_WIDTH;
+    // Blocks with the same leaf states get the same mutations
+    ParsimonyPatternCache< std::vector< BlockParsimonyMutation > > patternCache;
+    tbb::parallel_for(tbb::blocked_range< size_t >(0, numBlocks, 4 * width), [&](const tbb::blocked_range< size_t >& range) {
+        std::vector< uint8_t > states(layout.size() * width, 0);
+        std::vector< uint8_t > rootStates(width, 0);
+        std::unordered_map< std::string, size_t > patternSlots;
+        std::vector< std::string > slotPatterns;
+        std::vector< std::vector< size_t > > slotBlocks;
+        std::vector< BlockParsimonyMutation > foundMutations;
+
+        auto emitMutations = [&](const std::vector< BlockParsimonyMutation >& mutations, size_t block) {
+            for(auto mutation: mutations) {
+                mutation.block = block;
+                foundMutations.push_back(mutation);
+            }
+        };
+
+        auto flushBatch = [&]() {
+            std::vector< BlockParsimonyMutation > mutations;
+            blockFitchForwardColumns(layout, states.data(), width);
+            blockFitchBackwardColumns(layout, states.data(), width, rootDefaultStates.empty() ? nullptr : rootStates.data());
+            blockFitchAssignColumns(layout, states.data(), width, mutations);
+            std::vector< std::vector< BlockParsimonyMutation > > slotMutations(slotPatterns.size());
+            for(const auto& mutation: mutations) {
+                if(mutation.block < slotPatterns.size()) {
+                    slotMutations[mutation.block].push_back(mutation);
+                }
+            }
+            for(size_t slot = 0; slot < slotPatterns.size(); slot++) {
+                patternCache.insert(slotPatterns[slot], slotMutations[slot]);
+                for(auto block: slotBlocks[slot]) {
+                    emitMutations(slotMutations[slot], block);
+                }
+            }
+            patternSlots.clear();
+            slotPatterns.clear();
+            slotBlocks.clear();
+        };
+
+        std::string pattern(leafNodes.size() + 1, 0);
+        for(size_t b = range.begin(); b < range.end(); b++) {
+            for(size_t l = 0; l < leafNodes.size(); l++) {
+                pattern[l] = leafStates[l * numBlocks + b];
+            }
+            pattern[leafNodes.size()] = rootDefaultStates.empty() ? 0 : rootDefaultStates[b];
+
+            if(const auto* cached = patternCache.find(pattern)) {
+                emitMutations(*cached, b);
+                continue;
+            }
+            auto slotIt = patternSlots.find(pattern);
+            if(slotIt != patternSlots.end()) {
+                slotBlocks[slotIt->second].push_back(b);
+                continue;
+            }
+
+            size_t slot = slotPatterns.size();
+            patternSlots[pattern] = slot;
+            slotPatterns.push_back(pattern);
+            slotBlocks.push_back({b});
+            for(size_t l = 0; l < leafNodes.size(); l++) {
+                states[leafNodes[l] * width + slot] = pattern[l];
+            }
+            rootStates[slot] = pattern[leafNodes.size()];
+            if(slotPatterns.size() == width) {
+                flushBatch();
+            }
+        }
+        if(!slotPatterns.empty()) {
+            flushBatch();
+        }
+        consume(foundMutations);
+    });
+    patternCache.printStatistics("Block presence patterns");
+}
 
 std::vector< int > panmanUtils::Tree::nucSankoffForwardPassOpt(Node* node,
         std::unordered_map< std::string, std::vector< int > >& stateSets) {
@@ -704,6 +1057,201 @@ void panmanUtils::Tree::nucSankoffAssignMutations(Node* node,
 
 
 
+// Flat Sankoff over a single alignment column. `costs` holds 16 costs per node (node-major, in
+// layout order) and `states` one chosen state per node; both are meant to be reused across
+// columns by a worker. Leaf rows are set with setNucSankoffLeaf, and leaves that are never set
+// must hold SANKOFF_INF in every entry
+
+static inline void setNucSankoffLeaf(int32_t* costs, int32_t node, int code) {
+    std::fill(costs + node * 16, costs + node * 16 + 16, SANKOFF_INF);
+    costs[node * 16 + code] = 0;
+}
+
+static inline void emitNucSankoffMutation(std::vector< NucParsimonyMutation >& mutations, int32_t node,
+                                          uint32_t column, int32_t parentState, int32_t state) {
+    panmanUtils::NucMutationType type;
+    if(parentState == 0) {
+        type = panmanUtils::NucMutationType::NI;
+    } else if(state == 0) {
+        type = panmanUtils::NucMutationType::ND;
+    } else {
+        type = panmanUtils::NucMutationType::NS;
+    }
+    mutations.push_back({node, column, (int8_t)type, (int8_t)state});
+}
+
+static void nucSankoffForwardColumn(const ParsimonyTreeLayout& layout, int32_t* costs) {
+    for(size_t i = 0; i < layout.size(); i++) {
+        int32_t childBegin = layout.childOffsets[i], childEnd = layout.childOffsets[i+1];
+        if(childBegin == childEnd) {
+            continue;
+        }
+        int32_t* current = costs + i * 16;
+        std::fill(current, current + 16, 0);
+        bool minExists = false;
+        for(int32_t k = childBegin; k < childEnd; k++) {
+            const int32_t* child = costs + layout.childIndices[k] * 16;
+            // min over k of (i != k) + child[k] is min(child[i], min(child) + 1)
+            int32_t minCost = *std::min_element(child, child + 16);
+            if(minCost < SANKOFF_INF) {
+                minExists = true;
+            }
+            for(int s = 0; s < 16; s++) {
+                int32_t cost = std::min(child[s], minCost + 1);
+                current[s] += (cost < SANKOFF_INF) ? cost : 0;
+            }
+        }
+        if(!minExists) {
+            std::fill(current, current + 16, SANKOFF_INF);
+        }
+    }
+}
+
+static inline int32_t nucSankoffChildState(const int32_t* child, int32_t parentState) {
+    int32_t minState = -1;
+    int32_t minCost = SANKOFF_INF;
+    for(int s = 0; s < 16; s++) {
+        if((s != parentState) + child[s] < minCost) {
+            minCost = (s != parentState) + child[s];
+            minState = s;
+        }
+    }
+    return minState;
+}
+
+static void nucSankoffBackwardColumn(const ParsimonyTreeLayout& layout, const int32_t* costs, int32_t* states,
+                                     int defaultState) {
+    for(size_t i = layout.size(); i-- > 0;) {
+        const int32_t* current = costs + i * 16;
+        if(layout.parents[i] == -1) {
+            if(defaultState != -1) {
+                states[i] = defaultState;
+            } else {
+                int32_t minState = std::min_element(current, current + 16) - current;
+                states[i] = (current[minState] < SANKOFF_INF) ? minState : -1;
+            }
+        } else if(states[layout.parents[i]] == -1) {
+            states[i] = -1;
+        } else {
+            states[i] = nucSankoffChildState(current, states[layout.parents[i]]);
+        }
+    }
+}
+
+#ifdef PANMAN_FITCH_AVX2
+__attribute__((target("avx2")))
+static inline int32_t horizontalMinAVX2(__m256i values) {
+    __m128i m = _mm_min_epi32(_mm256_castsi256_si128(values), _mm256_extracti128_si256(values, 1));
+    m = _mm_min_epi32(m, _mm_shuffle_epi32(m, _MM_SHUFFLE(1, 0, 3, 2)));
+    m = _mm_min_epi32(m, _mm_shuffle_epi32(m, _MM_SHUFFLE(2, 3, 0, 1)));
+    return _mm_cvtsi128_si32(m);
+}
+
+__attribute__((target("avx2")))
+static void nucSankoffForwardColumnAVX2(const ParsimonyTreeLayout& layout, int32_t* costs) {
+    const __m256i inf = _mm256_set1_epi32(SANKOFF_INF);
+    for(size_t i = 0; i < layout.size(); i++) {
+        int32_t childBegin = layout.childOffsets[i], childEnd = layout.childOffsets[i+1];
+        if(childBegin == childEnd) {
+            continue;
+        }
+        __m256i low = _mm256_setzero_si256(), high = _mm256_setzero_si256();
+        bool minExists = false;
+        for(int32_t k = childBegin; k < childEnd; k++) {
+            const int32_t* child = costs + layout.childIndices[k] * 16;
+            __m256i childLow = _mm256_loadu_si256((const __m256i*)child);
+            __m256i childHigh = _mm256_loadu_si256((const __m256i*)(child + 8));
+            int32_t minCost = horizontalMinAVX2(_mm256_min_epi32(childLow, childHigh));
+            if(minCost < SANKOFF_INF) {
+                minExists = true;
+            }
+            __m256i changeCost = _mm256_set1_epi32(minCost + 1);
+            childLow = _mm256_min_epi32(childLow, changeCost);
+            childHigh = _mm256_min_epi32(childHigh, changeCost);
+            low = _mm256_add_epi32(low, _mm256_and_si256(childLow, _mm256_cmpgt_epi32(inf, childLow)));
+            high = _mm256_add_epi32(high, _mm256_and_si256(childHigh, _mm256_cmpgt_epi32(inf, childHigh)));
+        }
+        if(!minExists) {
+            low = high = inf;
+        }
+        _mm256_storeu_si256((__m256i*)(costs + i * 16), low);
+        _mm256_storeu_si256((__m256i*)(costs + i * 16 + 8), high);
+    }
+}
+
+__attribute__((target("avx2")))
+static void nucSankoffBackwardColumnAVX2(const ParsimonyTreeLayout& layout, const int32_t* costs, int32_t* states,
+                                         int defaultState) {
+    const __m256i one = _mm256_set1_epi32(1);
+    const __m256i lowIndices = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+    const __m256i highIndices = _mm256_setr_epi32(8, 9, 10, 11, 12, 13, 14, 15);
+    for(size_t i = layout.size(); i-- > 0;) {
+        const int32_t* current = costs + i * 16;
+        int32_t parentState;
+        if(layout.parents[i] == -1) {
+            if(defaultState != -1) {
+                states[i] = defaultState;
+                continue;
+            }
+            // No transition cost at the root; an out of range parent state adds 1 everywhere
+            parentState = 16;
+        } else {
+            parentState = states[layout.parents[i]];
+            if(parentState == -1) {
+                states[i] = -1;
+                continue;
+            }
+        }
+        __m256i parent = _mm256_set1_epi32(parentState);
+        __m256i low = _mm256_add_epi32(_mm256_loadu_si256((const __m256i*)current),
+                                       _mm256_add_epi32(one, _mm256_cmpeq_epi32(lowIndices, parent)));
+        __m256i high = _mm256_add_epi32(_mm256_loadu_si256((const __m256i*)(current + 8)),
+                                        _mm256_add_epi32(one, _mm256_cmpeq_epi32(highIndices, parent)));
+        int32_t minCost = horizontalMinAVX2(_mm256_min_epi32(low, high));
+        if(minCost >= SANKOFF_INF) {
+            states[i] = -1;
+            continue;
+        }
+        __m256i target = _mm256_set1_epi32(minCost);
+        uint32_t matches = (uint32_t)_mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpeq_epi32(low, target)))
+                         | ((uint32_t)_mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpeq_epi32(high, target))) << 8);
+        states[i] = __builtin_ctz(matches);
+    }
+}
+#endif
+
+static void nucSankoffAssignColumn(const ParsimonyTreeLayout& layout, const int32_t* states, int32_t rootParentState,
+                                   uint32_t column, std::vector< NucParsimonyMutation >& mutations) {
+    for(size_t i = layout.size(); i-- > 0;) {
+        if(states[i] == -1) {
+            continue;
+        }
+        int32_t parentState = (layout.parents[i] == -1) ? rootParentState : states[layout.parents[i]];
+        if(parentState != states[i]) {
+            emitNucSankoffMutation(mutations, i, column, parentState, states[i]);
+        }
+    }
+}
+
+// Run Sankoff on one column whose leaf costs are already set. `defaultState` pins the root
+// state (-1 for none) and `rootParentState` is the consensus code the root is compared against
+static void nucSankoffColumn(const ParsimonyTreeLayout& layout, int32_t* costs, int32_t* states,
+                             int defaultState, int32_t rootParentState, uint32_t column,
+                             std::vector< NucParsimonyMutation >& mutations) {
+#ifdef PANMAN_FITCH_AVX2
+    static const bool avx2Supported = __builtin_cpu_supports("avx2");
+    if(avx2Supported) {
+        nucSankoffForwardColumnAVX2(layout, costs);
+        nucSankoffBackwardColumnAVX2(layout, costs, states, defaultState);
+        nucSankoffAssignColumn(layout, states, rootParentState, column, mutations);
+        return;
+    }
+#endif
+    nucSankoffForwardColumn(layout, costs);
+    nucSankoffBackwardColumn(layout, costs, states, defaultState);
+    nucSankoffAssignColumn(layout, states, rootParentState, column, mutations);
+}
+
 std::vector< int > panmanUtils::Tree::blockSankoffForwardPass(Node* node,
         std::unordered_map< std::string, std::vector< int > >& stateSets) {
 
@@ -1,1000 +1,337 @@
 #include "panmanUtils.hpp"
 
-void panmanUtils::Tree::convertToGFA(std::ostream& fout) {
-    // First we check if there are any nucleotide mutations. If there are no nuc mutations, we can
-    // simply construct a GFA of blocks
-    bool nucMutationFlag = false;
-    for(auto u: allNodes) {
-        if(u.second->nucMutation.size() != 0) {
-            nucMutationFlag = true;
-        }
+// State shared across the depth first traversal of the block-aware GFA writer
+struct GfaSegmentationState {
+    sequence_t sequence;
+    blockExists_t blockExists;
+    blockStrand_t blockStrand;
+
+    // Alignment column breakpoints of each block. Region r of block b spans columns
+    // [breakpoints[b][r], breakpoints[b][r+1])
+    std::vector< std::vector< int32_t > > breakpoints;
+    // Column of the first gap position of each nucleotide position in each block. The last
+    // entry of every block is the total number of columns in it
+    std::vector< std::vector< int32_t > > columnOffsets;
+    // Global index of the first region of each block
+    std::vector< size_t > regionOffsets;
+
+    // Segment currently spelled by each region. 0 if the region only has gaps
+    std::vector< size_t > currentSegment;
+    // Distinct contents seen for each region and their segment IDs
+    std::vector< std::unordered_map< std::string, size_t > > regionSegments;
+    // Sequence of each segment indexed by segment ID. Index 0 is the empty segment
+    std::vector< std::string > segmentSequences;
+
+    // Path of each leaf as a list of < segment ID, strand > pairs
+    std::vector< std::pair< std::string, std::vector< std::pair< size_t, bool > > > > paths;
+};
+
+// Alignment column of a position within its block
+static int32_t getGfaColumn(const GfaSegmentationState& state,
+                            const panmanUtils::Coordinate& coordinate) {
+    const auto& offsets = state.columnOffsets[coordinate.primaryBlockId];
+    if(coordinate.nucGapPosition == -1) {
+        // Main nucleotide comes after all the gap nucleotides at this position
+        return offsets[coordinate.nucPosition + 1] - 1;
     }
+    return offsets[coordinate.nucPosition] + coordinate.nucGapPosition;
+}
 
-    if(!nucMutationFlag) {
-        // get nodes
-        std::map<std::pair<int32_t, int32_t>, std::string> nodes;
-        for(auto block: blocks) {
-            int64_t primaryBlockId = block.primaryBlockId;
-            int64_t secondaryBlockId = block.secondaryBlockId;
-            std::string sequenceString;
-            for(auto u: block.consensusSeq) {
-                for(size_t k = 0; k < 8; k++) {
-                    const int nucCode = (((u) >> (4*(7 - k))) & 15);
-                    if(nucCode == 0) {
-                        break;
-                    }
-                    const char nucleotide = panmanUtils::getNucleotideFromCode(nucCode);
-                    sequenceString += nucleotide;
-                }
-            }
-            nodes[std::make_pair(primaryBlockId, secondaryBlockId)] = sequenceString;
-        }
-
-        // block presense map
-        std::vector< std::pair< bool, std::vector< bool > > > blockExistsGlobal(blocks.size() + 1, {false, {}});
-        // Assigning block gaps
-        for(size_t i = 0; i < blockGaps.blockPosition.size(); i++) {
-            blockExistsGlobal[blockGaps.blockPosition[i]].second.resize(blockGaps.blockGapLength[i], false);
-        }
-
-        tbb::concurrent_unordered_set< std::pair< std::pair<int32_t, int32_t>, std::pair<int32_t, int32_t> > > edges;
-        tbb::concurrent_unordered_map< std::string, std::vector< std::pair<int32_t, int32_t> > > paths;
-
-        // get all paths
-        tbb::parallel_for_each(allNodes, [&](auto u) {
-            if(u.second->children.size()) {
-                return;
-            }
-
-            auto blockExists = blockExistsGlobal;
-
-            std::vector< panmanUtils::Node* > path;
-
-            Node* it = u.second;
-            while(it != root) {
-                path.push_back(it);
-                it = it->parent;
-            }
-            path.push_back(root);
-            std::reverse(path.begin(), path.end());
-            for(auto node: path) {
-                for(auto mutation: node->blockMutation) {
-                    int primaryBlockId = mutation.primaryBlockId;
-                    int secondaryBlockId = mutation.secondaryBlockId;
-                    int type = (mutation.blockMutInfo);
-
-                    if(type == panmanUtils::BlockMutationType::BI) {
-                        if(secondaryBlockId != -1) {
-                            blockExists[primaryBlockId].second[secondaryBlockId] = true;
-                        } else {
-                            blockExists[primaryBlockId].first = true;
-                        }
-                    } else {
-                        if(secondaryBlockId != -1) {
-                            blockExists[primaryBlockId].second[secondaryBlockId] = false;
-                        } else {
-                            blockExists[primaryBlockId].first = false;
-                        }
-                    }
-                }
-            }
-            std::vector< std::pair< int32_t, int32_t > > currentPath;
-            for(size_t i = 0; i < blockExists.size(); i++) {
-                if(blockExists[i].first) {
-                    currentPath.push_back(std::make_pair(i, -1));
-                }
-                for(size_t j = 0; j < blockExists[i].second.size(); j++) {
-                    if(blockExists[i].second[j]) {
-                        currentPath.push_back(std::make_pair(i, j));
-                    }
-                }
-            }
-            paths[u.second->identifier] = currentPath;
-            for(size_t i = 1; i < currentPath.size(); i++) {
-                edges.insert(std::make_pair(currentPath[i-1], currentPath[i]));
-            }
-        });
-        std::map< std::pair< int32_t, int32_t >, uint64_t > nodeIds;
-        uint64_t ctr = 0;
-        for(auto u: nodes) {
-            nodeIds[u.first] = ctr;
-            ctr++;
-        }
-        for(auto u: nodes) {
-            fout << "S\t" << nodeIds[u.first] << "\t" << u.second << "\n";
-        }
-        for(auto u: edges) {
-            fout << "L\t" << nodeIds[u.first] << "\t+\t" << nodeIds[u.second] << "\t+\t0M\n";
-        }
-        for(auto u: paths) {
-            fout << "P\t" << u.first << "\t";
-            for(size_t i = 0; i < u.second.size(); i++) {
-                fout << nodeIds[u.second[i]] << "+";
-                if(i != u.second.size() - 1) {
-                    fout << ",";
-                }
-            }
-            fout << "\t*\n";
-        }
-    } else {
-        size_t node_len = 32;
-        size_t autoIncrId = 0;
-        std::map< std::pair< std::tuple< int, size_t, size_t >, std::string >,
-            std::pair< size_t, bool > > allSequenceNodes;
-        std::mutex allSequenceNodeMutex;
-        tbb::concurrent_unordered_map< std::string, std::vector< size_t > > paths;
-        tbb::concurrent_unordered_map< std::string, std::vector< bool > > strandPaths;
-
-        // for(const auto& u: allNodes) {
-        tbb::parallel_for_each(allNodes, [&](const auto& u) {
-            if(u.second->children.size() != 0) {
-                return;
-                // continue;
-            }
-
-            sequence_t sequence;
-            blockExists_t blockExists;
-            blockStrand_t blockStrand;
-            getSequenceFromReference(sequence, blockExists, blockStrand, u.first);
-
-            std::string currentSequence;
-            std::vector< size_t > sequenceNodeIds;
-            std::vector< bool > sequenceStrands;
-
-            for(size_t i = 0; i < sequence.size(); i++) {
-                if(blockExists[i].first) {
-                    if(blockStrand[i].first) {
-                        std::tuple< size_t, size_t, size_t > currentStart;
-                        for(size_t j = 0; j < sequence[i].first.size(); j++) {
-                            for(size_t k = 0; k < sequence[i].first[j].second.size(); k++) {
-                                if(currentSequence.length() == 0) {
-                                    currentStart = std::make_tuple(i,j,k);
-                                }
-                                currentSequence += sequence[i].first[j].second[k];
-                                if(currentSequence.length() == node_len) {
-                                    currentSequence = stripGaps(currentSequence);
-                                    if(currentSequence.length()) {
-                                        allSequenceNodeMutex.lock();
-                                        if(allSequenceNodes.find(std::make_pair(currentStart,
-                                                                                currentSequence)) == allSequenceNodes.end()) {
-                                            allSequenceNodes[std::make_pair(currentStart,
-                                                                            currentSequence)] = std::make_pair(autoIncrId, true);
-                                            sequenceNodeIds.push_back(autoIncrId);
-                                            sequenceStrands.push_back(true);
-                                            autoIncrId++;
-                                        } else {
-                                            sequenceNodeIds.push_back(
-                                                allSequenceNodes[std::make_pair(currentStart,
-                                                                                currentSequence)].first);
-                                            sequenceStrands.push_back(true);
-                                        }
-                                        allSequenceNodeMutex.unlock();
-                                    }
-                                    currentSequence = "";
-                                }
-                            }
-                            if(currentSequence.length() == 0) {
-                                currentStart = std::make_tuple(i,j,-1);
-                            }
-                            currentSequence += sequence[i].first[j].first;
-                            if(currentSequence.length() == node_len) {
-                                currentSequence = stripGaps(currentSequence);
-                                if(currentSequence.length()) {
-                                    allSequenceNodeMutex.lock();
-                                    if(allSequenceNodes.find(std::make_pair(currentStart,
-                                                                            currentSequence)) == allSequenceNodes.end())  {
-                                        allSequenceNodes[std::make_pair(currentStart,
-                                                                        currentSequence)] = std::make_pair(autoIncrId, true);
-                                        sequenceNodeIds.push_back(autoIncrId);
-                                        sequenceStrands.push_back(true);
-                                        autoIncrId++;
-                                    } else {
-                                        sequenceNodeIds.push_back(
-                                            allSequenceNodes[std::make_pair(currentStart,
-                                                                            currentSequence)].first);
-                                        sequenceStrands.push_back(true);
-                                    }
-                                    allSequenceNodeMutex.unlock();
-                                }
-                                currentSequence = "";
-                            }
-                        }
-                        if(currentSequence.length()) {
-                            currentSequence = stripGaps(currentSequence);
-                            if(currentSequence.length()) {
-                                allSequenceNodeMutex.lock();
-                                if(allSequenceNodes.find(std::make_pair(currentStart,
-                                                                        currentSequence)) == allSequenceNodes.end()) {
-                                    allSequenceNodes[std::make_pair(currentStart, currentSequence)]
-                                        = std::make_pair(autoIncrId, true);
-                                    sequenceNodeIds.push_back(autoIncrId);
-                                    sequenceStrands.push_back(true);
-                                    autoIncrId++;
-                                } else {
-                                    sequenceNodeIds.push_back(
-                                        allSequenceNodes[std::make_pair(currentStart,
-                                                                        currentSequence)].first);
-                                    sequenceStrands.push_back(true);
-                                }
-                                allSequenceNodeMutex.unlock();
-                            }
-                            currentSequence = "";
-                        }
-                    } else {
-                        std::tuple< size_t, size_t, size_t > currentStart;
-                        for(size_t j = sequence[i].first.size()-1; j + 1 > 0; j--) {
-                            currentSequence += sequence[i].first[j].first;
-                            currentStart = std::make_tuple(-1*(int)i-1,j,-1);
-                            if(currentSequence.length() == node_len) {
-                                currentSequence = stripGaps(currentSequence);
-                                if(currentSequence.length()) {
-                                    // Since the GFA stores the strand parameter, the reverse
-                                    // complement will be computed anyway
-                                    std::reverse(currentSequence.begin(), currentSequence.end());
-                                    allSequenceNodeMutex.lock();
-                                    if(allSequenceNodes.find(std::make_pair(currentStart,
-                                                                            currentSequence)) == allSequenceNodes.end()) {
-                                        allSequenceNodes[std::make_pair(currentStart, currentSequence)]
-                                            = std::make_pair(autoIncrId, false);
-                                        sequenceNodeIds.push_back(autoIncrId);
-                                        sequenceStrands.push_back(false);
-                                        autoIncrId++;
-                                    } else {
-                                        sequenceNodeIds.push_back(allSequenceNodes[
-                                                                      std::make_pair(currentStart, currentSequence)].first);
-                                        sequenceStrands.push_back(false);
-                                    }
-                                    allSequenceNodeMutex.unlock();
-                                    currentSequence = "";
-                                }
-                            }
-                            for(size_t k = sequence[i].first[j].second.size() - 1; k + 1 > 0; k--) {
-                                currentSequence += sequence[i].first[j].second[k];
-                                currentStart = std::make_tuple(-1*(int)i,j,k);
-                                if(currentSequence.length() == node_len) {
-                                    currentSequence = stripGaps(currentSequence);
-                                    if(currentSequence.length()) {
-                                        // Since the GFA stores the strand parameter, the reverse
-                                        // complement will be computed anyway
-                                        std::reverse(currentSequence.begin(), currentSequence.end());
-                                        allSequenceNodeMutex.lock();
-                                        if(allSequenceNodes.find(std::make_pair(currentStart,
-                                                                                currentSequence)) == allSequenceNodes.end()) {
-                                            allSequenceNodes[std::make_pair(currentStart,
-                                                                            currentSequence)] = std::make_pair(autoIncrId, false);
-                                            sequenceNodeIds.push_back(autoIncrId);
-                                            sequenceStrands.push_back(false);
-                                            autoIncrId++;
-                                        } else {
-                                            sequenceNodeIds.push_back(allSequenceNodes[
-                                                                          std::make_pair(currentStart, currentSequence)].first);
-                                            sequenceStrands.push_back(false);
-                                        }
-                                        allSequenceNodeMutex.unlock();
-                                    }
-                                    currentSequence = "";
-                                }
-                            }
-                        }
-                        if(currentSequence.length()) {
-                            currentSequence = stripGaps(currentSequence);
-                            if(currentSequence.length()) {
-                                // Since the GFA stores the strand parameter, the reverse
-                                // complement will be computed anyway
-                                std::reverse(currentSequence.begin(), currentSequence.end());
-                                allSequenceNodeMutex.lock();
-                                if(allSequenceNodes.find(std::make_pair(currentStart, currentSequence))
-                                        == allSequenceNodes.end()) {
-                                    allSequenceNodes[std::make_pair(currentStart, currentSequence)]
-                                        = std::make_pair(autoIncrId, false);
-                                    sequenceNodeIds.push_back(autoIncrId);
-                                    sequenceStrands.push_back(false);
-                                    autoIncrId++;
-                                } else {
-                                    sequenceNodeIds.push_back(allSequenceNodes[
-                                                                  std::make_pair(currentStart, currentSequence)].first);
-                                    sequenceStrands.push_back(false);
-                                }
-                                allSequenceNodeMutex.unlock();
-                            }
-                            currentSequence = "";
-                        }
-                    }
-                }
-            }
-
-            paths[u.first] = sequenceNodeIds;
-            strandPaths[u.first] = sequenceStrands;
-        });
-        // }
-
-        std::map< std::pair< size_t, bool >, std::string > finalNodes;
-        for(const auto& u: allSequenceNodes) {
-            finalNodes[u.second] = u.first.second;
-        }
-
-        // Graph and its transpose
-        // Maps from < blockID, strand > pair to list of neighbours stored as
-        // < sequenceId, < blockId, strand > >
-        std::map< std::pair< size_t, bool >, std::vector< std::pair< std::string,
-            std::pair< size_t, bool > > > > G;
-        std::map< std::pair< size_t, bool >, std::vector< std::pair< std::string,
-            std::pair< size_t, bool > > > > GT;
-
-        for(const auto& u: paths) {
-            for(size_t i = 1; i < u.second.size(); i++) {
-                G[std::make_pair(u.second[i-1], strandPaths[u.first][i-1])].push_back(
-                    std::make_pair(u.first, std::make_pair(u.second[i], strandPaths[u.first][i])));
-                GT[std::make_pair(u.second[i], strandPaths[u.first][i])].push_back(
-                    std::make_pair(u.first, std::make_pair(u.second[i-1],
-                                   strandPaths[u.first][i-1])));
-            }
-        }
-
-        for(auto& u: G) {
-            // Sort so we can compare the sequence IDs of incoming and outgoing edges for equality
-            tbb::parallel_sort(u.second.begin(), u.second.end());
-        }
-        for(auto& u: GT) {
-            // Sort so we can compare the sequence IDs of incoming and outgoing edges for equality
-            tbb::parallel_sort(u.second.begin(), u.second.end());
-        }
-
-        for(auto& u: G) {
-            if(finalNodes.find(u.first) == finalNodes.end()) {
-                continue;
-            }
-
-            while(true) {
-                // check if a node's edges only go to one next next node and there is an
-                // outgoing edge for every incoming edge
-                if(u.second.size() != GT[u.first].size() || u.second.size() == 0) {
-                    break;
-                }
-                bool check = true;
-
-                for(size_t j = 0; j < u.second.size(); j++) {
-                    if(u.second[j].first != GT[u.first][j].first) {
-                        check = false;
-                        break;
-                    } else if(j>0 && u.second[j].second != u.second[j-1].second) {
-                        check = false;
-                        break;
-                    }
-                }
-
-                if(!check) {
-                    break;
-                }
-
-                std::pair< size_t, bool > dest = u.second[0].second;
-                if(u.second.size() != GT[dest].size()) {
-                    break;
-                }
-                // Combine only if strands match
-                if(u.first.second != dest.second) {
-                    break;
-                }
-                for(size_t j = 0; j < u.second.size(); j++) {
-                    if(u.second[j].first != GT[dest][j].first && GT[dest][j].second != u.first) {
-                        check = false;
-                        break;
-                    }
-                }
-                if(G[dest].size() != GT[dest].size()) {
-                    break;
-                }
-                for(size_t j = 0; j < GT[dest].size(); j++) {
-                    if(G[dest][j].first != GT[dest][j].first) {
-                        check = false;
-                        break;
-                    }
-                }
-                if(!check) {
-                    break;
-                }
-
-                // combine src and dest
-                if(u.first.second) {
-                    // forward strand
-                    finalNodes[u.first] += finalNodes[dest];
-                } else {
-                    // reverse strand
-                    finalNodes[u.first] = finalNodes[dest] + finalNodes[u.first];
-                }
-                finalNodes.erase(dest);
-                u.second.clear();
-                u.second = G[dest];
-            }
-        }
-
-        // Remove duplicate nodes
-        std::map< std::string, size_t > sequenceToId;
-        size_t ctr = 1;
-        for(const auto& u: finalNodes) {
-            sequenceToId[u.second] = ctr++;
-        }
-
-        std::unordered_map< size_t, size_t > oldToNew;
-        for(const auto& u: finalNodes) {
-            if(sequenceToId.find(u.second) != sequenceToId.end()) {
-                oldToNew[u.first.first] = sequenceToId[u.second];
-            }
-            // oldToNew[u.first.first] = ctr++;
-        }
-
-        std::set< std::pair< pair< size_t, bool >, pair< size_t, bool > > > edges;
-
-        for(const auto& u: G) {
-            if(finalNodes.find(u.first) == finalNodes.end()) {
-                continue;
-            }
-            for(auto edge: u.second) {
-                if(finalNodes.find(edge.second) == finalNodes.end()) {
-                    continue;
-                }
-                edges.insert(std::make_pair(std::make_pair(oldToNew[u.first.first],
-                                            u.first.second), std::make_pair(oldToNew[edge.second.first],
-                                                    edge.second.second)));
-            }
-        }
-
-        for(auto& p: paths) {
-            std::vector< size_t > newPath;
-            std::vector< bool > newStrandPath;
-            for(size_t j = 0; j < p.second.size(); j++) {
-                if(finalNodes.find(std::make_pair(p.second[j], strandPaths[p.first][j]))
-                        != finalNodes.end()) {
-                    newPath.push_back(p.second[j]);
-                    newStrandPath.push_back(strandPaths[p.first][j]);
-                }
-            }
-            p.second = newPath;
-            strandPaths[p.first] = newStrandPath;
-        }
-
-        // for(auto& p: paths) {
-        //     fout << ">" << p.first << "\n";
-        //     for(int i = 0; i < p.second.size(); i++) {
-        //         fout << finalNodes[std::make_pair(p.second[i], strandPaths[p.first][i])];
-        //     }
-        //     fout << "\n";
-        // }
-
-        // convert node IDs to consecutive node IDs
-        size_t currentID = 1;
-        std::unordered_map< size_t, size_t > sequentialIds;
-        for(auto u: finalNodes) {
-            if(sequentialIds.find(oldToNew[u.first.first]) == sequentialIds.end()) {
-                sequentialIds[oldToNew[u.first.first]] = currentID;
-                currentID++;
-            }
-        }
-
-        fout << "H\tVN:Z:1.1\n";
-        std::unordered_map< size_t, bool > alreadyPrinted;
-        for(auto u: finalNodes) {
-            if(!alreadyPrinted[oldToNew[u.first.first]]) {
-                alreadyPrinted[oldToNew[u.first.first]] = true;
-                fout << "S\t" << sequentialIds[oldToNew[u.first.first]] << "\t" << u.second << "\n";
-            }
-        }
-
-        for(auto u: edges) {
-            fout << "L\t" << sequentialIds[u.first.first] << "\t" << (u.first.second? "+":"-")
-                 << "\t" << sequentialIds[u.second.first] << "\t" << (u.second.second? "+":"-")
-                 << "\t0M\n";
-        }
-
-        for(auto u: paths) {
-            fout << "P\t" << u.first << "\t";
-            for(size_t i = 0; i < u.second.size(); i++) {
-                fout << sequentialIds[oldToNew[u.second[i]]] << (strandPaths[u.first][i]?"+":"-");
-                if(i != u.second.size() - 1) {
-                    fout << ",";
-                }
-            }
-            fout << "\t*\n";
+// Ungapped forward strand sequence currently spelled by a region of a block
+static std::string getGfaRegionSequence(const GfaSegmentationState& state, int32_t blockId,
+                                        size_t region) {
+    const auto& block = state.sequence[blockId].first;
+    const auto& offsets = state.columnOffsets[blockId];
+    int32_t start = state.breakpoints[blockId][region];
+    int32_t end = state.breakpoints[blockId][region + 1];
+
+    std::string regionSequence;
+    size_t pos = std::upper_bound(offsets.begin(), offsets.end(), start) - offsets.begin() - 1;
+    for(int32_t column = start; column < end; column++) {
+        while(column >= offsets[pos + 1]) {
+            pos++;
+        }
+        size_t gapPos = column - offsets[pos];
+        char c = (gapPos < block[pos].second.size()) ? block[pos].second[gapPos] : block[pos].first;
+        if(c != '-' && c != 'x') {
+            regionSequence += c;
         }
     }
+    return regionSequence;
 }
 
-void panmanUtils::Tree::convertToGFAEfficient(std::ostream& fout) {
-    // First we check if there are any nucleotide mutations. If there are no nuc mutations, we can
-    // simply construct a GFA of blocks
-    bool nucMutationFlag = false;
-    for(auto u: allNodes) {
-        if(u.second->nucMutation.size() != 0) {
-            nucMutationFlag = true;
+// Recompute the segment spelled by a region, recording the previous segment for backtracking
+static void updateGfaRegion(GfaSegmentationState& state, int32_t blockId, size_t region,
+                            std::vector< std::pair< size_t, size_t > >& segmentInfo) {
+    size_t globalRegion = state.regionOffsets[blockId] + region;
+    std::string regionSequence = getGfaRegionSequence(state, blockId, region);
+
+    size_t segmentId = 0;
+    if(regionSequence.length()) {
+        auto& segments = state.regionSegments[globalRegion];
+        auto it = segments.find(regionSequence);
+        if(it == segments.end()) {
+            segmentId = state.segmentSequences.size();
+            state.segmentSequences.push_back(regionSequence);
+            segments[regionSequence] = segmentId;
+        } else {
+            segmentId = it->second;
         }
     }
 
-    if(!nucMutationFlag) {
-        // get nodes
-        std::map<std::pair<int32_t, int32_t>, std::string> nodes;
-        for(auto block: blocks) {
-            int64_t primaryBlockId = block.primaryBlockId;
-            int64_t secondaryBlockId = block.secondaryBlockId;
-            std::string sequenceString;
-            for(auto u: block.consensusSeq) {
-                for(size_t k = 0; k < 8; k++) {
-                    const int nucCode = (((u) >> (4*(7 - k))) & 15);
-                    if(nucCode == 0) {
-                        break;
-                    }
-                    const char nucleotide = panmanUtils::getNucleotideFromCode(nucCode);
-                    sequenceString += nucleotide;
-                }
-            }
-            nodes[std::make_pair(primaryBlockId, secondaryBlockId)] = sequenceString;
-        }
+    if(segmentId != state.currentSegment[globalRegion]) {
+        segmentInfo.push_back(std::make_pair(globalRegion, state.currentSegment[globalRegion]));
+        state.currentSegment[globalRegion] = segmentId;
+    }
+}
 
-        // block presense map
-        std::vector< std::pair< bool, std::vector< bool > > > blockExistsGlobal(blocks.size() + 1, {false, {}});
-        // Assigning block gaps
-        for(size_t i = 0; i < blockGaps.blockPosition.size(); i++) {
-            blockExistsGlobal[blockGaps.blockPosition[i]].second.resize(blockGaps.blockGapLength[i], false);
+static void convertToGFABlockAwareHelper(panmanUtils::Tree* T, panmanUtils::Node* node,
+        GfaSegmentationState& state) {
+    blockMutationInfo_t blockMutationInfo;
+    mutationInfo_t mutationInfo;
+    T->applyMutations(node, state.sequence, state.blockExists, state.blockStrand,
+                      blockMutationInfo, mutationInfo);
+
+    // Only the regions touched by this node's nucleotide mutations can spell a new segment
+    std::vector< std::pair< int32_t, size_t > > touchedRegions;
+    for(const auto& mutation: node->nucMutation) {
+        if(mutation.secondaryBlockId != -1) {
+            continue;
+        }
+        int32_t blockId = mutation.primaryBlockId;
+        const auto& breakpoints = state.breakpoints[blockId];
+        int32_t firstColumn = getGfaColumn(state, panmanUtils::Coordinate(mutation));
+        int32_t lastColumn = getGfaColumn(state,
+                                          panmanUtils::Coordinate(mutation, mutation.length() - 1));
+        size_t firstRegion = std::upper_bound(breakpoints.begin(), breakpoints.end(), firstColumn)
+                             - breakpoints.begin() - 1;
+        size_t lastRegion = std::upper_bound(breakpoints.begin(), breakpoints.end(), lastColumn)
+                            - breakpoints.begin() - 1;
+        for(size_t r = firstRegion; r <= lastRegion; r++) {
+            touchedRegions.push_back(std::make_pair(blockId, r));
         }
+    }
+    std::sort(touchedRegions.begin(), touchedRegions.end());
+    touchedRegions.erase(std::unique(touchedRegions.begin(), touchedRegions.end()),
+                         touchedRegions.end());
+
+    // For backtracking - < global region, old segment ID >
+    std::vector< std::pair< size_t, size_t > > segmentInfo;
+    for(const auto& region: touchedRegions) {
+        updateGfaRegion(state, region.first, region.second, segmentInfo);
+    }
 
-        tbb::concurrent_unordered_set< std::pair< std::pair<int32_t, int32_t>, std::pair<int32_t, int32_t> > > edges;
-        tbb::concurrent_unordered_map< std::string, std::vector< std::pair<int32_t, int32_t> > > paths;
-
-        // get all paths
-        tbb::parallel_for_each(allNodes, [&](auto u) {
-            if(u.second->children.size()) {
-                return;
-            }
-
-            auto blockExists = blockExistsGlobal;
-
-            std::vector< panmanUtils::Node* > path;
-
-            Node* it = u.second;
-            while(it != root) {
-                path.push_back(it);
-                it = it->parent;
+    if(node->children.size() == 0) {
+        std::vector< std::pair< size_t, bool > > path;
+        for(size_t i = 0; i < state.blockExists.size(); i++) {
+            if(!state.blockExists[i].first) {
+                continue;
             }
-            path.push_back(root);
-            std::reverse(path.begin(), path.end());
-            for(auto node: path) {
-                for(auto mutation: node->blockMutation) {
-                    int primaryBlockId = mutation.primaryBlockId;
-                    int secondaryBlockId = mutation.secondaryBlockId;
-                    int type = (mutation.blockMutInfo);
-
-                    if(type == panmanUtils::BlockMutationType::BI) {
-                        if(secondaryBlockId != -1) {
-                            blockExists[primaryBlockId].second[secondaryBlockId] = true;
-                        } else {
-                            blockExists[primaryBlockId].first = true;
-                        }
-                    } else {
-                        if(secondaryBlockId != -1) {
-                            blockExists[primaryBlockId].second[secondaryBlockId] = false;
-                        } else {
-                            blockExists[primaryBlockId].first = false;
-                        }
+            size_t numRegions = state.breakpoints[i].size() - 1;
+            if(state.blockStrand[i].first) {
+                for(size_t r = 0; r < numRegions; r++) {
+                    size_t segmentId = state.currentSegment[state.regionOffsets[i] + r];
+                    if(segmentId) {
+                        path.push_back(std::make_pair(segmentId, true));
                     }
                 }
-            }
-            std::vector< std::pair< int32_t, int32_t > > currentPath;
-            for(size_t i = 0; i < blockExists.size(); i++) {
-                if(blockExists[i].first) {
-                    currentPath.push_back(std::make_pair(i, -1));
-                }
-                for(size_t j = 0; j < blockExists[i].second.size(); j++) {
-                    if(blockExists[i].second[j]) {
-                        currentPath.push_back(std::make_pair(i, j));
+            } else {
+                // Since the GFA stores the strand parameter, the reverse complement will be
+                // computed from the forward segment
+                for(size_t r = numRegions - 1; r + 1 > 0; r--) {
+                    size_t segmentId = state.currentSegment[state.regionOffsets[i] + r];
+                    if(segmentId) {
+                        path.push_back(std::make_pair(segmentId, false));
                     }
                 }
             }
-            paths[u.second->identifier] = currentPath;
-            for(size_t i = 1; i < currentPath.size(); i++) {
-                edges.insert(std::make_pair(currentPath[i-1], currentPath[i]));
-            }
-        });
-        std::map< std::pair< int32_t, int32_t >, uint64_t > nodeIds;
-        uint64_t ctr = 0;
-        for(auto u: nodes) {
-            nodeIds[u.first] = ctr;
-            ctr++;
-        }
-        for(auto u: nodes) {
-            fout << "S\t" << nodeIds[u.first] << "\t" << u.second << "\n";
-        }
-        for(auto u: edges) {
-            fout << "L\t" << nodeIds[u.first] << "\t+\t" << nodeIds[u.second] << "\t+\t0M\n";
-        }
-        for(auto u: paths) {
-            fout << "P\t" << u.first << "\t";
-            for(size_t i = 0; i < u.second.size(); i++) {
-                fout << nodeIds[u.second[i]] << "+";
-                if(i != u.second.size() - 1) {
-                    fout << ",";
-                }
-            }
-            fout << "\t*\n";
         }
+        state.paths.push_back(std::make_pair(node->identifier, path));
     } else {
-        size_t node_len = 32;
-        size_t autoIncrId = 0;
-        std::map< std::pair< std::tuple< int, size_t, size_t >, std::string >,
-            std::pair< size_t, bool > > allSequenceNodes;
-        std::mutex allSequenceNodeMutex;
-        tbb::concurrent_unordered_map< std::string, std::vector< size_t > > paths;
-        tbb::concurrent_unordered_map< std::string, std::vector< bool > > strandPaths;
-
-        // for(const auto& u: allNodes) {
-        tbb::parallel_for_each(allNodes, [&](const auto& u) {
-            if(u.second->children.size() != 0) {
-                return;
-                // continue;
-            }
-
-            sequence_t sequence;
-            blockExists_t blockExists;
-            blockStrand_t blockStrand;
-            getSequenceFromReference(sequence, blockExists, blockStrand, u.first);
-
-            std::string currentSequence;
-            std::vector< size_t > sequenceNodeIds;
-            std::vector< bool > sequenceStrands;
-
-            for(size_t i = 0; i < sequence.size(); i++) {
-                if(blockExists[i].first) {
-                    if(blockStrand[i].first) {
-                        std::tuple< size_t, size_t, size_t > currentStart;
-                        for(size_t j = 0; j < sequence[i].first.size(); j++) {
-                            for(size_t k = 0; k < sequence[i].first[j].second.size(); k++) {
-                                if(currentSequence.length() == 0) {
-                                    currentStart = std::make_tuple(i,j,k);
-                                }
-                                currentSequence += sequence[i].first[j].second[k];
-                                if(currentSequence.length() == node_len) {
-                                    currentSequence = stripGaps(currentSequence);
-                                    if(currentSequence.length()) {
-                                        allSequenceNodeMutex.lock();
-                                        if(allSequenceNodes.find(std::make_pair(currentStart,
-                                                                                currentSequence)) == allSequenceNodes.end()) {
-                                            allSequenceNodes[std::make_pair(currentStart,
-                                                                            currentSequence)] = std::make_pair(autoIncrId, true);
-                                            sequenceNodeIds.push_back(autoIncrId);
-                                            sequenceStrands.push_back(true);
-                                            autoIncrId++;
-                                        } else {
-                                            sequenceNodeIds.push_back(
-                                                allSequenceNodes[std::make_pair(currentStart,
-                                                                                currentSequence)].first);
-                                            sequenceStrands.push_back(true);
-                                        }
-                                        allSequenceNodeMutex.unlock();
-                                    }
-                                    currentSequence = "";
-                                }
-                            }
-                            if(currentSequence.length() == 0) {
-                                currentStart = std::make_tuple(i,j,-1);
-                            }
-                            currentSequence += sequence[i].first[j].first;
-                            if(currentSequence.length() == node_len) {
-                                currentSequence = stripGaps(currentSequence);
-                                if(currentSequence.length()) {
-                                    allSequenceNodeMutex.lock();
-                                    if(allSequenceNodes.find(std::make_pair(currentStart,
-                                                                            currentSequence)) == allSequenceNodes.end())  {
-                                        allSequenceNodes[std::make_pair(currentStart,
-                                                                        currentSequence)] = std::make_pair(autoIncrId, true);
-                                        sequenceNodeIds.push_back(autoIncrId);
-                                        sequenceStrands.push_back(true);
-                                        autoIncrId++;
-                                    } else {
-                                        sequenceNodeIds.push_back(
-                                            allSequenceNodes[std::make_pair(currentStart,
-                                                                            currentSequence)].first);
-                                        sequenceStrands.push_back(true);
-                                    }
-                                    allSequenceNodeMutex.unlock();
-                                }
-                                currentSequence = "";
-                            }
-                        }
-                        if(currentSequence.length()) {
-                            currentSequence = stripGaps(currentSequence);
-                            if(currentSequence.length()) {
-                                allSequenceNodeMutex.lock();
-                                if(allSequenceNodes.find(std::make_pair(currentStart,
-                                                                        currentSequence)) == allSequenceNodes.end()) {
-                                    allSequenceNodes[std::make_pair(currentStart, currentSequence)]
-                                        = std::make_pair(autoIncrId, true);
-                                    sequenceNodeIds.push_back(autoIncrId);
-                                    sequenceStrands.push_back(true);
-                                    autoIncrId++;
-                                } else {
-                                    sequenceNodeIds.push_back(
-                                        allSequenceNodes[std::make_pair(currentStart,
-                                                                        currentSequence)].first);
-                                    sequenceStrands.push_back(true);
-                                }
-                                allSequenceNodeMutex.unlock();
-                            }
-                            currentSequence = "";
-                        }
-                    } else {
-                        std::tuple< size_t, size_t, size_t > currentStart;
-                        for(size_t j = sequence[i].first.size()-1; j + 1 > 0; j--) {
-                            currentSequence += sequence[i].first[j].first;
-                            currentStart = std::make_tuple(-1*(int)i-1,j,-1);
-                            if(currentSequence.length() == node_len) {
-                                currentSequence = stripGaps(currentSequence);
-                                if(currentSequence.length()) {
-                                    // Since the GFA stores the strand parameter, the reverse
-                                    // complement will be computed anyway
-                                    std::reverse(currentSequence.begin(), currentSequence.end());
-                                    allSequenceNodeMutex.lock();
-                                    if(allSequenceNodes.find(std::make_pair(currentStart,
-                                                                            currentSequence)) == allSequenceNodes.end()) {
-                                        allSequenceNodes[std::make_pair(currentStart, currentSequence)]
-                                            = std::make_pair(autoIncrId, false);
-                                        sequenceNodeIds.push_back(autoIncrId);
-                                        sequenceStrands.push_back(false);
-                                        autoIncrId++;
-                                    } else {
-                                        sequenceNodeIds.push_back(allSequenceNodes[
-                                                                      std::make_pair(currentStart, currentSequence)].first);
-                                        sequenceStrands.push_back(false);
-                                    }
-                                    allSequenceNodeMutex.unlock();
-                                    currentSequence = "";
-                                }
-                            }
-                            for(size_t k = sequence[i].first[j].second.size() - 1; k + 1 > 0; k--) {
-                                currentSequence += sequence[i].first[j].second[k];
-                                currentStart = std::make_tuple(-1*(int)i,j,k);
-                                if(currentSequence.length() == node_len) {
-                                    currentSequence = stripGaps(currentSequence);
-                                    if(currentSequence.length()) {
-                                        // Since the GFA stores the strand parameter, the reverse
-                                        // complement will be computed anyway
-                                        std::reverse(currentSequence.begin(), currentSequence.end());
-                                        allSequenceNodeMutex.lock();
-                                        if(allSequenceNodes.find(std::make_pair(currentStart,
-                                                                                currentSequence)) == allSequenceNodes.end()) {
-                                            allSequenceNodes[std::make_pair(currentStart,
-                                                                            currentSequence)] = std::make_pair(autoIncrId, false);
-                                            sequenceNodeIds.push_back(autoIncrId);
-                                            sequenceStrands.push_back(false);
-                                            autoIncrId++;
-                                        } else {
-                                            sequenceNodeIds.push_back(allSequenceNodes[
-                                                                          std::make_pair(currentStart, currentSequence)].first);
-                                            sequenceStrands.push_back(false);
-                                        }
-                                        allSequenceNodeMutex.unlock();
-                                    }
-                                    currentSequence = "";
-                                }
-                            }
-                        }
-                        if(currentSequence.length()) {
-                            currentSequence = stripGaps(currentSequence);
-                            if(currentSequence.length()) {
-                                // Since the GFA stores the strand parameter, the reverse
-                                // complement will be computed anyway
-                                std::reverse(currentSequence.begin(), currentSequence.end());
-                                allSequenceNodeMutex.lock();
-                                if(allSequenceNodes.find(std::make_pair(currentStart, currentSequence))
-                                        == allSequenceNodes.end()) {
-                                    allSequenceNodes[std::make_pair(currentStart, currentSequence)]
-                                        = std::make_pair(autoIncrId, false);
-                                    sequenceNodeIds.push_back(autoIncrId);
-                                    sequenceStrands.push_back(false);
-                                    autoIncrId++;
-                                } else {
-                                    sequenceNodeIds.push_back(allSequenceNodes[
-                                                                  std::make_pair(currentStart, currentSequence)].first);
-                                    sequenceStrands.push_back(false);
-                                }
-                                allSequenceNodeMutex.unlock();
-                            }
-                            currentSequence = "";
-                        }
-                    }
-                }
-            }
-
-            paths[u.first] = sequenceNodeIds;
-            strandPaths[u.first] = sequenceStrands;
-        });
-        // }
-
-        std::map< std::pair< size_t, bool >, std::string > finalNodes;
-        for(const auto& u: allSequenceNodes) {
-            finalNodes[u.second] = u.first.second;
+        for(auto child: node->children) {
+            convertToGFABlockAwareHelper(T, child, state);
         }
+    }
 
-        // Graph and its transpose
-        // Maps from < blockID, strand > pair to list of neighbours stored as
-        // < sequenceId, < blockId, strand > >
-        std::map< std::pair< size_t, bool >, std::vector< std::pair< std::string,
-            std::pair< size_t, bool > > > > G;
-        std::map< std::pair< size_t, bool >, std::vector< std::pair< std::string,
-            std::pair< size_t, bool > > > > GT;
-
-        for(const auto& u: paths) {
-            for(size_t i = 1; i < u.second.size(); i++) {
-                G[std::make_pair(u.second[i-1], strandPaths[u.first][i-1])].push_back(
-                    std::make_pair(u.first, std::make_pair(u.second[i], strandPaths[u.first][i])));
-                GT[std::make_pair(u.second[i], strandPaths[u.first][i])].push_back(
-                    std::make_pair(u.first, std::make_pair(u.second[i-1],
-                                   strandPaths[u.first][i-1])));
-            }
-        }
+    for(auto it = segmentInfo.rbegin(); it != segmentInfo.rend(); it++) {
+        state.currentSegment[it->first] = it->second;
+    }
+    T->undoMutations(state.sequence, state.blockExists, state.blockStrand, blockMutationInfo,
+                     mutationInfo);
+}
 
-        for(auto& u: G) {
-            // Sort so we can compare the sequence IDs of incoming and outgoing edges for equality
-            tbb::parallel_sort(u.second.begin(), u.second.end());
-        }
-        for(auto& u: GT) {
-            // Sort so we can compare the sequence IDs of incoming and outgoing edges for equality
-            tbb::parallel_sort(u.second.begin(), u.second.end());
-        }
+void panmanUtils::Tree::convertToGFABlockAware(std::ostream& fout) {
+    GfaSegmentationState state;
+    getConsensusSequence(state.sequence, state.blockExists, state.blockStrand);
+
+    // Column layout of each block. Secondary blocks are deprecated and not segmented
+    size_t numBlocks = state.sequence.size();
+    state.columnOffsets.resize(numBlocks);
+    state.breakpoints.resize(numBlocks);
+    for(size_t i = 0; i < numBlocks; i++) {
+        const auto& block = state.sequence[i].first;
+        state.columnOffsets[i].resize(block.size() + 1, 0);
+        for(size_t j = 0; j < block.size(); j++) {
+            state.columnOffsets[i][j+1] = state.columnOffsets[i][j] + block[j].second.size() + 1;
+        }
+        state.breakpoints[i].push_back(0);
+        state.breakpoints[i].push_back(state.columnOffsets[i][block.size()]);
+    }
 
-        for(auto& u: G) {
-            if(finalNodes.find(u.first) == finalNodes.end()) {
+    // Every mutation boundary in the tree splits its block, so that stretches untouched by
+    // mutations stay a single segment regardless of their length
+    for(const auto& u: allNodes) {
+        for(const auto& mutation: u.second->nucMutation) {
+            if(mutation.secondaryBlockId != -1) {
                 continue;
             }
-
-            while(true) {
-                // check if a node's edges only go to one next next node and there is an
-                // outgoing edge for every incoming edge
-                if(u.second.size() != GT[u.first].size() || u.second.size() == 0) {
-                    break;
-                }
-                bool check = true;
-
-                for(size_t j = 0; j < u.second.size(); j++) {
-                    if(u.second[j].first != GT[u.first][j].first) {
-                        check = false;
-                        break;
-                    } else if(j>0 && u.second[j].second != u.second[j-1].second) {
-                        check = false;
-                        break;
-                    }
-                }
-
-                if(!check) {
-                    break;
-                }
-
-                std::pair< size_t, bool > dest = u.second[0].second;
-                if(u.second.size() != GT[dest].size()) {
-                    break;
-                }
-                // Combine only if strands match
-                if(u.first.second != dest.second) {
-                    break;
-                }
-                for(size_t j = 0; j < u.second.size(); j++) {
-                    if(u.second[j].first != GT[dest][j].first && GT[dest][j].second != u.first) {
-                        check = false;
-                        break;
-                    }
-                }
-                if(G[dest].size() != GT[dest].size()) {
-                    break;
-                }
-                for(size_t j = 0; j < GT[dest].size(); j++) {
-                    if(G[dest][j].first != GT[dest][j].first) {
-                        check = false;
-                        break;
-                    }
-                }
-                if(!check) {
-                    break;
-                }
-
-                // combine src and dest
-                if(u.first.second) {
-                    // forward strand
-                    finalNodes[u.first] += finalNodes[dest];
-                } else {
-                    // reverse strand
-                    finalNodes[u.first] = finalNodes[dest] + finalNodes[u.first];
-                }
-                finalNodes.erase(dest);
-                u.second.clear();
-                u.second = G[dest];
-            }
+            int32_t blockId = mutation.primaryBlockId;
+            state.breakpoints[blockId].push_back(getGfaColumn(state, Coordinate(mutation)));
+            state.breakpoints[blockId].push_back(
+                getGfaColumn(state, Coordinate(mutation, mutation.length() - 1)) + 1);
         }
+    }
 
-        // Remove duplicate nodes
-        std::map< std::string, size_t > sequenceToId;
-        size_t ctr = 1;
-        for(const auto& u: finalNodes) {
-            sequenceToId[u.second] = ctr++;
-        }
+    size_t numRegions = 0;
+    state.regionOffsets.resize(numBlocks);
+    for(size_t i = 0; i < numBlocks; i++) {
+        auto& breakpoints = state.breakpoints[i];
+        std::sort(breakpoints.begin(), breakpoints.end());
+        breakpoints.erase(std::unique(breakpoints.begin(), breakpoints.end()), breakpoints.end());
+        state.regionOffsets[i] = numRegions;
+        numRegions += breakpoints.size() - 1;
+    }
 
-        std::unordered_map< size_t, size_t > oldToNew;
-        for(const auto& u: finalNodes) {
-            if(sequenceToId.find(u.second) != sequenceToId.end()) {
-                oldToNew[u.first.first] = sequenceToId[u.second];
-            }
-            // oldToNew[u.first.first] = ctr++;
+    // Segments spelled by the consensus sequence
+    state.currentSegment.resize(numRegions, 0);
+    state.regionSegments.resize(numRegions);
+    state.segmentSequences.push_back("");
+    std::vector< std::pair< size_t, size_t > > segmentInfo;
+    for(size_t i = 0; i < numBlocks; i++) {
+        for(size_t r = 0; r + 1 < state.breakpoints[i].size(); r++) {
+            updateGfaRegion(state, i, r, segmentInfo);
         }
+    }
 
-        std::set< std::pair< pair< size_t, bool >, pair< size_t, bool > > > edges;
-
-        for(const auto& u: G) {
-            if(finalNodes.find(u.first) == finalNodes.end()) {
-                continue;
-            }
-            for(auto edge: u.second) {
-                if(finalNodes.find(edge.second) == finalNodes.end()) {
-                    continue;
-                }
-                edges.insert(std::make_pair(std::make_pair(oldToNew[u.first.first],
-                                            u.first.second), std::make_pair(oldToNew[edge.second.first],
-                                                    edge.second.second)));
+    convertToGFABlockAwareHelper(this, root, state);
+
+    size_t numSegments = state.segmentSequences.size();
+
+    // Neighbour of each segment on its right and left side in forward orientation across all
+    // paths. -1 if no neighbour has been seen, -2 if there is more than one neighbour or the
+    // side is a path end
+    std::vector< int64_t > rightNeighbour(numSegments, -1);
+    std::vector< int64_t > leftNeighbour(numSegments, -1);
+    std::vector< bool > segmentUsed(numSegments, false);
+    auto addNeighbour = [](int64_t& side, int64_t neighbour) {
+        if(side == -1) {
+            side = neighbour;
+        } else if(side != neighbour) {
+            side = -2;
+        }
+    };
+
+    for(const auto& p: state.paths) {
+        const auto& path = p.second;
+        if(path.size() == 0) {
+            continue;
+        }
+        for(size_t i = 0; i < path.size(); i++) {
+            segmentUsed[path[i].first] = true;
+        }
+        addNeighbour(path[0].second ? leftNeighbour[path[0].first] : rightNeighbour[path[0].first], -2);
+        addNeighbour(path.back().second ? rightNeighbour[path.back().first] : leftNeighbour[path.back().first], -2);
+        for(size_t i = 1; i < path.size(); i++) {
+            size_t x = path[i-1].first, y = path[i].first;
+            bool xStrand = path[i-1].second, yStrand = path[i].second;
+            if(xStrand && yStrand) {
+                addNeighbour(rightNeighbour[x], y);
+                addNeighbour(leftNeighbour[y], x);
+            } else if(!xStrand && !yStrand) {
+                addNeighbour(leftNeighbour[x], y);
+                addNeighbour(rightNeighbour[y], x);
+            } else if(xStrand) {
+                // Strand flips are never merged
+                addNeighbour(rightNeighbour[x], -2);
+                addNeighbour(rightNeighbour[y], -2);
+            } else {
+                addNeighbour(leftNeighbour[x], -2);
+                addNeighbour(leftNeighbour[y], -2);
             }
         }
+    }
 
-        for(auto& p: paths) {
-            std::vector< size_t > newPath;
-            std::vector< bool > newStrandPath;
-            for(size_t j = 0; j < p.second.size(); j++) {
-                if(finalNodes.find(std::make_pair(p.second[j], strandPaths[p.first][j]))
-                        != finalNodes.end()) {
-                    newPath.push_back(p.second[j]);
-                    newStrandPath.push_back(strandPaths[p.first][j]);
-                }
-            }
-            p.second = newPath;
-            strandPaths[p.first] = newStrandPath;
+    // Merge chains of segments where every traversal of one segment continues into the next one
+    auto canMerge = [&](size_t a) {
+        int64_t b = rightNeighbour[a];
+        return b >= 0 && (size_t)b != a && leftNeighbour[b] == (int64_t)a;
+    };
+
+    std::vector< size_t > newSegmentIds(numSegments, 0);
+    std::vector< bool > mergedIntoPrevious(numSegments, false);
+    std::vector< std::string > finalSegments;
+    for(size_t a = 1; a < numSegments; a++) {
+        if(!segmentUsed[a]) {
+            continue;
+        }
+        int64_t previous = leftNeighbour[a];
+        if(previous >= 0 && canMerge(previous)) {
+            continue;
+        }
+        std::string mergedSequence = state.segmentSequences[a];
+        size_t current = a;
+        while(canMerge(current)) {
+            current = rightNeighbour[current];
+            if(mergedIntoPrevious[current]) {
+                break;
+            }
+            mergedIntoPrevious[current] = true;
+            mergedSequence += state.segmentSequences[current];
+        }
+        finalSegments.push_back(mergedSequence);
+        newSegmentIds[a] = finalSegments.size();
+    }
+    // Segments on a cycle of mergeable segments have no chain start and are kept as they are
+    for(size_t a = 1; a < numSegments; a++) {
+        if(segmentUsed[a] && !newSegmentIds[a] && !mergedIntoPrevious[a]) {
+            finalSegments.push_back(state.segmentSequences[a]);
+            newSegmentIds[a] = finalSegments.size();
         }
+    }
 
-        // for(auto& p: paths) {
-        //     fout << ">" << p.first << "\n";
-        //     for(int i = 0; i < p.second.size(); i++) {
-        //         fout << finalNodes[std::make_pair(p.second[i], strandPaths[p.first][i])];
-        //     }
-        //     fout << "\n";
-        // }
-
-        // convert node IDs to consecutive node IDs
-        size_t currentID = 1;
-        std::unordered_map< size_t, size_t > sequentialIds;
-        for(auto u: finalNodes) {
-            if(sequentialIds.find(oldToNew[u.first.first]) == sequentialIds.end()) {
-                sequentialIds[oldToNew[u.first.first]] = currentID;
-                currentID++;
+    std::set< std::pair< std::pair< size_t, bool >, std::pair< size_t, bool > > > edges;
+    for(auto& p: state.paths) {
+        std::vector< std::pair< size_t, bool > > newPath;
+        for(const auto& v: p.second) {
+            if(!mergedIntoPrevious[v.first]) {
+                newPath.push_back(std::make_pair(newSegmentIds[v.first], v.second));
             }
         }
-
-        fout << "H\tVN:Z:1.1\n";
-        std::unordered_map< size_t, bool > alreadyPrinted;
-        for(auto u: finalNodes) {
-            if(!alreadyPrinted[oldToNew[u.first.first]]) {
-                alreadyPrinted[oldToNew[u.first.first]] = true;
-                fout << "S\t" << sequentialIds[oldToNew[u.first.first]] << "\t" << u.second << "\n";
-            }
+        for(size_t i = 1; i < newPath.size(); i++) {
+            edges.insert(std::make_pair(newPath[i-1], newPath[i]));
         }
+        p.second = newPath;
+    }
 
-        for(auto u: edges) {
-            fout << "L\t" << sequentialIds[u.first.first] << "\t" << (u.first.second? "+":"-")
-                 << "\t" << sequentialIds[u.second.first] << "\t" << (u.second.second? "+":"-")
-                 << "\t0M\n";
-        }
+    fout << "H\tVN:Z:1.1\n";
+    for(size_t i = 0; i < finalSegments.size(); i++) {
+        fout << "S\t" << i + 1 << "\t" << finalSegments[i] << "\n";
+    }
 
-        for(auto u: paths) {
-            fout << "P\t" << u.first << "\t";
-            for(size_t i = 0; i < u.second.size(); i++) {
-                fout << sequentialIds[oldToNew[u.second[i]]] << (strandPaths[u.first][i]?"+":"-");
-                if(i != u.second.size() - 1) {
-                    fout << ",";
-                }
+    for(const auto& u: edges) {
+        fout << "L\t" << u.first.first << "\t" << (u.first.second? "+":"-")
+             << "\t" << u.second.first << "\t" << (u.second.second? "+":"-")
+             << "\t0M\n";
+    }
+
+    for(const auto& p: state.paths) {
+        fout << "P\t" << p.first << "\t";
+        for(size_t i = 0; i < p.second.size(); i++) {
+            fout << p.second[i].first << (p.second[i].second?"+":"-");
+            if(i != p.second.size() - 1) {
+                fout << ",";
             }
-            fout << "\t*\n";
         }
+        fout << "\t*\n";
     }
 }
-
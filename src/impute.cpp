@@ -10,25 +10,44 @@ void panmanUtils::Tree::imputeNs(int allowedIndelDistance) {
     // Make pre-order pass over the tree, building lookup tables
     fillImputationLookupTables(substitutions, insertions, originalNucs, wasBlockInv);
 
-    // Impute all substitutions (100% success rate)
-    int totalSubNs = 0;
-    for (const auto& toImpute: substitutions) {
-        totalSubNs += imputeSubstitution(allNodes[toImpute.first]->nucMutation, toImpute.second);
+    // Impute all substitutions (100% success rate). Substitutions are collected in preorder, so
+    // the ones of a node are contiguous and every node can be handled independently
+    std::vector< size_t > substitutionStarts;
+    for (size_t i = 0; i < substitutions.size(); i++) {
+        if (i == 0 || substitutions[i].first != substitutions[i-1].first) {
+            substitutionStarts.push_back(i);
+        }
+    }
+    substitutionStarts.push_back(substitutions.size());
+
+    std::vector< Node* > substitutionNodes(substitutionStarts.size() - 1);
+    for (size_t i = 0; i + 1 < substitutionStarts.size(); i++) {
+        substitutionNodes[i] = allNodes[substitutions[substitutionStarts[i]].first];
     }
+
+    std::atomic< int > totalSubNs(0);
+    tbb::parallel_for((size_t)0, substitutionNodes.size(), [&](size_t i) {
+        int subNs = 0;
+        for (size_t j = substitutionStarts[i]; j < substitutionStarts[i+1]; j++) {
+            subNs += imputeSubstitution(substitutionNodes[i]->nucMutation, substitutions[j].second);
+        }
+        totalSubNs += subNs;
+    });
     std::cout << "Imputed " << totalSubNs << "/" << totalSubNs << " SNPs/MNPs to N" << std::endl;
     
     // Attempt to impute insertions
 
-    // Store {node ID to move : {node to move under, new mutations}} for all imputation attempts
-    std::unordered_map< std::string, std::pair< panmanUtils::Node*, panmanUtils::MutationList > > toMove;
-    // Must filter "insertions" to just those with Ns
-    std::vector<panmanUtils::IndelPosition> insertionsWithNs;
-    int insertionImputationAttempts = 0;
-
-    // Find possible places to move nodes to for insertion imputation
-    for (const auto& toImpute: insertions) {
-        insertionsWithNs.clear();
-        for (const auto& curInsertion: toImpute.second) {
+    // Inverted index from insertion position to {node : number of Ns} for every node with that
+    // insertion, so that candidate targets are looked up instead of searched for
+    std::unordered_map< panmanUtils::IndelPosition, std::vector< std::pair< panmanUtils::Node*, int32_t > > > insertionIndex;
+    // Nodes with insertions to N, and the positions of those insertions
+    std::vector< std::pair< panmanUtils::Node*, std::vector< panmanUtils::IndelPosition > > > toImpute;
+
+    for (const auto& nodeInsertions: insertions) {
+        Node* curNode = allNodes[nodeInsertions.first];
+        std::vector< panmanUtils::IndelPosition > insertionsWithNs;
+        for (const auto& curInsertion: nodeInsertions.second) {
+            insertionIndex[curInsertion.first].emplace_back(curNode, curInsertion.second);
             if (curInsertion.second > 0) {
                 insertionsWithNs.push_back(curInsertion.first);
             }
@@ -36,28 +55,50 @@ void panmanUtils::Tree::imputeNs(int allowedIndelDistance) {
 
         // Only attempt an imputation if necessary
         if (!insertionsWithNs.empty()) {
-            insertionImputationAttempts++;
-            toMove[toImpute.first] = findInsertionImputationMove(
-                allNodes[toImpute.first], insertionsWithNs,
-                allowedIndelDistance, insertions, originalNucs, wasBlockInv);
+            toImpute.emplace_back(curNode, insertionsWithNs);
         }
     }
+    int insertionImputationAttempts = toImpute.size();
+
+    // Find possible places to move nodes to for insertion imputation. The tree is not changed
+    // until all moves have been evaluated, so this runs concurrently
+    std::vector< std::pair< panmanUtils::Node*, panmanUtils::MutationList > > toMove(toImpute.size());
+    tbb::parallel_for((size_t)0, toImpute.size(), [&](size_t i) {
+        toMove[i] = findInsertionImputationMove(toImpute[i].first, toImpute[i].second,
+            allowedIndelDistance, insertionIndex, originalNucs, wasBlockInv);
+    });
+
+    // Resolve conflicts by applying the moves with the largest parsimony improvement first
+    auto mutationLength = [](const std::vector< panmanUtils::NucMut >& nucMutation) {
+        int length = 0;
+        for (const auto& curMut: nucMutation) length += curMut.length();
+        return length;
+    };
+    std::vector< std::tuple< int, int, std::string, size_t > > moveOrder;
+    for (size_t i = 0; i < toMove.size(); i++) {
+        if (toMove[i].first != nullptr) {
+            Node* curNode = toImpute[i].first;
+            moveOrder.emplace_back(
+                mutationLength(toMove[i].second.nucMutation) - mutationLength(curNode->nucMutation),
+                (int)toMove[i].second.blockMutation.size() - (int)curNode->blockMutation.size(),
+                curNode->identifier, i);
+        }
+    }
+    std::sort(moveOrder.begin(), moveOrder.end());
 
     // Make all moves
     std::vector<panmanUtils::Node*> oldParents;
     std::unordered_set<panmanUtils::Node*> moved;
-    for (const auto& curMove: toMove) {
-        Node* curNode = allNodes[curMove.first];
-        Node* newParent = curMove.second.first;
+    for (const auto& curMove: moveOrder) {
+        Node* curNode = toImpute[std::get<3>(curMove)].first;
+        Node* newParent = toMove[std::get<3>(curMove)].first;
         Node* curParent = curNode->parent;
-        if (newParent != nullptr) {
-            // If a node was moved, any mutations calculated relative to it are no longer valid
-            if (moved.find(newParent) == moved.end() && !newParent->isDescendant(moved)) {
-                if (moveNode(curNode, newParent, curMove.second.second)) {
-                    // This move succeeded
-                    oldParents.push_back(curParent);
-                    moved.emplace(curNode);
-                }
+        // If a node was moved, any mutations calculated relative to it are no longer valid
+        if (moved.find(newParent) == moved.end() && !newParent->isDescendant(moved)) {
+            if (moveNode(curNode, newParent, toMove[std::get<3>(curMove)].second)) {
+                // This move succeeded
+                oldParents.push_back(curParent);
+                moved.emplace(curNode);
             }
         }
     }
@@ -242,7 +283,7 @@ const void panmanUtils::Tree::imputeAllSubstitutionsWithNs(std::vector<panmanUti
 
 const std::pair< panmanUtils::Node*, panmanUtils::MutationList > panmanUtils::Tree::findInsertionImputationMove(
     panmanUtils::Node* node, const std::vector<panmanUtils::IndelPosition>& mutsToN, int allowedDistance,
-    const std::unordered_map< std::string, std::unordered_map< panmanUtils::IndelPosition, int32_t > >& insertions,
+    const std::unordered_map< panmanUtils::IndelPosition, std::vector< std::pair< panmanUtils::Node*, int32_t > > >& insertionIndex,
     const std::unordered_map< std::string, std::unordered_map< panmanUtils::Coordinate, int8_t > >& originalNucs,
     const std::unordered_map< std::string, std::unordered_map< uint64_t, bool > >& wasBlockInv) {
     // Certain cases are simply impossible
@@ -256,13 +297,8 @@ const std::pair< panmanUtils::Node*, panmanUtils::MutationList > panmanUtils::Tr
     Node* bestNewParent = nullptr;
     panmanUtils::MutationList bestNewMuts;
 
-    std::vector<panmanUtils::IndelPosition> toImpute;
-    for (const auto& curInsertion: insertions.at(node->identifier)) {
-        if (curInsertion.second > 0) toImpute.push_back(curInsertion.first);
-    }
-    
-    for (const auto& nearby: findNearbyInsertions(node->parent, mutsToN, allowedDistance, node,
-                                                  insertions, originalNucs, wasBlockInv)) {
+    for (const auto& nearby: findNearbyInsertions(node, mutsToN, allowedDistance,
+                                                  insertionIndex, originalNucs, wasBlockInv)) {
         panmanUtils::MutationList curNewMuts = nearby.second.concat(MutationList(node));
         curNewMuts.nucMutation = consolidateNucMutations(curNewMuts.nucMutation);
         imputeAllSubstitutionsWithNs(curNewMuts.nucMutation);
@@ -286,52 +322,77 @@ const std::pair< panmanUtils::Node*, panmanUtils::MutationList > panmanUtils::Tr
 }
 
 const std::vector<std::pair< panmanUtils::Node*, panmanUtils::MutationList >> panmanUtils::Tree::findNearbyInsertions(
-    panmanUtils::Node* node, const std::vector<panmanUtils::IndelPosition>& mutsToN, int allowedDistance, panmanUtils::Node* ignore,
-    const std::unordered_map< std::string, std::unordered_map< panmanUtils::IndelPosition, int32_t > >& insertions,
+    panmanUtils::Node* node, const std::vector<panmanUtils::IndelPosition>& mutsToN, int allowedDistance,
+    const std::unordered_map< panmanUtils::IndelPosition, std::vector< std::pair< panmanUtils::Node*, int32_t > > >& insertionIndex,
     const std::unordered_map< std::string, std::unordered_map< panmanUtils::Coordinate, int8_t > >& originalNucs,
     const std::unordered_map< std::string, std::unordered_map< uint64_t, bool > >& wasBlockInv) {
 
     std::vector<std::pair< panmanUtils::Node*, panmanUtils::MutationList >> nearbyInsertions;
+    if (node == nullptr || node->parent == nullptr) return nearbyInsertions;
 
-    // Bases cases: nonexistant node or node too far away
-    if (node == nullptr || allowedDistance < 0) return nearbyInsertions;
-
-    std::string curID = node->identifier;
+    // Candidates are decided by the first of "mutsToN" they have an insertion at. They are only
+    // used if this insertion has non-N nucleotides to contribute
+    std::unordered_map< panmanUtils::Node*, bool > candidates;
     for (const auto& curMut: mutsToN) {
-        if (insertions.at(curID).find(curMut) != insertions.at(curID).end()) {
-            // Only use if this insertion has non-N nucleotides to contribute
-            if (insertions.at(curID).at(curMut) < curMut.length) {
-                nearbyInsertions.emplace_back(node, MutationList());
-            }
-            break;
+        auto it = insertionIndex.find(curMut);
+        if (it == insertionIndex.end()) continue;
+        for (const auto& curNode: it->second) {
+            candidates.emplace(curNode.first, curNode.second < curMut.length);
         }
     }
 
-    // Try children
-    for (const auto& child: node->children) {
-        if (child != ignore) {
-            auto childPossibilities = findNearbyInsertions(
-                child, mutsToN, allowedDistance - child->branchLength, 
-                node, insertions, originalNucs, wasBlockInv);
-            
-            // Only bother with getting/inverting mutations if necessary
-            if (!childPossibilities.empty()) {
-                // Add mutations to get to child (which must be reversed)
-                panmanUtils::MutationList toAdd = MutationList(child);
-                toAdd.invertMutations(originalNucs.at(child->identifier), wasBlockInv.at(child->identifier));
-                for (const auto& nearby: childPossibilities) {
-                    nearbyInsertions.emplace_back(nearby.first, nearby.second.concat(toAdd));
-                }
-            }
-        }
+    std::vector< panmanUtils::Node* > targets;
+    for (const auto& candidate: candidates) {
+        if (candidate.second) targets.push_back(candidate.first);
+    }
+    if (targets.empty()) return nearbyInsertions;
+    std::sort(targets.begin(), targets.end(), [](panmanUtils::Node* a, panmanUtils::Node* b) {
+        return a->identifier < b->identifier;
+    });
+
+    // Ancestors of the search start (the parent of "node") that are within "allowedDistance",
+    // with the distance left on reaching them. Branch lengths are subtracted and truncated one
+    // branch at a time as the search has always done
+    std::vector< panmanUtils::Node* > ancestors;
+    std::unordered_map< panmanUtils::Node*, std::pair< size_t, int > > ancestorDistance;
+    int remaining = allowedDistance;
+    for (Node* it = node->parent; it != nullptr && remaining >= 0; it = it->parent) {
+        ancestorDistance[it] = std::make_pair(ancestors.size(), remaining);
+        ancestors.push_back(it);
+        remaining = remaining - it->branchLength;
     }
-    // Try parent
-    if (node->parent != ignore) {
-        for (const auto& nearby: findNearbyInsertions(node->parent, mutsToN, allowedDistance - node->branchLength,
-                                                      node, insertions, originalNucs, wasBlockInv)) {
-            // Add mutations to get to parent
-            nearbyInsertions.emplace_back(nearby.first, nearby.second.concat(MutationList(node)));
+
+    // Never search down to direct descendants of "node"
+    for (const auto& target: targets) {
+        std::vector< panmanUtils::Node* > down;
+        Node* it = target;
+        while (it != nullptr && it != node && ancestorDistance.find(it) == ancestorDistance.end()) {
+            down.push_back(it);
+            it = it->parent;
+        }
+        if (it == nullptr || it == node) continue;
+
+        const auto& common = ancestorDistance[it];
+        remaining = common.second;
+        for (auto child = down.rbegin(); child != down.rend() && remaining >= 0; child++) {
+            remaining = remaining - (*child)->branchLength;
+        }
+        if (remaining < 0) continue;
+
+        // Mutations from the target up to the common ancestor (which must be reversed), then
+        // down to the parent of "node"
+        panmanUtils::MutationList toAdd;
+        for (const auto& child: down) {
+            panmanUtils::MutationList inverted = MutationList(child);
+            inverted.invertMutations(originalNucs.at(child->identifier), wasBlockInv.at(child->identifier));
+            toAdd.nucMutation.insert(toAdd.nucMutation.end(), inverted.nucMutation.begin(), inverted.nucMutation.end());
+            toAdd.blockMutation.insert(toAdd.blockMutation.end(), inverted.blockMutation.begin(), inverted.blockMutation.end());
+        }
+        for (size_t i = common.first; i > 0; i--) {
+            toAdd.nucMutation.insert(toAdd.nucMutation.end(), ancestors[i-1]->nucMutation.begin(), ancestors[i-1]->nucMutation.end());
+            toAdd.blockMutation.insert(toAdd.blockMutation.end(), ancestors[i-1]->blockMutation.begin(), ancestors[i-1]->blockMutation.end());
         }
+        nearbyInsertions.emplace_back(target, toAdd);
     }
     return nearbyInsertions;
 }
@@ -355,4 +416,5 @@ bool panmanUtils::Tree::moveNode(panmanUtils::Node* toMove, panmanUtils::Node* n
     toMove->branchLength = 1;
     toMove->nucMutation = newMuts.nucMutation;
     toMove->blockMutation = newMuts.blockMutation;
+    return true;
 }
\ No newline at end of file
@@ -2,186 +2,228 @@
 #include "panmanUtils.hpp"
 
 void panmanUtils::Tree::generateSequencesFromMAF(std::ifstream& fin, std::ofstream& fout) {
+    // Collect the rows of every leaf in one pass over the file, keyed by start position
+    std::unordered_map< std::string, std::map< int, std::string > > leafRows;
     for(auto u: allNodes) {
         if(u.second->children.size() == 0) {
-            // sequence
-            std::string sequenceId = u.first;
-            fout << ">" << sequenceId << "\n";
-
-            std::string line;
-            std::map< int, std::string > positionToSequence;
-
-            while(getline(fin, line, '\n')) {
-                if(line.length() > 2 && line.substr(0,2) == "s\t") {
-                    std::vector< std::string > words;
-                    stringSplit(line, '\t', words);
-                    if(words.size() != 7) {
-                        std::cout << "Line not in correct format. Line size: " << words.size() << std::endl;
-                        return;
-                    }
-
-                    int startPosition = std::stoll(words[2]);
-                    if(words[1] != sequenceId) {
-                        continue;
-                    }
-
-                    bool strand = (words[4] == "+"?true: false);
-                    std::string sequence = words[words.size()-1];
-                    std::string strippedSequence;
-                    for(auto u: sequence) {
-                        if(u != '-') {
-                            if(strand) {
-                                strippedSequence+=u;
-                            } else {
-                                strippedSequence+=getComplementCharacter(u);
-                            }
-                        }
-                    }
-                    if(!strand) {
-                        std::reverse(strippedSequence.begin(), strippedSequence.end());
-                    }
-                    positionToSequence[startPosition] = strippedSequence;
-                }
-            }
-            int nextExpected = 0;
-            int endLength = 0;
-            std::string fullSequence;
-            for(auto u: positionToSequence) {
-                if(nextExpected == 0 && u.first != nextExpected) {
-                    nextExpected = u.first;
-                    endLength = u.first;
-                }
-                if(u.first != nextExpected) {
-                    std::cout << "Error in positions" << std::endl;
-                }
-                fullSequence+=u.second;
-                nextExpected+=u.second.length();
-            }
-            fullSequence = fullSequence.substr(fullSequence.length() - endLength) + fullSequence.substr(0,fullSequence.length() - endLength);
-            fout << fullSequence << '\n';
-            fin.clear();
-            fin.seekg(0);
+            leafRows[u.first];
         }
     }
-}
 
-void panmanUtils::Tree::printMAF(std::ostream& fout) {
-    std::vector< std::string > sequenceNames;
-
-    std::map< std::vector< uint32_t >, std::vector< std::pair< int,int > > > blocksWithSameSequences;
+    LineReader lines(fin);
+    std::string_view line;
+    while(lines.getLine(line)) {
+        if(line.length() > 2 && line.substr(0,2) == "s\t") {
+            std::vector< std::string > words;
+            stringSplit(std::string(line), '\t', words);
+            if(words.size() != 7) {
+                std::cout << "Line not in correct format. Line size: " << words.size() << std::endl;
+                return;
+            }
 
-    for(auto b: blocks) {
-        blocksWithSameSequences[b.consensusSeq].push_back(std::make_pair(b.primaryBlockId, b.secondaryBlockId));
+            auto leafIt = leafRows.find(words[1]);
+            if(leafIt == leafRows.end()) {
+                continue;
+            }
+            int startPosition = std::stoll(words[2]);
+            bool strand = (words[4] == "+"?true: false);
+            leafIt->second[startPosition] = (strand ? '+' : '-') + words[words.size()-1];
+        }
     }
 
-    // sequence name, primary bid, secondary bid -> actual sequence offset
-    std::map< std::tuple< std::string, int32_t, int32_t >, int32_t > sequenceBlockToStartPoint;
-    std::map< std::string, int32_t > sequenceLengths;
-
-    int ctr2=0;
-
+    std::vector< std::string > leafIds;
     for(auto u: allNodes) {
         if(u.second->children.size() == 0) {
-            sequenceNames.push_back(u.first);
-            sequence_t sequence;
-            blockExists_t blockExists;
-            blockStrand_t blockStrand;
-            int rotIndex = 0;
-            getSequenceFromReference(sequence, blockExists, blockStrand, u.first, true, &rotIndex);
-
-            // List of block IDs to account for rotation and inversion
-            std::vector< int > blockIds(sequence.size());
-            for(size_t i = 0; i < sequence.size(); i++) {
-                blockIds[i] = i;
+            leafIds.push_back(u.first);
+        }
+    }
+    std::vector< std::string > fullSequences(leafIds.size());
+    tbb::parallel_for((size_t)0, leafIds.size(), [&](size_t i) {
+        int nextExpected = 0;
+        int endLength = 0;
+        std::string& fullSequence = fullSequences[i];
+        for(auto& u: leafRows.at(leafIds[i])) {
+            bool strand = (u.second[0] == '+');
+            std::string strippedSequence;
+            for(size_t j = 1; j < u.second.length(); j++) {
+                if(u.second[j] != '-') {
+                    strippedSequence += strand ? u.second[j] : getComplementCharacter(u.second[j]);
+                }
             }
-            if(rotationIndexes.find(u.first) != rotationIndexes.end()) {
-                rotate(blockIds.begin(), blockIds.begin() + rotIndex, blockIds.end());
+            if(!strand) {
+                std::reverse(strippedSequence.begin(), strippedSequence.end());
             }
-            if(sequenceInverted.find(u.first) != sequenceInverted.end()
-                    && sequenceInverted[u.first]) {
-                reverse(blockIds.begin(), blockIds.end());
+            u.second.clear();
+
+            if(nextExpected == 0 && u.first != nextExpected) {
+                nextExpected = u.first;
+                endLength = u.first;
             }
+            if(u.first != nextExpected) {
+                std::cout << "Error in positions" << std::endl;
+            }
+            fullSequence+=strippedSequence;
+            nextExpected+=strippedSequence.length();
+        }
+        fullSequence = fullSequence.substr(fullSequence.length() - endLength) + fullSequence.substr(0,fullSequence.length() - endLength);
+    });
 
-            int ctr = 0;
+    for(size_t i = 0; i < leafIds.size(); i++) {
+        fout << ">" << leafIds[i] << "\n";
+        fout << fullSequences[i] << '\n';
+    }
+}
+
+// State shared across the depth first traversal of the MAF writer
+struct MafExportState {
+    sequence_t sequence;
+    blockExists_t blockExists;
+    blockStrand_t blockStrand;
+
+    // Alignment rows collected for each block, indexed like the tree's block list
+    std::vector< std::string > blockRows;
+};
+
+// Aligned row of a block with gaps and the end character written as '-'
+static std::string getMafBlockRow(const std::vector< std::pair< char, std::vector< char > > >& block,
+                                  int32_t& ungappedLength) {
+    std::string row;
+    ungappedLength = 0;
+    for(size_t i = 0; i < block.size(); i++) {
+        for(size_t j = 0; j < block[i].second.size(); j++) {
+            if(block[i].second[j] != '-' && block[i].second[j] != 'x') {
+                row += block[i].second[j];
+                ungappedLength++;
+            } else {
+                row += '-';
+            }
+        }
+        if(block[i].first != '-' && block[i].first != 'x') {
+            row += block[i].first;
+            ungappedLength++;
+        } else {
+            row += '-';
+        }
+    }
+    return row;
+}
 
-            for(size_t i = 0; i < sequence.size(); i++) {
+static void printMAFHelper(panmanUtils::Tree* T, panmanUtils::Node* node, MafExportState& state) {
+    blockMutationInfo_t blockMutationInfo;
+    mutationInfo_t mutationInfo;
+    T->applyMutations(node, state.sequence, state.blockExists, state.blockStrand,
+                      blockMutationInfo, mutationInfo);
+
+    if(node->children.size() == 0) {
+        const std::string& name = node->identifier;
+        const auto& sequence = state.sequence;
+        const auto& blockExists = state.blockExists;
+
+        // Order of the blocks in the sequence, accounting for rotation and inversion
+        std::vector< int32_t > blockIds(sequence.size());
+        for(size_t i = 0; i < blockIds.size(); i++) {
+            blockIds[i] = i;
+        }
+        auto rotation = T->rotationIndexes.find(name);
+        if(rotation != T->rotationIndexes.end() && rotation->second != 0) {
+            int ctr = -1, rotInd = 0;
+            for(size_t i = 0; i < blockExists.size(); i++) {
                 if(blockExists[i].first) {
-                    sequenceBlockToStartPoint[std::make_tuple(u.first, blockIds[i], -1)] = ctr;
-                    for(size_t j = 0; j < sequence[i].first.size(); j++) {
-                        for(size_t k = 0; k < sequence[i].first[j].second.size(); k++) {
-                            if(sequence[i].first[j].second[k] != '-' && sequence[i].first[j].second[k] != 'x') {
-                                ctr++;
-                            }
-                            ctr2++;
-                        }
-                        if(sequence[i].first[j].first != '-' && sequence[i].first[j].first != 'x') {
-                            ctr++;
-                        }
-                        ctr2++;
-                    }
+                    ctr++;
                 }
+                if(ctr == rotation->second) {
+                    rotInd = i;
+                    break;
+                }
+            }
+            std::rotate(blockIds.begin(), blockIds.begin() + rotInd, blockIds.end());
+        }
+        auto inverted = T->sequenceInverted.find(name);
+        if(inverted != T->sequenceInverted.end() && inverted->second) {
+            std::reverse(blockIds.begin(), blockIds.end());
+        }
+
+        // Aligned rows and ungapped lengths of all primary blocks
+        std::vector< std::string > rows(sequence.size());
+        std::vector< int32_t > ungappedLengths(sequence.size(), 0);
+        tbb::parallel_for((size_t)0, sequence.size(), [&](size_t i) {
+            if(blockExists[i].first) {
+                rows[i] = getMafBlockRow(sequence[i].first, ungappedLengths[i]);
             }
-            sequenceLengths[u.first] = ctr;
-            if(circularSequences.find(u.first) != circularSequences.end()) {
-                int offset = circularSequences[u.first];
-                for(auto& v: sequenceBlockToStartPoint) {
-                    if(std::get<0>(v.first) != u.first) {
-                        continue;
-                    }
-                    v.second -= offset;
-                    if(v.second < 0) {
-                        v.second += ctr;
-                    }
+        });
+
+        // Start of each block within the sequence
+        std::vector< int32_t > blockStarts(sequence.size(), 0);
+        int32_t sequenceLength = 0;
+        for(auto blockId: blockIds) {
+            if(blockExists[blockId].first) {
+                blockStarts[blockId] = sequenceLength;
+                sequenceLength += ungappedLengths[blockId];
+            }
+        }
+        auto circular = T->circularSequences.find(name);
+        if(circular != T->circularSequences.end()) {
+            for(auto& start: blockStarts) {
+                start -= circular->second;
+                if(start < 0) {
+                    start += sequenceLength;
                 }
             }
         }
-    }
 
-    std::atomic<int> ctr3 = 0;
+        tbb::parallel_for((size_t)0, T->blocks.size(), [&](size_t i) {
+            int32_t primaryBlockId = T->blocks[i].primaryBlockId;
+            int32_t secondaryBlockId = T->blocks[i].secondaryBlockId;
+            if(!blockExists[primaryBlockId].first) {
+                return;
+            }
 
-    fout << "##maf version=1\n";
+            std::string secondaryRow;
+            int32_t rowLength = ungappedLengths[primaryBlockId];
+            bool strand = state.blockStrand[primaryBlockId].first;
+            if(secondaryBlockId != -1) {
+                secondaryRow = getMafBlockRow(sequence[primaryBlockId].second[secondaryBlockId],
+                                              rowLength);
+                strand = state.blockStrand[primaryBlockId].second[secondaryBlockId];
+            }
+            const std::string& row = (secondaryBlockId != -1) ? secondaryRow : rows[primaryBlockId];
+
+            auto& blockRows = state.blockRows[i];
+            blockRows += "s\t" + name + "\t" + std::to_string(blockStarts[primaryBlockId]) + "\t"
+                         + std::to_string(rowLength) + (strand ? "\t+\t" : "\t-\t")
+                         + std::to_string(sequenceLength) + "\t" + row + "\n";
+        });
+    } else {
+        for(auto child: node->children) {
+            printMAFHelper(T, child, state);
+        }
+    }
 
-    for(auto& common: blocksWithSameSequences) {
-        fout << "a\n";
-        for(auto& b: common.second) {
-            tbb::concurrent_unordered_map< std::string, std::pair< std::pair< int, int >, std::pair< std::string, bool > > > sequenceIdToSequence;
+    T->undoMutations(state.sequence, state.blockExists, state.blockStrand, blockMutationInfo,
+                     mutationInfo);
+}
 
-            int primaryBlockId = b.first;
-            int secondaryBlockId = b.second;
+void panmanUtils::Tree::printMAF(std::ostream& fout) {
+    // Blocks with the same consensus are written to the same alignment block
+    std::map< std::vector< uint32_t >, std::vector< size_t > > blocksWithSameSequences;
+    for(size_t i = 0; i < blocks.size(); i++) {
+        blocksWithSameSequences[blocks[i].consensusSeq].push_back(i);
+    }
 
-            tbb::parallel_for_each(sequenceNames, [&](auto u) {
-                if(sequenceBlockToStartPoint.find(std::make_tuple(u, primaryBlockId, -1)) == sequenceBlockToStartPoint.end()) {
-                    return;
-                }
+    // Every leaf is materialized once, and its rows are appended to the buffer of each block
+    MafExportState state;
+    getConsensusSequence(state.sequence, state.blockExists, state.blockStrand);
+    state.blockRows.resize(blocks.size());
+    printMAFHelper(this, root, state);
 
-                block_t sequence;
-                bool blockExists = false, blockStrand = true;
-
-                getBlockSequenceFromReference(sequence, blockExists, blockStrand, u, primaryBlockId,
-                                              secondaryBlockId);
-
-                std::string stringSequence;
-                for(size_t i = 0; i < sequence.size(); i++) {
-                    for(size_t j = 0; j < sequence[i].second.size(); j++) {
-                        if(sequence[i].second[j] != '-' && sequence[i].second[j] != 'x') {
-                            stringSequence += sequence[i].second[j];
-                        } else {
-                            stringSequence += '-';
-                        }
-                    }
-                    if(sequence[i].first != '-' && sequence[i].first != 'x') {
-                        stringSequence += sequence[i].first;
-                    } else {
-                        stringSequence += '-';
-                    }
-                }
-                ctr3+=stringSequence.length();
-                sequenceIdToSequence[u] = std::make_pair(std::make_pair(primaryBlockId, secondaryBlockId), std::make_pair(stringSequence, blockStrand));
-            });
+    fout << "##maf version=1\n";
 
-            for(auto u: sequenceIdToSequence) {
-                fout << "s\t" << u.first << "\t"<< sequenceBlockToStartPoint[std::make_tuple(u.first, u.second.first.first, u.second.first.second)] <<"\t" << stripGaps(u.second.second.first).length() << "\t" << (u.second.second.second? "+\t":"-\t") << sequenceLengths[u.first] << "\t" << u.second.second.first << "\n";
-            }
+    for(auto& common: blocksWithSameSequences) {
+        fout << "a\n";
+        for(auto i: common.second) {
+            fout << state.blockRows[i];
+            // Release the rows of the block once they are written
+            std::string().swap(state.blockRows[i]);
         }
         fout << "\n";
     }
@@ -2,6 +2,7 @@
 
 #include <iostream>
 #include <string>
+#include <cstring>
 #include <vector>
 #include <stack>
 #include <tbb/parallel_reduce.h>
@@ -12,13 +13,21 @@
 #include <tbb/concurrent_unordered_map.h>
 #include <tbb/concurrent_unordered_set.h>
 #include <tbb/concurrent_map.h>
+#include <tbb/enumerable_thread_specific.h>
+#include <tbb/pipeline.h>
 #include <ctime>
 #include <iomanip>
 #include <mutex>
 #include <chrono>
 #include <filesystem>
+#include <unistd.h>
 #include <set>
+#include <deque>
+#include <string_view>
 #include <boost/iostreams/filter/lzma.hpp>
+#include <boost/iostreams/device/array.hpp>
+#include <boost/iostreams/stream.hpp>
+#include <boost/iostreams/device/back_inserter.hpp>
 #include <typeinfo>
 
 
@@ -34,6 +43,7 @@
 #include "gfa.cpp"
 #include "annotate.cpp"
 #include "reroot.cpp"
+#include "place.cpp"
 #include "aaTrans.cpp"
 #include "panman2usher.cpp"
 #include "panmanUtils.hpp"
@@ -295,6 +305,324 @@ void panmanUtils::stringSplit (std::string const& s, char delim, std::vector<std
 }
 
 
+panmanUtils::LineReader::LineReader(std::istream& in, size_t bufferSize): in(in), buffer(bufferSize) {}
+
+bool panmanUtils::LineReader::getLine(std::string_view& line) {
+    while(true) {
+        const char* newline = (const char*)memchr(buffer.data() + begin, '\n', end - begin);
+        if(newline != nullptr || (eof && begin < end)) {
+            size_t lineEnd = (newline != nullptr) ? newline - buffer.data() : end;
+            size_t length = lineEnd - begin;
+            if(length && buffer[begin + length - 1] == '\r') {
+                length--;
+            }
+            line = std::string_view(buffer.data() + begin, length);
+            begin = (newline != nullptr) ? lineEnd + 1 : end;
+            return true;
+        }
+        if(eof) {
+            return false;
+        }
+
+        // Move the partial line to the front and refill, growing the buffer for long lines
+        std::memmove(buffer.data(), buffer.data() + begin, end - begin);
+        end -= begin;
+        begin = 0;
+        if(end == buffer.size()) {
+            buffer.resize(buffer.size() * 2);
+        }
+        in.read(buffer.data() + end, buffer.size() - end);
+        end += in.gcount();
+        if(!in) {
+            eof = true;
+        }
+    }
+}
+
+bool panmanUtils::FastaReader::next(std::string& id, std::string& sequence) {
+    std::string_view line;
+    while(!hasHeader && lines.getLine(line)) {
+        if(line.length() && line[0] == '>') {
+            header = line;
+            hasHeader = true;
+        }
+    }
+    if(!hasHeader) {
+        return false;
+    }
+
+    std::vector< std::string > splitLine;
+    stringSplit(header, ' ', splitLine);
+    id = splitLine[0].substr(1);
+    sequence.clear();
+    hasHeader = false;
+    while(lines.getLine(line)) {
+        if(line.length() == 0) {
+            continue;
+        }
+        if(line[0] == '>') {
+            header = line;
+            hasHeader = true;
+            break;
+        }
+        sequence.append(line);
+    }
+    return true;
+}
+
+panmanUtils::JsonReader::JsonReader(std::istream& in, size_t bufferSize): in(in), buffer(bufferSize) {}
+
+// Next character, without consuming it. Returns 0 at the end of the stream
+char panmanUtils::JsonReader::peek() {
+    if(begin == end) {
+        in.read(buffer.data(), buffer.size());
+        begin = 0;
+        end = in.gcount();
+        if(end == 0) {
+            return 0;
+        }
+    }
+    return buffer[begin];
+}
+
+char panmanUtils::JsonReader::get() {
+    char c = peek();
+    if(c == 0) {
+        throw std::runtime_error("Unexpected end of JSON input");
+    }
+    begin++;
+    return c;
+}
+
+// Skip whitespace and consume c
+void panmanUtils::JsonReader::expect(char c) {
+    char next = get();
+    while(std::isspace((unsigned char)next)) {
+        next = get();
+    }
+    if(next != c) {
+        throw std::runtime_error(std::string("Malformed JSON: expected '") + c + "', found '" + next + "'");
+    }
+}
+
+void panmanUtils::JsonReader::beginObject() {
+    expect('{');
+}
+
+bool panmanUtils::JsonReader::nextMember(std::string& key) {
+    while(std::isspace((unsigned char)peek())) {
+        begin++;
+    }
+    if(peek() == '}') {
+        begin++;
+        return false;
+    }
+    if(peek() == ',') {
+        begin++;
+    }
+    readString(key);
+    expect(':');
+    return true;
+}
+
+void panmanUtils::JsonReader::beginArray() {
+    expect('[');
+}
+
+bool panmanUtils::JsonReader::nextElement() {
+    while(std::isspace((unsigned char)peek())) {
+        begin++;
+    }
+    if(peek() == ']') {
+        begin++;
+        return false;
+    }
+    if(peek() == ',') {
+        begin++;
+    }
+    return true;
+}
+
+void panmanUtils::JsonReader::readString(std::string& value) {
+    expect('"');
+    value.clear();
+    while(true) {
+        // Copy runs without escapes straight from the buffer
+        if(peek() == 0) {
+            throw std::runtime_error("Unexpected end of JSON input");
+        }
+        size_t runEnd = begin;
+        while(runEnd < end && buffer[runEnd] != '"' && buffer[runEnd] != '\\') {
+            runEnd++;
+        }
+        value.append(buffer.data() + begin, runEnd - begin);
+        begin = runEnd;
+        if(begin == end) {
+            continue;
+        }
+
+        char c = get();
+        if(c == '"') {
+            return;
+        }
+        c = get();
+        switch(c) {
+        case 'b':
+            value += '\b';
+            break;
+        case 'f':
+            value += '\f';
+            break;
+        case 'n':
+            value += '\n';
+            break;
+        case 'r':
+            value += '\r';
+            break;
+        case 't':
+            value += '\t';
+            break;
+        case 'u': {
+            std::string hex;
+            for(int i = 0; i < 4; i++) {
+                hex += get();
+            }
+            uint32_t codePoint = std::stoul(hex, nullptr, 16);
+            if(codePoint < 0x80) {
+                value += (char)codePoint;
+            } else if(codePoint < 0x800) {
+                value += (char)(0xC0 | (codePoint >> 6));
+                value += (char)(0x80 | (codePoint & 0x3F));
+            } else {
+                value += (char)(0xE0 | (codePoint >> 12));
+                value += (char)(0x80 | ((codePoint >> 6) & 0x3F));
+                value += (char)(0x80 | (codePoint & 0x3F));
+            }
+            break;
+        }
+        default:
+            value += c;
+        }
+    }
+}
+
+int64_t panmanUtils::JsonReader::readInt() {
+    while(std::isspace((unsigned char)peek())) {
+        begin++;
+    }
+    if(peek() == 'n') {
+        // null reads as 0
+        readBool();
+        return 0;
+    }
+    std::string number;
+    while(true) {
+        char c = peek();
+        if(!(std::isdigit((unsigned char)c) || c == '-' || c == '+' || c == '.' || c == 'e' || c == 'E')) {
+            break;
+        }
+        number += c;
+        begin++;
+    }
+    if(number.empty()) {
+        throw std::runtime_error("Malformed JSON: expected a number");
+    }
+    return (int64_t)std::stod(number);
+}
+
+bool panmanUtils::JsonReader::readBool() {
+    while(std::isspace((unsigned char)peek())) {
+        begin++;
+    }
+    std::string literal;
+    while(std::isalpha((unsigned char)peek())) {
+        literal += get();
+    }
+    if(literal == "true") {
+        return true;
+    } else if(literal == "false" || literal == "null") {
+        return false;
+    }
+    throw std::runtime_error("Malformed JSON: expected a boolean, found " + literal);
+}
+
+void panmanUtils::JsonReader::skipString() {
+    expect('"');
+    while(true) {
+        char c = get();
+        if(c == '"') {
+            return;
+        }
+        if(c == '\\') {
+            get();
+        }
+    }
+}
+
+void panmanUtils::JsonReader::skipValue() {
+    while(std::isspace((unsigned char)peek())) {
+        begin++;
+    }
+    char c = peek();
+    if(c == '"') {
+        skipString();
+        return;
+    }
+    if(c != '{' && c != '[') {
+        // number or literal
+        while(true) {
+            c = peek();
+            if(c == 0 || c == ',' || c == '}' || c == ']' || std::isspace((unsigned char)c)) {
+                return;
+            }
+            begin++;
+        }
+    }
+
+    // Nested containers only need their brackets balanced, strings may contain brackets
+    size_t depth = 0;
+    do {
+        c = peek();
+        if(c == '"') {
+            skipString();
+            continue;
+        }
+        c = get();
+        if(c == '{' || c == '[') {
+            depth++;
+        } else if(c == '}' || c == ']') {
+            depth--;
+        }
+    } while(depth);
+}
+
+void panmanUtils::forEachFastaRecord(std::istream& in,
+                                     const std::function< void(size_t, std::string&, std::string&) >& consume) {
+    struct FastaRecord {
+        size_t index;
+        std::string id, sequence;
+    };
+
+    FastaReader reader(in);
+    size_t index = 0;
+    // Bound the number of records in flight so that memory stays proportional to the thread count
+    tbb::parallel_pipeline(2 * tbb::task_scheduler_init::default_num_threads(),
+        tbb::make_filter< void, FastaRecord* >(tbb::filter::serial_in_order, [&](tbb::flow_control& fc) -> FastaRecord* {
+            FastaRecord* record = new FastaRecord{index, "", ""};
+            if(!reader.next(record->id, record->sequence)) {
+                delete record;
+                fc.stop();
+                return nullptr;
+            }
+            index++;
+            return record;
+        }) &
+        tbb::make_filter< FastaRecord*, void >(tbb::filter::parallel, [&](FastaRecord* record) {
+            consume(record->index, record->id, record->sequence);
+            delete record;
+        }));
+}
+
 std::string panmanUtils::stripString(std::string s){
     while(s.length() && s[s.length() - 1] == ' '){
         s.pop_back();
@@ -631,128 +959,355 @@ bool panmanUtils::Tree::hasPolytomy(Node* node) {
 }
 
 
+// Read an aligned FASTA file into a map from sequence id to sequence. Records are parsed by a
+// buffered reader and stored in file order on worker threads; the length check and the insertion
+// run afterwards so that errors and duplicate ids resolve as in a serial read, where the last
+// record with a given id wins and all sequences must match the length of the first one
 void readFasta(std::ifstream& fin, std::map< std::string, std::string >& sequenceIdsToSequences) {
-    std::string line;
-    std::string currentSequence, currentSequenceId;
-    size_t lineLength = 0;
+    // Elements of a concurrent_vector never move, so each worker can fill its own slot
+    tbb::concurrent_vector< std::pair< std::string, std::string > > records;
 
-    while(getline(fin,line,'\n')) {
-        if(line.length() == 0) {
+    panmanUtils::forEachFastaRecord(fin, [&](size_t index, std::string& currentSequenceId, std::string& currentSequence) {
+        records.grow_to_at_least(index + 1);
+        records[index].first = std::move(currentSequenceId);
+        records[index].second = std::move(currentSequence);
+    });
+
+    size_t lineLength = 0;
+    for(auto& record: records) {
+        if(record.second.length() == 0) {
             continue;
         }
-        if(line[0] == '>') {
-            if(currentSequence.length()) {
-                if(lineLength == 0) {
-                    lineLength = currentSequence.length();
-                } else if(lineLength != currentSequence.length()) {
-                    std::cerr << "Error: sequence lengths don't match! " << currentSequenceId << 
-                    "Expected: " << lineLength << "Produced:" << currentSequence.length() << std::endl;
-                    exit(-1);
-                }
-                sequenceIdsToSequences[currentSequenceId] = currentSequence;
-            }
-            std::vector< std::string > splitLine;
-            panmanUtils::stringSplit(line,' ',splitLine);
-            currentSequenceId = splitLine[0].substr(1);
-            currentSequence = "";
-        } else {
-            currentSequence += line;
+        if(lineLength == 0) {
+            lineLength = record.second.length();
+        } else if(lineLength != record.second.length()) {
+            std::cerr << "Error: sequence lengths don't match! " << record.first << 
+                "Expected: " << lineLength << "Produced:" << record.second.length() << std::endl;
+            exit(-1);
         }
+        sequenceIdsToSequences[record.first] = std::move(record.second);
     }
-    if(currentSequence.length()) {
-        if(lineLength != 0 && lineLength != currentSequence.length()) {
-            std::cerr << "Error: sequence lengths don't match! " << currentSequenceId << 
-                    "Expected: " << lineLength << "Produced:" << currentSequence.length() << std::endl;
-            exit(-1);
-        } else {
-            lineLength = currentSequence.length();
+}
+
+
+
+// Uniquely named file in the temporary directory that is removed when the guard goes out of
+// scope. Files still alive when the process calls exit() are removed by an atexit handler, since
+// exit() skips the destructors of local objects
+class TemporaryFile {
+public:
+    explicit TemporaryFile(const std::string& prefix) {
+        // mkstemp creates the file atomically with a random suffix, and the pid keeps names of
+        // concurrent runs apart
+        std::string pathTemplate = (std::filesystem::temp_directory_path()
+                                    / (prefix + std::to_string(getpid()) + "_XXXXXX")).string();
+        std::vector< char > name(pathTemplate.begin(), pathTemplate.end());
+        name.push_back('\0');
+        int fd = mkstemp(name.data());
+        if(fd == -1) {
+            return;
         }
-        sequenceIdsToSequences[currentSequenceId] = currentSequence;
+        close(fd);
+        path = name.data();
+
+        // The registry is constructed before the handler is registered, so that it is still
+        // alive when the handler runs
+        std::lock_guard< std::mutex > lock(registryMutex());
+        auto& paths = registry();
+        static bool handlerRegistered = (std::atexit(removeRemaining) == 0);
+        (void)handlerRegistered;
+        paths.insert(path);
     }
 
-}
+    TemporaryFile(const TemporaryFile&) = delete;
+    TemporaryFile& operator=(const TemporaryFile&) = delete;
+
+    ~TemporaryFile() {
+        if(path.empty()) {
+            return;
+        }
+        std::error_code error;
+        std::filesystem::remove(path, error);
+        std::lock_guard< std::mutex > lock(registryMutex());
+        registry().erase(path);
+    }
 
+    // Empty if the file could not be created
+    const std::string& getPath() const {
+        return path;
+    }
 
+private:
+    std::string path;
 
-size_t readFastaInBatch(std::ifstream& fin, std::map< std::string, std::string >& sequenceIdsToSequences, size_t &startIndex, size_t batchSize) {
-    std::string line;
-    std::string currentSequence, currentSequenceId;
-    size_t lineLength = 0;
-    size_t nextStartIndex = startIndex;
+    static std::set< std::string >& registry() {
+        static std::set< std::string > paths;
+        return paths;
+    }
+    static std::mutex& registryMutex() {
+        static std::mutex m;
+        return m;
+    }
+    static void removeRemaining() {
+        std::lock_guard< std::mutex > lock(registryMutex());
+        for(const auto& path: registry()) {
+            std::error_code error;
+            std::filesystem::remove(path, error);
+        }
+        registry().clear();
+    }
+};
+
+// Stream an MSA once, writing the aligned residues of every sequence back to back with headers
+// and line breaks stripped, so that sequence s occupies [s * lineLength, (s + 1) * lineLength)
+void writeMsaResidues(std::ifstream& fin, std::ofstream& fout, std::vector< std::string >& sequenceIds, size_t& lineLength) {
+    panmanUtils::LineReader lines(fin);
+    std::string_view line;
+    size_t currentLength = 0;
+    lineLength = 0;
+    auto finishSequence = [&]() {
+        if(sequenceIds.empty()) {
+            return;
+        }
+        if(sequenceIds.size() == 1) {
+            lineLength = currentLength;
+        } else if(lineLength != currentLength) {
+            std::cerr << "Error: sequence lengths don't match! " << sequenceIds.back() << 
+                "Expected: " << lineLength << "Produced:" << currentLength << std::endl;
+            exit(-1);
+        }
+    };
 
-    // std::cout << "starting reading for " << nextStartIndex << std::endl;
-    while(getline(fin,line,'\n')) {
+    while(lines.getLine(line)) {
         if(line.length() == 0) {
             continue;
         }
         if(line[0] == '>') {
-            if(currentSequence.length()) {
-                if(lineLength == 0) {
-                    lineLength = currentSequence.length();
-                } else if(lineLength != currentSequence.length()) {
-                    std::cerr << "Error: sequence lengths don't match! " << currentSequenceId << 
-                    "Expected: " << lineLength << "Produced:" << currentSequence.length() << std::endl;
-                    exit(-1);
-                }
-                size_t lengthStr = startIndex+batchSize>currentSequence.size() ? currentSequence.size()-startIndex: batchSize;
-                sequenceIdsToSequences[currentSequenceId] = currentSequence.substr(startIndex, lengthStr);
-            }
+            finishSequence();
             std::vector< std::string > splitLine;
-            panmanUtils::stringSplit(line,' ',splitLine);
-            currentSequenceId = splitLine[0].substr(1);
-            currentSequence = "";
+            panmanUtils::stringSplit(std::string(line),' ',splitLine);
+            sequenceIds.push_back(splitLine[0].substr(1));
+            currentLength = 0;
         } else {
-            currentSequence += line;
+            fout.write(line.data(), line.size());
+            currentLength += line.size();
         }
     }
-    if(currentSequence.length()) {
-        if(lineLength != 0 && lineLength != currentSequence.length()) {
-            std::cerr << "Error: sequence lengths don't match! " << currentSequenceId << 
-                    "Expected: " << lineLength << "Produced:" << currentSequence.length() << std::endl;
-            exit(-1);
-        } else {
-            lineLength = currentSequence.length();
+    finishSequence();
+}
+
+// Fetch columns [startIndex, startIndex + width) of every sequence from a residue file written by
+// writeMsaResidues and transpose them, so that column i holds sequence s at i * numSequences + s
+void readMsaColumnChunk(std::ifstream& fin, size_t numSequences, size_t lineLength, size_t startIndex,
+                        size_t width, std::vector< char >& rows, std::vector< char >& columns) {
+    rows.resize(numSequences * width);
+    columns.resize(numSequences * width);
+    for(size_t s = 0; s < numSequences; s++) {
+        fin.seekg(s * lineLength + startIndex);
+        fin.read(rows.data() + s * width, width);
+    }
+    tbb::parallel_for((size_t)0, width, [&](size_t i) {
+        char* column = columns.data() + i * numSequences;
+        for(size_t s = 0; s < numSequences; s++) {
+            column[s] = rows[s * width + i];
+        }
+    });
+}
+
+// Mutation lists keyed by node identifier that parallel parsimony workers fill without locking,
+// one copy per thread
+template< typename Mutation >
+using ThreadLocalNodeMutations = tbb::enumerable_thread_specific<
+    std::unordered_map< std::string, std::vector< Mutation > > >;
+
+// Concatenate the per-thread lists of each node, sort them and pass them to `consume`. Nodes are
+// merged in parallel, each by a single task, so `consume` may modify its node freely
+template< typename Mutation, typename Consumer >
+void mergeThreadLocalNodeMutations(ThreadLocalNodeMutations< Mutation >& buffers,
+                                   std::unordered_map< std::string, panmanUtils::Node* >& allNodes,
+                                   Consumer consume) {
+    tbb::parallel_for_each(allNodes, [&](auto& node) {
+        std::vector< Mutation > mutations;
+        for(auto& buffer: buffers) {
+            auto it = buffer.find(node.first);
+            if(it != buffer.end()) {
+                mutations.insert(mutations.end(), it->second.begin(), it->second.end());
+            }
+        }
+        if(mutations.empty()) {
+            return;
+        }
+        std::sort(mutations.begin(), mutations.end());
+        consume(node.second, mutations);
+    });
+}
+
+// Turn a node's sorted (position, type, nucleotide) MSA mutations into NucMuts that each cover up
+// to 6 consecutive positions of the same type
+void groupMsaNucMutations(panmanUtils::Node* node, const std::vector< std::tuple< int,int8_t,int8_t > >& mutations) {
+    size_t currentStart = 0;
+    for(size_t i = 1; i < mutations.size(); i++) {
+        if(i - currentStart == 6 || std::get<0>(mutations[i]) != std::get<0>(mutations[i-1])+1 || std::get<1>(mutations[i]) != std::get<1>(mutations[i-1])) {
+            node->nucMutation.emplace_back(mutations, currentStart, i);
+            currentStart = i;
         }
-        size_t lengthStr = startIndex+batchSize>currentSequence.size() ? currentSequence.size()-startIndex: batchSize;
-        sequenceIdsToSequences[currentSequenceId] = currentSequence.substr(startIndex, lengthStr);
-        nextStartIndex += lengthStr;
     }
+    node->nucMutation.emplace_back(mutations, currentStart, mutations.size());
+}
+
+// Read the segments and paths of a GFA file. The file is consumed in large chunks that are
+// split into lines in parallel, and segment names are interned into integer ids on the fly so
+// that paths are held as compact (segment id, strand) arrays instead of strings
+void readGfa(std::ifstream& fin, std::vector< std::string >& pathNames,
+             std::vector< std::vector< std::pair< int32_t, bool > > >& paths,
+             std::vector< std::string >& segmentSequences) {
+    const size_t chunkSize = ((size_t)1 << 26);
+
+    // Deque so that the views used as hash keys stay valid as names are added
+    std::deque< std::string > segmentNames;
+    std::unordered_map< std::string_view, int32_t > segmentIds;
+    auto internSegment = [&](std::string_view name) {
+        auto it = segmentIds.find(name);
+        if(it != segmentIds.end()) {
+            return it->second;
+        }
+        int32_t id = segmentNames.size();
+        segmentNames.emplace_back(name);
+        segmentIds[segmentNames.back()] = id;
+        segmentSequences.emplace_back();
+        return id;
+    };
+
+    struct GfaLine {
+        char type = 0;
+        std::string_view name;
+        std::string_view sequence;
+        std::vector< std::pair< std::string_view, bool > > stepNames;
+        std::vector< std::pair< int32_t, bool > > steps;
+    };
+
+    std::vector< char > chunk(chunkSize);
+    std::string buffer, carry;
+    while(true) {
+        fin.read(chunk.data(), chunkSize);
+        size_t bytesRead = fin.gcount();
+        bool lastChunk = (bytesRead < chunkSize);
+
+        buffer.swap(carry);
+        buffer.append(chunk.data(), bytesRead);
+        size_t end = buffer.size();
+        if(!lastChunk) {
+            // Hold back the trailing partial line for the next chunk
+            size_t lastNewline = buffer.rfind('\n');
+            if(lastNewline == std::string::npos) {
+                carry = std::move(buffer);
+                buffer.clear();
+                continue;
+            }
+            carry.assign(buffer, lastNewline + 1, std::string::npos);
+            end = lastNewline + 1;
+        } else {
+            carry.clear();
+        }
+
+        std::vector< std::pair< size_t, size_t > > lineBounds;
+        size_t lineStart = 0;
+        while(lineStart < end) {
+            const char* newline = (const char*)memchr(buffer.data() + lineStart, '\n', end - lineStart);
+            size_t lineEnd = (newline == nullptr) ? end : (newline - buffer.data());
+            if(lineEnd > lineStart && (buffer[lineStart] == 'S' || buffer[lineStart] == 'P')) {
+                lineBounds.emplace_back(lineStart, lineEnd);
+            }
+            lineStart = lineEnd + 1;
+        }
+
+        std::vector< GfaLine > lines(lineBounds.size());
+        tbb::parallel_for((size_t)0, lineBounds.size(), [&](size_t i) {
+            std::string_view line(buffer.data() + lineBounds[i].first,
+                                  lineBounds[i].second - lineBounds[i].first);
+            if(line.back() == '\r') {
+                line.remove_suffix(1);
+            }
+            std::string_view fields[3];
+            size_t fieldStart = 0;
+            for(size_t f = 0; f < 3; f++) {
+                size_t tab = line.find('\t', fieldStart);
+                fields[f] = line.substr(fieldStart, tab == std::string_view::npos ? std::string_view::npos : tab - fieldStart);
+                if(tab == std::string_view::npos) {
+                    break;
+                }
+                fieldStart = tab + 1;
+            }
+            if(fields[0].size() != 1) {
+                return;
+            }
+            lines[i].type = fields[0][0];
+            lines[i].name = fields[1];
+            if(lines[i].type == 'S') {
+                lines[i].sequence = fields[2];
+            } else {
+                size_t stepStart = 0;
+                while(stepStart < fields[2].size()) {
+                    size_t comma = fields[2].find(',', stepStart);
+                    if(comma == std::string_view::npos) {
+                        comma = fields[2].size();
+                    }
+                    if(comma > stepStart) {
+                        std::string_view step = fields[2].substr(stepStart, comma - stepStart);
+                        lines[i].stepNames.emplace_back(step.substr(0, step.size() - 1), step.back() == '+');
+                    }
+                    stepStart = comma + 1;
+                }
+            }
+        });
+
+        // Segment ids are assigned in file order
+        for(auto& line: lines) {
+            if(line.type == 'S') {
+                segmentSequences[internSegment(line.name)].assign(line.sequence);
+            }
+        }
 
-    // std::cout << "Done reading till " << nextStartIndex - 1 << std::endl;
+        // Resolve path steps against the segments seen so far, steps to segments that haven't
+        // been seen yet are interned afterwards in file order
+        tbb::parallel_for((size_t)0, lines.size(), [&](size_t i) {
+            if(lines[i].type != 'P') {
+                return;
+            }
+            lines[i].steps.reserve(lines[i].stepNames.size());
+            for(const auto& step: lines[i].stepNames) {
+                auto it = segmentIds.find(step.first);
+                lines[i].steps.emplace_back(it == segmentIds.end() ? -1 : it->second, step.second);
+            }
+        });
+        for(auto& line: lines) {
+            if(line.type != 'P') {
+                continue;
+            }
+            for(size_t j = 0; j < line.steps.size(); j++) {
+                if(line.steps[j].first == -1) {
+                    line.steps[j].first = internSegment(line.stepNames[j].first);
+                }
+            }
+            pathNames.emplace_back(line.name);
+            paths.push_back(std::move(line.steps));
+        }
 
-    return nextStartIndex;
+        if(lastChunk) {
+            break;
+        }
+    }
 }
 
 panmanUtils::Tree::Tree(std::ifstream& fin, std::ifstream& secondFin, FILE_TYPE ftype,
                         std::string reference) {
     if(ftype == panmanUtils::FILE_TYPE::GFA) {
-        std::map< std::string, std::string > nodes;
-        std::map< std::string, std::vector< std::pair<std::string, bool> > > paths;
-        std::string line;
-        while(getline(fin, line, '\n')) {
-            std::vector< std::string > separatedLine;
-            stringSplit(line, '\t', separatedLine);
-            if(separatedLine[0] == "S") {
-                nodes[separatedLine[1]] = separatedLine[2];
-            } else if(separatedLine[0] == "P") {
-                std::vector< std::string > v;
-                std::vector< std::pair< std::string, bool > > currentPath;
-                stringSplit(separatedLine[2], ',', v);
-                for(size_t i = 0; i < v.size(); i++) {
-                    currentPath.push_back(std::make_pair(v[i].substr(0,v[i].size()-1),
-                                                         (v[i][v[i].size()-1] == '+')?true:false));
-                }
-                paths[separatedLine[1]] = currentPath;
-            }
-        }
-        std::vector< std::vector< std::pair< std::string, bool > > > stringSequences;
-        std::vector< std::string > sequenceIds;
-        for(auto p: paths) {
-            sequenceIds.push_back(p.first);
-            stringSequences.push_back(p.second);
-        }
+        std::vector< std::string > pathNames;
+        std::vector< std::vector< std::pair< int32_t, bool > > > paths;
+        std::vector< std::string > segmentSequences;
+        readGfa(fin, pathNames, paths, segmentSequences);
 
-        GfaGraph g(sequenceIds, stringSequences, nodes);
+        GfaGraph g(pathNames, paths, segmentSequences);
         std::cout << "Graph without cycles created" << std::endl;
 
         std::vector< size_t > topoArray = g.getTopologicalSort();
@@ -778,55 +1333,43 @@ panmanUtils::Tree::Tree(std::ifstream& fin, std::ifstream& secondFin, FILE_TYPE
             blocks.emplace_back(i, g.intNodeToSequence[topoArray[i]]);
         }
 
-        tbb::concurrent_unordered_map< size_t, std::unordered_map< std::string,
-            std::pair< BlockMutationType, bool > > > globalMutations;
+        // Presence and strand of every block in the paths that are leaves of the tree
+        ParsimonyTreeLayout layout(root);
+        std::vector< int32_t > leafNodes;
+        std::vector< uint8_t > leafStates;
+        for(const auto& u: pathIdToSequence) {
+            auto nodeIt = layout.nodeIndices.find(u.first);
+            if(nodeIt == layout.nodeIndices.end() || layout.nodes[nodeIt->second]->children.size()) {
+                continue;
+            }
+            leafNodes.push_back(nodeIt->second);
+            const auto& strands = pathIdToStrandSequence[u.first];
+            for(size_t i = 0; i < topoArray.size(); i++) {
+                leafStates.push_back((u.second[i] == -1) ? 1 : (strands[i] ? 2 : 4));
+            }
+        }
 
-        tbb::parallel_for((size_t)0, topoArray.size(), [&](size_t i) {
-            std::unordered_map< std::string, int > states;
-            std::unordered_map< std::string, std::pair< BlockMutationType, bool > > mutations;
-            for(const auto& u: pathIdToSequence) {
-                if(u.second[i] == -1) {
-                    states[u.first] = 1;
-                } else if(pathIdToStrandSequence[u.first][i]) {
-                    // forward strand
-                    states[u.first] = 2;
-                } else {
-                    // reverse strand
-                    states[u.first] = 4;
-                }
+        ThreadLocalNodeMutations< std::pair< size_t, std::pair< BlockMutationType, bool > > > blockMutationBuffers;
+        blockFitchBlocks(layout, leafNodes, leafStates, topoArray.size(), {}, [&](const std::vector< BlockParsimonyMutation >& mutations) {
+            auto& buffer = blockMutationBuffers.local();
+            for(const auto& mutation: mutations) {
+                buffer[layout.nodes[mutation.node]->identifier].emplace_back(mutation.block, mutation.type);
             }
-            blockFitchForwardPassNew(root, states);
-            blockFitchBackwardPassNew(root, states, 1);
-            blockFitchAssignMutationsNew(root, states, mutations, 1);
-            globalMutations[i] = mutations;
         });
 
-        std::unordered_map< std::string, std::mutex > nodeMutexes;
-
-        for(auto u: allNodes) {
-            nodeMutexes[u.first];
-        }
-
-        tbb::parallel_for_each(globalMutations, [&](auto& pos) {
-            auto& mutations = pos.second;
-            for(const auto& node: allNodes) {
-                if(mutations.find(node.first) != mutations.end()) {
-                    nodeMutexes[node.first].lock();
-                    node.second->blockMutation.emplace_back(pos.first, mutations[node.first]);
-                    nodeMutexes[node.first].unlock();
-                }
+        mergeThreadLocalNodeMutations(blockMutationBuffers, allNodes, [](Node* node, const auto& mutations) {
+            for(const auto& mutation: mutations) {
+                node->blockMutation.emplace_back(mutation.first, mutation.second);
             }
         });
     } else if(ftype == panmanUtils::FILE_TYPE::PANGRAPH) {
         std::string newickString;
         // secondFin >> newickString;
         std::getline(secondFin, newickString);
-        Json::Value pangraphData;
-        fin >> pangraphData;
         root = createTreeFromNewickString(newickString);
         auto start = std::chrono::high_resolution_clock::now();
 
-        panmanUtils::Pangraph pg(pangraphData, root);
+        panmanUtils::Pangraph pg(fin, root);
 
         auto end = std::chrono::high_resolution_clock::now();
         std::chrono::nanoseconds timing = end -start;
@@ -864,16 +1407,68 @@ panmanUtils::Tree::Tree(std::ifstream& fin, std::ifstream& secondFin, FILE_TYPE
             gaps.push_back(g);
         }
 
-        tbb::concurrent_unordered_map< size_t, std::unordered_map< std::string,
-            std::pair< BlockMutationType, bool > > > globalBlockMutations;
+        ThreadLocalNodeMutations< std::pair< size_t, std::pair< BlockMutationType, bool > > > blockMutationBuffers;
 
-        
-        
         std::cout << "Inferring Block mutations..." << std::endl;
-        tbb::parallel_for((size_t)0, topoArray.size(), [&](size_t i) {
-        // for(size_t i=0; i<topoArray.size(); i++){
-            if(!polytomy) {
-                // Apply Fitch's algorithm if not a Polytomy
+        if(!polytomy) {
+            // Apply Fitch's algorithm if not a Polytomy, on the presence and strand of every block
+            // in the sequences that are leaves of the tree
+            ParsimonyTreeLayout layout(root);
+            std::vector< int32_t > leafNodes;
+            std::vector< uint8_t > leafStates;
+            std::string referenceName;
+            for(const auto& u: alignedSequences) {
+                if(reference.length() && u.first.find(reference) != std::string::npos) {
+                    referenceName = u.first;
+                }
+                auto nodeIt = layout.nodeIndices.find(u.first);
+                if(nodeIt == layout.nodeIndices.end() || layout.nodes[nodeIt->second]->children.size()) {
+                    continue;
+                }
+                leafNodes.push_back(nodeIt->second);
+                const auto& strands = alignedStrandSequences[u.first];
+                for(size_t i = 0; i < topoArray.size(); i++) {
+                    leafStates.push_back((u.second[i] == -1) ? 1 : (strands[i] ? 2 : 4));
+                }
+            }
+            std::vector< uint8_t > rootDefaultStates;
+            if(referenceName.length()) {
+                const auto& referenceBlocks = alignedSequences[referenceName];
+                const auto& referenceStrands = alignedStrandSequences[referenceName];
+                for(size_t i = 0; i < topoArray.size(); i++) {
+                    rootDefaultStates.push_back((referenceBlocks[i] == -1) ? 1 : (referenceStrands[i] ? 2 : 4));
+                }
+            }
+
+            blockFitchBlocks(layout, leafNodes, leafStates, topoArray.size(), rootDefaultStates,
+                             [&](const std::vector< BlockParsimonyMutation >& mutations) {
+                auto& buffer = blockMutationBuffers.local();
+                for(const auto& mutation: mutations) {
+                    buffer[layout.nodes[mutation.node]->identifier].emplace_back(mutation.block, mutation.type);
+                }
+            });
+        } else {
+            auto recordBlockMutations = [&](size_t i, const std::unordered_map< std::string, std::pair< BlockMutationType, bool > >& mutations) {
+                auto& buffer = blockMutationBuffers.local();
+                for(const auto& mutation: mutations) {
+                    buffer[mutation.first].emplace_back(i, mutation.second);
+                }
+            };
+
+            ParsimonyPatternCache< std::unordered_map< std::string, std::pair< BlockMutationType, bool > > > patternCache;
+            tbb::parallel_for((size_t)0, topoArray.size(), [&](size_t i) {
+                // Blocks with the same presence and strand in every sequence get the same mutations
+                std::string pattern;
+                for(const auto& u: alignedSequences) {
+                    pattern += (u.second[i] == -1) ? '0' : (alignedStrandSequences[u.first][i] ? '1' : '2');
+                }
+                if(const auto* cached = patternCache.find(pattern)) {
+                    recordBlockMutations(i, *cached);
+                    return;
+                }
+
+                // Apply Sankoff's algorithm if the tree is a Polytomy
+                std::unordered_map< std::string, std::vector < int > > stateSets;
                 std::unordered_map< std::string, int > states;
                 std::unordered_map< std::string, std::pair< BlockMutationType, bool > > mutations;
 
@@ -883,99 +1478,46 @@ panmanUtils::Tree::Tree(std::ifstream& fin, std::ifstream& secondFin, FILE_TYPE
                     if(reference.length()) {
                         if(u.first.find(reference) != std::string::npos) {
                             if(u.second[i] == -1) {
-                                defaultState = 1;
+                                defaultState = 0;
                             } else if(alignedStrandSequences[u.first][i]) {
                                 // forward strand
-                                defaultState = 2;
+                                defaultState = 1;
                             } else {
                                 // reverse strand
-                                defaultState = 4;
+                                defaultState = 2;
                             }
                         }
                     }
 
+                    std::vector< int > currentState(3, SANKOFF_INF);
                     if(u.second[i] == -1) {
-                        states[u.first] = 1;
+                        currentState[0] = 0;
                     } else if(alignedStrandSequences[u.first][i]) {
                         // forward strand
-                        states[u.first] = 2;
+                        currentState[1] = 0;
                     } else {
                         // reverse strand
-                        states[u.first] = 4;
+                        currentState[2] = 0;
                     }
+                    stateSets[u.first] = currentState;
                 }
 
-                blockFitchForwardPassNew(root, states);
+                blockSankoffForwardPass(root, stateSets);
                 if(defaultState != -1) {
-                    blockFitchBackwardPassNew(root, states, 1, defaultState);
+                    blockSankoffBackwardPass(root, stateSets, states, 0, defaultState);
                 } else {
-                    blockFitchBackwardPassNew(root, states, 1);
+                    blockSankoffBackwardPass(root, stateSets, states, 0);
                 }
-                blockFitchAssignMutationsNew(root, states, mutations, 1);
-                globalBlockMutations[i] = mutations;
-            } else {
-                // Apply Sankoff's algorithm if the tree is a Polytomy
+                blockSankoffAssignMutations(root, states, mutations, 0);
+                patternCache.insert(pattern, mutations);
+                recordBlockMutations(i, mutations);
+            });
+            patternCache.printStatistics("Block presence patterns");
+        }
 
-                std::unordered_map< std::string, std::vector < int > > stateSets;
-                std::unordered_map< std::string, int > states;
-                std::unordered_map< std::string, std::pair< BlockMutationType, bool > > mutations;
-
-                int defaultState = -1;
-
-                for(const auto& u: alignedSequences) {
-                    if(reference.length()) {
-                        if(u.first.find(reference) != std::string::npos) {
-                            if(u.second[i] == -1) {
-                                defaultState = 0;
-                            } else if(alignedStrandSequences[u.first][i]) {
-                                // forward strand
-                                defaultState = 1;
-                            } else {
-                                // reverse strand
-                                defaultState = 2;
-                            }
-                        }
-                    }
-
-                    std::vector< int > currentState(3, SANKOFF_INF);
-                    if(u.second[i] == -1) {
-                        currentState[0] = 0;
-                    } else if(alignedStrandSequences[u.first][i]) {
-                        // forward strand
-                        currentState[1] = 0;
-                    } else {
-                        // reverse strand
-                        currentState[2] = 0;
-                    }
-                    stateSets[u.first] = currentState;
-                }
-
-                blockSankoffForwardPass(root, stateSets);
-                if(defaultState != -1) {
-                    blockSankoffBackwardPass(root, stateSets, states, 0, defaultState);
-                } else {
-                    blockSankoffBackwardPass(root, stateSets, states, 0);
-                }
-                blockSankoffAssignMutations(root, states, mutations, 0);
-                globalBlockMutations[i] = mutations;
-            }
-        // }
-        });
-
-        std::unordered_map< std::string, std::mutex > nodeMutexes;
-
-        for(auto u: allNodes) {
-            nodeMutexes[u.first];
-        }
-
-        tbb::parallel_for_each(globalBlockMutations, [&](auto& pos) {
-            auto& mutations = pos.second;
-            for(const auto& node: allNodes) {
-                if(mutations.find(node.first) != mutations.end()) {
-                    nodeMutexes[node.first].lock();
-                    node.second->blockMutation.emplace_back(pos.first, mutations[node.first]);
-                    nodeMutexes[node.first].unlock();
-                }
+        mergeThreadLocalNodeMutations(blockMutationBuffers, allNodes, [](Node* node, const auto& mutations) {
+            for(const auto& mutation: mutations) {
+                node->blockMutation.emplace_back(mutation.first, mutation.second);
             }
         });
 
@@ -995,10 +1537,23 @@ panmanUtils::Tree::Tree(std::ifstream& fin, std::ifstream& secondFin, FILE_TYPE
             }
         });
 
-        tbb::concurrent_unordered_map< std::string,
-            std::vector< std::tuple< int,int,int,int,int,int > > > nonGapMutations;
-        tbb::concurrent_unordered_map< std::string,
-            std::vector< std::tuple< int,int,int,int,int,int > > > gapMutations;
+        // Resolve the name of every sequence to its mutation table index once, so the per-block
+        // workers below do not hash sequence names
+        struct SampleTable {
+            const std::string* name;
+            const std::vector< int >* alignedBlocks;
+            const std::vector< size_t >* blockCounts;
+            int64_t sequenceIndex;
+        };
+        std::vector< SampleTable > sampleTables;
+        for(const auto& u: alignedSequences) {
+            auto sequenceIt = pg.sequenceIndices.find(u.first);
+            sampleTables.push_back({&u.first, &u.second, &blockCounts[u.first],
+                                    (sequenceIt != pg.sequenceIndices.end()) ? (int64_t)sequenceIt->second : -1});
+        }
+
+        ThreadLocalNodeMutations< std::tuple< int,int,int,int,int,int > > nonGapMutationBuffers;
+        ThreadLocalNodeMutations< std::tuple< int,int,int,int,int,int > > gapMutationBuffers;
 
         std::cout << "Inferring Nuc mutations..." << std::endl;
         tbb::parallel_for((size_t)0, topoArray.size(), [&](size_t i) {
@@ -1021,27 +1576,34 @@ panmanUtils::Tree::Tree(std::ifstream& fin, std::ifstream& secondFin, FILE_TYPE
             tbb::concurrent_unordered_map< std::string,
                 std::vector< std::pair< char, std::vector< char > > > > individualSequences;
 
-            tbb::parallel_for_each(alignedSequences, [&](const auto& u) {
-                std::vector< std::pair< char, std::vector< char > > > currentSequence = sequence;
-                if(u.second[i] == -1) {
-                    // individualSequences[u.first] = dumysequence;
+            auto blockIt = pg.blockIndices.find(pg.intIdToStringId[topoArray[i]]);
+            uint32_t blockIndex = (blockIt != pg.blockIndices.end()) ? blockIt->second : pg.blockIds.size();
+            tbb::parallel_for((size_t)0, sampleTables.size(), [&](size_t s) {
+                const auto& sample = sampleTables[s];
+                if((*sample.alignedBlocks)[i] == -1) {
                     return;
                 }
+                std::vector< std::pair< char, std::vector< char > > > currentSequence = sequence;
 
-                for(const auto& v: pg.substitutions[pg.intIdToStringId[topoArray[i]]][u.first][blockCounts[u.first][i]]) {
-                    currentSequence[v.first-1].first = v.second[0];
-                }
-                for(const auto& v: pg.insertions[pg.intIdToStringId[topoArray[i]]][u.first][blockCounts[u.first][i]]) {
-                    for(size_t j = 0; j < std::get<2>(v).length(); j++) {
-                        currentSequence[std::get<0>(v)].second[std::get<1>(v)+j] = std::get<2>(v)[j];
+                const auto* range = (sample.sequenceIndex != -1)
+                                    ? pg.getMutations(blockIndex, sample.sequenceIndex, (*sample.blockCounts)[i]) : nullptr;
+                if(range != nullptr) {
+                    for(size_t m = range->substitutionBegin; m < range->substitutionEnd; m++) {
+                        currentSequence[pg.substitutions[m].first-1].first = pg.substitutions[m].second;
                     }
-                }
-                for(const auto& v: pg.deletions[pg.intIdToStringId[topoArray[i]]][u.first][blockCounts[u.first][i]]) {
-                    for(size_t j = v.first; j < v.first + v.second; j++) {
-                        currentSequence[j-1].first = '-';
+                    for(size_t m = range->insertionBegin; m < range->insertionEnd; m++) {
+                        const auto& insertion = pg.insertions[m];
+                        for(size_t j = 0; j < insertion.length; j++) {
+                            currentSequence[insertion.position].second[insertion.gapPosition+j] = pg.insertedNucleotides[insertion.offset+j];
+                        }
+                    }
+                    for(size_t m = range->deletionBegin; m < range->deletionEnd; m++) {
+                        for(size_t j = pg.deletions[m].first; j < pg.deletions[m].first + pg.deletions[m].second; j++) {
+                            currentSequence[j-1].first = '-';
+                        }
                     }
                 }
-                individualSequences[u.first] = currentSequence;
+                individualSequences[*sample.name] = currentSequence;
             });
 
            
@@ -1077,10 +1639,9 @@ panmanUtils::Tree::Tree(std::ifstream& fin, std::ifstream& secondFin, FILE_TYPE
                             nucFitchBackwardPass(root, states, (1 << getCodeFromNucleotide(sequence[j].second[k])));
                         }
                         nucFitchAssignMutations(root, states, mutations, (1 << getCodeFromNucleotide(sequence[j].second[k])));
+                        auto& buffer = gapMutationBuffers.local();
                         for(auto mutation: mutations) {
-                            nodeMutexes[mutation.first].lock();
-                            gapMutations[mutation.first].push_back(std::make_tuple((int)i, -1, j, k, mutation.second.first, getCodeFromNucleotide(mutation.second.second)));
-                            nodeMutexes[mutation.first].unlock();
+                            buffer[mutation.first].push_back(std::make_tuple((int)i, -1, j, k, mutation.second.first, getCodeFromNucleotide(mutation.second.second)));
                         }
                     } else {
                         // Since the topology is a polytomy, applying Sankoff
@@ -1115,10 +1676,9 @@ panmanUtils::Tree::Tree(std::ifstream& fin, std::ifstream& secondFin, FILE_TYPE
                             nucSankoffBackwardPass(root, stateSets, states, getCodeFromNucleotide(sequence[j].second[k]));
                         }
                         nucSankoffAssignMutations(root, states, mutations, getCodeFromNucleotide(sequence[j].second[k]));
+                        auto& buffer = gapMutationBuffers.local();
                         for(auto mutation: mutations) {
-                            nodeMutexes[mutation.first].lock();
-                            gapMutations[mutation.first].push_back(std::make_tuple((int)i, -1, j, k, mutation.second.first, getCodeFromNucleotide(mutation.second.second)));
-                            nodeMutexes[mutation.first].unlock();
+                            buffer[mutation.first].push_back(std::make_tuple((int)i, -1, j, k, mutation.second.first, getCodeFromNucleotide(mutation.second.second)));
                         }
                     }
                 });
@@ -1150,10 +1710,9 @@ panmanUtils::Tree::Tree(std::ifstream& fin, std::ifstream& secondFin, FILE_TYPE
                         nucFitchBackwardPass(root, states, (1 << getCodeFromNucleotide(sequence[j].first)));
                     }
                     nucFitchAssignMutations(root, states, mutations, (1 << getCodeFromNucleotide(sequence[j].first)));
+                    auto& buffer = nonGapMutationBuffers.local();
                     for(auto mutation: mutations) {
-                        nodeMutexes[mutation.first].lock();
-                        nonGapMutations[mutation.first].push_back(std::make_tuple((int)i, -1, j, -1, mutation.second.first, getCodeFromNucleotide(mutation.second.second)));
-                        nodeMutexes[mutation.first].unlock();
+                        buffer[mutation.first].push_back(std::make_tuple((int)i, -1, j, -1, mutation.second.first, getCodeFromNucleotide(mutation.second.second)));
                     }
                 } else {
                     // Since the topology is a polytomy, applying Sankoff
@@ -1223,52 +1782,35 @@ panmanUtils::Tree::Tree(std::ifstream& fin, std::ifstream& secondFin, FILE_TYPE
                     //     }
                     //     assert(nuc == u.second[j].first);
                     // }
+                    auto& buffer = nonGapMutationBuffers.local();
                     for(auto mutation: mutations) {
-                        nodeMutexes[mutation.first].lock();
-                        nonGapMutations[mutation.first].push_back(std::make_tuple((int)i, -1, j, -1, mutation.second.first, getCodeFromNucleotide(mutation.second.second)));
-                        nodeMutexes[mutation.first].unlock();
+                        buffer[mutation.first].push_back(std::make_tuple((int)i, -1, j, -1, mutation.second.first, getCodeFromNucleotide(mutation.second.second)));
                     }
                 }
             });
         });
         
 
-        tbb::parallel_for_each(nonGapMutations, [&](auto& u) {
-            nodeMutexes[u.first].lock();
-            std::sort(u.second.begin(), u.second.end());
-            nodeMutexes[u.first].unlock();
+        mergeThreadLocalNodeMutations(nonGapMutationBuffers, allNodes, [](Node* node, const auto& mutations) {
             size_t currentStart = 0;
-            for(size_t i = 1; i < u.second.size(); i++) {
-                if(i - currentStart == 6 || std::get<0>(u.second[i]) != std::get<0>(u.second[i-1]) || std::get<2>(u.second[i]) != std::get<2>(u.second[i-1])+1 || std::get<4>(u.second[i]) != std::get<4>(u.second[i-1])) {
-                    nodeMutexes[u.first].lock();
-                    allNodes[u.first]->nucMutation.emplace_back(u.second, currentStart, i);
-                    nodeMutexes[u.first].unlock();
+            for(size_t i = 1; i < mutations.size(); i++) {
+                if(i - currentStart == 6 || std::get<0>(mutations[i]) != std::get<0>(mutations[i-1]) || std::get<2>(mutations[i]) != std::get<2>(mutations[i-1])+1 || std::get<4>(mutations[i]) != std::get<4>(mutations[i-1])) {
+                    node->nucMutation.emplace_back(mutations, currentStart, i);
                     currentStart = i;
-                    continue;
                 }
             }
-            nodeMutexes[u.first].lock();
-            allNodes[u.first]->nucMutation.emplace_back(u.second, currentStart, u.second.size());
-            nodeMutexes[u.first].unlock();
+            node->nucMutation.emplace_back(mutations, currentStart, mutations.size());
         });
 
-        tbb::parallel_for_each(gapMutations, [&](auto& u) {
-            nodeMutexes[u.first].lock();
-            std::sort(u.second.begin(), u.second.end());
-            nodeMutexes[u.first].unlock();
+        mergeThreadLocalNodeMutations(gapMutationBuffers, allNodes, [](Node* node, const auto& mutations) {
             size_t currentStart = 0;
-            for(size_t i = 1; i < u.second.size(); i++) {
-                if(i - currentStart == 6 || std::get<0>(u.second[i]) != std::get<0>(u.second[i-1]) || std::get<2>(u.second[i]) != std::get<2>(u.second[i-1]) || std::get<3>(u.second[i]) != std::get<3>(u.second[i-1])+1 || std::get<4>(u.second[i]) != std::get<4>(u.second[i-1])) {
-                    nodeMutexes[u.first].lock();
-                    allNodes[u.first]->nucMutation.emplace_back(u.second, currentStart, i);
-                    nodeMutexes[u.first].unlock();
+            for(size_t i = 1; i < mutations.size(); i++) {
+                if(i - currentStart == 6 || std::get<0>(mutations[i]) != std::get<0>(mutations[i-1]) || std::get<2>(mutations[i]) != std::get<2>(mutations[i-1]) || std::get<3>(mutations[i]) != std::get<3>(mutations[i-1])+1 || std::get<4>(mutations[i]) != std::get<4>(mutations[i-1])) {
+                    node->nucMutation.emplace_back(mutations, currentStart, i);
                     currentStart = i;
-                    continue;
                 }
             }
-            nodeMutexes[u.first].lock();
-            allNodes[u.first]->nucMutation.emplace_back(u.second, currentStart, u.second.size());
-            nodeMutexes[u.first].unlock();
+            node->nucMutation.emplace_back(mutations, currentStart, mutations.size());
         });
 
     } else if(ftype == panmanUtils::FILE_TYPE::MSA) {
@@ -1279,50 +1821,11 @@ panmanUtils::Tree::Tree(std::ifstream& fin, std::ifstream& secondFin, FILE_TYPE
         root = createTreeFromNewickString(newickString);
 
         std::map< std::string, std::string > sequenceIdsToSequences;
-        std::string line;
-        std::string currentSequence, currentSequenceId;
-        size_t lineLength = 0;
         std::string consensusSeq;
-        
-        // Read MSA
-        while(getline(fin,line,'\n')) {
-            if(line.length() == 0) {
-                continue;
-            }
-            if(line[0] == '>') {
-                if(currentSequence.length()) {
-                    if(lineLength == 0) {
-                        lineLength = currentSequence.length();
-                    } else if(lineLength != currentSequence.length()) {
-                        std::cerr << "Error: sequence lengths don't match! " << currentSequenceId << 
-                    "Expected: " << lineLength << "Produced:" << currentSequence.length() << std::endl;
-                        exit(-1);
-                    }
-                    std::vector< std::string > splitLine;
-                    stringSplit(currentSequenceId,'\r',splitLine);
-                    sequenceIdsToSequences[splitLine[0]] = currentSequence;
-                }
-                std::vector< std::string > splitLine;
-                stringSplit(line,' ',splitLine);
-                currentSequenceId = splitLine[0].substr(1);
-                currentSequence = "";
-            } else {
-                std::vector< std::string > splitLine;
-                stringSplit(line,'\r',splitLine);
-                currentSequence += splitLine[0];
-            }
-        }
 
-        if(currentSequence.length()) {
-            if(lineLength != 0 && lineLength != currentSequence.length()) {
-                std::cerr << "Error: sequence lengths don't match! " << currentSequenceId << 
-                    "Expected: " << lineLength << "Produced:" << currentSequence.length() << std::endl;
-                exit(-1);
-            } else {
-                lineLength = currentSequence.length();
-            }
-            sequenceIdsToSequences[currentSequenceId] = currentSequence;
-        }
+        // Read MSA
+        readFasta(fin, sequenceIdsToSequences);
+        size_t lineLength = sequenceIdsToSequences.empty() ? 0 : sequenceIdsToSequences.begin()->second.length();
 
 
         // std::cout << lineLength << std::endl;
@@ -1361,78 +1864,102 @@ panmanUtils::Tree::Tree(std::ifstream& fin, std::ifstream& secondFin, FILE_TYPE
             }
         }
 
-        tbb::concurrent_unordered_map< std::string, std::vector< std::tuple< int,int8_t,int8_t > > > nonGapMutationsMSA;
-        std::unordered_map< std::string, std::mutex > nodeMutexes;
-        std::unordered_map< size_t, std::mutex > posMutexes;
+        ThreadLocalNodeMutations< std::tuple< int,int8_t,int8_t > > nonGapMutationBuffers;
 
-        for(auto u: allNodes) {
-            nodeMutexes[u.first];
+        // Fitch over batches of columns on a flat postorder copy of the tree
+        ParsimonyTreeLayout layout(root);
+        std::vector< std::pair< int32_t, const std::string* > > leafSequences;
+        for(const auto& u: sequenceIdsToSequences) {
+            auto nodeIt = layout.nodeIndices.find(u.first);
+            if(nodeIt != layout.nodeIndices.end()) {
+                leafSequences.emplace_back(nodeIt->second, &u.second);
+            }
         }
+        const std::string* referenceSequence = (reference == "") ? nullptr : &sequenceIdsToSequences[reference];
 
+        const size_t width = NUC_FITCH_BATCH_WIDTH;
+        ParsimonyPatternCache< std::vector< NucParsimonyMutation > > patternCache;
+        tbb::parallel_for(tbb::blocked_range< size_t >(0, consensusSeq.size(), 16 * width), [&](const tbb::blocked_range< size_t >& range) {
+            // Columns with a new pattern are packed into slots of a batch; repeated patterns
+            // within the batch share a slot
+            std::vector< uint16_t > states(layout.size() * width, 0);
+            std::vector< uint16_t > rootStates(width, 0), rootParentStates(width, 0);
+            std::unordered_map< std::string, size_t > patternSlots;
+            std::vector< std::string > slotPatterns;
+            std::vector< std::vector< size_t > > slotColumns;
+            std::vector< std::tuple< int32_t, int, int8_t, int8_t > > foundMutations;
 
-        for (auto i=0; i<consensusSeq.length(); i++) {
-            posMutexes[i];
-        }
-    	int positionCount = 0;
+            auto emitMutations = [&](const std::vector< NucParsimonyMutation >& mutations, size_t column) {
+                for(const auto& mutation: mutations) {
+                    foundMutations.emplace_back(mutation.node, column, mutation.type, mutation.nuc);
+                }
+            };
 
-        
+            auto flushBatch = [&]() {
+                std::vector< NucParsimonyMutation > mutations;
+                nucFitchColumns(layout, states.data(), width, (referenceSequence != nullptr) ? rootStates.data() : nullptr,
+                                nullptr, rootParentStates.data(), mutations);
+                std::vector< std::vector< NucParsimonyMutation > > slotMutations(width);
+                for(auto mutation: mutations) {
+                    size_t slot = mutation.column;
+                    mutation.column = 0;
+                    slotMutations[slot].push_back(mutation);
+                }
+                for(size_t slot = 0; slot < slotPatterns.size(); slot++) {
+                    patternCache.insert(slotPatterns[slot], slotMutations[slot]);
+                    for(auto column: slotColumns[slot]) {
+                        emitMutations(slotMutations[slot], column);
+                    }
+                }
+                patternSlots.clear();
+                slotPatterns.clear();
+                slotColumns.clear();
+            };
 
-        // tbb::parallel_for((size_t)0, consensusSeq.length(), [&](size_t i) {
-        for(int i=0; i<consensusSeq.size(); i++) {
-            // Sankoff
-            // std::cout << "index: "<< i << " " << consensusSeq[i] << std::endl;
-            // std::unordered_map< std::string, std::vector< int > > stateSets;
-            // std::unordered_map< std::string, int > states;
-            // std::unordered_map< std::string, std::pair< panmanUtils::NucMutationType, char > > mutations;
-
-            // for(const auto& u: sequenceIdsToSequences) {
-            //     std::vector< int > currentState(16, SANKOFF_INF);
-            //     if(u.second[i] != '-') {
-            //         currentState[getCodeFromNucleotide(u.second[i])] = 0;
-            //     } else {
-            //         currentState[0] = 0;
-            //     }
-            //     stateSets[u.first] = currentState;
-            // }
-            // nucSankoffForwardPass(root, stateSets);
-            // nucSankoffBackwardPass(root, stateSets, states, getCodeFromNucleotide(consensusSeq[i]));
-            // nucSankoffAssignMutations(root, states, mutations, getCodeFromNucleotide(consensusSeq[i]));
-            // for(auto mutation: mutations) {
-            //     nodeMutexes[mutation.first].lock();
-            //     nonGapMutationsMSA[mutation.first].push_back(std::make_tuple(i, mutation.second.first, getCodeFromNucleotide(mutation.second.second)));
-            //     nodeMutexes[mutation.first].unlock();
-            // }
-            // Fitch
-            
-            std::unordered_map< std::string, int > states;
-            std::unordered_map< std::string, std::pair< panmanUtils::NucMutationType, char > > mutations;
-            for(const auto& u: sequenceIdsToSequences) {
-                if(u.second[i] != '-') {
-                    states.insert({u.first, (1 << getCodeFromNucleotide(u.second[i]))});
-                    // states[u.first] = (1 << getCodeFromNucleotide(u.second[i]));
-                } else {
-                    states.insert({u.first, 1});
-                    // states[u.first] = 1;
-                }
-            }  
-            // exit(0);
-            int refState = (reference=="")?-1:1<<getCodeFromNucleotide(sequenceIdsToSequences[reference][i]);
-            nucFitchForwardPass(root, states, refState);
-            // for (const auto &a: states) std::cout << a.first.c_str() <<  ": " << a.second << std::endl;
-            // exit(0);
-            // std::cout << i << "\t" << states[root->identifier] << std::endl;
-            nucFitchBackwardPass(root, states, (1 << getCodeFromNucleotide(consensusSeq[i])));
-            nucFitchAssignMutations(root, states, mutations, (1 << getCodeFromNucleotide(consensusSeq[i])));
-            for(auto mutation: mutations) {
-                nodeMutexes[mutation.first].lock();
-                nonGapMutationsMSA[mutation.first].push_back(std::make_tuple(i, mutation.second.first, getCodeFromNucleotide(mutation.second.second)));
-                nodeMutexes[mutation.first].unlock();
-            }
-            posMutexes[i].lock();
-            posMutexes[i].unlock();
-            
-        // });
-        }
+            std::string pattern(leafSequences.size() + 2, 0);
+            for(size_t i = range.begin(); i < range.end(); i++) {
+                for(size_t l = 0; l < leafSequences.size(); l++) {
+                    pattern[l] = getCodeFromNucleotide((*leafSequences[l].second)[i]);
+                }
+                pattern[leafSequences.size()] = getCodeFromNucleotide(consensusSeq[i]);
+                pattern[leafSequences.size() + 1] = (referenceSequence != nullptr) ? getCodeFromNucleotide((*referenceSequence)[i]) : -1;
+
+                if(const auto* cached = patternCache.find(pattern)) {
+                    emitMutations(*cached, i);
+                    continue;
+                }
+                auto slotIt = patternSlots.find(pattern);
+                if(slotIt != patternSlots.end()) {
+                    slotColumns[slotIt->second].push_back(i);
+                    continue;
+                }
+
+                size_t slot = slotPatterns.size();
+                patternSlots[pattern] = slot;
+                slotPatterns.push_back(pattern);
+                slotColumns.push_back({i});
+                for(size_t l = 0; l < leafSequences.size(); l++) {
+                    states[leafSequences[l].first * width + slot] = (1 << pattern[l]);
+                }
+                rootParentStates[slot] = (1 << pattern[leafSequences.size()]);
+                if(referenceSequence != nullptr) {
+                    rootStates[slot] = (1 << pattern[leafSequences.size() + 1]);
+                }
+                if(slotPatterns.size() == width) {
+                    flushBatch();
+                }
+            }
+            if(!slotPatterns.empty()) {
+                flushBatch();
+            }
+
+            auto& buffer = nonGapMutationBuffers.local();
+            for(const auto& mutation: foundMutations) {
+                const std::string& nodeId = layout.nodes[std::get<0>(mutation)]->identifier;
+                buffer[nodeId].push_back(std::make_tuple(std::get<1>(mutation), std::get<2>(mutation), std::get<3>(mutation)));
+            }
+        });
+        patternCache.printStatistics("Fitch column patterns");
 
         // std::cout << root->identifier << std::endl;
         // std::cout << consensusSeq << std::endl;
@@ -1442,208 +1969,168 @@ panmanUtils::Tree::Tree(std::ifstream& fin, std::ifstream& secondFin, FILE_TYPE
 
         sequenceIdsToSequences.clear(); // saving memory
 
-        tbb::parallel_for_each(nonGapMutationsMSA, [&](auto& u) {
-        // for(auto &u: nonGapMutationsMSA){
-            nodeMutexes[u.first].lock();
-            std::sort(u.second.begin(), u.second.end());
-            nodeMutexes[u.first].unlock();
-            size_t currentStart = 0;
-            for(size_t i = 1; i < u.second.size(); i++) {
-                if(i - currentStart == 6 || std::get<0>(u.second[i]) != std::get<0>(u.second[i-1])+1 || std::get<1>(u.second[i]) != std::get<1>(u.second[i-1])) {
-                    nodeMutexes[u.first].lock();
-                    // if (std::get<0>(u.second[currentStart]) == 0)
-                    //     std::cout << u.first << std::endl;
-                    allNodes[u.first]->nucMutation.emplace_back(u.second, currentStart, i);
-                    nodeMutexes[u.first].unlock();
-                    currentStart = i;
-                    continue;
-                }
-            }
-            nodeMutexes[u.first].lock();
-            allNodes[u.first]->nucMutation.emplace_back(u.second, currentStart, u.second.size());
-            nodeMutexes[u.first].unlock();
-        // }
-        });
+        mergeThreadLocalNodeMutations(nonGapMutationBuffers, allNodes, groupMsaNucMutations);
     } else if(ftype == panmanUtils::FILE_TYPE::MSA_OPTIMIZE) {
         std::string newickString;
         // secondFin >> newickString;
         std::getline(secondFin, newickString);
         root = createTreeFromNewickString(newickString);
 
-        std::string line;
-        std::string currentSequence, currentSequenceId;
+        // Read the MSA once into a compact residue file; each batch of columns is then fetched
+        // from it by offset instead of re-parsing the whole FASTA per batch
+        TemporaryFile residueFile("panman_msa_");
+        if(residueFile.getPath().empty()) {
+            std::cerr << "Could not create a temporary file for the MSA" << std::endl;
+            exit(1);
+        }
+        std::vector< std::string > sequenceIds;
         size_t lineLength = 0;
-        std::string consensusSeq;
-
-        // Find length of MSA
-        while(getline(fin,line,'\n')) {
-            if(line.length() == 0) {
-                continue;
+        {
+            std::ofstream residueOut(residueFile.getPath(), std::ios::binary);
+            if(!residueOut) {
+                std::cerr << "Could not open temporary file " << residueFile.getPath() << std::endl;
+                exit(1);
             }
-            if(line[0] == '>') {
-                if(currentSequence.length()) {
-                    if(lineLength == 0) {
-                        lineLength = currentSequence.length();
-                    } else if(lineLength != currentSequence.length()) {
-                        std::cerr << "Error: sequence lengths don't match! " << currentSequenceId << 
-                    "Expected: " << lineLength << "Produced:" << currentSequence.length() << std::endl;
-                        exit(-1);
-                    }
-                }
-                std::vector< std::string > splitLine;
-                stringSplit(line,' ',splitLine);
-                currentSequenceId = splitLine[0].substr(1);
-                currentSequence = "";
-            } else {
-                currentSequence += line;
+            writeMsaResidues(fin, residueOut, sequenceIds, lineLength);
+            residueOut.close();
+            if(residueOut.fail()) {
+                std::cerr << "Could not write temporary file " << residueFile.getPath() << std::endl;
+                exit(1);
             }
         }
+        std::ifstream residueIn(residueFile.getPath(), std::ios::binary);
+        if(!residueIn) {
+            std::cerr << "Could not open temporary file " << residueFile.getPath() << std::endl;
+            exit(1);
+        }
         std::cout << "line length: " << lineLength << std::endl;
 
+        const size_t numSequences = sequenceIds.size();
+        std::string consensusSeq;
         consensusSeq.resize(lineLength);
 
-        tbb::concurrent_unordered_map< std::string, std::vector< std::tuple< int,int8_t,int8_t > > > nonGapMutationsMSA;
-        std::unordered_map< std::string, std::mutex > nodeMutexes;
-        for(auto u: allNodes) {
-            nodeMutexes[u.first];
+        // The consensus takes the first non-gap character in sequence name order
+        std::vector< size_t > sortedSequenceIndices(numSequences);
+        for(size_t i = 0; i < numSequences; i++) {
+            sortedSequenceIndices[i] = i;
         }
+        std::sort(sortedSequenceIndices.begin(), sortedSequenceIndices.end(), [&](size_t a, size_t b) {
+            return sequenceIds[a] < sequenceIds[b];
+        });
+
+        size_t referenceIndex = numSequences;
+        if(reference != "") {
+            std::cout << "Reference Found: " << reference << std::endl;
+            for(size_t i = 0; i < numSequences; i++) {
+                if(sequenceIds[i] == reference) {
+                    referenceIndex = i;
+                }
+            }
+            if(referenceIndex == numSequences) {
+                std::cerr << "Reference not found in the sequence" << std::endl;
+                exit(0);
+            }
+        }
+
+        ThreadLocalNodeMutations< std::tuple< int,int8_t,int8_t > > nonGapMutationBuffers;
         
+        ParsimonyPatternCache< std::vector< NucParsimonyMutation > > patternCache;
+        ParsimonyTreeLayout layout(root);
+        std::vector< int32_t > sequenceNodes(numSequences, -1);
+        for(size_t s = 0; s < numSequences; s++) {
+            auto nodeIt = layout.nodeIndices.find(sequenceIds[s]);
+            if(nodeIt != layout.nodeIndices.end()) {
+                sequenceNodes[s] = nodeIt->second;
+            }
+        }
+
         size_t startIndex = 0;
-        size_t memory = 128;//GB
         size_t batchSize = 20000;
         size_t nextStartIndex;
+        std::vector< char > rows, columns;
 
         while (startIndex < lineLength) {
             auto newStart = std::chrono::high_resolution_clock::now();
-            std::map< std::string, std::string > sequenceIdsToSequences;
-            
-            //reset file read pointer
-            fin.clear(); // clear bad state after eof
-            fin.seekg(0);
-
-            nextStartIndex = readFastaInBatch(fin, sequenceIdsToSequences, startIndex, batchSize);
+            nextStartIndex = std::min(startIndex + batchSize, lineLength);
+            readMsaColumnChunk(residueIn, numSequences, lineLength, startIndex, nextStartIndex - startIndex, rows, columns);
 
             std::cout << "writing consensus sequences from" << startIndex << " to " << nextStartIndex << std::endl;
-            if (reference != "") {
-                std::cout << "Reference Found: " << reference << std::endl;
-                for (int i=0; i<nextStartIndex-startIndex; i++){
-                    if (sequenceIdsToSequences[reference][i] == '-'){
-                        for(auto u: sequenceIdsToSequences) {
-                            if(u.second[i] != '-') {
-                                consensusSeq[i+startIndex] = u.second[i];
-                                break;
-                            }
-                        }
-                    } else {
-                        consensusSeq[startIndex+i] = sequenceIdsToSequences[reference][i];
-                    }
-                    
+            tbb::parallel_for((size_t)0, nextStartIndex-startIndex, [&](size_t i) {
+                const char* column = columns.data() + i * numSequences;
+                if(referenceIndex != numSequences && column[referenceIndex] != '-') {
+                    consensusSeq[startIndex+i] = column[referenceIndex];
+                    return;
                 }
-            } else {
-                tbb::parallel_for((size_t)0, nextStartIndex-startIndex, [&](size_t i) {
-                    bool nonGapFound = false;
-                    for(auto u: sequenceIdsToSequences) {
-                        if(u.second[i] != '-') {
-                            consensusSeq[i+startIndex] = u.second[i];
-                            nonGapFound = true;
-                            break;
-                        }
-                    }
-                    if(!nonGapFound) {
-                        std::cout << "ideally should not happen\n" << std::endl;
-                        exit(1);
+                for(auto s: sortedSequenceIndices) {
+                    if(column[s] != '-') {
+                        consensusSeq[startIndex+i] = column[s];
+                        return;
                     }
-                });
-            }
-            
-            // std::cout << "consensus seq len " << consensusSeq.size() << std::endl;
-            // for (int i=startIndex; i<nextStartIndex;i++)
-            //     std::cout << consensusSeq[i];
-            // std::cout << std::endl;
+                }
+                std::cout << "ideally should not happen\n" << std::endl;
+                exit(1);
+            });
 
             auto newEnd = std::chrono::high_resolution_clock::now();
             std::chrono::nanoseconds newTime = newEnd - newStart;
 
             newStart = std::chrono::high_resolution_clock::now();
-            tbb::parallel_for((size_t)0, nextStartIndex-startIndex, [&](size_t i) {
-                // Sankoff
-                std::unordered_map< std::string, std::vector< int > > stateSets;
-                std::unordered_map< std::string, int > states;
-                std::unordered_map< std::string, std::pair< panmanUtils::NucMutationType, char > > mutations;
-
-                for(const auto& u: sequenceIdsToSequences) {
-                    std::vector< int > currentState(16, SANKOFF_INF);
-                    if(u.second[i] != '-') {
-                        currentState[getCodeFromNucleotide(u.second[i])] = 0;
-                    } else {
-                        currentState[0] = 0;
+            tbb::parallel_for(tbb::blocked_range< size_t >(0, nextStartIndex-startIndex), [&](const tbb::blocked_range< size_t >& range) {
+                // Sankoff on the flat layout, with the cost and state arrays reused across columns
+                std::vector< int32_t > costs(layout.size() * 16, SANKOFF_INF);
+                std::vector< int32_t > states(layout.size());
+                std::vector< NucParsimonyMutation > mutations, columnMutations;
+                std::string pattern(numSequences + 2, 0);
+                for(size_t i = range.begin(); i < range.end(); i++) {
+                    const char* column = columns.data() + i * numSequences;
+                    for(size_t s = 0; s < numSequences; s++) {
+                        pattern[s] = getCodeFromNucleotide(column[s]);
                     }
-                    stateSets[u.first] = currentState;
-                }
-                int defaultState = -1;
-                if (reference.length()){
-                    if (sequenceIdsToSequences.find(reference) != sequenceIdsToSequences.end()) {
-                        if (sequenceIdsToSequences[reference][i] != '-') {
-                            defaultState = getCodeFromNucleotide(sequenceIdsToSequences[reference][i]);
-                        } else {
-                            defaultState = 0;
+                    int defaultState = -1;
+                    if(referenceIndex != numSequences) {
+                        defaultState = pattern[referenceIndex];
+                    }
+                    pattern[numSequences] = getCodeFromNucleotide(consensusSeq[startIndex + i]);
+                    pattern[numSequences + 1] = defaultState;
+
+                    const auto* cached = patternCache.find(pattern);
+                    if(cached == nullptr) {
+                        for(size_t s = 0; s < numSequences; s++) {
+                            if(sequenceNodes[s] != -1) {
+                                setNucSankoffLeaf(costs.data(), sequenceNodes[s], pattern[s]);
+                            }
                         }
+                        columnMutations.clear();
+                        nucSankoffColumn(layout, costs.data(), states.data(), defaultState,
+                                         pattern[numSequences], 0, columnMutations);
+                        patternCache.insert(pattern, columnMutations);
+                        cached = &columnMutations;
                     }
-                    else {
-                        std::cerr << "Reference not found in the sequence" << std::endl;
-                        exit(0);
+                    for(auto mutation: *cached) {
+                        mutation.column = startIndex + i;
+                        mutations.push_back(mutation);
                     }
                 }
-
-                nucSankoffForwardPass(root, stateSets);
-                
-                if (defaultState != -1) {
-                    nucSankoffBackwardPass(root, stateSets, states, getCodeFromNucleotide(consensusSeq[startIndex + i]), defaultState);
-                } else {
-                    nucSankoffBackwardPass(root, stateSets, states, getCodeFromNucleotide(consensusSeq[startIndex + i]));
+                auto& buffer = nonGapMutationBuffers.local();
+                for(const auto& mutation: mutations) {
+                    const std::string& nodeId = layout.nodes[mutation.node]->identifier;
+                    buffer[nodeId].push_back(std::make_tuple(mutation.column, mutation.type, mutation.nuc));
                 }
-
-                nucSankoffAssignMutations(root, states, mutations, getCodeFromNucleotide(consensusSeq[startIndex + i]));
-                for(auto mutation: mutations) {
-                    nodeMutexes[mutation.first].lock();
-                    nonGapMutationsMSA[mutation.first].push_back(std::make_tuple(startIndex + i, mutation.second.first, getCodeFromNucleotide(mutation.second.second)));
-                    nodeMutexes[mutation.first].unlock();
-                }
-
             });
             newEnd = std::chrono::high_resolution_clock::now();
             newTime = newEnd - newStart;
             std::cout << "Processed characters from " << startIndex << " to " << nextStartIndex - 1 << " in " << newTime.count() << " nanoseconds" << std::endl;
             startIndex = nextStartIndex;
         }
+        residueIn.close();
+        patternCache.printStatistics("Sankoff column patterns");
         std::cout << consensusSeq << std::endl;
         blocks.emplace_back(0, consensusSeq);
         root->blockMutation.emplace_back(0, std::make_pair(BlockMutationType::BI, false));
         // std::cout << consensusSeq << std::endl;
 
         
-        tbb::parallel_for_each(nonGapMutationsMSA, [&](auto& u) {
-        // for(auto &u: nonGapMutationsMSA){
-            nodeMutexes[u.first].lock();
-            std::sort(u.second.begin(), u.second.end());
-            nodeMutexes[u.first].unlock();
-            size_t currentStart = 0;
-            for(size_t i = 1; i < u.second.size(); i++) {
-                if(i - currentStart == 6 || std::get<0>(u.second[i]) != std::get<0>(u.second[i-1])+1 || std::get<1>(u.second[i]) != std::get<1>(u.second[i-1])) {
-                    nodeMutexes[u.first].lock();
-                    // if (std::get<0>(u.second[currentStart]) == 0)
-                    //     std::cout << u.first << std::endl;
-                    allNodes[u.first]->nucMutation.emplace_back(u.second, currentStart, i);
-                    nodeMutexes[u.first].unlock();
-                    currentStart = i;
-                    continue;
-                }
-            }
-            nodeMutexes[u.first].lock();
-            allNodes[u.first]->nucMutation.emplace_back(u.second, currentStart, u.second.size());
-            nodeMutexes[u.first].unlock();
-        // }
-        });
+        mergeThreadLocalNodeMutations(nonGapMutationBuffers, allNodes, groupMsaNucMutations);
 
 
     }
@@ -2371,6 +2858,40 @@ std::vector<panmanUtils::BlockMut> panmanUtils::Tree::consolidateBlockMutations(
     return mutationArray;
 }
 
+void panmanUtils::computeSubtreeSizes(Node* root, std::unordered_map< Node*, size_t >& subtreeSize) {
+    std::function< size_t(Node*) > computeSize = [&](Node* node) {
+        size_t size = 1;
+        for(auto child: node->children) {
+            size += computeSize(child);
+        }
+        subtreeSize[node] = size;
+        return size;
+    };
+    computeSize(root);
+}
+
+panmanUtils::TreePartition panmanUtils::partitionTree(Node* root,
+        const std::unordered_map< Node*, size_t >& subtreeSize) {
+    // About eight subtrees per thread
+    size_t threshold = std::max< size_t >(1, subtreeSize.at(root) / (8 * tbb::this_task_arena::max_concurrency()));
+
+    TreePartition partition;
+    std::function< void(Node*) > descend = [&](Node* node) {
+        if(subtreeSize.at(node) <= threshold) {
+            partition.preorder.emplace_back(node, true);
+            partition.subtreeRoots.push_back(node);
+            return;
+        }
+        partition.preorder.emplace_back(node, false);
+        partition.upperNodes.push_back(node);
+        for(auto child: node->children) {
+            descend(child);
+        }
+    };
+    descend(root);
+    return partition;
+}
+
 void panmanUtils::MutationList::invertMutations(const std::unordered_map< panmanUtils::Coordinate, int8_t >& originalNucs,
     const std::unordered_map< uint64_t, bool >& wasBlockInv) {
 
@@ -3696,362 +4217,270 @@ void panmanUtils::Tree::printNodePaths(std::ostream& fout) {
 }
 
 
-void panmanUtils::Tree::printMutationsNew(std::ostream& fout) {
-
-    // Get reference sequence
-    sequence_t rootSequence;
-    blockExists_t rootBlockExists;
-    blockStrand_t rootBlockStrand;
-    getSequenceFromReference(rootSequence, rootBlockExists, rootBlockStrand, root->identifier);
-
-    // sequence_t st;
-    // blockExists_t bt;
-    // blockStrand_t bst;
-    // getSequenceFromReference(st, bt, bst, "USA/CA-CDC-QDX21497008/2021|MW666944.1|2021-01-27");
-
-    // std::cout << st[55].first[132].second[40] << std::endl;
-
-
-    tbb::concurrent_map< std::tuple< int, int, int >, size_t > panMATCoordinateToGlobal;
-    tbb::concurrent_map< std::tuple< int, int, int >, char > rootCurrentCharacter;
-
-    tbb::concurrent_unordered_map< std::string,
-        std::vector< std::tuple< char, size_t, char, char, bool > > > nodeMutations;
-
-    tbb::concurrent_unordered_map< size_t, bool > rootPresentBlocks;
-
-    tbb::concurrent_map< std::tuple< int, int, int >, bool > isGapCoordinate;
-
-    // convert PanMAT coordinate to global reference coordinate
-    size_t rootCtr = 0;
-    for(size_t i = 0; i < rootSequence.size(); i++) {
-        if(rootBlockExists[i].first) {
-            rootPresentBlocks[i] = true;
-            if(rootBlockStrand[i].first) {
-                for(size_t j = 0; j < rootSequence[i].first.size(); j++) {
-                    for(size_t k = 0; k < rootSequence[i].first[j].second.size(); k++) {
-                        panMATCoordinateToGlobal[std::make_tuple(i,j,k)] = rootCtr;
-                        if(rootSequence[i].first[j].second[k] != '-' && rootSequence[i].first[j].second[k] != 'x') {
-                            rootCurrentCharacter[std::make_tuple(i,j,k)] = rootSequence[i].first[j].second[k];
-                            isGapCoordinate[std::make_tuple(i,j,k)] = false;
-                            rootCtr++;
-                        } else {
-                            rootCurrentCharacter[std::make_tuple(i,j,k)] = '-';
-                            isGapCoordinate[std::make_tuple(i,j,k)] = true;
-                        }
-                    }
-                    panMATCoordinateToGlobal[std::make_tuple(i,j,-1)] = rootCtr;
-                    if(rootSequence[i].first[j].first != '-' && rootSequence[i].first[j].first != 'x') {
-                        rootCurrentCharacter[std::make_tuple(i,j,-1)] = rootSequence[i].first[j].first;
-                        isGapCoordinate[std::make_tuple(i,j,-1)] = false;
-                        rootCtr++;
-                    } else {
-                        rootCurrentCharacter[std::make_tuple(i,j,-1)] = '-';
-                        isGapCoordinate[std::make_tuple(i,j,-1)] = true;
-                    }
-                }
-            } else {
-                for(size_t j = rootSequence[i].first.size() - 1; j + 1 > 0; j--) {
-                    panMATCoordinateToGlobal[std::make_tuple(i,j,-1)] = rootCtr;
-                    if(rootSequence[i].first[j].first != '-' && rootSequence[i].first[j].first != 'x') {
-                        rootCurrentCharacter[std::make_tuple(i,j,-1)] = rootSequence[i].first[j].first;
-                        isGapCoordinate[std::make_tuple(i,j,-1)] = false;
-                        rootCtr++;
-                    } else {
-                        rootCurrentCharacter[std::make_tuple(i,j,-1)] = '-';
-                        isGapCoordinate[std::make_tuple(i,j,-1)] = true;
-                    }
-                    for(size_t k = rootSequence[i].first[j].second.size() - 1; k + 1 > 0; k--) {
-                        panMATCoordinateToGlobal[std::make_tuple(i,j,k)] = rootCtr;
-                        if(rootSequence[i].first[j].second[k] != '-' && rootSequence[i].first[j].second[k] != 'x') {
-                            rootCurrentCharacter[std::make_tuple(i,j,k)] = rootSequence[i].first[j].second[k];
-                            // if(rootCtr == 240) {
-                            //     std::cout << rootSequence[i].first[j].first << " " << i << " " << j << " " << k << std::endl;
-                            // }
-                            isGapCoordinate[std::make_tuple(i,j,k)] = false;
-                            rootCtr++;
-                        } else {
-                            rootCurrentCharacter[std::make_tuple(i,j,k)] = '-';
-                            isGapCoordinate[std::make_tuple(i,j,k)] = true;
-                        }
-                    }
-                }
-            }
-        } else {
-            rootPresentBlocks[i] = false;
-            if(rootBlockStrand[i].first) {
-                for(size_t j = 0; j < rootSequence[i].first.size(); j++) {
-                    for(size_t k = 0; k < rootSequence[i].first[j].second.size(); k++) {
-                        panMATCoordinateToGlobal[std::make_tuple(i,j,k)] = rootCtr;
-                        rootCurrentCharacter[std::make_tuple(i,j,k)] = '-';
-                        isGapCoordinate[std::make_tuple(i,j,k)] = false;
-                    }
-                    panMATCoordinateToGlobal[std::make_tuple(i,j,-1)] = rootCtr;
-                    rootCurrentCharacter[std::make_tuple(i,j,-1)] = '-';
-                    isGapCoordinate[std::make_tuple(i,j,-1)] = false;
-                }
-            } else {
-                for(size_t j = rootSequence[i].first.size() - 1; j + 1 > 0; j--) {
-                    panMATCoordinateToGlobal[std::make_tuple(i,j,-1)] = rootCtr;
-                    rootCurrentCharacter[std::make_tuple(i,j,-1)] = '-';
-                    isGapCoordinate[std::make_tuple(i,j,-1)] = false;
-                    for(size_t k = rootSequence[i].first[j].second.size() - 1; k + 1 > 0; k--) {
-                        panMATCoordinateToGlobal[std::make_tuple(i,j,k)] = rootCtr;
-                        rootCurrentCharacter[std::make_tuple(i,j,k)] = '-';
-                        isGapCoordinate[std::make_tuple(i,j,k)] = false;
-                    }
-                }
-            }
-        }
-    }
-
-    tbb::concurrent_map< std::tuple< std::string, int, int, int >, char > seqChar;
-
-    tbb::parallel_for_each(allNodes, [&](auto u) {
-        sequence_t st;
-        blockExists_t bt;
-        blockStrand_t bst;
-        getSequenceFromReference(st, bt, bst, u.first);
-
-        for(size_t i = 0; i < st.size(); i++) {
-            if(bst[i].first) {
-                for(size_t j = 0; j < st[i].first.size(); j++) {
-                    for(size_t k = 0; k < st[i].first[j].second.size(); k++) {
-                        if(st[i].first[j].second[k] != '-' && st[i].first[j].second[k] != 'x') {
-                            seqChar[std::make_tuple(u.first,i,j,k)] = st[i].first[j].second[k];
-                        } else {
-                            seqChar[std::make_tuple(u.first,i,j,k)] = '-';
-                        }
-                    }
-                    if(st[i].first[j].first != '-' && st[i].first[j].first != 'x' && bt[i].first) {
-                        seqChar[std::make_tuple(u.first,i,j,-1)] = st[i].first[j].first;
-                    } else {
-                        seqChar[std::make_tuple(u.first,i,j,-1)] = '-';
-                    }
-                }
-            } else {
-                for(size_t j = st[i].first.size() - 1; j + 1 > 0; j--) {
-                    if(st[i].first[j].first != '-' && st[i].first[j].first != 'x') {
-                        seqChar[std::make_tuple(u.first,i,j,-1)] = rootSequence[i].first[j].first;
-                    } else {
-                        seqChar[std::make_tuple(u.first,i,j,-1)] = '-';
-                    }
-                    for(size_t k = st[i].first[j].second.size() - 1; k + 1 > 0; k--) {
-                        if(st[i].first[j].second[k] != '-' && st[i].first[j].second[k] != 'x') {
-                            seqChar[std::make_tuple(u.first,i,j,k)] = st[i].first[j].second[k];
-                        } else {
-                            seqChar[std::make_tuple(u.first,i,j,k)] = '-';
-                        }
-                    }
-                }
-            }
-        }
-    });
-
-    nodeMutations[root->identifier];
-
-    // Compute mutations for each of the other sequences
-    tbb::parallel_for_each(allNodes, [&](auto u) {
-        if(u.first == root->identifier) {
-            return;
-        }
-
-        tbb::concurrent_map< std::tuple< int, int, int >, char > currentCharacter = rootCurrentCharacter;
-        tbb::concurrent_unordered_map< size_t, bool > presentBlocks = rootPresentBlocks;
-
-        nodeMutations[u.first];
-
-        Node* it = u.second;
-        std::vector< panmanUtils::Node* > path;
-
-        while(it != root) {
-            path.push_back(it);
-            it = it->parent;
-        }
-
-        std::vector< std::pair< size_t, std::tuple< char, size_t, char, char, bool > > > currentNodeMutations;
-
-        for(auto node = path.rbegin(); node != path.rend(); node++) {
-            for(auto mutation: (*node)->blockMutation) {
-                int32_t primaryBlockId = mutation.primaryBlockId;
-                if(rootPresentBlocks.find(primaryBlockId) == rootPresentBlocks.end()) {
+// Mutable state for printing mutations in a depth-first traversal. Holds the nucleotides of
+// the current node and the presence of its primary blocks in flat arrays indexed by column,
+// and records every change so that it can be undone when the traversal leaves the node
+struct MutationPrintState {
+    // Columns of position j in block i start at positionStart[blockStart[i] + j]. The gap
+    // nucleotides come first, and the last column is the main nucleotide
+    const std::vector< size_t >& blockStart;
+    const std::vector< size_t >& positionStart;
+    // Coordinate in the root sequence and whether the column is a gap in the root
+    const std::vector< size_t >& globalCoordinate;
+    const std::vector< bool >& isGapCoordinate;
+
+    std::vector< char > characters;
+    std::vector< bool > presentBlocks;
+    std::vector< std::pair< size_t, char > > nucUndo;
+    std::vector< std::pair< size_t, bool > > blockUndo;
+
+    MutationPrintState(const std::vector< size_t >& bs, const std::vector< size_t >& ps,
+                       const std::vector< size_t >& gc, const std::vector< bool >& ig,
+                       const std::vector< char >& c, const std::vector< bool >& pb):
+        blockStart(bs), positionStart(ps), globalCoordinate(gc), isGapCoordinate(ig),
+        characters(c), presentBlocks(pb) {}
+
+    // Column of a nucleotide, or -1 if it is outside the root coordinate system
+    int64_t column(int32_t primaryBlockId, int32_t nucPosition, int32_t nucGapPosition) const {
+        if(primaryBlockId < 0 || (size_t)primaryBlockId + 1 >= blockStart.size() || nucPosition < 0
+                || (size_t)nucPosition >= blockStart[primaryBlockId + 1] - blockStart[primaryBlockId]) {
+            return -1;
+        }
+        size_t position = blockStart[primaryBlockId] + nucPosition;
+        if(nucGapPosition == -1) {
+            return positionStart[position + 1] - 1;
+        }
+        if(nucGapPosition < 0 || (size_t)nucGapPosition + 1 >= positionStart[position + 1] - positionStart[position]) {
+            return -1;
+        }
+        return positionStart[position] + nucGapPosition;
+    }
+
+    void applyNucleotides(panmanUtils::Node* node) {
+        for(const auto& mutation: node->nucMutation) {
+            uint32_t type = mutation.type();
+            bool deletion = (type == panmanUtils::NucMutationType::ND || type == panmanUtils::NucMutationType::NSNPD);
+            for(int j = 0; j < mutation.length(); j++) {
+                int64_t c = column(mutation.primaryBlockId,
+                                   mutation.nucPosition + ((mutation.nucGapPosition == -1) ? j : 0),
+                                   mutation.nucGapPosition + ((mutation.nucGapPosition == -1) ? 0 : j));
+                if(c == -1) {
                     continue;
                 }
-
-                bool type = mutation.blockMutInfo;
-                bool inversion = mutation.inversion;
-                if(type == 1) {
-                    // insertion
-                    presentBlocks[primaryBlockId] = true;
-                    if(inversion) {
-                        std::cout << "INVERTED BLOCK FOUND" << std::endl;
-                    }
-                } else {
-                    if(inversion) {
-                        // This means that this is not a deletion, but instead an inversion
-                        std::cout << "INVERSION FOUND" << std::endl;
-                    } else {
-                        // Actually a deletion
-                        presentBlocks[primaryBlockId] = false;
-                    }
-                }
+                nucUndo.emplace_back(c, characters[c]);
+                characters[c] = deletion ? '-' : panmanUtils::getNucleotideFromCode(mutation.getNucCode(j));
             }
         }
+    }
 
-        for(auto node = path.rend()-1; node != path.rend(); node++) {
-            for(size_t i = 0; i < (*node)->nucMutation.size(); i++) {
-                int32_t primaryBlockId = (*node)->nucMutation[i].primaryBlockId;
-                if(rootPresentBlocks.find(primaryBlockId) == rootPresentBlocks.end()) {
-                    continue;
-                }
-
-                int32_t nucPosition = (*node)->nucMutation[i].nucPosition;
-                int32_t nucGapPosition = (*node)->nucMutation[i].nucGapPosition;
-                uint32_t type = ((*node)->nucMutation[i].type());
-                char newVal = '-';
-
-                if(type < 3) {
-                    int len = (*node)->nucMutation[i].length();
-
-                    if(type == panmanUtils::NucMutationType::NS) {
-                        if(nucGapPosition != -1) {
-                            for(int j = 0; j < len; j++) {
-                                newVal = panmanUtils::getNucleotideFromCode((*node)->nucMutation[i].getNucCode(j));
-                                if(presentBlocks[primaryBlockId]) {
-                                    // char oldVal = currentCharacter[std::make_tuple(primaryBlockId, nucPosition, nucGapPosition+j)];
-                                    char oldVal = seqChar[std::make_tuple((*node)->parent->identifier,primaryBlockId, nucPosition, nucGapPosition+j)];
-                                    if(oldVal == '-' || oldVal == 'x') {
-                                        continue;
-                                    }
-                                    // if(node == path.rend()-1)
-                                    currentNodeMutations.push_back(std::make_pair(primaryBlockId, std::make_tuple('S', panMATCoordinateToGlobal[std::make_tuple(primaryBlockId, nucPosition, nucGapPosition+j)], oldVal, newVal, isGapCoordinate[std::make_tuple(primaryBlockId, nucPosition, nucGapPosition+j)])));
-                                    // nodeMutations[u.first].push_back(std::make_tuple('S', panMATCoordinateToGlobal[std::make_tuple(primaryBlockId, nucPosition, nucGapPosition+j)], oldVal, newVal));
-                                }
-                                currentCharacter[std::make_tuple(primaryBlockId, nucPosition, nucGapPosition+j)] = newVal;
-                            }
-                        } else {
-                            for(int j = 0; j < len; j++) {
-                                newVal = panmanUtils::getNucleotideFromCode((*node)->nucMutation[i].getNucCode(j));
-                                if(presentBlocks[primaryBlockId]) {
-                                    char oldVal = seqChar[std::make_tuple((*node)->parent->identifier,primaryBlockId, nucPosition+j, -1)];
-                                    // char oldVal = currentCharacter[std::make_tuple(primaryBlockId, nucPosition + j, -1)];
-                                    // if(u.first == "Denmark/DCGC-504971/2022|OX187739.1|2022-04-28" && panMATCoordinateToGlobal[std::make_tuple(primaryBlockId, nucPosition + j, -1)] == 185) {
-                                    //     std::cout << oldVal << " " << newVal << " " << primaryBlockId << " " << nucPosition+j << " " << -1 << std::endl;
-                                    // }
-                                    if(oldVal == '-' || oldVal == 'x') {
-                                        // std::cout << "NOT ACTUALLY A SUBSTITUTION" << std::endl;
-                                        continue;
-                                    }
-                                    // if(oldVal == newVal) {
-                                    //     std::cout << primaryBlockId << " " << nucPosition << " " << nucGapPosition+j << " " << oldVal << " " << newVal << std::endl;
-                                    // }
-                                    // if(node == path.rend()-1)
-                                    currentNodeMutations.push_back(std::make_pair(primaryBlockId, std::make_tuple('S', panMATCoordinateToGlobal[std::make_tuple(primaryBlockId, nucPosition + j, -1)], oldVal, newVal, isGapCoordinate[std::make_tuple(primaryBlockId, nucPosition+j, -1)])));
-                                    // nodeMutations[u.first].push_back(std::make_tuple('S', panMATCoordinateToGlobal[std::make_tuple(primaryBlockId, nucPosition + j, -1)], oldVal, newVal));
-                                }
-                                currentCharacter[std::make_tuple(primaryBlockId, nucPosition + j, -1)] = newVal;
-                            }
-                        }
-                    } else if(type == panmanUtils::NucMutationType::NI) {
-                        if(nucGapPosition != -1) {
-                            for(int j = 0; j < len; j++) {
-                                newVal = panmanUtils::getNucleotideFromCode((*node)->nucMutation[i].getNucCode(j));
-                                // if(node == path.rend()-1)
-                                currentNodeMutations.push_back(std::make_pair(primaryBlockId, std::make_tuple('I', panMATCoordinateToGlobal[std::make_tuple(primaryBlockId, nucPosition, nucGapPosition + j)], '-', newVal, isGapCoordinate[std::make_tuple(primaryBlockId, nucPosition, nucGapPosition + j)])));
-                            }
-                        } else {
-                            for(int j = 0; j < len; j++) {
-                                newVal = panmanUtils::getNucleotideFromCode((*node)->nucMutation[i].getNucCode(j));
-                                // if(node == path.rend()-1)
-                                currentNodeMutations.push_back(std::make_pair(primaryBlockId, std::make_tuple('I', panMATCoordinateToGlobal[std::make_tuple(primaryBlockId, nucPosition + j, -1)], '-', newVal, isGapCoordinate[std::make_tuple(primaryBlockId, nucPosition + j, -1)])));
-
-                            }
-                        }
-                    } else if(type == panmanUtils::NucMutationType::ND) {
-                        if(nucGapPosition != -1) {
-                            for(int j = 0; j < len; j++) {
-                                char oldVal = seqChar[std::make_tuple((*node)->parent->identifier,primaryBlockId, nucPosition, nucGapPosition + j)];
-                                // if(node == path.rend()-1){
-                                currentNodeMutations.push_back(std::make_pair(primaryBlockId, std::make_tuple('D', panMATCoordinateToGlobal[std::make_tuple(primaryBlockId, nucPosition, nucGapPosition + j)], oldVal, '-', isGapCoordinate[std::make_tuple(primaryBlockId, nucPosition, nucGapPosition + j)])));
-                                // }
-                            }
-                        } else {
-                            for(int j = 0; j < len; j++) {
-                                char oldVal = seqChar[std::make_tuple((*node)->parent->identifier,primaryBlockId, nucPosition + j, nucGapPosition)];
-                                // if(node == path.rend()-1){
-                                currentNodeMutations.push_back(std::make_pair(primaryBlockId, std::make_tuple('D', panMATCoordinateToGlobal[std::make_tuple(primaryBlockId, nucPosition + j, -1)], oldVal, '-', isGapCoordinate[std::make_tuple(primaryBlockId, nucPosition + j, -1)])));
-                                // }
-                            }
-                        }
-                    }
-                } else if(type == panmanUtils::NucMutationType::NSNPS) {
-                    newVal = panmanUtils::getNucleotideFromCode((*node)->nucMutation[i].getFirstNucCode());
-                    if(nucGapPosition != -1) {
-                        if(presentBlocks[primaryBlockId]) {
-                            char oldVal = seqChar[std::make_tuple((*node)->parent->identifier,primaryBlockId, nucPosition, nucGapPosition)];
-                            // char oldVal = currentCharacter[std::make_tuple(primaryBlockId, nucPosition, nucGapPosition)];
-                            if(oldVal == '-' || oldVal == 'x') {
-                                std::cout << "NOT ACTUALLY A SUBSTITUTION" << std::endl;
-                            }
-                            // if(node == path.rend()-1)
-                            currentNodeMutations.push_back(std::make_pair(primaryBlockId, std::make_tuple('S', panMATCoordinateToGlobal[std::make_tuple(primaryBlockId, nucPosition, nucGapPosition)], oldVal, newVal, isGapCoordinate[std::make_tuple(primaryBlockId, nucPosition, nucGapPosition)])));
-                            // nodeMutations[u.first].push_back(std::make_tuple('S', panMATCoordinateToGlobal[std::make_tuple(primaryBlockId, nucPosition, nucGapPosition)], oldVal, newVal));
+    // Apply the mutations of a node, appending the node's substitutions, insertions and
+    // deletions to the given strings
+    void apply(panmanUtils::Node* node, std::string* substitutions, std::string* insertions, std::string* deletions) {
+        // Presence of blocks in the parent, for the blocks changed in this node
+        size_t blockMark = blockUndo.size();
+        for(const auto& mutation: node->blockMutation) {
+            int32_t primaryBlockId = mutation.primaryBlockId;
+            if(primaryBlockId < 0 || (size_t)primaryBlockId >= presentBlocks.size() || mutation.isSimpleInversion()) {
+                continue;
+            }
+            blockUndo.emplace_back(primaryBlockId, presentBlocks[primaryBlockId]);
+            presentBlocks[primaryBlockId] = mutation.isInsertion();
+        }
+        auto parentHasBlock = [&](int32_t primaryBlockId) -> bool {
+            for(size_t i = blockMark; i < blockUndo.size(); i++) {
+                if(blockUndo[i].first == (size_t)primaryBlockId) {
+                    return blockUndo[i].second;
+                }
+            }
+            return presentBlocks[primaryBlockId];
+        };
+
+        if(substitutions != nullptr) {
+            for(const auto& mutation: node->nucMutation) {
+                uint32_t type = mutation.type();
+                int32_t primaryBlockId = mutation.primaryBlockId;
+                for(int j = 0; j < mutation.length(); j++) {
+                    int64_t c = column(primaryBlockId,
+                                       mutation.nucPosition + ((mutation.nucGapPosition == -1) ? j : 0),
+                                       mutation.nucGapPosition + ((mutation.nucGapPosition == -1) ? 0 : j));
+                    if(c == -1) {
+                        continue;
+                    }
+                    char oldVal = (parentHasBlock(primaryBlockId) && characters[c] != 'x') ? characters[c] : '-';
+                    char newVal = panmanUtils::getNucleotideFromCode(mutation.getNucCode(j));
+                    std::string coordinate = (isGapCoordinate[c] ? "g" : "");
+                    std::string position = std::to_string(globalCoordinate[c] + 1);
+
+                    if(type == panmanUtils::NucMutationType::NS || type == panmanUtils::NucMutationType::NSNPS) {
+                        // Substitutions are only reported in blocks present in the node, and
+                        // multiple nucleotide substitutions only where the parent has a nucleotide
+                        if(!presentBlocks[primaryBlockId] || (type == panmanUtils::NucMutationType::NS && oldVal == '-')) {
+                            continue;
                         }
-                        currentCharacter[std::make_tuple(primaryBlockId, nucPosition, nucGapPosition)] = newVal;
+                        *substitutions += " > " + coordinate + oldVal + position + newVal;
+                    } else if(type == panmanUtils::NucMutationType::NI || type == panmanUtils::NucMutationType::NSNPI) {
+                        *insertions += " > " + coordinate + position + newVal;
                     } else {
-                        if(presentBlocks[primaryBlockId]) {
-                            char oldVal = seqChar[std::make_tuple((*node)->parent->identifier,primaryBlockId, nucPosition, -1)];
-                            // char oldVal = currentCharacter[std::make_tuple(primaryBlockId, nucPosition, -1)];
-                            if(oldVal == '-' || oldVal == 'x') {
-                                std::cout << "NOT ACTUALLY A SUBSTITUTION" << std::endl;
-                            }
-                            // if(node == path.rend()-1)
-                            currentNodeMutations.push_back(std::make_pair(primaryBlockId, std::make_tuple('S', panMATCoordinateToGlobal[std::make_tuple(primaryBlockId, nucPosition, -1)], oldVal, newVal, isGapCoordinate[std::make_tuple(primaryBlockId, nucPosition, -1)])));
-                            // nodeMutations[u.first].push_back(std::make_tuple('S', panMATCoordinateToGlobal[std::make_tuple(primaryBlockId, nucPosition, -1)], oldVal, newVal));
-                        }
-                        currentCharacter[std::make_tuple(primaryBlockId, nucPosition, -1)] = newVal;
+                        *deletions += " > " + coordinate + position + oldVal;
                     }
                 }
             }
         }
 
-        for(auto mut: currentNodeMutations) {
-            if(presentBlocks.find(mut.first) != presentBlocks.end()) {
-                nodeMutations[u.first].push_back(mut.second);
-            }
+        applyNucleotides(node);
+    }
+
+    void undo(size_t blockMark, size_t nucMark) {
+        while(nucUndo.size() > nucMark) {
+            characters[nucUndo.back().first] = nucUndo.back().second;
+            nucUndo.pop_back();
         }
-    });
+        while(blockUndo.size() > blockMark) {
+            presentBlocks[blockUndo.back().first] = blockUndo.back().second;
+            blockUndo.pop_back();
+        }
+    }
+};
 
-    for(auto& u: nodeMutations) {
-        // print all substitutions first
-        fout << "Substitutions:\t";
-        fout << u.first << '\t';
-        for(auto v: u.second) {
-            if(std::get<0>(v) == 'S') {
-                fout << " > " << (std::get<4>(v) ? "g" : "") << std::get<2>(v) << std::get<1>(v)+1 << std::get<3>(v);
-            }
+void panmanUtils::Tree::printMutationsNew(std::ostream& fout) {
+
+    // Get reference sequence
+    sequence_t rootSequence;
+    blockExists_t rootBlockExists;
+    blockStrand_t rootBlockStrand;
+    getSequenceFromReference(rootSequence, rootBlockExists, rootBlockStrand, root->identifier);
+
+    // Flat column layout of the primary blocks
+    std::vector< size_t > blockStart = {0};
+    std::vector< size_t > positionStart;
+    for(size_t i = 0; i < rootSequence.size(); i++) {
+        blockStart.push_back(blockStart.back() + rootSequence[i].first.size());
+    }
+    positionStart.assign(blockStart.back() + 1, 0);
+    for(size_t i = 0; i < rootSequence.size(); i++) {
+        for(size_t j = 0; j < rootSequence[i].first.size(); j++) {
+            size_t position = blockStart[i] + j;
+            positionStart[position + 1] = positionStart[position] + rootSequence[i].first[j].second.size() + 1;
         }
-        fout << '\n';
+    }
+    size_t numColumns = positionStart.back();
 
-        fout << "Insertions:\t";
-        fout << u.first << '\t';
-        // print insertions
-        for(auto v: u.second) {
-            if(std::get<0>(v) == 'I') {
-                fout << " > " << (std::get<4>(v) ? "g" : "") << std::get<1>(v)+1 << std::get<3>(v);
+    // Convert PanMAT coordinates to global reference coordinates, starting from the nucleotides of
+    // the root. The root's own mutations are applied again so that blocks absent from the root hold
+    // the nucleotides their descendants inherit
+    std::vector< size_t > globalCoordinate(numColumns, 0);
+    std::vector< bool > isGapCoordinate(numColumns, false);
+    std::vector< char > characters(numColumns, '-');
+    std::vector< bool > presentBlocks(rootSequence.size(), false);
+
+    size_t rootCtr = 0;
+    auto assignColumn = [&](size_t c, char nucleotide, bool present) {
+        globalCoordinate[c] = rootCtr;
+        characters[c] = nucleotide;
+        if(present) {
+            isGapCoordinate[c] = (nucleotide == '-' || nucleotide == 'x');
+            if(!isGapCoordinate[c]) {
+                rootCtr++;
             }
         }
-        fout << '\n';
+    };
+    for(size_t i = 0; i < rootSequence.size(); i++) {
+        bool present = rootBlockExists[i].first;
+        presentBlocks[i] = present;
+        size_t numPositions = rootSequence[i].first.size();
+        for(size_t p = 0; p < numPositions; p++) {
+            size_t j = rootBlockStrand[i].first ? p : numPositions - 1 - p;
+            const auto& position = rootSequence[i].first[j];
+            size_t start = positionStart[blockStart[i] + j];
+            if(rootBlockStrand[i].first) {
+                for(size_t k = 0; k < position.second.size(); k++) {
+                    assignColumn(start + k, position.second[k], present);
+                }
+                assignColumn(start + position.second.size(), position.first, present);
+            } else {
+                assignColumn(start + position.second.size(), position.first, present);
+                for(size_t k = position.second.size(); k > 0; k--) {
+                    assignColumn(start + k - 1, position.second[k - 1], present);
+                }
+            }
+        }
+    }
 
-        fout << "Deletions:\t";
-        fout << u.first << '\t';
-        // print deletions
-        for(auto v: u.second) {
-            if(std::get<0>(v) == 'D') {
-                fout << " > " << (std::get<4>(v) ? "g" : "") << std::get<1>(v)+1 << std::get<2>(v);
+    MutationPrintState upper(blockStart, positionStart, globalCoordinate, isGapCoordinate, characters, presentBlocks);
+    upper.applyNucleotides(root);
+    upper.nucUndo.clear();
+
+    // Mutations of each node are formatted into its own slot, in preorder
+    std::vector< Node* > preorder;
+    std::unordered_map< Node*, size_t > preorderIndex;
+    std::function< void(Node*) > collectPreorder = [&](Node* node) {
+        preorderIndex[node] = preorder.size();
+        preorder.push_back(node);
+        for(auto child: node->children) {
+            collectPreorder(child);
+        }
+    };
+    collectPreorder(root);
+    std::vector< std::array< std::string, 3 > > nodeMutations(preorder.size());
+
+    std::unordered_map< Node*, size_t > subtreeSize;
+    computeSubtreeSizes(root, subtreeSize);
+    TreePartition partition = partitionTree(root, subtreeSize);
+    const auto& frontier = partition.subtreeRoots;
+
+    // Nodes above the subtrees are printed serially, keeping the nodes on the path to the current
+    // one applied. The root's mutations are already part of the initial state
+    std::vector< std::tuple< Node*, size_t, size_t > > applied;
+    for(const auto& entry: partition.preorder) {
+        Node* node = entry.first;
+        while(!applied.empty() && std::get<0>(applied.back()) != node->parent) {
+            upper.undo(std::get<1>(applied.back()), std::get<2>(applied.back()));
+            applied.pop_back();
+        }
+        if(entry.second) {
+            continue;
+        }
+        applied.emplace_back(node, upper.blockUndo.size(), upper.nucUndo.size());
+        if(node != root) {
+            auto& output = nodeMutations[preorderIndex[node]];
+            upper.apply(node, &output[0], &output[1], &output[2]);
+        }
+    }
+
+    tbb::parallel_for(tbb::blocked_range< size_t >(0, frontier.size(), 1),
+                      [&](const tbb::blocked_range< size_t >& range) {
+        for(size_t i = range.begin(); i < range.end(); i++) {
+            if(frontier[i] == root) {
+                continue;
+            }
+            MutationPrintState state(blockStart, positionStart, globalCoordinate, isGapCoordinate, characters, presentBlocks);
+            state.applyNucleotides(root);
+            std::vector< Node* > path;
+            for(Node* node = frontier[i]->parent; node != root; node = node->parent) {
+                path.push_back(node);
             }
+            for(auto it = path.rbegin(); it != path.rend(); it++) {
+                state.apply(*it, nullptr, nullptr, nullptr);
+            }
+
+            std::function< void(Node*) > search = [&](Node* node) {
+                size_t blockMark = state.blockUndo.size(), nucMark = state.nucUndo.size();
+                auto& output = nodeMutations[preorderIndex[node]];
+                state.apply(node, &output[0], &output[1], &output[2]);
+                for(auto child: node->children) {
+                    search(child);
+                }
+                state.undo(blockMark, nucMark);
+            };
+            search(frontier[i]);
         }
-        fout << '\n';
+    });
+
+    for(size_t i = 0; i < preorder.size(); i++) {
+        const std::string& identifier = preorder[i]->identifier;
+        fout << "Substitutions:\t" << identifier << '\t' << nodeMutations[i][0] << '\n';
+        fout << "Insertions:\t" << identifier << '\t' << nodeMutations[i][1] << '\n';
+        fout << "Deletions:\t" << identifier << '\t' << nodeMutations[i][2] << '\n';
     }
 
 }
@@ -4673,39 +5102,13 @@ void panmanUtils::Tree::printMutationsNew(std::ostream& fout, std::vector<std::s
 
 }
 
-const void panmanUtils::Tree::getSequenceFromReference(sequence_t& sequence, blockExists_t& blockExists, 
-    blockStrand_t& blockStrand, std::string reference, bool rotateSequence, int* rotIndex) {
-    Node* referenceNode = nullptr;
-
-    for(auto u: allNodes) {
-        // printf("%s\n",u.first);
-        // std::cerr << u.first << std::endl;
-        if(u.first == reference) {
-            referenceNode = u.second;
-            break;
-        }
-    }
-
-    // printf(reference)
-
-    if(referenceNode == nullptr) {
-        std::cerr << "Error: Reference sequence with matching name not found: " << reference << std::endl;
-        return;
-    }
-
-    std::vector< panmanUtils::Node* > path;
-    Node* it = referenceNode;
-
-    while(it != root) {
-        path.push_back(it);
-        it = it->parent;
-    }
-    path.push_back(root);
-
+void panmanUtils::Tree::getConsensusSequence(sequence_t& sequence, blockExists_t& blockExists,
+    blockStrand_t& blockStrand) {
     // List of blocks. Each block has a nucleotide list. Along with each nucleotide is a gap list.
+    sequence.clear();
     sequence.resize(blocks.size() + 1);
-    blockExists.resize(blocks.size() + 1, {false, {}});
-    blockStrand.resize(blocks.size() + 1, {true, {}});
+    blockExists.assign(blocks.size() + 1, {false, {}});
+    blockStrand.assign(blocks.size() + 1, {true, {}});
 
     // Assigning block gaps
     for(size_t i = 0; i < blockGaps.blockPosition.size(); i++) {
@@ -4716,8 +5119,8 @@ const void panmanUtils::Tree::getSequenceFromReference(sequence_t& sequence, blo
 
     int32_t maxBlockId = 0;
 
+    // Create consensus sequence of blocks
     for(size_t i = 0; i < blocks.size(); i++) {
-
         int32_t primaryBlockId = blocks[i].primaryBlockId;
         int32_t secondaryBlockId = blocks[i].secondaryBlockId;
 
@@ -4735,7 +5138,6 @@ const void panmanUtils::Tree::getSequenceFromReference(sequence_t& sequence, blo
                 const char nucleotide = panmanUtils::getNucleotideFromCode(nucCode);
 
                 if(secondaryBlockId != -1) {
-                    std::cout << "Is it used?\n" ;
                     sequence[primaryBlockId].second[secondaryBlockId].push_back({nucleotide, {}});
                 } else {
                     sequence[primaryBlockId].first.push_back({nucleotide, {}});
@@ -4758,7 +5160,7 @@ const void panmanUtils::Tree::getSequenceFromReference(sequence_t& sequence, blo
     blockExists.resize(maxBlockId + 1);
     blockStrand.resize(maxBlockId + 1);
 
-    // Assigning nucleotide gaps
+    // Assigning nucleotide gaps in blocks
     for(size_t i = 0; i < gaps.size(); i++) {
         int32_t primaryBId = (gaps[i].primaryBlockId);
         int32_t secondaryBId = (gaps[i].secondaryBlockId);
@@ -4766,7 +5168,6 @@ const void panmanUtils::Tree::getSequenceFromReference(sequence_t& sequence, blo
         for(size_t j = 0; j < gaps[i].nucPosition.size(); j++) {
             int len = gaps[i].nucGapLength[j];
             int pos = gaps[i].nucPosition[j];
-
             if(secondaryBId != -1) {
                 sequence[primaryBId].second[secondaryBId][pos].second.resize(len, '-');
             } else {
@@ -4774,6 +5175,135 @@ const void panmanUtils::Tree::getSequenceFromReference(sequence_t& sequence, blo
             }
         }
     }
+}
+
+void panmanUtils::Tree::applyMutations(panmanUtils::Node* node, sequence_t& sequence,
+    blockExists_t& blockExists, blockStrand_t& blockStrand,
+    blockMutationInfo_t& blockMutationInfo, mutationInfo_t& mutationInfo) {
+
+    // Block Mutations
+    for(const auto& mutation: node->blockMutation) {
+        int32_t primaryBlockId = mutation.primaryBlockId;
+        int32_t secondaryBlockId = mutation.secondaryBlockId;
+
+        bool oldMut, oldStrand;
+        if(secondaryBlockId != -1) {
+            oldMut = blockExists[primaryBlockId].second[secondaryBlockId];
+            oldStrand = blockStrand[primaryBlockId].second[secondaryBlockId];
+        } else {
+            oldMut = blockExists[primaryBlockId].first;
+            oldStrand = blockStrand[primaryBlockId].first;
+        }
+
+        bool newMut, newStrand;
+        if(mutation.isInsertion()) {
+            // if insertion of inverted block takes place, the strand is backwards
+            newMut = true;
+            newStrand = !mutation.inversion;
+        } else if(mutation.isSimpleInversion()) {
+            newMut = oldMut;
+            newStrand = !oldStrand;
+        } else {
+            // resetting strand to true during deletion
+            newMut = false;
+            newStrand = true;
+        }
+
+        if(secondaryBlockId != -1) {
+            blockExists[primaryBlockId].second[secondaryBlockId] = newMut;
+            blockStrand[primaryBlockId].second[secondaryBlockId] = newStrand;
+        } else {
+            blockExists[primaryBlockId].first = newMut;
+            blockStrand[primaryBlockId].first = newStrand;
+        }
+        blockMutationInfo.push_back(std::make_tuple(primaryBlockId, secondaryBlockId, oldMut,
+                                    oldStrand, newMut, newStrand));
+    }
+
+    // Nuc mutations. SNP types have length 1, so both kinds are handled by the same loop
+    for(const auto& mutation: node->nucMutation) {
+        int len = mutation.length();
+        for(int j = 0; j < len; j++) {
+            panmanUtils::Coordinate coordinate(mutation, j);
+            char oldVal = coordinate.getSequenceBase(sequence);
+            char newVal = '-';
+            if(!mutation.isDeletion()) {
+                newVal = panmanUtils::getNucleotideFromCode(mutation.getNucCode(j));
+            }
+            coordinate.setSequenceBase(sequence, newVal);
+            mutationInfo.push_back(std::make_tuple(coordinate.primaryBlockId,
+                                   coordinate.secondaryBlockId, coordinate.nucPosition,
+                                   coordinate.nucGapPosition, oldVal, newVal));
+        }
+    }
+}
+
+void panmanUtils::Tree::undoMutations(sequence_t& sequence, blockExists_t& blockExists,
+    blockStrand_t& blockStrand, const blockMutationInfo_t& blockMutationInfo,
+    const mutationInfo_t& mutationInfo) {
+
+    // Undo block mutations in reverse order of application
+    for(auto it = blockMutationInfo.rbegin(); it != blockMutationInfo.rend(); it++) {
+        auto mutation = *it;
+        if(std::get<1>(mutation) != -1) {
+            blockExists[std::get<0>(mutation)].second[std::get<1>(mutation)] = std::get<2>(mutation);
+            blockStrand[std::get<0>(mutation)].second[std::get<1>(mutation)] = std::get<3>(mutation);
+        } else {
+            blockExists[std::get<0>(mutation)].first = std::get<2>(mutation);
+            blockStrand[std::get<0>(mutation)].first = std::get<3>(mutation);
+        }
+    }
+
+    // Undo nuc mutations in reverse order of application
+    for(auto it = mutationInfo.rbegin(); it != mutationInfo.rend(); it++) {
+        auto mutation = *it;
+        if(std::get<1>(mutation) != -1) {
+            if(std::get<3>(mutation) != -1) {
+                sequence[std::get<0>(mutation)].second[std::get<1>(mutation)][std::get<2>(mutation)].second[std::get<3>(mutation)] = std::get<4>(mutation);
+            } else {
+                sequence[std::get<0>(mutation)].second[std::get<1>(mutation)][std::get<2>(mutation)].first = std::get<4>(mutation);
+            }
+        } else {
+            if(std::get<3>(mutation) != -1) {
+                sequence[std::get<0>(mutation)].first[std::get<2>(mutation)].second[std::get<3>(mutation)] = std::get<4>(mutation);
+            } else {
+                sequence[std::get<0>(mutation)].first[std::get<2>(mutation)].first = std::get<4>(mutation);
+            }
+        }
+    }
+}
+
+const void panmanUtils::Tree::getSequenceFromReference(sequence_t& sequence, blockExists_t& blockExists, 
+    blockStrand_t& blockStrand, std::string reference, bool rotateSequence, int* rotIndex) {
+    Node* referenceNode = nullptr;
+
+    for(auto u: allNodes) {
+        // printf("%s\n",u.first);
+        // std::cerr << u.first << std::endl;
+        if(u.first == reference) {
+            referenceNode = u.second;
+            break;
+        }
+    }
+
+    // printf(reference)
+
+    if(referenceNode == nullptr) {
+        std::cerr << "Error: Reference sequence with matching name not found: " << reference << std::endl;
+        return;
+    }
+
+    std::vector< panmanUtils::Node* > path;
+    Node* it = referenceNode;
+
+    while(it != root) {
+        path.push_back(it);
+        it = it->parent;
+    }
+    path.push_back(root);
+
+    // Start from the consensus of every block, with all blocks absent
+    getConsensusSequence(sequence, blockExists, blockStrand);
 
     // Get all blocks on the path
     for(auto node = path.rbegin(); node != path.rend(); node++) {
@@ -5470,20 +6000,41 @@ bool panmanUtils::Tree::verifyVCFFile(std::ifstream& fin) {
 }
 
 void panmanUtils::Tree::vcfToFASTA(std::ifstream& fin, std::ofstream& fout) {
+    // Read the VCF once and let each worker parse its own sample from the in-memory copy
+    std::string vcfContent;
+    fin.seekg(0, std::ios::end);
+    vcfContent.resize(fin.tellg());
+    fin.seekg(0);
+    fin.read(&vcfContent[0], vcfContent.size());
+
+    std::vector< std::string > leafIds;
     for(auto u: allNodes) {
         if(u.second->children.size() == 0) {
-            fin.clear();
-            fin.seekg(0);
-            std::string sequenceString = getSequenceFromVCF(u.first, fin);
-            fout << '>' << u.first << '\n';
-            for(size_t i = 0; i < sequenceString.size(); i+=70) {
-                fout << sequenceString.substr(i,std::min(70, (int)sequenceString.length() - (int)i)) << '\n';
+            leafIds.push_back(u.first);
+        }
+    }
+
+    // Samples are processed a few at a time so that only a batch of sequences is held in memory
+    size_t batchSize = tbb::task_scheduler_init::default_num_threads();
+    std::vector< std::string > sequences(batchSize);
+    for(size_t batchStart = 0; batchStart < leafIds.size(); batchStart += batchSize) {
+        size_t batchEnd = std::min(batchStart + batchSize, leafIds.size());
+        tbb::parallel_for(batchStart, batchEnd, [&](size_t i) {
+            boost::iostreams::stream< boost::iostreams::array_source > vcfStream(vcfContent.data(), vcfContent.size());
+            sequences[i - batchStart] = getSequenceFromVCF(leafIds[i], vcfStream);
+        });
+        for(size_t i = batchStart; i < batchEnd; i++) {
+            const std::string& sequenceString = sequences[i - batchStart];
+            fout << '>' << leafIds[i] << '\n';
+            for(size_t j = 0; j < sequenceString.size(); j+=70) {
+                fout.write(sequenceString.data() + j, std::min((size_t)70, sequenceString.size() - j));
+                fout << '\n';
             }
         }
     }
 }
 
-std::string panmanUtils::Tree::getSequenceFromVCF(std::string sequenceId, std::ifstream& fin) {
+std::string panmanUtils::Tree::getSequenceFromVCF(std::string sequenceId, std::istream& fin) {
     std::string line;
 
     // get reference line
@@ -6057,11 +6608,18 @@ std::pair< panmanUtils::Tree, panmanUtils::Tree > panmanUtils::Tree::splitByComp
 
 }
 
-panmanUtils::GfaGraph::GfaGraph(const std::vector< std::string >& pathNames, const std::vector< std::vector< std::pair< std::string, bool > > >& sequences, std::map< std::string, std::string >& nodes) {
-    pathIds = pathNames;
-
-    // New integer Node ID to old string Node ID
-    std::vector< std::string > nodeIdToString;
+panmanUtils::GfaGraph::GfaGraph(const std::vector< std::string >& pathNames, const std::vector< std::vector< std::pair< int32_t, bool > > >& sequences, const std::vector< std::string >& segmentSequences) {
+    // Paths are processed in the order of their names
+    std::vector< size_t > pathOrder(pathNames.size());
+    for(size_t i = 0; i < pathOrder.size(); i++) {
+        pathOrder[i] = i;
+    }
+    std::sort(pathOrder.begin(), pathOrder.end(), [&](size_t a, size_t b) {
+        return pathNames[a] < pathNames[b];
+    });
+    for(auto i: pathOrder) {
+        pathIds.push_back(pathNames[i]);
+    }
 
     // Auto increment ID to assign to nodes
     numNodes = 0;
@@ -6069,17 +6627,18 @@ panmanUtils::GfaGraph::GfaGraph(const std::vector< std::string >& pathNames, con
     intSequences.resize(sequences.size());
     strandPaths.resize(sequences.size());
 
-    std::unordered_map<int,std::string> intToString; // Locally stored -> Later on mapped to intIdToStringId
-    std::vector<std::string> consensus = {};
+    // Chaining matches blocks by their interned segment id
+    std::unordered_map<int,int32_t> intToSegment;
+    std::vector<int32_t> consensus = {};
     std::vector<int> intSequenceConsensus= {};
 
     for(size_t seqCount = 0; seqCount < sequences.size(); seqCount++) {
+        const auto& sequence = sequences[pathOrder[seqCount]];
         if (seqCount == 0) {
             // Load first sequence path
-            for(const auto& block: sequences[seqCount]) {
+            for(const auto& block: sequence) {
                 consensus.push_back(block.first);
-                // sample_base.push_back(block);
-                intToString[numNodes] = block.first;
+                intToSegment[numNodes] = block.first;
                 intSequences[0].push_back(numNodes);
                 strandPaths[seqCount].push_back(block.second);
                 intSequenceConsensus.push_back(numNodes);
@@ -6088,10 +6647,10 @@ panmanUtils::GfaGraph::GfaGraph(const std::vector< std::string >& pathNames, con
         } else {
             std::vector<int> intSequenceSample;
             std::vector<int> intSequenceConsensusNew;
-            std::vector<std::string> sample;
-            std::vector<std::string> consensusNew;
+            std::vector<int32_t> sample;
+            std::vector<int32_t> consensusNew;
 
-            for(const auto& block: sequences[seqCount]) {
+            for(const auto& block: sequence) {
                 sample.push_back(block.first);
                 strandPaths[seqCount].push_back(block.second);
             }
@@ -6103,21 +6662,13 @@ panmanUtils::GfaGraph::GfaGraph(const std::vector< std::string >& pathNames, con
                          numNodes,
                          consensusNew,
                          intSequenceConsensusNew,
-                         intToString);
+                         intToSegment);
             for (auto &b: intSequenceSample) {
                 intSequences[seqCount].push_back(b);
             }
-            consensus.clear();
-            intSequenceConsensus.clear();
-            for (auto &b: consensusNew) {
-                consensus.push_back(b);
-            }
-
-            for (auto &b: intSequenceConsensusNew) {
-                intSequenceConsensus.push_back(b);
-            }
+            consensus = std::move(consensusNew);
+            intSequenceConsensus = std::move(intSequenceConsensusNew);
         }
-        // std::cout << seqCount << " " << intSequenceConsensus.size() << endl;
     }
 
     // re-assigning IDs in fixed order
@@ -6125,7 +6676,7 @@ panmanUtils::GfaGraph::GfaGraph(const std::vector< std::string >& pathNames, con
     std::unordered_map<int, int> orderMap = {};
     for (auto &i: intSequenceConsensus) {
         orderMap[i] = reorder;
-        nodeIdToString.push_back(intToString[i]);
+        intNodeToSequence.push_back(segmentSequences[intToSegment[i]]);
         topoSortedIntSequences.push_back(reorder);
         reorder++;
     }
@@ -6135,10 +6686,6 @@ panmanUtils::GfaGraph::GfaGraph(const std::vector< std::string >& pathNames, con
             s = orderMap[s];
         }
     }
-
-    for(size_t i = 0; i < reorder; i++) {
-        intNodeToSequence.push_back(nodes[nodeIdToString[i]]);
-    }
 }
 
 std::vector< std::vector< int64_t > > panmanUtils::GfaGraph::getAlignedSequences(const std::vector< size_t >& topoArray) {
@@ -6197,136 +6744,300 @@ std::vector< size_t > panmanUtils::GfaGraph::getTopologicalSort() {
 }
 
 
-panmanUtils::Pangraph::Pangraph(Json::Value& pangraphData, panmanUtils::Node* root) {
-    // load paths
+panmanUtils::Pangraph::Pangraph(std::istream& fin, panmanUtils::Node* root) {
     bool circular=false;
-    for(size_t i = 0; i < pangraphData["paths"].size(); i++) {
-        Json::Value path = pangraphData["paths"][(int)i];
-        for(size_t j = 0; j < path["blocks"].size(); j++) {
-            paths[path["name"].asString()].push_back(path["blocks"][(int)j]["id"].asString());
-            strandPaths[path["name"].asString()].push_back(path["blocks"][(int)j]["strand"].asBool());
-        }
-        if(path["circular"].asBool() == true) {
-            circular = true;
-            circularSequences[path["name"].asString()] = -path["offset"].asInt();
-        }
-    }
 
-    std::unordered_map<std::string, int> blockSizeMap;
+    // The JSON is parsed as it is read, and the mutations of each block are packed into the
+    // integer-indexed tables once the block is complete
+    auto internSequence = [&](const std::string& name) {
+        auto it = sequenceIndices.emplace(name, sequenceNames.size());
+        if(it.second) {
+            sequenceNames.push_back(name);
+        }
+        return it.first->second;
+    };
+
+    panmanUtils::JsonReader reader(fin);
+    std::string key;
+
+    // Read a list of [ {name, number, ...}, [entry, ...] ] pairs, calling readEntry for every
+    // entry with the interned sequence index and block number
+    auto readMutationLists = [&](const std::function< void(size_t, size_t) >& readEntry) {
+        reader.beginArray();
+        while(reader.nextElement()) {
+            std::string name, memberKey;
+            size_t number = 0;
+            reader.beginArray();
+            reader.nextElement();
+            reader.beginObject();
+            while(reader.nextMember(memberKey)) {
+                if(memberKey == "name") {
+                    reader.readString(name);
+                } else if(memberKey == "number") {
+                    number = reader.readInt();
+                } else {
+                    reader.skipValue();
+                }
+            }
+            size_t sequenceIndex = internSequence(name);
+            reader.nextElement();
+            reader.beginArray();
+            while(reader.nextElement()) {
+                readEntry(sequenceIndex, number);
+            }
+            while(reader.nextElement()) {
+                reader.skipValue();
+            }
+        }
+    };
+    auto endArray = [&]() {
+        while(reader.nextElement()) {
+            reader.skipValue();
+        }
+    };
+
+    reader.beginObject();
+    while(reader.nextMember(key)) {
+        if(key == "paths") {
+            // load paths
+            reader.beginArray();
+            while(reader.nextElement()) {
+                std::string name, blockId;
+                std::vector< std::string > pathBlocks;
+                std::vector< int > pathStrands;
+                bool pathCircular = false;
+                int64_t offset = 0;
+                reader.beginObject();
+                while(reader.nextMember(key)) {
+                    if(key == "name") {
+                        reader.readString(name);
+                    } else if(key == "circular") {
+                        pathCircular = reader.readBool();
+                    } else if(key == "offset") {
+                        offset = reader.readInt();
+                    } else if(key == "blocks") {
+                        reader.beginArray();
+                        while(reader.nextElement()) {
+                            bool strand = false;
+                            reader.beginObject();
+                            while(reader.nextMember(key)) {
+                                if(key == "id") {
+                                    reader.readString(blockId);
+                                } else if(key == "strand") {
+                                    strand = reader.readBool();
+                                } else {
+                                    reader.skipValue();
+                                }
+                            }
+                            pathBlocks.push_back(blockId);
+                            pathStrands.push_back(strand);
+                        }
+                    } else {
+                        reader.skipValue();
+                    }
+                }
+                if(pathBlocks.size()) {
+                    auto& path = paths[name];
+                    path.insert(path.end(), pathBlocks.begin(), pathBlocks.end());
+                    auto& strandPath = strandPaths[name];
+                    strandPath.insert(strandPath.end(), pathStrands.begin(), pathStrands.end());
+                }
+                if(pathCircular) {
+                    circular = true;
+                    circularSequences[name] = -offset;
+                }
+            }
+        } else if(key == "blocks") {
+            // load blocks
+            reader.beginArray();
+            while(reader.nextElement()) {
+                std::string blockId, sequence, mutationString;
+                std::vector< std::pair< size_t, size_t > > blockGaps;
+                // (sequence index, number, position, nucleotides)
+                std::vector< std::tuple< size_t, size_t, size_t, std::string > > blockSubstitutions;
+                // (sequence index, number, position, gap position, nucleotides)
+                std::vector< std::tuple< size_t, size_t, size_t, size_t, std::string > > blockInsertions;
+                // (sequence index, number, position, length)
+                std::vector< std::tuple< size_t, size_t, size_t, size_t > > blockDeletions;
+
+                reader.beginObject();
+                while(reader.nextMember(key)) {
+                    if(key == "id") {
+                        reader.readString(blockId);
+                    } else if(key == "sequence") {
+                        reader.readString(sequence);
+                    } else if(key == "gaps") {
+                        std::string position;
+                        reader.beginObject();
+                        while(reader.nextMember(position)) {
+                            blockGaps.emplace_back(std::stoi(position), reader.readInt());
+                        }
+                    } else if(key == "mutate") {
+                        readMutationLists([&](size_t sequenceIndex, size_t number) {
+                            reader.beginArray();
+                            reader.nextElement();
+                            size_t position = reader.readInt();
+                            reader.nextElement();
+                            reader.readString(mutationString);
+                            endArray();
+                            blockSubstitutions.emplace_back(sequenceIndex, number, position, mutationString);
+                        });
+                    } else if(key == "insert") {
+                        readMutationLists([&](size_t sequenceIndex, size_t number) {
+                            reader.beginArray();
+                            reader.nextElement();
+                            reader.beginArray();
+                            reader.nextElement();
+                            size_t position = reader.readInt();
+                            reader.nextElement();
+                            size_t gapPosition = reader.readInt();
+                            endArray();
+                            reader.nextElement();
+                            reader.readString(mutationString);
+                            endArray();
+                            blockInsertions.emplace_back(sequenceIndex, number, position, gapPosition, mutationString);
+                        });
+                    } else if(key == "delete") {
+                        readMutationLists([&](size_t sequenceIndex, size_t number) {
+                            reader.beginArray();
+                            reader.nextElement();
+                            size_t position = reader.readInt();
+                            reader.nextElement();
+                            size_t length = reader.readInt();
+                            endArray();
+                            blockDeletions.emplace_back(sequenceIndex, number, position, length);
+                        });
+                    } else {
+                        reader.skipValue();
+                    }
+                }
 
-    // load blocks
-    for(size_t i = 0; i < pangraphData["blocks"].size(); i++) {
-        std::string blockId = pangraphData["blocks"][(int)i]["id"].asString();
-        std::string sequence = pangraphData["blocks"][(int)i]["sequence"].asString();
-        std::transform(sequence.begin(), sequence.end(),sequence.begin(), ::toupper);
-        stringIdToConsensusSeq[blockId] = sequence;
-        blockSizeMap[blockId] = sequence.size();
-        std::vector< std::string > gapMemberNames = pangraphData["blocks"][(int)i]["gaps"].getMemberNames();
-        for(auto member: gapMemberNames) {
-            stringIdToGaps[blockId].push_back( std::make_pair( std::stoi(member), pangraphData["blocks"][(int)i]["gaps"][member].asInt() ) );
-        }
-        for(size_t j = 0; j < pangraphData["blocks"][(int)i]["mutate"].size(); j++) {
-            std::string seqName = pangraphData["blocks"][(int)i]["mutate"][(int)j][0]["name"].asString();
-            size_t number = pangraphData["blocks"][(int)i]["mutate"][(int)j][0]["number"].asInt();
+                std::transform(sequence.begin(), sequence.end(),sequence.begin(), ::toupper);
+                stringIdToConsensusSeq[blockId] = std::move(sequence);
+                for(const auto& gap: blockGaps) {
+                    stringIdToGaps[blockId].push_back(gap);
+                }
 
-            for(size_t k = 0; k < pangraphData["blocks"][(int)i]["mutate"][(int)j][1].size(); k++) {
-                std::string mutationString = pangraphData["blocks"][(int)i]["mutate"][(int)j][1][(int)k][1].asString();
-                std::transform(mutationString.begin(), mutationString.end(),mutationString.begin(), ::toupper);
-                substitutions[blockId][seqName][number].push_back( std::make_pair( pangraphData["blocks"][(int)i]["mutate"][(int)j][1][(int)k][0].asInt(), mutationString) );
-            }
-        }
-        for(size_t j = 0; j < pangraphData["blocks"][(int)i]["insert"].size(); j++) {
-            std::string seqName = pangraphData["blocks"][(int)i]["insert"][(int)j][0]["name"].asString();
-            size_t number = pangraphData["blocks"][(int)i]["insert"][(int)j][0]["number"].asInt();
+                auto blockIt = blockIndices.emplace(blockId, blockIds.size());
+                if(blockIt.second) {
+                    blockIds.push_back(blockId);
+                    blockMutationRanges.emplace_back(0, 0);
+                }
 
-            for(size_t k = 0; k < pangraphData["blocks"][(int)i]["insert"][(int)j][1].size(); k++) {
-                std::string mutationString = pangraphData["blocks"][(int)i]["insert"][(int)j][1][(int)k][1].asString();
-                std::transform(mutationString.begin(), mutationString.end(),mutationString.begin(), ::toupper);
-                insertions[blockId][seqName][number].push_back( std::make_tuple( pangraphData["blocks"][(int)i]["insert"][(int)j][1][(int)k][0][0].asInt(), pangraphData["blocks"][(int)i]["insert"][(int)j][1][(int)k][0][1].asInt(), mutationString ) );
-            }
-        }
-        for(size_t j = 0; j < pangraphData["blocks"][(int)i]["delete"].size(); j++) {
-            std::string seqName = pangraphData["blocks"][(int)i]["delete"][(int)j][0]["name"].asString();
-            size_t number = pangraphData["blocks"][(int)i]["delete"][(int)j][0]["number"].asInt();
+                // Group the mutations of the block by (sequence, number), keeping file order
+                // within a group
+                auto byCopy = [](const auto& a, const auto& b) {
+                    return std::make_pair(std::get<0>(a), std::get<1>(a)) < std::make_pair(std::get<0>(b), std::get<1>(b));
+                };
+                std::stable_sort(blockSubstitutions.begin(), blockSubstitutions.end(), byCopy);
+                std::stable_sort(blockInsertions.begin(), blockInsertions.end(), byCopy);
+                std::stable_sort(blockDeletions.begin(), blockDeletions.end(), byCopy);
+
+                std::map< std::pair< size_t, size_t >, MutationRange > ranges;
+                auto rangeOf = [&](size_t sequenceIndex, size_t number) -> MutationRange& {
+                    auto it = ranges.find({sequenceIndex, number});
+                    if(it == ranges.end()) {
+                        it = ranges.emplace(std::make_pair(sequenceIndex, number), MutationRange()).first;
+                        it->second.sequence = sequenceIndex;
+                        it->second.number = number;
+                    }
+                    return it->second;
+                };
+                for(size_t j = 0; j < blockSubstitutions.size(); j++) {
+                    const auto& mutation = blockSubstitutions[j];
+                    MutationRange& range = rangeOf(std::get<0>(mutation), std::get<1>(mutation));
+                    if(range.substitutionBegin == range.substitutionEnd) {
+                        range.substitutionBegin = substitutions.size();
+                    }
+                    substitutions.emplace_back(std::get<2>(mutation), ::toupper(std::get<3>(mutation)[0]));
+                    range.substitutionEnd = substitutions.size();
+                }
+                for(size_t j = 0; j < blockInsertions.size(); j++) {
+                    const auto& mutation = blockInsertions[j];
+                    MutationRange& range = rangeOf(std::get<0>(mutation), std::get<1>(mutation));
+                    if(range.insertionBegin == range.insertionEnd) {
+                        range.insertionBegin = insertions.size();
+                    }
+                    const std::string& nucs = std::get<4>(mutation);
+                    insertions.push_back({(uint32_t)std::get<2>(mutation), (uint32_t)std::get<3>(mutation),
+                                          insertedNucleotides.size(), (uint32_t)nucs.length()});
+                    for(char c: nucs) {
+                        insertedNucleotides += ::toupper(c);
+                    }
+                    range.insertionEnd = insertions.size();
+                }
+                for(size_t j = 0; j < blockDeletions.size(); j++) {
+                    const auto& mutation = blockDeletions[j];
+                    MutationRange& range = rangeOf(std::get<0>(mutation), std::get<1>(mutation));
+                    if(range.deletionBegin == range.deletionEnd) {
+                        range.deletionBegin = deletions.size();
+                    }
+                    deletions.emplace_back(std::get<2>(mutation), std::get<3>(mutation));
+                    range.deletionEnd = deletions.size();
+                }
 
-            for(size_t k = 0; k < pangraphData["blocks"][(int)i]["delete"][(int)j][1].size(); k++) {
-                deletions[blockId][seqName][number].push_back( std::make_pair( pangraphData["blocks"][(int)i]["delete"][(int)j][1][(int)k][0].asInt(), pangraphData["blocks"][(int)i]["delete"][(int)j][1][(int)k][1].asInt() ) );
+                auto& blockRange = blockMutationRanges[blockIt.first->second];
+                blockRange.first = mutationRanges.size();
+                for(const auto& range: ranges) {
+                    mutationRanges.push_back(range.second);
+                }
+                blockRange.second = mutationRanges.size();
             }
+        } else {
+            reader.skipValue();
         }
-
     }
 
     // Rotation
-    // Testing data structure
-    std::unordered_map<std::string, std::vector<string>> test;
     if (circular) {
 
-        std::vector<std::string> sample_base = {};
-        int seq_count = 0;
-        std::string sample_base_string;
+        std::vector< const std::string* > names;
+        std::vector< std::vector< std::string >* > samplePaths;
+        std::vector< std::vector< int >* > sampleStrands;
+        std::vector< std::vector< size_t >* > sampleNumbers;
+        for(auto& p: paths) {
+            names.push_back(&p.first);
+            samplePaths.push_back(&p.second);
+            sampleStrands.push_back(&strandPaths[p.first]);
+            sampleNumbers.push_back(&blockNumbers[p.first]);
+        }
+
+        // Intern block names so that the alignment compares integers
+        std::unordered_map< std::string, int32_t > blockIdMap;
+        std::vector< std::vector< int32_t > > internedPaths(samplePaths.size());
+        for(size_t i = 0; i < samplePaths.size(); i++) {
+            internedPaths[i].reserve(samplePaths[i]->size());
+            for(const auto& block: *samplePaths[i]) {
+                auto it = blockIdMap.emplace(block, (int32_t)blockIdMap.size()).first;
+                internedPaths[i].push_back(it->second);
+            }
+        }
 
-        std::vector<std::string> sample_new = {};
-        for(const auto& p: paths) {
-            // std::cout << p.first << "\n";
+        std::vector< int > rotations(samplePaths.size(), 0);
+        std::vector< char > inverted(samplePaths.size(), false);
 
-            test[p.first] = p.second;
-            if (seq_count == 0) {
-                std::unordered_map< std::string, size_t > baseBlockNumber;
-                sequenceInverted[p.first] = false;
-                rotationIndexes[p.first] = 0;
+        // The first sequence is the base every other sequence is rotated against
+        tbb::parallel_for((size_t)0, samplePaths.size(), [&](size_t i) {
+            // Assigning block numbers
+            std::unordered_map< std::string, size_t > baseBlockNumber;
+            for(const auto& block: *samplePaths[i]) {
+                sampleNumbers[i]->push_back(baseBlockNumber[block]+1);
+                baseBlockNumber[block]++;
+            }
+            if (i == 0 || samplePaths[i]->empty()) {
+                return;
+            }
 
-                for(const auto& block: p.second) {
-                    blockNumbers[p.first].push_back(baseBlockNumber[block]+1);
-                    baseBlockNumber[block]++;
-                    sample_base.push_back(block);
-                }
-            } else {
-                // Assigning block numbers
-                std::unordered_map< std::string, size_t > baseBlockNumber;
-                for(const auto& block: p.second) {
-                    blockNumbers[p.first].push_back(baseBlockNumber[block]+1);
-                    baseBlockNumber[block]++;
-                }
-
-                std::vector<std::string> sample_dumy = {};
-                sample_new.clear();
-                for(const auto& block: p.second) {
-                    // std::cout << block << ",";
-                    sample_dumy.push_back(block);
-                }
-                int rotation_index;
-                bool invert = false;
-                sample_new= rotate_sample(sample_base, sample_dumy, strandPaths[p.first], blockNumbers[p.first], blockSizeMap, rotation_index, invert);
-
-                // std::cout << p.first << "\n";
-                // std::vector<string> temp1({"a","b","c","d","e","f"});
-                // std::vector<string> temp2({"a","b","c","d","g","h"});
-                // std::vector<int> temp3({1,1,1,1,1,1});
-                // int temp4;
-                // bool temp5;
-                // temp2 = rotate_sample(temp1, temp2, temp3, blockSizeMap, temp4, temp5);
-                // std::cout << "ROTATED" << std::endl;
-                // for(auto u: temp2) {
-                //     std::cout << u << " ";
-                // }
-                // std::cout << std::endl;
-
-                // // Testing
-                // for (auto i = 0; i < sample_dumy.size(); i++)
-                // {
-                //     if (sample_dumy[(i+rotation_index)%sample_dumy.size()] != sample_new[i])
-                //     {
-                //         std::cout << "Error\n";
-                //         // break;
-                //     }
-                // }
-
-                sequenceInverted[p.first] = invert;
-                rotationIndexes[p.first] = rotation_index;
-
-                paths[p.first] = sample_new;
-            }
-            seq_count++;
+            int rotation_index;
+            bool invert = false;
+            *samplePaths[i] = rotate_sample(internedPaths[0], internedPaths[i], *samplePaths[i], *sampleStrands[i], *sampleNumbers[i], rotation_index, invert);
+            rotations[i] = rotation_index;
+            inverted[i] = invert;
+        });
+
+        for(size_t i = 0; i < names.size(); i++) {
+            sequenceInverted[*names[i]] = inverted[i];
+            rotationIndexes[*names[i]] = rotations[i];
         }
 
         std::cout << "All Seqeunces Rotated\n";
@@ -6424,6 +7135,23 @@ panmanUtils::Pangraph::Pangraph(Json::Value& pangraphData, panmanUtils::Node* ro
 
 }
 
+const panmanUtils::Pangraph::MutationRange* panmanUtils::Pangraph::getMutations(uint32_t blockIndex,
+        uint32_t sequenceIndex, size_t number) const {
+    if(blockIndex >= blockMutationRanges.size()) {
+        return nullptr;
+    }
+    auto first = mutationRanges.begin() + blockMutationRanges[blockIndex].first;
+    auto last = mutationRanges.begin() + blockMutationRanges[blockIndex].second;
+    auto it = std::lower_bound(first, last, std::make_pair(sequenceIndex, number),
+        [](const MutationRange& range, const std::pair< uint32_t, size_t >& key) {
+            return std::make_pair(range.sequence, (size_t)range.number) < key;
+        });
+    if(it == last || it->sequence != sequenceIndex || it->number != number) {
+        return nullptr;
+    }
+    return &*it;
+}
+
 std::unordered_map< std::string,std::vector< int > > panmanUtils::Pangraph::getAlignedStrandSequences(const std::vector< size_t >& topoArray) {
     std::unordered_map< std::string, std::vector< int > > alignedStrandSequences;
     for(auto p: intSequences) {
@@ -497,7 +497,7 @@ struct BlockMut {
     // Make this mutation into an insertion, keeping the same block IDs
     void convertToInsertion(bool inversion) {
         blockMutInfo = true;
-        inversion = inversion;
+        this->inversion = inversion;
     }
 
     // Make this mutation into a deletion, keeping the same block IDs
@@ -630,6 +630,54 @@ struct MutationList {
 
 };
 
+// Counters collected in a single traversal of a tree for its summary
+struct SummaryStatistics {
+    size_t totalNodes = 0;
+    size_t totalLeaves = 0;
+
+    // Substitutions are counted by length, the other nucleotide mutations by number
+    int64_t substitutions = 0;
+    int64_t insertions = 0;
+    int64_t deletions = 0;
+    int64_t snpSubstitutions = 0;
+    int64_t snpInsertions = 0;
+    int64_t snpDeletions = 0;
+
+    int64_t blockInsertions = 0;
+    int64_t blockDeletions = 0;
+    int64_t blockInversions = 0;
+    // Inversions of inserted blocks are counted in the total inversions too
+    int64_t inversions = 0;
+    int64_t blockDuplications = 0;
+    int64_t blockTranslocations = 0;
+
+    // Depth of leaves in number of branches from the root
+    size_t maxDepth = 0;
+    double meanDepth = 0;
+
+    // Number of nodes by the number of mutated nucleotides and block mutations on their branch
+    std::map< size_t, size_t > nucMutationHistogram;
+    std::map< size_t, size_t > blockMutationHistogram;
+};
+
+// Split of a tree into subtrees small enough to balance across threads. Traversals process the
+// nodes above the subtrees serially and the subtrees in parallel
+struct TreePartition {
+    // Nodes above the subtrees and roots of the subtrees, in preorder. The flag is set for roots
+    // of subtrees
+    std::vector< std::pair< Node*, bool > > preorder;
+    // Nodes above the subtrees, in preorder
+    std::vector< Node* > upperNodes;
+    // Roots of the subtrees, in preorder
+    std::vector< Node* > subtreeRoots;
+};
+
+// Number of nodes in the subtree of every node
+void computeSubtreeSizes(Node* root, std::unordered_map< Node*, size_t >& subtreeSize);
+
+// Split the tree under root given the subtree sizes from computeSubtreeSizes
+TreePartition partitionTree(Node* root, const std::unordered_map< Node*, size_t >& subtreeSize);
+
 // Data structure to represent a PangenomeMAT
 class Tree {
   private:
@@ -644,12 +692,6 @@ class Tree {
     void assignMutationsToNodes(Node* root, size_t& currentIndex,
                                 std::vector< panmanOld::node >& nodes);
 
-    // Get the total number of mutations of given type
-    int getTotalParsimonyParallel(NucMutationType nucMutType,
-                                  BlockMutationType blockMutType = NONE);
-    
-    void getBlockMutationsParallel();
-
     // Run tree traversal to extract mutations in range
     panmanUtils::Node* extractPanMATSegmentHelper(panmanUtils::Node* node,
             const std::tuple< int, int, int, int >& start,
@@ -707,11 +749,6 @@ class Tree {
     bool debugSimilarity(const std::vector< NucMut > array1,
                          const std::vector< NucMut > array2);
 
-    // Compress extracted subtree by combining parent and child nodes where parent has only
-    // one child
-    // void compressTreeParallel(Node* node, size_t level);
-    void compressTreeParallel(Node* node, size_t level, const std::set< std::string >& nodeIdsToDefinitelyInclude);
-
     // Used in rerooting
     void dfsExpansion(Node* node, std::vector< Node* >& vec);
     Node* transformHelper(Node* node);
@@ -777,16 +814,16 @@ class Tree {
     // Returns a pair of (new parent, new mutations) for a parsimony improvement
     const std::pair< Node*, MutationList > findInsertionImputationMove(
         Node* node, const std::vector<IndelPosition>& mutsToN, int allowedDistance,
-        const std::unordered_map< std::string, std::unordered_map< IndelPosition, int32_t > >& insertions,
+        const std::unordered_map< IndelPosition, std::vector< std::pair< Node*, int32_t > > >& insertionIndex,
         const std::unordered_map< std::string, std::unordered_map< Coordinate, int8_t > >& originalNucs,
         const std::unordered_map< std::string, std::unordered_map< uint64_t, bool > >& wasBlockInv);
-    // Find insertions the size/position of "mutToN" within "allowedDistance" branch length from "node"
+    // Find insertions the size/position of "mutToN" within "allowedDistance" branch length from the parent of "node"
     // Uses "originalNucs" and "wasBlockInv" maps to help invert mutations when necessary
-    // Don't search down the edge to "ignore"
-    // Relies on a precomputed map of nodes to insertion positions                   
+    // Doesn't search down the edge to "node"
+    // Candidates are looked up in "insertionIndex", an inverted index of {insertion position : [(node, number of Ns)]}
     const std::vector<std::pair< Node*, MutationList >> findNearbyInsertions(
-        Node* node, const std::vector<IndelPosition>& mutsToN, int allowedDistance, Node* ignore,
-        const std::unordered_map< std::string, std::unordered_map< IndelPosition, int32_t > >& insertions,
+        Node* node, const std::vector<IndelPosition>& mutsToN, int allowedDistance,
+        const std::unordered_map< IndelPosition, std::vector< std::pair< Node*, int32_t > > >& insertionIndex,
         const std::unordered_map< std::string, std::unordered_map< Coordinate, int8_t > >& originalNucs,
         const std::unordered_map< std::string, std::unordered_map< uint64_t, bool > >& wasBlockInv);
 
@@ -879,17 +916,6 @@ class Tree {
                                       std::unordered_map< std::string, int >& states, std::unordered_map< std::string,
                                       std::pair< panmanUtils::NucMutationType, char > >& mutations, int parentState);
 
-    // Fitch algorithm on Block Mutations
-    int blockFitchForwardPassNew(Node* node,
-                                 std::unordered_map< std::string, int >& states);
-    void blockFitchBackwardPassNew(Node* node,
-                                   std::unordered_map< std::string, int >& states, int parentState,
-                                   int defaultValue = (1<<28));
-    void blockFitchAssignMutationsNew(Node* node,
-                                      std::unordered_map< std::string, int >& states,
-                                      std::unordered_map< std::string,
-                                      std::pair< panmanUtils::BlockMutationType, bool > >& mutations, int parentState);
-
     // Sankoff algorithm on Block Mutations
     std::vector< int > blockSankoffForwardPass(Node* node, std::unordered_map< std::string,
             std::vector< int > >& stateSets);
@@ -901,8 +927,9 @@ class Tree {
                                      std::unordered_map< std::string, int >& states, std::unordered_map< std::string,
                                      std::pair< panmanUtils::BlockMutationType, bool > >& mutations, int parentState);
 
-    // void printSummary();
-    void printSummary(std::ostream &out);
+    // Collect all summary counters in a single traversal of the tree
+    SummaryStatistics getSummaryStatistics();
+    void printSummary(std::ostream &out, bool json = false);
     void printBfs(Node* node = nullptr);
     void printFASTA(std::ostream& fout, bool aligned = false, bool rootSeq = false, const std::tuple<int, int, int, int> &start={-1,-1,-1,-1}, const std::tuple<int, int, int, int> &end={-1,-1,-1,-1}, bool allIndex = false);
     void printFASTANew(std::ostream& fout, bool aligned = false, bool rootSeq = false, const std::tuple<int, int, int, int> &start={-1,-1,-1,-1}, const std::tuple<int, int, int, int> &end={-1,-1,-1,-1}, bool allIndex = false);
@@ -918,6 +945,9 @@ class Tree {
     void printVCFParallel(std::string reference, std::ostream& fout);
     void printVCFParallel(panmanUtils::Node* node, std::ostream& fout);
     void extractAminoAcidTranslations(std::ostream& fout, int64_t start, int64_t end);
+    // Translate all the coding regions listed in a BED or GFF file in a single traversal. The
+    // coordinates are with respect to the root sequence
+    void extractAminoAcidTranslations(std::ostream& fout, std::ifstream& fin);
 
     // Extract PanMAT representing a segment of the genome. The start and end coordinates
     // are with respect to the root sequence. The strands of the terminal blocks in all
@@ -930,6 +960,18 @@ class Tree {
     // Node* subtreeExtractParallel(std::vector< std::string > nodeIds);
     void writeToFile(kj::std::StdOutputStream& fout, Node* node = nullptr);
     std::string getNewickString(Node* node);
+    // Fill sequence with the consensus of every block, with all blocks absent. Used as the
+    // starting state of depth first traversals that apply mutations node by node
+    void getConsensusSequence(sequence_t& sequence, blockExists_t& blockExists,
+                              blockStrand_t& blockStrand);
+    // Apply the block and nucleotide mutations of a node to the current sequence state and
+    // record what is needed to undo them once the node's subtree has been processed
+    void applyMutations(Node* node, sequence_t& sequence, blockExists_t& blockExists,
+                        blockStrand_t& blockStrand, blockMutationInfo_t& blockMutationInfo,
+                        mutationInfo_t& mutationInfo);
+    void undoMutations(sequence_t& sequence, blockExists_t& blockExists,
+                       blockStrand_t& blockStrand, const blockMutationInfo_t& blockMutationInfo,
+                       const mutationInfo_t& mutationInfo);
     std::string getStringFromReference(std::string reference, bool aligned = true,
                                        bool incorporateInversions=true);
     const void getSequenceFromReference(sequence_t& sequence, blockExists_t& blockExists,
@@ -962,13 +1004,14 @@ class Tree {
         const blockExists_t& blockExists,
         const blockStrand_t& blockStrand, int64_t circularOffset = 0);
 
-    std::string getSequenceFromVCF(std::string sequenceId, std::ifstream& fin);
+    std::string getSequenceFromVCF(std::string sequenceId, std::istream& fin);
     bool verifyVCFFile(std::ifstream& fin);
     void vcfToFASTA(std::ifstream& fin, std::ofstream& fout);
     void annotate(std::ifstream& fin);
     std::vector< std::string > searchByAnnotation(std::string annotation);
-    void convertToGFA(std::ostream& fout);
-    void convertToGFAEfficient(std::ostream& fout);
+    // Write a GFA whose segments are block regions between mutation breakpoints, collected in
+    // a single traversal of the tree. Identical stretches across sequences share one segment
+    void convertToGFABlockAware(std::ostream& fout);
     void printFASTAFromGFA(std::ifstream& fin, std::ofstream& fout);
     void getNodesPreorder(panmanUtils::Node* root, capnp::List<panman::Node>::Builder& nodesBuilder, size_t& nodeIndex);
     size_t getGlobalCoordinate(int primaryBlockId, int secondaryBlockId, int nucPosition,
@@ -978,6 +1021,10 @@ class Tree {
     void transform(Node* node);
     void reroot(std::string sequenceName);
 
+    // Place the aligned sequences of a FASTA file (in the coordinate system of the PanMAT) one
+    // by one at the node that needs the fewest mutations to reach them
+    void placeSamples(std::ifstream& fin);
+
     
 
 };
@@ -279,326 +279,223 @@ std::vector<int8_t> get_nuc_vec_from_id (int8_t nuc_id) {
     return get_nuc_vec(get_nuc(nuc_id));
 }
 
-void getNodeDFS(Parsimony::data &data, panmanUtils::Node* node, 
-    std::vector<std::vector<std::pair<int, std::vector<int>>>> &globalCoords_t, 
-    std::vector<std::vector<std::pair<char, std::vector<char>>>> &pseudoRoot, 
-    std::vector<std::vector<std::pair<char, std::vector<char>>>> &sequence,
-    std::vector< bool >  &blockExists,
-    std::vector< bool >  &blockStrand){
-    // write nuc mutations 
-    auto mutation_list = data.add_node_mutations();
-
-    std::vector< std::tuple< int32_t, bool, bool, bool, bool > > blockMutationInfo;
-
-    // Block Mutations
-    for(auto mutation: node->blockMutation) {
-        int32_t primaryBlockId = mutation.primaryBlockId;
-        bool type = mutation.blockMutInfo;
-        bool inversion = mutation.inversion;
-        if(type == 1) {
-            // insertion
-            bool oldStrand;
-            bool oldMut;
-            oldStrand = blockStrand[primaryBlockId];
-            oldMut = blockExists[primaryBlockId];
-            blockExists[primaryBlockId] = true;
-            // if insertion of inverted block takes place, the strand is backwards
-            blockStrand[primaryBlockId] = !inversion;
-            blockMutationInfo.push_back( std::make_tuple(mutation.primaryBlockId, oldMut, oldStrand, true, !inversion) );
-        } else {
-            bool oldMut;
-            bool oldStrand;
-            if(inversion) {
-                // This means that this is not a deletion, but instead an inversion
-                oldStrand = blockStrand[primaryBlockId];
-                oldMut = blockExists[primaryBlockId];
-                blockStrand[primaryBlockId] = !oldStrand;
-                
-                if(oldMut != true) {
-                    // std::cout << "There was a problem in PanMAT generation. Please Report." << std::endl;
-                }
-                blockMutationInfo.push_back( std::make_tuple(mutation.primaryBlockId, oldMut, oldStrand, oldMut, !oldStrand) );
-            } else {
-                // Actually a deletion
-                oldStrand = blockStrand[primaryBlockId];
-                oldMut = blockExists[primaryBlockId];
-                blockExists[primaryBlockId] = false;
-
-                // resetting strand to true during deletion
-                blockStrand[primaryBlockId] = true;
-            }
-            blockMutationInfo.push_back( std::make_tuple(mutation.primaryBlockId, oldMut, oldStrand, false, true) );
-
-        }   
+// Sequence of the node being visited, starting from the pseudo-root. Changes are logged so
+// that a worker can return to the pseudo-root after processing a subtree
+struct UsherMutationState {
+    std::vector<std::vector<std::pair<char, std::vector<char>>>> sequence;
+    // primaryBlockId, nucPosition, nucGapPosition, oldVal
+    std::vector< std::tuple< int32_t, int, int, char > > mutationInfo;
+
+    UsherMutationState(const std::vector<std::vector<std::pair<char, std::vector<char>>>> &pseudoRoot): sequence(pseudoRoot) {}
+
+    char* nucleotide(int32_t primaryBlockId, int nucPosition, int nucGapPosition) {
+        if (primaryBlockId < 0 || (size_t)primaryBlockId >= sequence.size() || nucPosition < 0
+            || (size_t)nucPosition >= sequence[primaryBlockId].size()) {
+            return nullptr;
+        }
+        auto &position = sequence[primaryBlockId][nucPosition];
+        if (nucGapPosition == -1) {
+            return &position.first;
+        }
+        if (nucGapPosition < 0 || (size_t)nucGapPosition >= position.second.size()) {
+            return nullptr;
+        }
+        return &position.second[nucGapPosition];
     }
 
-    // For backtracking. primaryBlockId, secondaryBlockId, pos, gapPos, (oldVal, newVal) in substitution, ('-', newVal) in insertion, (oldVal, '-') in deletion
-    std::vector< std::tuple< int32_t, int, int, char, char > > mutationInfo;
-
-    for (int i=0; i<node->nucMutation.size(); i++) {
-        int32_t primaryBlockId = node->nucMutation[i].primaryBlockId;
-        int32_t secondaryBlockId = node->nucMutation[i].secondaryBlockId;
-        int32_t nucPosition = node->nucMutation[i].nucPosition;
-        int32_t nucGapPosition = node->nucMutation[i].nucGapPosition;
-        uint32_t type = node->nucMutation[i].type();
-        char newVal = '-';
-
-        if(type < 3) {
-            // Either S, I or D
-            int len = node->nucMutation[i].length();
-
-            if(primaryBlockId >= sequence.size()) {
-                std::cout << primaryBlockId << " " << sequence.size() << std::endl;
+    // Apply the nucleotide mutations of a node. If mutation_list is given, the mutations are
+    // also written to it in UShER coordinates
+    void apply(panmanUtils::Node* node, Parsimony::mutation_list* mutation_list,
+        const std::vector<std::vector<std::pair<int, std::vector<int>>>> &globalCoords_t,
+        const std::vector<std::vector<std::pair<char, std::vector<char>>>> &pseudoRoot) {
+        for (const auto &mutation: node->nucMutation) {
+            int32_t primaryBlockId = mutation.primaryBlockId;
+            int32_t nucPosition = mutation.nucPosition;
+            int32_t nucGapPosition = mutation.nucGapPosition;
+            uint32_t type = mutation.type();
+            if (type > panmanUtils::NucMutationType::NSNPD) {
+                continue;
             }
-
-            if(type == panmanUtils::NucMutationType::NS) {
-                // Substitution
-                if(nucGapPosition != -1) {
-                    for(int j = 0; j < len; j++) {
-                        auto mut = mutation_list->add_mutation();
-                        char oldVal = sequence[primaryBlockId][nucPosition].second[nucGapPosition+j];
-                        newVal = panmanUtils::getNucleotideFromCode(node->nucMutation[i].getNucCode(j));
-                        sequence[primaryBlockId][nucPosition].second[nucGapPosition+j] = newVal;
-                        mutationInfo.push_back(std::make_tuple(primaryBlockId, nucPosition, nucGapPosition+j, oldVal, newVal));
-                        
-                        mut->set_position(globalCoords_t[primaryBlockId][nucPosition].second[nucGapPosition+j]);
-                        mut->set_par_nuc(panmanUtils::getCodeFromNucleotide(oldVal));
-                        mut->set_ref_nuc(panmanUtils::getCodeFromNucleotide(pseudoRoot[primaryBlockId][nucPosition].second[nucGapPosition+j]));
-                        for (auto nuc: get_nuc_vec_from_id(panmanUtils::getCodeFromNucleotide(newVal))) {
-                            mut->add_mut_nuc(nuc);
-                        }
-                    }
-                } else {
-                    for(int j = 0; j < len; j++) {
-                        auto mut = mutation_list->add_mutation();
-                        char oldVal = sequence[primaryBlockId][nucPosition+j].first;
-                        newVal = panmanUtils::getNucleotideFromCode(node->nucMutation[i].getNucCode(j));
-                        sequence[primaryBlockId][nucPosition+j].first = newVal;
-                        mutationInfo.push_back(std::make_tuple(primaryBlockId, nucPosition + j, nucGapPosition, oldVal, newVal));
-                        
-                        mut->set_position(globalCoords_t[primaryBlockId][nucPosition+j].first);
-                        mut->set_par_nuc(panmanUtils::getCodeFromNucleotide(oldVal));
-                        mut->set_ref_nuc(panmanUtils::getCodeFromNucleotide(pseudoRoot[primaryBlockId][nucPosition+j].first));
-                        for (auto nuc: get_nuc_vec_from_id(panmanUtils::getCodeFromNucleotide(newVal))) {
-                            mut->add_mut_nuc(nuc);
-                        }
-                    }
+            bool deletion = (type == panmanUtils::NucMutationType::ND || type == panmanUtils::NucMutationType::NSNPD);
+            int len = (type < 3) ? mutation.length() : 1;
+
+            for (int j = 0; j < len; j++) {
+                int pos = (nucGapPosition == -1) ? nucPosition + j : nucPosition;
+                int gapPos = (nucGapPosition == -1) ? -1 : nucGapPosition + j;
+                char* current = nucleotide(primaryBlockId, pos, gapPos);
+                if (current == nullptr) {
+                    continue;
                 }
-            } else if(type == panmanUtils::NucMutationType::NI) {
-                // Insertion
-                if(nucGapPosition != -1) {
-                    for(int j = 0; j < len; j++) {
-                        auto mut = mutation_list->add_mutation();
-                        char oldVal = sequence[primaryBlockId][nucPosition].second[nucGapPosition+j];
-                        newVal = panmanUtils::getNucleotideFromCode(node->nucMutation[i].getNucCode(j));
-                        sequence[primaryBlockId][nucPosition].second[nucGapPosition+j] = newVal;
-                        mutationInfo.push_back(std::make_tuple(primaryBlockId, nucPosition, nucGapPosition+j, oldVal, newVal));
-                        
-                        mut->set_position(globalCoords_t[primaryBlockId][nucPosition].second[nucGapPosition+j]);
-                        mut->set_par_nuc(panmanUtils::getCodeFromNucleotide(oldVal));
-                        mut->set_ref_nuc(panmanUtils::getCodeFromNucleotide(pseudoRoot[primaryBlockId][nucPosition].second[nucGapPosition+j]));
-                        for (auto nuc: get_nuc_vec_from_id(panmanUtils::getCodeFromNucleotide(newVal))) {
-                            mut->add_mut_nuc(nuc);
-                        }
-                    }
-                } else {
-                    for(int j = 0; j < len; j++) {
-                        auto mut = mutation_list->add_mutation();
-                        char oldVal = sequence[primaryBlockId][nucPosition+j].first;
-                        newVal = panmanUtils::getNucleotideFromCode(node->nucMutation[i].getNucCode(j));
-                        sequence[primaryBlockId][nucPosition+j].first = newVal;
-                        mutationInfo.push_back(std::make_tuple(primaryBlockId, nucPosition + j, nucGapPosition, oldVal, newVal));
-                        
-                        mut->set_position(globalCoords_t[primaryBlockId][nucPosition+j].first);
-                        mut->set_par_nuc(panmanUtils::getCodeFromNucleotide(oldVal));
-                        mut->set_ref_nuc(panmanUtils::getCodeFromNucleotide(pseudoRoot[primaryBlockId][nucPosition+j].first));
-                        for (auto nuc: get_nuc_vec_from_id(panmanUtils::getCodeFromNucleotide(newVal))) {
-                            mut->add_mut_nuc(nuc);
-                        }
-                    }
-                }
-            } else if(type == panmanUtils::NucMutationType::ND) {
-                // Deletion
-                if(nucGapPosition != -1) {
-                    for(int j = 0; j < len; j++) {
-                        auto mut = mutation_list->add_mutation();
-                        char oldVal = sequence[primaryBlockId][nucPosition].second[nucGapPosition+j];
-                        sequence[primaryBlockId][nucPosition].second[nucGapPosition+j] = '-';
-                        mutationInfo.push_back(std::make_tuple(primaryBlockId, nucPosition, nucGapPosition+j, oldVal, '-'));
-                        
-                        mut->set_position(globalCoords_t[primaryBlockId][nucPosition].second[nucGapPosition+j]);
-                        mut->set_par_nuc(panmanUtils::getCodeFromNucleotide(oldVal));
-                        mut->set_ref_nuc(panmanUtils::getCodeFromNucleotide(pseudoRoot[primaryBlockId][nucPosition].second[nucGapPosition+j]));
-                        for (auto nuc: get_nuc_vec_from_id(panmanUtils::getCodeFromNucleotide(newVal))) {
-                            mut->add_mut_nuc(nuc);
-                        }
-                    }
-                } else {
-                    for(int j = 0; j < len; j++) {
-                        auto mut = mutation_list->add_mutation();
-                        char oldVal = sequence[primaryBlockId][nucPosition+j].first;
-                        sequence[primaryBlockId][nucPosition+j].first = '-';
-                        mutationInfo.push_back(std::make_tuple(primaryBlockId, nucPosition + j, nucGapPosition, oldVal, '-'));
-                        
-                        mut->set_position(globalCoords_t[primaryBlockId][nucPosition+j].first);
-                        mut->set_par_nuc(panmanUtils::getCodeFromNucleotide(oldVal));
-                        mut->set_ref_nuc(panmanUtils::getCodeFromNucleotide(pseudoRoot[primaryBlockId][nucPosition+j].first));
-                        for (auto nuc: get_nuc_vec_from_id(panmanUtils::getCodeFromNucleotide(newVal))) {
-                            mut->add_mut_nuc(nuc);
-                        }
-                    }
-                }
-            }
-        } else {
-            if(type == panmanUtils::NucMutationType::NSNPS) {
-                // SNP Substitution
-                newVal = panmanUtils::getNucleotideFromCode(node->nucMutation[i].getFirstNucCode());
-                if(nucGapPosition != -1) {
-                    auto mut = mutation_list->add_mutation();
-                    char oldVal = sequence[primaryBlockId][nucPosition].second[nucGapPosition];
-                    sequence[primaryBlockId][nucPosition].second[nucGapPosition] = newVal;
-                    mutationInfo.push_back(std::make_tuple(primaryBlockId, nucPosition, nucGapPosition, oldVal, newVal));
-                    
-                    mut->set_position(globalCoords_t[primaryBlockId][nucPosition].second[nucGapPosition]);
-                    mut->set_par_nuc(panmanUtils::getCodeFromNucleotide(oldVal));
-                    mut->set_ref_nuc(panmanUtils::getCodeFromNucleotide(pseudoRoot[primaryBlockId][nucPosition].second[nucGapPosition]));
-                    for (auto nuc: get_nuc_vec_from_id(panmanUtils::getCodeFromNucleotide(newVal))) {
-                        mut->add_mut_nuc(nuc);
-                    }
-                } else {
-                    auto mut = mutation_list->add_mutation();
-                    char oldVal = sequence[primaryBlockId][nucPosition].first;
-                    sequence[primaryBlockId][nucPosition].first = newVal;
-                    mutationInfo.push_back(std::make_tuple(primaryBlockId, nucPosition, nucGapPosition, oldVal, newVal));
-                    
-                    mut->set_position(globalCoords_t[primaryBlockId][nucPosition].first);
-                    mut->set_par_nuc(panmanUtils::getCodeFromNucleotide(oldVal));
-                    mut->set_ref_nuc(panmanUtils::getCodeFromNucleotide(pseudoRoot[primaryBlockId][nucPosition].first));
-                    for (auto nuc: get_nuc_vec_from_id(panmanUtils::getCodeFromNucleotide(newVal))) {
-                        mut->add_mut_nuc(nuc);
-                    }
+                char oldVal = *current;
+                char newVal = deletion ? '-' : panmanUtils::getNucleotideFromCode(mutation.getNucCode(j));
+                *current = newVal;
+                mutationInfo.push_back(std::make_tuple(primaryBlockId, pos, gapPos, oldVal));
+
+                if (mutation_list == nullptr) {
+                    continue;
                 }
-            } else if(type == panmanUtils::NucMutationType::NSNPI) {
-                // SNP Insertion
-                newVal = panmanUtils::getNucleotideFromCode(node->nucMutation[i].getFirstNucCode());
-                if(nucGapPosition != -1) {
-                    auto mut = mutation_list->add_mutation();
-                    char oldVal = sequence[primaryBlockId][nucPosition].second[nucGapPosition];
-                    sequence[primaryBlockId][nucPosition].second[nucGapPosition] = newVal;
-                    mutationInfo.push_back(std::make_tuple(primaryBlockId, nucPosition, nucGapPosition, oldVal, newVal));
-                    
-                    mut->set_position(globalCoords_t[primaryBlockId][nucPosition].second[nucGapPosition]);
-                    mut->set_par_nuc(panmanUtils::getCodeFromNucleotide(oldVal));
-                    mut->set_ref_nuc(panmanUtils::getCodeFromNucleotide(pseudoRoot[primaryBlockId][nucPosition].second[nucGapPosition]));
-                    for (auto nuc: get_nuc_vec_from_id(panmanUtils::getCodeFromNucleotide(newVal))) {
-                        mut->add_mut_nuc(nuc);
-                    }
+                auto mut = mutation_list->add_mutation();
+                if (gapPos == -1) {
+                    mut->set_position(globalCoords_t[primaryBlockId][pos].first);
+                    mut->set_ref_nuc(panmanUtils::getCodeFromNucleotide(pseudoRoot[primaryBlockId][pos].first));
                 } else {
-                    auto mut = mutation_list->add_mutation();
-                    char oldVal = sequence[primaryBlockId][nucPosition].first;
-                    sequence[primaryBlockId][nucPosition].first = newVal;
-                    mutationInfo.push_back(std::make_tuple(primaryBlockId, nucPosition, nucGapPosition, oldVal, newVal));
-                    
-                    mut->set_position(globalCoords_t[primaryBlockId][nucPosition].first);
-                    mut->set_par_nuc(panmanUtils::getCodeFromNucleotide(oldVal));
-                    mut->set_ref_nuc(panmanUtils::getCodeFromNucleotide(pseudoRoot[primaryBlockId][nucPosition].first));
-                    for (auto nuc: get_nuc_vec_from_id(panmanUtils::getCodeFromNucleotide(newVal))) {
-                        mut->add_mut_nuc(nuc);
-                    }
+                    mut->set_position(globalCoords_t[primaryBlockId][pos].second[gapPos]);
+                    mut->set_ref_nuc(panmanUtils::getCodeFromNucleotide(pseudoRoot[primaryBlockId][pos].second[gapPos]));
                 }
-            } else if(type == panmanUtils::NucMutationType::NSNPD) {
-                // SNP Deletion
-                if(nucGapPosition != -1) {
-                    auto mut = mutation_list->add_mutation();
-                    char oldVal = sequence[primaryBlockId][nucPosition].second[nucGapPosition];
-                    sequence[primaryBlockId][nucPosition].second[nucGapPosition] = '-';
-                    mutationInfo.push_back(std::make_tuple(primaryBlockId, nucPosition, nucGapPosition, oldVal, '-'));
-                    
-                    mut->set_position(globalCoords_t[primaryBlockId][nucPosition].second[nucGapPosition]);
-                    mut->set_par_nuc(panmanUtils::getCodeFromNucleotide(oldVal));
-                    mut->set_ref_nuc(panmanUtils::getCodeFromNucleotide(pseudoRoot[primaryBlockId][nucPosition].second[nucGapPosition]));
-                    for (auto nuc: get_nuc_vec_from_id(panmanUtils::getCodeFromNucleotide(newVal))) {
-                        mut->add_mut_nuc(nuc);
-                    }
-                } else {
-                    auto mut = mutation_list->add_mutation();
-                    char oldVal = sequence[primaryBlockId][nucPosition].first;
-                    sequence[primaryBlockId][nucPosition].first = '-';
-                    mutationInfo.push_back(std::make_tuple(primaryBlockId, nucPosition, nucGapPosition, oldVal, '-'));
-                    
-                    mut->set_position(globalCoords_t[primaryBlockId][nucPosition].first);
-                    mut->set_par_nuc(panmanUtils::getCodeFromNucleotide(oldVal));
-                    mut->set_ref_nuc(panmanUtils::getCodeFromNucleotide(pseudoRoot[primaryBlockId][nucPosition].first));
-                    for (auto nuc: get_nuc_vec_from_id(panmanUtils::getCodeFromNucleotide(newVal))) {
-                        mut->add_mut_nuc(nuc);
-                    }
+                mut->set_par_nuc(panmanUtils::getCodeFromNucleotide(oldVal));
+                for (auto nuc: get_nuc_vec_from_id(panmanUtils::getCodeFromNucleotide(newVal))) {
+                    mut->add_mut_nuc(nuc);
                 }
             }
         }
     }
 
-    for(panmanUtils::Node* child: node->children) {
-        getNodeDFS(data, child, globalCoords_t, pseudoRoot, sequence, blockExists, blockStrand);
+    void undo(size_t mark) {
+        while (mutationInfo.size() > mark) {
+            auto &mutation = mutationInfo.back();
+            *nucleotide(std::get<0>(mutation), std::get<1>(mutation), std::get<2>(mutation)) = std::get<3>(mutation);
+            mutationInfo.pop_back();
+        }
     }
+};
 
-    // Undo block mutations when current node and its subtree have been processed
-    for(auto it = blockMutationInfo.rbegin(); it != blockMutationInfo.rend(); it++) {
-        auto mutation = *it;
-        blockExists[std::get<0>(mutation)] = std::get<1>(mutation);
-        blockStrand[std::get<0>(mutation)] = std::get<2>(mutation);
-
+// Append a varint in protobuf wire format
+void appendVarint(std::string &out, uint64_t value) {
+    while (value >= 0x80) {
+        out.push_back((char)((value & 0x7F) | 0x80));
+        value >>= 7;
     }
+    out.push_back((char)value);
+}
 
-    // Undo nuc mutations when current node and its subtree have been processed
-    for(auto it = mutationInfo.rbegin(); it != mutationInfo.rend(); it++) {
-        auto mutation = *it;
-        if(std::get<2>(mutation) != -1) {
-            sequence[std::get<0>(mutation)][std::get<1>(mutation)].second[std::get<2>(mutation)] = std::get<3>(mutation);
-        } else {
-            sequence[std::get<0>(mutation)][std::get<1>(mutation)].first = std::get<3>(mutation);
-        }
-
-    }
+// Compress a chunk into a complete gzip member. Concatenated members form a valid gzip file
+std::string gzipCompressChunk(const std::string &chunk) {
+    std::string compressed;
+    boost::iostreams::filtering_ostream out;
+    out.push(boost::iostreams::gzip_compressor());
+    out.push(boost::iostreams::back_inserter(compressed));
+    out.write(chunk.data(), chunk.size());
+    boost::iostreams::close(out);
+    return compressed;
 }
 
 void panmanUtils::panmanToUsher(panmanUtils::Tree* panmanTree, std::string refName, std::string filename,std::string refSeq) {
-    std::vector<std::vector<std::pair<int, std::vector<int>>>> globalCoords_t;
-    std::vector<std::vector<std::pair<char, std::vector<char>>>> pseudoRoot;
+    int32_t numBlocks = 0;
+    for (const auto &block: panmanTree->blocks) {
+        numBlocks = std::max(numBlocks, (int32_t)block.primaryBlockId + 1);
+    }
+    std::vector<std::vector<std::pair<int, std::vector<int>>>> globalCoords_t(numBlocks);
+    std::vector<std::vector<std::pair<char, std::vector<char>>>> pseudoRoot(numBlocks);
     
     getCoordMap(panmanTree, globalCoords_t);
     getPseudoRoot(panmanTree, pseudoRoot);
 
-    std::vector<std::vector<std::pair<char, std::vector<char>>>> sequence = pseudoRoot;
-
-    std::vector< bool >  blockExists(panmanTree->blocks.size() + 1, false, {});
-    std::vector< bool >  blockStrand(panmanTree->blocks.size() + 1, true, {});
-
     panmanUtils::Node* root = panmanTree->root;
-    
-    // Write Usher
-    Parsimony::data data;
-    data.set_newick(panmanTree->getNewickString(root));
-
-    getNodeDFS(data, root, globalCoords_t, pseudoRoot, sequence, blockExists, blockStrand);
 
     std::ofstream outfile(filename, std::ios::out | std::ios::binary);
-    boost::iostreams::filtering_streambuf< boost::iostreams::output> outbuf;
-
-    if (filename.find(".gz\0") != std::string::npos) {
-        try {
-            outbuf.push(boost::iostreams::gzip_compressor());
-            outbuf.push(outfile);
-            std::ostream outstream(&outbuf);
-            data.SerializeToOstream(&outstream);
-            boost::iostreams::close(outbuf);
-            outfile.close();
-        } catch(const boost::iostreams::gzip_error& e) {
-            std::cout << e.what() << '\n';
-        }
-    } else {
-        data.SerializeToOstream(&outfile);
-        outfile.close();
+    bool compress = (filename.find(".gz\0") != std::string::npos);
+
+    // Write Usher. The data message is streamed field by field: the newick string first,
+    // followed by the mutation list of every node in preorder
+    std::string header;
+    {
+        Parsimony::data data;
+        data.set_newick(panmanTree->getNewickString(root));
+        data.SerializeToString(&header);
     }
 
+    // The tree is processed in segments, each either a small subtree or a single node above the
+    // subtrees, in preorder
+    std::unordered_map< panmanUtils::Node*, size_t > subtreeSize;
+    panmanUtils::computeSubtreeSizes(root, subtreeSize);
+    const auto segments = panmanUtils::partitionTree(root, subtreeSize).preorder;
+
+    tbb::enumerable_thread_specific< UsherMutationState > states(pseudoRoot);
+
+    // Output bytes of a segment, and the gzip chunk that becomes ready after it is appended
+    struct UsherSegment {
+        size_t index;
+        std::string bytes;
+        std::string chunk;
+    };
+    const size_t chunkSize = (1 << 22);
+    std::string pending = header;
+    size_t index = 0;
+
+    // At most numTokens segments are in flight and they leave the pipeline in order, so segment i
+    // can reuse the slot of segment i - numTokens
+    const size_t numTokens = 2 * tbb::this_task_arena::max_concurrency();
+    std::vector< UsherSegment > pool(numTokens);
+
+    try {
+        tbb::parallel_pipeline(numTokens,
+            tbb::make_filter< void, UsherSegment* >(tbb::filter::serial_in_order, [&](tbb::flow_control& fc) -> UsherSegment* {
+                if (index == segments.size()) {
+                    fc.stop();
+                    return nullptr;
+                }
+                UsherSegment* segment = &pool[index % numTokens];
+                segment->index = index++;
+                segment->bytes.clear();
+                segment->chunk.clear();
+                return segment;
+            }) &
+            tbb::make_filter< UsherSegment*, UsherSegment* >(tbb::filter::parallel, [&](UsherSegment* segment) {
+                UsherMutationState &state = states.local();
+                panmanUtils::Node* start = segments[segment->index].first;
+
+                std::vector< panmanUtils::Node* > path;
+                for (panmanUtils::Node* node = start->parent; node != nullptr; node = node->parent) {
+                    path.push_back(node);
+                }
+                for (auto it = path.rbegin(); it != path.rend(); it++) {
+                    state.apply(*it, nullptr, globalCoords_t, pseudoRoot);
+                }
+
+                Parsimony::mutation_list mutation_list;
+                std::string message;
+                std::function< void(panmanUtils::Node*, bool) > search = [&](panmanUtils::Node* node, bool recurse) {
+                    size_t mark = state.mutationInfo.size();
+                    state.apply(node, &mutation_list, globalCoords_t, pseudoRoot);
+                    // Field 2 of the data message, length delimited
+                    mutation_list.SerializeToString(&message);
+                    segment->bytes.push_back((char)((2 << 3) | 2));
+                    appendVarint(segment->bytes, message.size());
+                    segment->bytes += message;
+                    mutation_list.Clear();
+                    if (recurse) {
+                        for (auto child: node->children) {
+                            search(child, true);
+                        }
+                    }
+                    state.undo(mark);
+                };
+                search(start, segments[segment->index].second);
+                state.undo(0);
+                return segment;
+            }) &
+            tbb::make_filter< UsherSegment*, UsherSegment* >(tbb::filter::serial_in_order, [&](UsherSegment* segment) {
+                pending += segment->bytes;
+                segment->bytes.clear();
+                if (pending.size() >= chunkSize || segment->index + 1 == segments.size()) {
+                    segment->chunk.swap(pending);
+                }
+                return segment;
+            }) &
+            tbb::make_filter< UsherSegment*, UsherSegment* >(tbb::filter::parallel, [&](UsherSegment* segment) {
+                if (compress && segment->chunk.size()) {
+                    segment->chunk = gzipCompressChunk(segment->chunk);
+                }
+                return segment;
+            }) &
+            tbb::make_filter< UsherSegment*, void >(tbb::filter::serial_in_order, [&](UsherSegment* segment) {
+                outfile.write(segment->chunk.data(), segment->chunk.size());
+            }));
+    } catch(const boost::iostreams::gzip_error& e) {
+        std::cout << e.what() << '\n';
+    }
+
+    outfile.close();
+
     return;
-}
\ No newline at end of file
+}
@@ -111,6 +111,7 @@ po::options_description annotateDesc("Annotate Command Line Arguments");
 po::positional_options_description annotatePositionArgumentDesc;
 po::options_description rerootDesc("Reroot Command Line Arguments");
 po::positional_options_description rerootArgumentDesc;
+po::options_description placeDesc("Place Command Line Arguments");
 po::options_description aaDesc("Amino Acid Translation Command Line Arguments");
 po::positional_options_description aaTranslationArgumentDesc;
 po::options_description createNetDesc("Create Network Command Line Arguments");
@@ -143,6 +144,8 @@ void setupOptionDescriptions() {
 
     ("printTips", po::value< std::string >(),"Print PanMAN summary")
     ("summary,s", "Print PanMAN summary")
+    ("json", "Print PanMAN summary in JSON format, one object per PanMAT")
+    ("fast-summary", "Print PanMAN summary directly from the file without loading the PanMAN")
     ("newick,t", "Print newick string of all trees in a PanMAN")
     ("fasta,f", "Print tip sequences (FASTA format)")
     // ("fasta-fast", "Print tip/internal sequences (FASTA format)")
@@ -153,6 +156,7 @@ void setupOptionDescriptions() {
     ("maf,w", "Print m-WGA for each PanMAT in a PanMAN (MAF format)")
     ("annotate,a", "Annotate nodes of the input PanMAN based on the list provided in the input-file (TSV)")
     ("reroot,r", "Reroot a PanMAT in a PanMAN based on the input sequence id (--reference)")
+    ("place", "Place the aligned sequences of the input-file (FASTA) into a PanMAT of a PanMAN at their most parsimonious positions")
     ("aa-translation,v", "Extract amino acid translations in TSV file")
     ("extended-newick,e", "Print PanMAN's network in extended-newick format")
     ("printMutations,p", "Print mutations from root to each node")
@@ -170,7 +174,7 @@ void setupOptionDescriptions() {
     ("end,y", po::value< int64_t >(), "End coordinate of protein translation/End coordinate for indexing")
     ("treeID,d", po::value< std::string >(), "Tree ID, required for --vcf")
     // ("tree-group", po::value< std::vector< std::string > >()->multitoken(), "File paths of PMATs to generate tree group")
-    ("input-file,i", po::value< std::string >(), "Path to the input file, required for --subnet, --annotate, and --create-network")
+    ("input-file,i", po::value< std::string >(), "Path to the input file, required for --subnet, --annotate, --place, and --create-network, optional BED/GFF annotation for --aa-translation")
     ("output-file,o", po::value< std::string >(), "Prefix of the output file name")
     ("threads", po::value< std::int32_t >(), "Number of threads")
     // ("complexmutation-file", po::value< std::string >(), "File path of complex mutation file for tree group")
@@ -195,6 +199,7 @@ void setupOptionDescriptions() {
         ("output-file,o", po::value< std::string >(), "Output file name");
 
     summaryDesc.add_options()
+        ("json", "Print summary in JSON format")
         ("output-file,o", po::value< std::string >(), "Output file name");
 
     // FASTA option descriptions
@@ -238,10 +243,16 @@ void setupOptionDescriptions() {
         ("reference", po::value< std::string >(), "Reference name")
         ("output-file,o", po::value< std::string >(), "Output file name");
 
+    placeDesc.add_options()
+        ("treeID", po::value< std::int64_t >(), "Tree ID [default 0]")
+        ("input-file", po::value< std::string >(), "Aligned FASTA file of the sequences to place")
+        ("output-file,o", po::value< std::string >(), "Output file name");
+
     aaDesc.add_options()
         ("treeID", po::value< std::int64_t >(), "Tree ID [default 0]")
         ("start,s", po::value< int64_t >(), "Start coordinate of protein translation/Start coordinate for indexing")
         ("end,e", po::value< int64_t >(), "End coordinate of protein translation/End coordinate for indexing")
+        ("input-file", po::value< std::string >(), "BED/GFF file of coding regions to translate instead of start/end")
         ("output-file,o", po::value< std::string >(), "Output file name");
 
     createNetDesc.add_options()
@@ -361,21 +372,58 @@ void summary(panmanUtils::TreeGroup *TG, po::variables_map &globalVm, std::ofstr
     }
 
     panmanUtils::TreeGroup tg = *TG;
+    bool json = globalVm.count("json");
 
     auto summaryStart = std::chrono::high_resolution_clock::now();
     for(int i = 0; i < tg.trees.size(); i++) {
         panmanUtils::Tree *T = &tg.trees[i];
         if(globalVm.count("output-file")) {
             std::string fileName = globalVm["output-file"].as< std::string >();
-            outputFile.open("./info/" + fileName + "_" + std::to_string(i) + ".summary");
+            outputFile.open("./info/" + fileName + "_" + std::to_string(i)
+                            + (json ? ".summary.json" : ".summary"));
+            buf = outputFile.rdbuf();
+        } else {
+            buf = std::cout.rdbuf();
+        }
+        std::ostream fout (buf);
+        T->printSummary(fout, json);
+
+        if(globalVm.count("output-file")) outputFile.close();
+    }
+
+    auto summaryEnd = std::chrono::high_resolution_clock::now();
+    std::chrono::nanoseconds summaryTime = summaryEnd - summaryStart;
+    std::cout << "\nSummary creation time: " << summaryTime.count() << " nanoseconds\n";
+}
+
+void fastSummary(std::istream &inputStream, po::variables_map &globalVm) {
+    // Print the summary of every PanMAT straight from the serialized PanMAN
+    std::filesystem::create_directory("./info");
+    bool json = globalVm.count("json");
+
+    auto summaryStart = std::chrono::high_resolution_clock::now();
+
+    kj::std::StdInputStream kjInputStream(inputStream);
+    capnp::InputStreamMessageReader messageReader(kjInputStream);
+    panman::TreeGroup::Reader TG = messageReader.getRoot<panman::TreeGroup>();
+
+    int i = 0;
+    for(auto tree: TG.getTrees()) {
+        std::ofstream outputFile;
+        std::streambuf * buf;
+        if(globalVm.count("output-file")) {
+            std::string fileName = globalVm["output-file"].as< std::string >();
+            outputFile.open("./info/" + fileName + "_" + std::to_string(i)
+                            + (json ? ".summary.json" : ".summary"));
             buf = outputFile.rdbuf();
         } else {
             buf = std::cout.rdbuf();
         }
         std::ostream fout (buf);
-        T->printSummary(fout);
+        panmanUtils::printSummaryFromReader(tree, fout, json);
 
         if(globalVm.count("output-file")) outputFile.close();
+        i++;
     }
 
     auto summaryEnd = std::chrono::high_resolution_clock::now();
@@ -639,7 +687,10 @@ void subnet(panmanUtils::TreeGroup *TG, po::variables_map &globalVm, std::ofstre
     std::ostream outstream(&outPMATBuffer);
     kj::std::StdOutputStream outputStream(outstream);
     panmanUtils::TreeGroup* subnetwork = TG->subnetworkExtract(nodeIds);
-    subnetwork->writeToFile(outputStream);
+    if(subnetwork != nullptr) {
+        subnetwork->writeToFile(outputStream);
+        delete subnetwork;
+    }
 
     boost::iostreams::close(outPMATBuffer);
     outputFiles.close();
@@ -721,7 +772,7 @@ void gfa(panmanUtils::TreeGroup *TG, po::variables_map &globalVm, std::ofstream
 
     auto generateVGStart = std::chrono::high_resolution_clock::now();
 
-    T->convertToGFA(fout);
+    T->convertToGFABlockAware(fout);
 
     auto generateVGEnd = std::chrono::high_resolution_clock::now();
     std::chrono::nanoseconds generateVGTime = generateVGEnd - generateVGStart;
@@ -892,6 +943,39 @@ void reroot(panmanUtils::TreeGroup *TG, po::variables_map &globalVm, std::ofstre
     writePanMAN(globalVm, TG);
 }
 
+void place(panmanUtils::TreeGroup *TG, po::variables_map &globalVm, std::ofstream &outputFile, std::streambuf * buf) {
+    // Add new aligned sequences to a PanMAT without rebuilding it
+    if(TG == nullptr) {
+        std::cout << "No PanMAN selected" << std::endl;
+        return;
+    }
+
+    int treeID = 0;
+    if(globalVm.count("treeID")) {
+        treeID = std::stoi(globalVm["treeID"].as< std::string >());
+    }
+
+    if(!globalVm.count("input-file")) {
+        panmanUtils::printError("Input file not provided!");
+        std::cout << globalDesc;
+        return;
+    }
+
+    std::string fileName = globalVm["input-file"].as< std::string >();
+    std::ifstream fin(fileName);
+    panmanUtils::Tree * T = &TG->trees[treeID];
+
+    auto placeStart = std::chrono::high_resolution_clock::now();
+
+    T->placeSamples(fin);
+
+    auto placeEnd = std::chrono::high_resolution_clock::now();
+    std::chrono::nanoseconds placeTime = placeEnd - placeStart;
+    std::cout << "Placement time: " << placeTime.count() << " nanoseconds\n";
+
+    writePanMAN(globalVm, TG);
+}
+
 void aa(panmanUtils::TreeGroup *TG, po::variables_map &globalVm, std::ofstream &outputFile, std::streambuf * buf) {
     // Extract amino acid translations in tsv file
     if(TG == nullptr) {
@@ -909,14 +993,20 @@ void aa(panmanUtils::TreeGroup *TG, po::variables_map &globalVm, std::ofstream &
     panmanUtils::TreeGroup tg = *TG;
     panmanUtils::Tree * T = &tg.trees[treeID];
 
-    if(!globalVm.count("start") || !globalVm.count("end")) {
+    std::ifstream fin;
+    if(globalVm.count("input-file")) {
+        // Coding regions are read from the annotation file
+        std::string fileName = globalVm["input-file"].as< std::string >();
+        fin.open(fileName);
+        if(!fin.is_open()) {
+            panmanUtils::printError("Could not open annotation file " + fileName);
+            return;
+        }
+    } else if(!globalVm.count("start") || !globalVm.count("end")) {
         std::cout << "Start/End Coordinate not provided" << std::endl;
         return;
     }
 
-    int64_t startCoordinate = globalVm["start"].as< int64_t >();
-    int64_t endCoordinate = globalVm["end"].as< int64_t >();
-
     if(globalVm.count("output-file")) {
         std::string fileName = globalVm["output-file"].as< std::string >();
         outputFile.open("./info/" + fileName + ".tsv");
@@ -928,7 +1018,13 @@ void aa(panmanUtils::TreeGroup *TG, po::variables_map &globalVm, std::ofstream &
 
     auto aaStart = std::chrono::high_resolution_clock::now();
 
-    T->extractAminoAcidTranslations(fout, startCoordinate, endCoordinate);
+    if(fin.is_open()) {
+        T->extractAminoAcidTranslations(fout, fin);
+    } else {
+        int64_t startCoordinate = globalVm["start"].as< int64_t >();
+        int64_t endCoordinate = globalVm["end"].as< int64_t >();
+        T->extractAminoAcidTranslations(fout, startCoordinate, endCoordinate);
+    }
 
     auto aaEnd = std::chrono::high_resolution_clock::now();
     std::chrono::nanoseconds aaTime = aaEnd - aaStart;
@@ -1312,6 +1408,11 @@ void parseAndExecute(int argc, char* argv[]) {
         inPMATBuffer.push(inputFile);
         std::istream inputStream(&inPMATBuffer);
 
+        if(globalVm.count("fast-summary")) {
+            fastSummary(inputStream, globalVm);
+            return;
+        }
+
         std::cout << "starting reading panman" << std::endl;
         TG = new panmanUtils::TreeGroup(inputStream);
 
@@ -1522,7 +1623,10 @@ void parseAndExecute(int argc, char* argv[]) {
     } else if (globalVm.count("reroot")) {
         reroot(TG, globalVm, outputFile, buf);
         return;
-    } else if (globalVm.count("aa-mutations")) {
+    } else if (globalVm.count("place")) {
+        place(TG, globalVm, outputFile, buf);
+        return;
+    } else if (globalVm.count("aa-translation")) {
         aa(TG, globalVm, outputFile, buf);
         return;
     } else if(globalVm.count("printMutations")) {
@@ -1652,6 +1756,13 @@ void parseAndExecute(int argc, char* argv[]) {
                         .run(), rerootVm);
                     reroot(TG, rerootVm, outputFile, buf);
 
+                } else if (strcmp(splitCommandArray[0], "place") == 0) {
+                    po::variables_map placeVm;
+                    po::store(po::command_line_parser((int)splitCommand.size(), splitCommandArray)
+                        .options(placeDesc)
+                        .run(), placeVm);
+                    place(TG, placeVm, outputFile, buf);
+
                 } else if (strcmp(splitCommandArray[0], "aa-mutations") == 0) {
                     po::variables_map aaVm;
                     po::store(po::command_line_parser((int)splitCommand.size(), splitCommandArray)
@@ -6,6 +6,8 @@
 #include <unordered_map>
 #include <queue>
 #include <atomic>
+#include <functional>
+#include <string_view>
 #include <tbb/concurrent_unordered_map.h>
 #include <tbb/task_scheduler_init.h>
 #include <boost/iostreams/filtering_stream.hpp>
@@ -63,8 +65,71 @@ std::string stripString(std::string s);
 
 void stringSplit (std::string const& s, char delim, std::vector<std::string>& words);
 
+// Buffered line reader shared by the text parsers. Lines are returned without the trailing '\n'
+// or '\r' and the returned view stays valid until the next call
+class LineReader {
+public:
+    LineReader(std::istream& in, size_t bufferSize = ((size_t)1 << 22));
+    bool getLine(std::string_view& line);
+
+private:
+    std::istream& in;
+    std::vector< char > buffer;
+    size_t begin = 0, end = 0;
+    bool eof = false;
+};
+
+// FASTA reader on top of LineReader. The record id is the first word of the header and the
+// sequence has its line breaks removed
+class FastaReader {
+public:
+    FastaReader(std::istream& in): lines(in) {}
+    bool next(std::string& id, std::string& sequence);
+
+private:
+    LineReader lines;
+    std::string header;
+    bool hasHeader = false;
+};
+
+// Pull parser that reads a JSON document from a stream without building it in memory. After
+// beginObject(), nextMember() yields the keys of the object until it returns false at the
+// closing brace; the caller then reads or skips the member's value. Arrays work the same way
+// with beginArray() and nextElement(). Malformed input throws std::runtime_error
+class JsonReader {
+public:
+    JsonReader(std::istream& in, size_t bufferSize = ((size_t)1 << 22));
+    void beginObject();
+    bool nextMember(std::string& key);
+    void beginArray();
+    bool nextElement();
+    void readString(std::string& value);
+    int64_t readInt();
+    bool readBool();
+    void skipValue();
+
+private:
+    char peek();
+    char get();
+    void expect(char c);
+    void skipString();
+
+    std::istream& in;
+    std::vector< char > buffer;
+    size_t begin = 0, end = 0;
+};
+
+// Read the records of a FASTA stream and pass each one to consume(index, id, sequence) on a
+// worker thread as soon as it has been parsed. Records are numbered in file order
+void forEachFastaRecord(std::istream& in,
+                        const std::function< void(size_t, std::string&, std::string&) >& consume);
+
 void panmanToUsher(panmanUtils::Tree* panmanTree, std::string refName, std::string filename, std::string refSeq="");
 
+// Print the summary of a PanMAT directly from its serialized form, without building the tree.
+// Returns false if the tree is malformed
+bool printSummaryFromReader(const panman::Tree::Reader& tree, std::ostream &out, bool json = false);
+
 
 // Represents input PanGraph information for PanMAT generation
 class Pangraph {
@@ -101,21 +166,47 @@ class Pangraph {
     // ID
     std::unordered_map< size_t, std::string > intIdToStringId;
 
-    // List of substitutions for each block
-    tbb::concurrent_unordered_map< std::string, tbb::concurrent_unordered_map< std::string,
-        tbb::concurrent_unordered_map< size_t,
-        std::vector< std::pair< size_t, std::string > > > > > substitutions;
-    // List of insertions for each block
-    tbb::concurrent_unordered_map< std::string, tbb::concurrent_unordered_map< std::string,
-        tbb::concurrent_unordered_map< size_t, std::vector< std::tuple< size_t, size_t,
-        std::string > > > > > insertions;
-    // List of deletions for each block
-    tbb::concurrent_unordered_map< std::string, tbb::concurrent_unordered_map< std::string,
-        tbb::concurrent_unordered_map< size_t,
-        std::vector< std::pair< size_t, size_t > > > > > deletions;
-
-    Pangraph(Json::Value& pangraphData, panmanUtils::Node* node=nullptr);
+    // Mutations of one copy (the "number" parameter) of a block in one sequence, as ranges into
+    // the packed substitution, insertion and deletion arrays
+    struct MutationRange {
+        uint32_t sequence;
+        uint32_t number;
+        size_t substitutionBegin = 0, substitutionEnd = 0;
+        size_t insertionBegin = 0, insertionEnd = 0;
+        size_t deletionBegin = 0, deletionEnd = 0;
+    };
+
+    struct Insertion {
+        uint32_t position;
+        uint32_t gapPosition;
+        // Range of the inserted nucleotides in insertedNucleotides
+        size_t offset;
+        uint32_t length;
+    };
+
+    // Integer IDs of the blocks and of the sequences named in their mutation lists
+    std::vector< std::string > sequenceNames;
+    std::unordered_map< std::string, uint32_t > sequenceIndices;
+    std::vector< std::string > blockIds;
+    std::unordered_map< std::string, uint32_t > blockIndices;
+
+    // Mutation ranges grouped by block and sorted by (sequence, number) within a block.
+    // blockMutationRanges[b] is the range of mutationRanges that belongs to block b
+    std::vector< MutationRange > mutationRanges;
+    std::vector< std::pair< size_t, size_t > > blockMutationRanges;
+
+    // (position, nucleotide) substitutions
+    std::vector< std::pair< uint32_t, char > > substitutions;
+    std::vector< Insertion > insertions;
+    std::string insertedNucleotides;
+    // (position, length) deletions
+    std::vector< std::pair< uint32_t, uint32_t > > deletions;
+
+    // Read a Pangraph JSON file as a stream, without building a JSON document in memory
+    Pangraph(std::istream& fin, panmanUtils::Node* node=nullptr);
     std::vector< size_t > getTopologicalSort();
+    // Mutations of copy `number` of a block in a sequence, or nullptr if it has none
+    const MutationRange* getMutations(uint32_t blockIndex, uint32_t sequenceIndex, size_t number) const;
     std::unordered_map< std::string,std::vector< int > >
     getAlignedSequences(const std::vector< size_t >& topoArray);
     // Patch to incorporate strands
@@ -143,9 +234,10 @@ class GfaGraph {
 
     // Raw sequence corresponding to each node
     std::vector< std::string > intNodeToSequence;
+    // Paths are given as (segment id, strand) steps indexing into segmentSequences
     GfaGraph(const std::vector< std::string >& pathNames,
-             const std::vector< std::vector< std::pair< std::string, bool > > >& sequences,
-             std::map< std::string, std::string >& nodes);
+             const std::vector< std::vector< std::pair< int32_t, bool > > >& sequences,
+             const std::vector< std::string >& segmentSequences);
 
     std::vector< size_t > getTopologicalSort();
     std::vector< std::vector< int64_t > > getAlignedSequences(const
@@ -0,0 +1,389 @@
+#include "panmanUtils.hpp"
+
+// Columns of the aligned (MSA) form of the PanMAT, as printed by printSequenceLines with every
+// block on the forward strand. Each block is a slot with a contiguous range of columns and every
+// position of a block contributes its gap columns followed by its main column
+struct PlacementLayout {
+    struct Slot {
+        int32_t primaryBlockId;
+        int32_t secondaryBlockId;
+        size_t start, end;
+        // Column of the first gap character of each position
+        std::vector< size_t > positionStart;
+    };
+
+    std::vector< Slot > slots;
+    std::vector< int32_t > primarySlot;
+    std::vector< std::vector< int32_t > > secondarySlot;
+    size_t numColumns = 0;
+
+    PlacementLayout(const sequence_t& sequence) {
+        primarySlot.assign(sequence.size(), -1);
+        secondarySlot.resize(sequence.size());
+        for(size_t i = 0; i < sequence.size(); i++) {
+            secondarySlot[i].assign(sequence[i].second.size(), -1);
+            for(size_t j = 0; j < sequence[i].second.size(); j++) {
+                secondarySlot[i][j] = slots.size();
+                addSlot(i, j, sequence[i].second[j]);
+            }
+            primarySlot[i] = slots.size();
+            addSlot(i, -1, sequence[i].first);
+        }
+    }
+
+    void addSlot(int32_t primaryBlockId, int32_t secondaryBlockId,
+                 const std::vector< std::pair< char, std::vector< char > > >& block) {
+        Slot slot{primaryBlockId, secondaryBlockId, numColumns, numColumns, {}};
+        slot.positionStart.reserve(block.size());
+        for(const auto& position: block) {
+            slot.positionStart.push_back(numColumns);
+            numColumns += position.second.size() + 1;
+        }
+        slot.end = numColumns;
+        slots.push_back(std::move(slot));
+    }
+
+    int32_t slotOf(int32_t primaryBlockId, int32_t secondaryBlockId) const {
+        if(secondaryBlockId != -1) {
+            return secondarySlot[primaryBlockId][secondaryBlockId];
+        }
+        return primarySlot[primaryBlockId];
+    }
+
+    size_t columnOf(const Slot& slot, int32_t nucPosition, int32_t nucGapPosition) const {
+        if(nucGapPosition != -1) {
+            return slot.positionStart[nucPosition] + nucGapPosition;
+        }
+        size_t next = ((size_t)nucPosition + 1 < slot.positionStart.size())
+                      ? slot.positionStart[nucPosition + 1] : slot.end;
+        return next - 1;
+    }
+};
+
+// Sequence state of one node flattened onto the placement layout, together with the parsimony
+// score of attaching the sample being placed below it. The score is updated incrementally as
+// mutations are applied and undone during a depth first traversal
+struct PlacementState {
+    const PlacementLayout& layout;
+    const std::string& sample;
+    const std::vector< bool >& sampleHasBlock;
+
+    std::vector< char > columns;
+    std::vector< bool > blockExists;
+    std::vector< bool > blockStrand;
+    // Mismatching columns of every slot, counted whether or not the slot is present
+    std::vector< int64_t > mismatches;
+    int64_t score = 0;
+
+    // (slot, column, old character) and (slot, old presence, old strand) of applied mutations
+    std::vector< std::tuple< int32_t, size_t, char > > nucUndo;
+    std::vector< std::tuple< int32_t, bool, bool > > blockUndo;
+
+    PlacementState(const PlacementLayout& l, const std::vector< char >& consensus,
+                   const std::string& s, const std::vector< bool >& hasBlock)
+        : layout(l), sample(s), sampleHasBlock(hasBlock), columns(consensus),
+          blockExists(l.slots.size(), false), blockStrand(l.slots.size(), true),
+          mismatches(l.slots.size(), 0) {
+        for(size_t i = 0; i < layout.slots.size(); i++) {
+            for(size_t c = layout.slots[i].start; c < layout.slots[i].end; c++) {
+                mismatches[i] += (columns[c] != sample[c]);
+            }
+            score += slotScore(i);
+        }
+    }
+
+    int64_t slotScore(size_t slot) const {
+        if(!sampleHasBlock[slot]) {
+            return blockExists[slot];
+        }
+        return (!blockExists[slot] || !blockStrand[slot]) + mismatches[slot];
+    }
+
+    void apply(panmanUtils::Node* node) {
+        for(const auto& mutation: node->blockMutation) {
+            int32_t slot = layout.slotOf(mutation.primaryBlockId, mutation.secondaryBlockId);
+            blockUndo.emplace_back(slot, blockExists[slot], blockStrand[slot]);
+            score -= slotScore(slot);
+            if(mutation.isInsertion()) {
+                blockExists[slot] = true;
+                blockStrand[slot] = !mutation.inversion;
+            } else if(mutation.isSimpleInversion()) {
+                blockStrand[slot] = !blockStrand[slot];
+            } else {
+                blockExists[slot] = false;
+                blockStrand[slot] = true;
+            }
+            score += slotScore(slot);
+        }
+
+        for(const auto& mutation: node->nucMutation) {
+            int32_t slot = layout.slotOf(mutation.primaryBlockId, mutation.secondaryBlockId);
+            const auto& s = layout.slots[slot];
+            int len = mutation.length();
+            for(int j = 0; j < len; j++) {
+                panmanUtils::Coordinate coordinate(mutation, j);
+                size_t column = layout.columnOf(s, coordinate.nucPosition, coordinate.nucGapPosition);
+                char newVal = '-';
+                if(!mutation.isDeletion()) {
+                    newVal = panmanUtils::getNucleotideFromCode(mutation.getNucCode(j));
+                }
+                nucUndo.emplace_back(slot, column, columns[column]);
+                setColumn(slot, column, newVal);
+            }
+        }
+    }
+
+    void undo(size_t blockMark, size_t nucMark) {
+        while(nucUndo.size() > nucMark) {
+            auto [slot, column, oldVal] = nucUndo.back();
+            nucUndo.pop_back();
+            setColumn(slot, column, oldVal);
+        }
+        while(blockUndo.size() > blockMark) {
+            auto [slot, oldExists, oldStrand] = blockUndo.back();
+            blockUndo.pop_back();
+            score -= slotScore(slot);
+            blockExists[slot] = oldExists;
+            blockStrand[slot] = oldStrand;
+            score += slotScore(slot);
+        }
+    }
+
+    void setColumn(int32_t slot, size_t column, char newVal) {
+        int64_t delta = (int64_t)(newVal != sample[column]) - (int64_t)(columns[column] != sample[column]);
+        columns[column] = newVal;
+        mismatches[slot] += delta;
+        if(sampleHasBlock[slot]) {
+            score += delta;
+        }
+    }
+};
+
+void panmanUtils::Tree::placeSamples(std::ifstream& fin) {
+    sequence_t sequence;
+    blockExists_t blockExists;
+    blockStrand_t blockStrand;
+    getConsensusSequence(sequence, blockExists, blockStrand);
+
+    PlacementLayout layout(sequence);
+    std::vector< char > consensus(layout.numColumns, '-');
+    for(const auto& slot: layout.slots) {
+        const auto& block = (slot.secondaryBlockId != -1)
+                            ? sequence[slot.primaryBlockId].second[slot.secondaryBlockId]
+                            : sequence[slot.primaryBlockId].first;
+        size_t column = slot.start;
+        for(const auto& position: block) {
+            for(char c: position.second) {
+                consensus[column++] = c;
+            }
+            consensus[column++] = (position.first == 'x') ? '-' : position.first;
+        }
+    }
+
+    // Subtree sizes are kept up to date as samples are placed, and used to split the tree across
+    // threads for every sample
+    std::unordered_map< Node*, size_t > subtreeSize;
+    computeSubtreeSizes(root, subtreeSize);
+
+    panmanUtils::FastaReader reader(fin);
+    std::string sampleId, sample;
+    while(reader.next(sampleId, sample)) {
+        if(allNodes.find(sampleId) != allNodes.end()) {
+            panmanUtils::printError("Sample " + sampleId + " already exists in the PanMAT, skipping");
+            continue;
+        }
+        if(sample.length() != layout.numColumns) {
+            panmanUtils::printError("Sample " + sampleId + " has length " + std::to_string(sample.length())
+                                    + ", expected an alignment of length " + std::to_string(layout.numColumns));
+            continue;
+        }
+
+        std::vector< bool > sampleHasBlock(layout.slots.size(), false);
+        bool valid = true;
+        for(size_t i = 0; i < layout.slots.size() && valid; i++) {
+            const auto& slot = layout.slots[i];
+            for(size_t c = slot.start; c < slot.end; c++) {
+                sample[c] = std::toupper(sample[c]);
+                if(sample[c] == '-') {
+                    continue;
+                }
+                if(c + 1 == slot.end || panmanUtils::getCodeFromNucleotide(sample[c]) == panmanUtils::NucCode::MISSING) {
+                    // The last main column of a block is its end marker and cannot hold a base
+                    valid = false;
+                    break;
+                }
+                sampleHasBlock[i] = true;
+            }
+        }
+        if(!valid) {
+            panmanUtils::printError("Sample " + sampleId + " is not in the coordinate system of the PanMAT, skipping");
+            continue;
+        }
+
+        TreePartition partition = partitionTree(root, subtreeSize);
+        const auto& frontier = partition.subtreeRoots;
+
+        auto better = [](const std::pair< int64_t, Node* >& a, const std::pair< int64_t, Node* >& b) {
+            if(b.second == nullptr) return a.second != nullptr;
+            if(a.second == nullptr) return false;
+            if(a.first != b.first) return a.first < b.first;
+            return a.second->identifier < b.second->identifier;
+        };
+
+        // Nodes above the subtrees are scored serially, keeping the nodes on the path to the
+        // current one applied
+        std::pair< int64_t, Node* > best = {0, nullptr};
+        PlacementState upper(layout, consensus, sample, sampleHasBlock);
+        std::vector< std::tuple< Node*, size_t, size_t > > applied;
+        for(const auto& entry: partition.preorder) {
+            Node* node = entry.first;
+            while(!applied.empty() && std::get<0>(applied.back()) != node->parent) {
+                upper.undo(std::get<1>(applied.back()), std::get<2>(applied.back()));
+                applied.pop_back();
+            }
+            if(entry.second) {
+                continue;
+            }
+            applied.emplace_back(node, upper.blockUndo.size(), upper.nucUndo.size());
+            upper.apply(node);
+            if(better({upper.score, node}, best)) {
+                best = {upper.score, node};
+            }
+        }
+
+        std::vector< std::pair< int64_t, Node* > > frontierBest(frontier.size(), {0, nullptr});
+        tbb::parallel_for(tbb::blocked_range< size_t >(0, frontier.size(), 1),
+                          [&](const tbb::blocked_range< size_t >& range) {
+            for(size_t i = range.begin(); i < range.end(); i++) {
+                PlacementState state(layout, consensus, sample, sampleHasBlock);
+                std::vector< Node* > path;
+                for(Node* node = frontier[i]->parent; node != nullptr; node = node->parent) {
+                    path.push_back(node);
+                }
+                for(auto it = path.rbegin(); it != path.rend(); it++) {
+                    state.apply(*it);
+                }
+                state.nucUndo.clear();
+                state.blockUndo.clear();
+
+                auto& localBest = frontierBest[i];
+                std::function< void(Node*) > search = [&](Node* node) {
+                    size_t blockMark = state.blockUndo.size(), nucMark = state.nucUndo.size();
+                    state.apply(node);
+                    if(better({state.score, node}, localBest)) {
+                        localBest = {state.score, node};
+                    }
+                    for(auto child: node->children) {
+                        search(child);
+                    }
+                    state.undo(blockMark, nucMark);
+                };
+                search(frontier[i]);
+            }
+        });
+        for(const auto& candidate: frontierBest) {
+            if(better(candidate, best)) {
+                best = candidate;
+            }
+        }
+
+        // Rebuild the state of the chosen node to derive the mutations of the new leaf
+        Node* target = best.second;
+        PlacementState state(layout, consensus, sample, sampleHasBlock);
+        std::vector< Node* > path;
+        for(Node* node = target; node != nullptr; node = node->parent) {
+            path.push_back(node);
+        }
+        for(auto it = path.rbegin(); it != path.rend(); it++) {
+            state.apply(*it);
+        }
+
+        bool split = false;
+        if(target->children.empty()) {
+            // A leaf cannot be a parent, so it is replaced by an internal node carrying its
+            // mutations, with the old leaf and the new sample as children
+            std::string internalId = newInternalNodeId();
+            while(allNodes.find(internalId) != allNodes.end()) {
+                internalId = newInternalNodeId();
+            }
+            Node* internal = new Node(internalId, target->branchLength);
+            internal->parent = target->parent;
+            internal->level = target->level;
+            internal->nucMutation = std::move(target->nucMutation);
+            internal->blockMutation = std::move(target->blockMutation);
+            internal->treeIndex = target->treeIndex;
+            if(target->parent != nullptr) {
+                std::replace(target->parent->children.begin(), target->parent->children.end(), target, internal);
+            } else {
+                root = internal;
+            }
+            target->nucMutation.clear();
+            target->blockMutation.clear();
+            target->branchLength = 0.0;
+            target->parent = internal;
+            target->level = internal->level + 1;
+            internal->children.push_back(target);
+            allNodes[internalId] = internal;
+            target = internal;
+            split = true;
+        }
+
+        Node* leaf = new Node(sampleId, target, best.first);
+        for(size_t i = 0; i < layout.slots.size(); i++) {
+            const auto& slot = layout.slots[i];
+            if(sampleHasBlock[i] && !state.blockExists[i]) {
+                leaf->blockMutation.emplace_back(slot.primaryBlockId, std::make_pair(panmanUtils::BlockMutationType::BI, false), slot.secondaryBlockId);
+            } else if(!sampleHasBlock[i] && state.blockExists[i]) {
+                leaf->blockMutation.emplace_back(slot.primaryBlockId, std::make_pair(panmanUtils::BlockMutationType::BD, false), slot.secondaryBlockId);
+            } else if(sampleHasBlock[i] && !state.blockStrand[i]) {
+                leaf->blockMutation.emplace_back(slot.primaryBlockId, std::make_pair(panmanUtils::BlockMutationType::BD, true), slot.secondaryBlockId);
+            }
+        }
+
+        std::vector< panmanUtils::NucMut > nucMutations;
+        for(size_t i = 0; i < layout.slots.size(); i++) {
+            const auto& slot = layout.slots[i];
+            if(!sampleHasBlock[i] || state.mismatches[i] == 0) {
+                continue;
+            }
+            size_t column = slot.start;
+            for(size_t pos = 0; pos < slot.positionStart.size(); pos++) {
+                size_t next = (pos + 1 < slot.positionStart.size()) ? slot.positionStart[pos + 1] : slot.end;
+                for(; column < next; column++) {
+                    char oldVal = state.columns[column];
+                    char newVal = sample[column];
+                    if(oldVal == newVal) {
+                        continue;
+                    }
+                    int gapPos = (column + 1 == next) ? -1 : (int)(column - slot.positionStart[pos]);
+                    int type = panmanUtils::NucMutationType::NSNPS;
+                    if(newVal == '-') {
+                        type = panmanUtils::NucMutationType::NSNPD;
+                    } else if(oldVal == '-') {
+                        type = panmanUtils::NucMutationType::NSNPI;
+                    }
+                    nucMutations.emplace_back(std::make_tuple(slot.primaryBlockId, slot.secondaryBlockId,
+                                              (int)pos, gapPos, type, (int)panmanUtils::getCodeFromNucleotide(newVal)));
+                }
+            }
+        }
+        leaf->nucMutation = consolidateNucMutations(nucMutations);
+        allNodes[sampleId] = leaf;
+        m_numLeaves++;
+
+        // The new leaf adds one node to the subtree of every ancestor. A split adds the internal
+        // node as well, whose subtree holds itself, the old leaf and the new leaf
+        subtreeSize[leaf] = 1;
+        if(split) {
+            subtreeSize[target] = 3;
+        } else {
+            subtreeSize[target]++;
+        }
+        for(Node* node = target->parent; node != nullptr; node = node->parent) {
+            subtreeSize[node] += split ? 2 : 1;
+        }
+
+        std::cout << "Placed " << sampleId << " under " << target->identifier
+                  << " with parsimony score " << best.first << std::endl;
+    }
+}
@@ -11,252 +11,154 @@ void panmanUtils::Tree::reroot(std::string sequenceName) {
         std::cerr << "Node with id " << sequenceName << " is not a tip!" << std::endl;
         return;
     }
-    sequence_t sequence;
-    blockExists_t blockExists;
-    blockStrand_t blockStrand;
-
-    getSequenceFromReference(sequence, blockExists, blockStrand, sequenceName);
-
-    std::unordered_map<std::string, sequence_t> nodeIdToSequence;
-    std::unordered_map<std::string, blockExists_t> nodeIdToBlockExists;
-    std::unordered_map<std::string, blockStrand_t> nodeIdToBlockStrand;
-
-    for(const auto& u: allNodes) {
-        if(u.second->children.size() == 0) {
-            sequence_t tempSequence;
-            blockExists_t tempBlockExists;
-            blockExists_t tempBlockStrand;
-
-            getSequenceFromReference(tempSequence, tempBlockExists, tempBlockStrand, u.first);
-            nodeIdToSequence[u.first] = tempSequence;
-            nodeIdToBlockExists[u.first] = tempBlockExists;
-            nodeIdToBlockStrand[u.first] = tempBlockStrand;
-        }
+    if(newRoot == root) {
+        return;
     }
 
-    // Transform tree topology
-    transform(newRoot);
-
-    std::cout << "Transformation complete!" << std::endl;
-
-    // clear previous block mutations
-    for(auto u: allNodes) {
-        u.second->blockMutation.clear();
+    // Only the branches on the path between the old and the new root change. Every other
+    // branch keeps its mutations since the sequences of all nodes stay the same.
+    std::vector< panmanUtils::Node* > path;
+    for(panmanUtils::Node* it = newRoot; it != nullptr; it = it->parent) {
+        path.push_back(it);
     }
+    std::reverse(path.begin(), path.end());
 
-    std::unordered_map< std::string, std::mutex > nodeMutexes;
-
-    for(auto u: allNodes) {
-        nodeMutexes[u.first];
+    std::map< std::pair< int32_t, int32_t >, size_t > blockIndex;
+    for(size_t i = 0; i < blocks.size(); i++) {
+        blockIndex[std::make_pair(blocks[i].primaryBlockId, blocks[i].secondaryBlockId)] = i;
     }
-
-    // make new block mutations
-    tbb::parallel_for((size_t)0, blockExists.size(), [&](size_t i) {
-        tbb::parallel_for((size_t)0, blockExists[i].second.size(), [&](size_t j) {
-            std::unordered_map< std::string, int > states;
-            std::unordered_map< std::string, std::pair< BlockMutationType, bool > > mutations;
-            // block gaps
-            for(const auto& u: nodeIdToBlockExists) {
-                if(!u.second[i].second[j]) {
-                    // doesn't exist
-                    states[u.first] = 1;
-                } else if(nodeIdToBlockStrand[u.first][i].second[j]) {
-                    // forward strand
-                    states[u.first] = 2;
-                } else {
-                    // reverse strand
-                    states[u.first] = 4;
-                }
-            }
-            int defaultState;
-            if(!blockExists[i].second[j]) {
-                defaultState = 1;
-            } else if(blockStrand[i].second[j]) {
-                defaultState = 2;
+    auto consensusCode = [&](const panmanUtils::Coordinate& position) -> int8_t {
+        if(position.nucGapPosition != -1) {
+            return panmanUtils::NucCode::MISSING;
+        }
+        auto it = blockIndex.find(std::make_pair(position.primaryBlockId, position.secondaryBlockId));
+        if(it == blockIndex.end()) {
+            return panmanUtils::NucCode::MISSING;
+        }
+        const auto& consensusSeq = blocks[it->second].consensusSeq;
+        if((size_t)position.nucPosition / 8 >= consensusSeq.size()) {
+            return panmanUtils::NucCode::MISSING;
+        }
+        return (consensusSeq[position.nucPosition / 8] >> (4*(7 - position.nucPosition % 8))) & 15;
+    };
+
+    // Walk down the path, tracking only the nucleotides and blocks mutated on it, and invert the
+    // mutations of every node so that they lead from the node back to its parent
+    std::unordered_map< panmanUtils::Coordinate, int8_t > nucState;
+    std::map< std::pair< int32_t, int32_t >, std::pair< bool, bool > > blockState;
+    // The old root has no parent edge to invert, so its entry stays empty
+    std::vector< panmanUtils::MutationList > invertedMutations;
+    invertedMutations.reserve(path.size());
+
+    for(size_t i = 0; i < path.size(); i++) {
+        std::unordered_map< panmanUtils::Coordinate, int8_t > originalNucs;
+        std::unordered_map< uint64_t, bool > wasBlockInv;
+
+        for(const auto& mutation: path[i]->blockMutation) {
+            auto& state = blockState.emplace(std::make_pair(mutation.primaryBlockId, mutation.secondaryBlockId),
+                                             std::make_pair(false, true)).first->second;
+            if(mutation.isInsertion()) {
+                state = std::make_pair(true, !mutation.inversion);
+            } else if(mutation.isSimpleInversion()) {
+                state.second = !state.second;
             } else {
-                defaultState = 4;
+                wasBlockInv.emplace(mutation.singleBlockID(), !state.second);
+                state = std::make_pair(false, true);
             }
+        }
 
-            blockFitchForwardPassNew(root, states);
-            blockFitchBackwardPassNew(root, states, 1, defaultState);
-            blockFitchAssignMutationsNew(root, states, mutations, 1);
-
-            for(auto u: mutations) {
-                nodeMutexes[u.first].lock();
-                allNodes[u.first]->blockMutation.emplace_back(i, u.second, j);
-                nodeMutexes[u.first].unlock();
-            }
-        });
-        std::unordered_map< std::string, int > states;
-        std::unordered_map< std::string, std::pair< BlockMutationType, bool > > mutations;
-        // main block
-        for(const auto& u: nodeIdToBlockExists) {
-            if(!u.second[i].first) {
-                // doesn't exist
-                states[u.first] = 1;
-            } else if(nodeIdToBlockStrand[u.first][i].first) {
-                // forward strand
-                states[u.first] = 2;
-            } else {
-                // reverse strand
-                states[u.first] = 4;
+        for(const auto& mutation: path[i]->nucMutation) {
+            uint32_t type = mutation.type();
+            bool deletion = (type == panmanUtils::NucMutationType::ND || type == panmanUtils::NucMutationType::NSNPD);
+            for(int j = 0; j < mutation.length(); j++) {
+                panmanUtils::Coordinate position(mutation, j);
+                auto it = nucState.find(position);
+                if(it == nucState.end()) {
+                    it = nucState.emplace(position, consensusCode(position)).first;
+                }
+                originalNucs.emplace(position, it->second);
+                it->second = deletion ? (int8_t)panmanUtils::NucCode::MISSING : (int8_t)mutation.getNucCode(j);
             }
         }
-        int defaultState;
-        if(!blockExists[i].first) {
-            defaultState = 1;
-        } else if(blockStrand[i].first) {
-            defaultState = 2;
-        } else {
-            defaultState = 4;
-        }
 
-        blockFitchForwardPassNew(root, states);
-        blockFitchBackwardPassNew(root, states, 1, defaultState);
-        blockFitchAssignMutationsNew(root, states, mutations, 1);
-        for(auto u: mutations) {
-            nodeMutexes[u.first].lock();
-            allNodes[u.first]->blockMutation.emplace_back(i, u.second, -1);
-            nodeMutexes[u.first].unlock();
+        if(i > 0) {
+            invertedMutations.emplace_back(path[i]);
+            invertedMutations.back().invertMutations(originalNucs, wasBlockInv);
+        } else {
+            invertedMutations.emplace_back();
         }
-    });
-
-    std::cout << "Block Mutations Ready!" << std::endl;
-
-    // clear previous nuc mutations
-    for(auto u: allNodes) {
-        u.second->nucMutation.clear();
     }
 
-    tbb::concurrent_unordered_map< std::string, std::vector< std::tuple< int,int,int,int,int,int > > > nonGapMutations;
-    tbb::concurrent_unordered_map< std::string, std::vector< std::tuple< int,int,int,int,int,int > > > gapMutations;
-
-    tbb::parallel_for((size_t)0, sequence.size(), [&](size_t i) {
-        // main block
-        std::vector< char > consensusSeq;
-        bool endFlag = false;
-        for(size_t t1 = 0; t1 < blocks.size(); t1++) {
-            if(blocks[t1].primaryBlockId == (int)i && blocks[t1].secondaryBlockId == -1) {
-                for(size_t t2 = 0; t2 < blocks[t1].consensusSeq.size(); t2++) {
-                    for(size_t t3 = 0; t3 < 8; t3++) {
-                        const int nucCode = (((blocks[t1].consensusSeq[t2]) >> (4*(7 - t3))) & 15);
-                        if(nucCode == 0) {
-                            endFlag = true;
-                            break;
-                        }
-                        const char nucleotide = panmanUtils::getNucleotideFromCode(nucCode);
-
-                        consensusSeq.push_back(nucleotide);
-                    }
-                    if(endFlag) {
-                        break;
-                    }
-                }
-                endFlag = true;
-                break;
-            }
+    // Mutations from the consensus to the new root sequence
+    std::vector< panmanUtils::NucMut > rootNucMutations;
+    for(const auto& u: nucState) {
+        int8_t consensus = consensusCode(u.first);
+        if(u.second == consensus) {
+            continue;
         }
-
-        if(!endFlag) {
-            std::cerr << "FATAL: Block with id " << i << " " << -1 << " not found!" << std::endl;
-            exit(-1);
+        int type = panmanUtils::NucMutationType::NSNPS;
+        if(u.second == panmanUtils::NucCode::MISSING) {
+            type = panmanUtils::NucMutationType::NSNPD;
+        } else if(consensus == panmanUtils::NucCode::MISSING) {
+            type = panmanUtils::NucMutationType::NSNPI;
         }
-
-        consensusSeq.push_back('-');
-        if(consensusSeq.size() != sequence[i].first.size()) {
-            std::cerr << "FATAL: consenusSeq length doesn't match with sequence length" << std::endl;
-            exit(-1);
+        rootNucMutations.emplace_back(std::make_tuple(u.first.primaryBlockId, u.first.secondaryBlockId,
+                                      u.first.nucPosition, u.first.nucGapPosition, type, (int)u.second));
+    }
+    std::vector< panmanUtils::BlockMut > rootBlockMutations;
+    for(const auto& u: blockState) {
+        if(u.second.first) {
+            rootBlockMutations.emplace_back(u.first.first, std::make_pair(panmanUtils::BlockMutationType::BI, !u.second.second), u.first.second);
         }
+    }
 
-        tbb::parallel_for((size_t)0, sequence[i].first.size(), [&](size_t k) {
-            tbb::parallel_for((size_t)0, sequence[i].first[k].second.size(), [&](size_t w) {
-                // gap nuc
-                std::unordered_map< std::string, int > states;
-                std::unordered_map< std::string, std::pair< panmanUtils::NucMutationType, char > > mutations;
-                for(const auto& u: nodeIdToSequence) {
-                    if(u.second[i].first[k].second[w] != '-' && u.second[i].first[k].second[w] != 'x') {
-                        states[u.first] = (1 << getCodeFromNucleotide(u.second[i].first[k].second[w]));
-                    }  else {
-                        states[u.first] = 1;
-                    }
-                }
-                int nucleotideCode = 1;
-                if(sequence[i].first[k].second[w] != '-' && sequence[i].first[k].second[w] != 'x') {
-                    nucleotideCode = (1 << getCodeFromNucleotide(sequence[i].first[k].second[w]));
-                }
-
-                nucFitchForwardPass(root, states);
-                nucFitchBackwardPass(root, states, nucleotideCode, nucleotideCode);
-                nucFitchAssignMutations(root, states, mutations, 1);
-
-                for(auto mutation: mutations) {
-                    nodeMutexes[mutation.first].lock();
-                    gapMutations[mutation.first].push_back(std::make_tuple((int)i, -1, k, w, mutation.second.first, getCodeFromNucleotide(mutation.second.second)));
-                    nodeMutexes[mutation.first].unlock();
-                }
-            });
-            // main nuc
-            std::unordered_map< std::string, int > states;
-            std::unordered_map< std::string, std::pair< panmanUtils::NucMutationType, char > > mutations;
-
-            for(const auto& u: nodeIdToSequence) {
-                if(u.second[i].first[k].first != '-' && u.second[i].first[k].first != 'x') {
-                    states[u.first] = (1 << getCodeFromNucleotide(u.second[i].first[k].first));
-                }  else {
-                    states[u.first] = 1;
-                }
-            }
-            int nucleotideCode = 1;
-            if(sequence[i].first[k].first != '-' && sequence[i].first[k].first != 'x') {
-                nucleotideCode = (1 << getCodeFromNucleotide(sequence[i].first[k].first));
+    // Put inverted mutations in front of the mutations of a node hanging off the path
+    auto prependMutations = [&](panmanUtils::Node* node, const panmanUtils::MutationList& mutations) {
+        std::vector< panmanUtils::NucMut > nucMuts = mutations.nucMutation;
+        nucMuts.insert(nucMuts.end(), node->nucMutation.begin(), node->nucMutation.end());
+        node->nucMutation = consolidateNucMutations(nucMuts);
+
+        std::vector< panmanUtils::BlockMut > blockMuts = mutations.blockMutation;
+        blockMuts.insert(blockMuts.end(), node->blockMutation.begin(), node->blockMutation.end());
+        node->blockMutation = consolidateBlockMutations(blockMuts);
+    };
+
+    panmanUtils::Node* oldRoot = root;
+    if(path.size() == 2) {
+        // The tip is a child of the root, so only the topology stays and the root takes the
+        // sequence of the tip
+        transform(newRoot);
+        for(auto child: oldRoot->children) {
+            if(child != newRoot) {
+                prependMutations(child, invertedMutations[1]);
             }
+        }
+    } else {
+        // The old root is dropped by the transformation if only one child remains after the
+        // path is taken out. That child then hangs off the first node on the path.
+        panmanUtils::Node* oldRootChild = nullptr;
+        if(oldRoot->children.size() == 2) {
+            oldRootChild = (oldRoot->children[0] == path[1]) ? oldRoot->children[1] : oldRoot->children[0];
+        }
 
-            nucFitchForwardPass(root, states);
-            nucFitchBackwardPass(root, states, nucleotideCode, nucleotideCode);
-            nucFitchAssignMutations(root, states, mutations, (1 << getCodeFromNucleotide(consensusSeq[k])));
-
-            for(auto mutation: mutations) {
-                nodeMutexes[mutation.first].lock();
-                nonGapMutations[mutation.first].push_back(std::make_tuple((int)i, -1, k, -1, mutation.second.first, getCodeFromNucleotide(mutation.second.second)));
-                nodeMutexes[mutation.first].unlock();
-            }
-        });
-    });
+        transform(newRoot);
 
-    tbb::parallel_for_each(nonGapMutations, [&](auto& u) {
-        nodeMutexes[u.first].lock();
-        std::sort(u.second.begin(), u.second.end());
-        nodeMutexes[u.first].unlock();
-        size_t currentStart = 0;
-        for(size_t i = 1; i < u.second.size(); i++) {
-            if(i - currentStart == 6 || std::get<0>(u.second[i]) != std::get<0>(u.second[i-1]) || std::get<1>(u.second[i]) != std::get<1>(u.second[i-1]) || std::get<2>(u.second[i]) != std::get<2>(u.second[i-1])+1 || std::get<4>(u.second[i]) != std::get<4>(u.second[i-1])) {
-                nodeMutexes[u.first].lock();
-                allNodes[u.first]->nucMutation.emplace_back(u.second, currentStart, i);
-                nodeMutexes[u.first].unlock();
-                currentStart = i;
-                continue;
-            }
+        for(size_t i = 1; i + 1 < path.size(); i++) {
+            path[i]->nucMutation = invertedMutations[i + 1].nucMutation;
+            path[i]->blockMutation = invertedMutations[i + 1].blockMutation;
         }
-        nodeMutexes[u.first].lock();
-        allNodes[u.first]->nucMutation.emplace_back(u.second, currentStart, u.second.size());
-        nodeMutexes[u.first].unlock();
-    });
-    tbb::parallel_for_each(gapMutations, [&](auto& u) {
-        nodeMutexes[u.first].lock();
-        std::sort(u.second.begin(), u.second.end());
-        nodeMutexes[u.first].unlock();
-        size_t currentStart = 0;
-        for(size_t i = 1; i < u.second.size(); i++) {
-            if(i - currentStart == 6 || std::get<0>(u.second[i]) != std::get<0>(u.second[i-1]) || std::get<1>(u.second[i]) != std::get<1>(u.second[i-1]) || std::get<2>(u.second[i]) != std::get<2>(u.second[i-1]) || std::get<3>(u.second[i]) != std::get<3>(u.second[i-1])+1 || std::get<4>(u.second[i]) != std::get<4>(u.second[i-1])) {
-                nodeMutexes[u.first].lock();
-                allNodes[u.first]->nucMutation.emplace_back(u.second, currentStart, i);
-                nodeMutexes[u.first].unlock();
-                currentStart = i;
-                continue;
-            }
+        if(oldRootChild != nullptr) {
+            prependMutations(oldRootChild, invertedMutations[1]);
+        } else {
+            oldRoot->nucMutation = invertedMutations[1].nucMutation;
+            oldRoot->blockMutation = invertedMutations[1].blockMutation;
         }
-        nodeMutexes[u.first].lock();
-        allNodes[u.first]->nucMutation.emplace_back(u.second, currentStart, u.second.size());
-        nodeMutexes[u.first].unlock();
-    });
+    }
+
+    root->nucMutation = consolidateNucMutations(rootNucMutations);
+    root->blockMutation = rootBlockMutations;
+    newRoot->nucMutation.clear();
+    newRoot->blockMutation.clear();
+
+    std::cout << "Transformation complete!" << std::endl;
 }
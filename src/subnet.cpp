@@ -1,206 +1,215 @@
 #include "panmanUtils.hpp"
 
-void panmanUtils::Tree::compressTreeParallel(panmanUtils::Node* node, size_t level, const std::set< std::string >& nodeIdsToDefinitelyInclude) {
-    node->level = level;
-
-    while(node->children.size() == 1) {
-        if(nodeIdsToDefinitelyInclude.find(node->identifier) != nodeIdsToDefinitelyInclude.end() ||
-                nodeIdsToDefinitelyInclude.find(node->children[0]->identifier)
-                != nodeIdsToDefinitelyInclude.end()) {
-            break;
-        }
-        mergeNodes(node, node->children[0]);
-        auto oldVector = node->nucMutation;
-        node->nucMutation = consolidateNucMutations(oldVector);
-        if(!debugSimilarity(oldVector, node->nucMutation)) {
-            printError("Inaccuracy observed in subtree extract. Please report to creators");
-            return;
-        }
-    }
-
-    if(node->children.size() == 0) {
-        return;
-    }
-
-    tbb::parallel_for(tbb::blocked_range<int>(0, (int)node->children.size()), [&](tbb::blocked_range<int> r) {
-        for(int i = r.begin(); i < r.end(); i++) {
-            while(node->children[i]->children.size() == 1) {
-                if(nodeIdsToDefinitelyInclude.find(node->children[i]->identifier) != nodeIdsToDefinitelyInclude.end() ||
-                        nodeIdsToDefinitelyInclude.find(node->children[i]->children[0]->identifier) != nodeIdsToDefinitelyInclude.end()) {
-                    break;
+// Euler tour of a tree with a sparse table over the depths along the tour. Answers lowest common
+// ancestor queries in constant time and ancestry queries through the first and last visits
+struct EulerTourIndex {
+    std::unordered_map< panmanUtils::Node*, std::pair< size_t, size_t > > visits;
+    std::vector< panmanUtils::Node* > tour;
+    std::vector< size_t > depths;
+    // sparse[j][i] is the position of the shallowest node in tour[i, i + 2^j)
+    std::vector< std::vector< size_t > > sparse;
+
+    EulerTourIndex(panmanUtils::Node* root) {
+        std::vector< std::pair< panmanUtils::Node*, size_t > > stack;
+        stack.emplace_back(root, 0);
+        visits[root].first = 0;
+        tour.push_back(root);
+        depths.push_back(0);
+        while(!stack.empty()) {
+            auto& top = stack.back();
+            if(top.second < top.first->children.size()) {
+                panmanUtils::Node* child = top.first->children[top.second++];
+                visits[child].first = tour.size();
+                stack.emplace_back(child, 0);
+                tour.push_back(child);
+                depths.push_back(stack.size() - 1);
+            } else {
+                visits[top.first].second = tour.size() - 1;
+                stack.pop_back();
+                if(!stack.empty()) {
+                    tour.push_back(stack.back().first);
+                    depths.push_back(stack.size() - 1);
                 }
-                mergeNodes(node->children[i], node->children[i]->children[0]);
-            }
-            // consolidate mutations of parent
-            auto oldVector = node->children[i]->nucMutation;
-
-            if(nodeIdsToDefinitelyInclude.find(node->children[i]->identifier) != nodeIdsToDefinitelyInclude.end() ||
-                    (node->children[i]->children.size() == 1 &&
-                     nodeIdsToDefinitelyInclude.find(node->children[i]->children[0]->identifier) != nodeIdsToDefinitelyInclude.end())) {
-                node->children[i]->nucMutation = consolidateNucMutations(node->children[i]->nucMutation);
             }
+        }
 
-            if(!debugSimilarity(oldVector, node->children[i]->nucMutation)) {
-                printError("Inaccuracy observed in subtree extract. Please report to the"
-                           "creators.");
-                return;
+        sparse.emplace_back(tour.size());
+        for(size_t i = 0; i < tour.size(); i++) {
+            sparse[0][i] = i;
+        }
+        for(size_t j = 1; ((size_t)1 << j) <= tour.size(); j++) {
+            size_t half = (size_t)1 << (j - 1);
+            sparse.emplace_back(tour.size() - (half << 1) + 1);
+            for(size_t i = 0; i < sparse[j].size(); i++) {
+                size_t left = sparse[j-1][i], right = sparse[j-1][i + half];
+                sparse[j][i] = (depths[right] < depths[left]) ? right : left;
             }
-
-            compressTreeParallel(node->children[i], level + 1, nodeIdsToDefinitelyInclude);
         }
-    });
-
-}
-
-panmanUtils::Node* subtreeExtractParallelHelper(panmanUtils::Node* node, const tbb::concurrent_unordered_map< panmanUtils::Node*, size_t >& ticks) {
-    if(ticks.find(node) == ticks.end()) {
-        return nullptr;
     }
 
-    panmanUtils::Node* newNode = new panmanUtils::Node(node->identifier, node->branchLength);
-
-    for(auto mutation: node->nucMutation) {
-        newNode->nucMutation.push_back(mutation);
+    size_t preorder(panmanUtils::Node* node) const {
+        return visits.at(node).first;
     }
 
-    for(auto mutation: node->blockMutation) {
-        newNode->blockMutation.push_back(mutation);
+    bool isAncestor(panmanUtils::Node* ancestor, panmanUtils::Node* node) const {
+        const auto& a = visits.at(ancestor);
+        const auto& b = visits.at(node);
+        return a.first <= b.first && b.second <= a.second;
     }
 
-    newNode->children.resize(node->children.size(), nullptr);
-
-    // Extract children that have been ticked
-    tbb::parallel_for(tbb::blocked_range(0, (int)node->children.size()), [&](tbb::blocked_range<int> r) {
-        for(int i = r.begin(); i < r.end(); i++) {
-            panmanUtils::Node* child = node->children[i];
-            if(ticks.find(child) != ticks.end()) {
-
-                panmanUtils::Node* newChild = subtreeExtractParallelHelper(child, ticks);
-
-                newChild->parent = newNode;
-                newNode->children[i] = newChild;
-            }
+    panmanUtils::Node* lca(panmanUtils::Node* a, panmanUtils::Node* b) const {
+        size_t l = visits.at(a).first, r = visits.at(b).first;
+        if(l > r) {
+            std::swap(l, r);
         }
-    });
-
-    // Bring all children to front of array
-    size_t i = 0, j = 0;
-    while(j < newNode->children.size()) {
-        if(newNode->children[j] != nullptr) {
-            std::swap(newNode->children[i], newNode->children[j]);
-            i++;
+        size_t j = 0;
+        while(((size_t)2 << j) <= r - l + 1) {
+            j++;
         }
-        j++;
+        size_t left = sparse[j][l], right = sparse[j][r + 1 - ((size_t)1 << j)];
+        return tour[(depths[right] < depths[left]) ? right : left];
     }
-    newNode->children.resize(i);
-
-    return newNode;
-
-}
+};
 
 panmanUtils::Node* panmanUtils::Tree::subtreeExtractParallel(std::vector< std::string > nodeIds, const std::set< std::string >& nodeIdsToDefinitelyInclude) {
-    tbb::concurrent_vector< panmanUtils::Node* > requiredNodes;
-
-    std::atomic<bool> idDoesntExist = false;
-
-    tbb::parallel_for_each(nodeIds.begin(), nodeIds.end(), [&](std::string& id) {
+    std::vector< panmanUtils::Node* > requiredNodes;
+    for(const auto& id: nodeIds) {
+        if(allNodes.find(id) == allNodes.end()) {
+            printError("Some of the specified node identifiers don't exist!!!");
+            return nullptr;
+        }
+        requiredNodes.push_back(allNodes[id]);
+    }
+    for(const auto& id: nodeIdsToDefinitelyInclude) {
         if(allNodes.find(id) != allNodes.end()) {
             requiredNodes.push_back(allNodes[id]);
-        } else {
-            idDoesntExist = true;
         }
-    });
-
-    if(idDoesntExist) {
-        printError("Some of the specified node identifiers don't exist!!!");
+    }
+    if(requiredNodes.empty()) {
         return nullptr;
     }
 
-    tbb::concurrent_unordered_map< panmanUtils::Node*, size_t > ticks;
+    // The induced subtree consists of the required nodes and the lowest common ancestors of
+    // consecutive required nodes in preorder
+    EulerTourIndex index(root);
+    auto byPreorder = [&](panmanUtils::Node* a, panmanUtils::Node* b) {
+        return index.preorder(a) < index.preorder(b);
+    };
+    std::sort(requiredNodes.begin(), requiredNodes.end(), byPreorder);
+    requiredNodes.erase(std::unique(requiredNodes.begin(), requiredNodes.end()), requiredNodes.end());
+    size_t numRequired = requiredNodes.size();
+    for(size_t i = 1; i < numRequired; i++) {
+        requiredNodes.push_back(index.lca(requiredNodes[i-1], requiredNodes[i]));
+    }
+    std::sort(requiredNodes.begin(), requiredNodes.end(), byPreorder);
+    requiredNodes.erase(std::unique(requiredNodes.begin(), requiredNodes.end()), requiredNodes.end());
+
+    // Parent of every node in the induced subtree, with the first node as its root
+    std::vector< int64_t > parents(requiredNodes.size(), -1);
+    std::vector< size_t > stack;
+    for(size_t i = 0; i < requiredNodes.size(); i++) {
+        while(!stack.empty() && !index.isAncestor(requiredNodes[stack.back()], requiredNodes[i])) {
+            stack.pop_back();
+        }
+        if(!stack.empty()) {
+            parents[i] = stack.back();
+        }
+        stack.push_back(i);
+    }
 
-    tbb::parallel_for_each(requiredNodes.begin(), requiredNodes.end(), [&](panmanUtils::Node*& node) {
-        Node* current = node;
+    // Each node takes the chain of branches up to its parent in the induced subtree, or up to
+    // the root of the tree, with the mutations of the chain consolidated in one pass. The chain
+    // keeps the identifier of its lowest node, so required nodes keep their names
+    std::vector< panmanUtils::Node* > newNodes(requiredNodes.size());
+    tbb::parallel_for((size_t)0, requiredNodes.size(), [&](size_t i) {
+        panmanUtils::Node* stop = (parents[i] == -1) ? nullptr : requiredNodes[parents[i]];
+        std::vector< panmanUtils::Node* > chain;
+        float branchLength = 0;
+        for(panmanUtils::Node* it = requiredNodes[i]; it != stop; it = it->parent) {
+            chain.push_back(it);
+            branchLength += it->branchLength;
+        }
 
-        while(current != nullptr) {
-            ticks[current]++;
-            current = current->parent;
+        panmanUtils::Node* newNode = new panmanUtils::Node(requiredNodes[i]->identifier, branchLength);
+        if(chain.size() == 1) {
+            newNode->nucMutation = chain[0]->nucMutation;
+            newNode->blockMutation = chain[0]->blockMutation;
+        } else {
+            std::vector< panmanUtils::NucMut > nucMuts;
+            std::vector< panmanUtils::BlockMut > blockMuts;
+            for(auto it = chain.rbegin(); it != chain.rend(); it++) {
+                nucMuts.insert(nucMuts.end(), (*it)->nucMutation.begin(), (*it)->nucMutation.end());
+                blockMuts.insert(blockMuts.end(), (*it)->blockMutation.begin(), (*it)->blockMutation.end());
+            }
+            newNode->nucMutation = consolidateNucMutations(nucMuts);
+            newNode->blockMutation = consolidateBlockMutations(blockMuts);
         }
+        newNodes[i] = newNode;
     });
 
-    panmanUtils::Node* newTreeRoot = subtreeExtractParallelHelper(root, ticks);
-
-    compressTreeParallel(newTreeRoot, 1, nodeIdsToDefinitelyInclude);
+    // Nodes are in preorder, so parents are linked and levelled before their children
+    newNodes[0]->level = 1;
+    for(size_t i = 1; i < newNodes.size(); i++) {
+        panmanUtils::Node* parent = newNodes[parents[i]];
+        newNodes[i]->parent = parent;
+        newNodes[i]->level = parent->level + 1;
+        parent->children.push_back(newNodes[i]);
+    }
 
-    return newTreeRoot;
+    return newNodes[0];
 }
 
 
 panmanUtils::TreeGroup* panmanUtils::TreeGroup::subnetworkExtract(std::unordered_map< int, std::vector< std::string > >& nodeIds) {
-    // Temporary directory to store subtrees
-    std::filesystem::create_directory("./temp_panman");
-    std::vector< std::string > fileNames;
+    // The subnetwork is assembled in memory from the extracted subtrees. PanMATs without any
+    // selected nodes are left out, so tree indices of complex mutations are remapped
+    std::vector< Tree* > noTrees;
+    TreeGroup* subnetwork = new TreeGroup(noTrees);
+    subnetwork->trees.reserve(trees.size());
+    std::vector< int64_t > newTreeIndex(trees.size(), -1);
+
     for (size_t i = 0; i < trees.size(); i++) {
-        std::vector< std::string > subtreeNodeIds = nodeIds[i];
         std::set< std::string > cplxMutationNodeIds;
-        for (auto mutation: complexMutations) {
+        for (const auto& mutation: complexMutations) {
             if (mutation.treeIndex1 == i) {
                 cplxMutationNodeIds.insert(mutation.sequenceId1);
-            } else if(mutation.treeIndex2 == i) {
+            }
+            if (mutation.treeIndex2 == i) {
                 cplxMutationNodeIds.insert(mutation.sequenceId2);
-            } else if(mutation.treeIndex3 == i) {
+            }
+            if (mutation.treeIndex3 == i) {
                 cplxMutationNodeIds.insert(mutation.sequenceId3);
             }
         }
 
-        std::set< std::string > subtreeNodeIdSet(subtreeNodeIds.begin(), subtreeNodeIds.end());
-        for (auto id: cplxMutationNodeIds) {
-            subtreeNodeIdSet.insert(id);
+        std::set< std::string > subtreeNodeIdSet(cplxMutationNodeIds);
+        auto selected = nodeIds.find(i);
+        if (selected != nodeIds.end()) {
+            subtreeNodeIdSet.insert(selected->second.begin(), selected->second.end());
+        }
+        if (subtreeNodeIdSet.empty()) {
+            continue;
         }
 
-        subtreeNodeIds = std::vector< std::string >(subtreeNodeIdSet.begin(), subtreeNodeIdSet.end());
-
-        std::string fileName = "./temp_panman/panmat_" + std::to_string(i) + ".panmat";
-
-        std::ofstream outputFile(fileName);
-        fileNames.push_back(fileName);
-
-        boost::iostreams::filtering_streambuf< boost::iostreams::output>
-        outPMATBuffer;
-        outPMATBuffer.push(boost::iostreams::gzip_compressor());
-        outPMATBuffer.push(outputFile);
-        std::ostream outstream(&outPMATBuffer);
-        kj::std::StdOutputStream outputStream(outstream);
-        
-        trees[i].writeToFile(outputStream, trees[i].subtreeExtractParallel(subtreeNodeIds, cplxMutationNodeIds));
+        std::vector< std::string > subtreeNodeIds(subtreeNodeIdSet.begin(), subtreeNodeIdSet.end());
+        Node* newRoot = trees[i].subtreeExtractParallel(subtreeNodeIds, cplxMutationNodeIds);
+        if (newRoot == nullptr) {
+            delete subnetwork;
+            return nullptr;
+        }
 
-        boost::iostreams::close(outPMATBuffer);
-        outputFile.close();
+        newTreeIndex[i] = subnetwork->trees.size();
+        subnetwork->trees.emplace_back(newRoot, trees[i].blocks, trees[i].gaps, trees[i].circularSequences,
+                                       trees[i].rotationIndexes, trees[i].sequenceInverted, trees[i].blockGaps);
     }
 
-    std::ofstream outputFile;
-    std::streambuf * buf;
-    outputFile.open("./temp_panman/cplx");
-    buf = outputFile.rdbuf();
-
-    std::ostream fout (buf);
-
-    printComplexMutations(fout);
-
-    outputFile.close();
-
-    std::ifstream cplxMutationFile("./temp_panman/cplx");
-
-    std::vector< std::ifstream > files;
-    for(auto f: fileNames) {
-        files.emplace_back(f);
+    // All sequences referred to by complex mutations are kept, so their block coordinates stay valid
+    for (auto mutation: complexMutations) {
+        mutation.treeIndex1 = newTreeIndex[mutation.treeIndex1];
+        mutation.treeIndex2 = newTreeIndex[mutation.treeIndex2];
+        mutation.treeIndex3 = newTreeIndex[mutation.treeIndex3];
+        subnetwork->complexMutations.push_back(mutation);
     }
 
-    TreeGroup* subnetwork = new TreeGroup(files, cplxMutationFile);
-
-    cplxMutationFile.close();
-
-    // Delete temporary directory
-    std::filesystem::remove_all("./temp_panman");
-
     return subnetwork;
 }
@@ -1,273 +1,405 @@
 #include "panmanUtils.hpp"
 
-int getTotalParsimonyParallelHelper(panmanUtils::Node* root, panmanUtils::NucMutationType nucMutType, panmanUtils::BlockMutationType blockMutType) {
-    int totalMutations = 0;
-
-    if(nucMutType != panmanUtils::NucMutationType::NNONE) {
-        totalMutations += tbb::parallel_reduce(tbb::blocked_range<int>(0, root->nucMutation.size()), 0, [&](tbb::blocked_range<int> r, int init) -> int{
-            for(int i = r.begin(); i != r.end(); i++) {
-                if(root->nucMutation[i].type() == nucMutType) {
-                    if(nucMutType == panmanUtils::NucMutationType::NS) {
-                        init += root->nucMutation[i].length(); // Length of contiguous mutation in case of substitution
-                    } else {
-                        init++;
-                    }
-                }
-            }
-            return init;
-        }, [&](int x, int y) {
-            return x + y;
-        });
-    }
-
-    if(blockMutType == panmanUtils::BlockMutationType::BIn) {
-        totalMutations += tbb::parallel_reduce(tbb::blocked_range<int>(0, root->blockMutation.size()), 0, [&](tbb::blocked_range<int> r, int init) -> int{
-            for(int i = r.begin(); i != r.end(); i++) {
-                if(root->blockMutation[i].inversion == true) {
-                    init++;
-                }
-            }
-            return init;
-        }, [&](int x, int y) {
-            return x + y;
-        });
-    } else if(blockMutType != panmanUtils::BlockMutationType::NONE) {
-        totalMutations += tbb::parallel_reduce(tbb::blocked_range<int>(0, root->blockMutation.size()), 0, [&](tbb::blocked_range<int> r, int init) -> int{
-            for(int i = r.begin(); i != r.end(); i++) {
-                // If not an inversion and mut type matches. Inversion is marked by blockMutInfo = deletion and inversion = true
-                if((blockMutType == panmanUtils::BlockMutationType::BI || root->blockMutation[i].inversion == false) && root->blockMutation[i].blockMutInfo == blockMutType) {
-                    init++;
-                }
-            }
-            return init;
-        }, [&](int x, int y) {
-            return x + y;
-        });
-    }
-
-    totalMutations += tbb::parallel_reduce(tbb::blocked_range<int>(0, root->children.size()), 0, [&](tbb::blocked_range<int>& r, int init) -> int{
-        for(int i = r.begin(); i != r.end(); i++) {
-            init += getTotalParsimonyParallelHelper(root->children[i], nucMutType, blockMutType);
+struct VectorHash {
+    std::size_t operator()(const std::vector<uint32_t>& vec) const {
+        std::size_t hash = 0;
+        for (uint32_t num : vec) {
+            hash ^= std::hash<int>()(num) + 0x9e3779b9 + (hash << 6) + (hash >> 2);
         }
-        return init;
-    },
-    [](int x, int y) -> int {
-        return x+y;
-    });
-
-    return totalMutations;
-}
+        return hash;
+    }
+};
 
-int panmanUtils::Tree::getTotalParsimonyParallel(NucMutationType nucMutType, BlockMutationType blockMutType) {
+// State shared across the summary traversal
+struct SummaryTraversalState {
+    // Whether each primary block exists in the current node
+    std::vector< bool > blockExists;
 
-    return getTotalParsimonyParallelHelper(root, nucMutType, blockMutType);
+    // Blocks grouped by identical consensus sequence, and the group of each primary block
+    std::vector< std::vector< uint32_t > > dups;
+    std::vector< uint32_t > dupsPos;
 
-}
+    // Sum and count of leaf depths
+    size_t totalLeafDepth = 0;
+};
 
-std::tuple<int, int, int> getBlockMutationsParallelHelper(panmanUtils::Node* root) {
-    std::tuple<int, int, int> muts(0,0,0);
+static void getSummaryStatisticsHelper(panmanUtils::Node* node, size_t depth,
+                                       SummaryTraversalState& state,
+                                       panmanUtils::SummaryStatistics& stats) {
+    stats.totalNodes++;
+    if(node->children.size() == 0) {
+        stats.totalLeaves++;
+        stats.maxDepth = std::max(stats.maxDepth, depth);
+        state.totalLeafDepth += depth;
+    }
 
-    std::get<0>(muts) += tbb::parallel_reduce(tbb::blocked_range<int>(0, root->blockMutation.size()), 0, [&](tbb::blocked_range<int> r, int init) -> int{
-        for(int i = r.begin(); i != r.end(); i++) {
-            if(root->blockMutation[i].blockMutInfo == panmanUtils::BlockMutationType::BI) {
-                init++;
-            }
-        }
-        return init;
-    }, [&](int x, int y) {
-        return x + y;
-    });
-
-    std::get<1>(muts) += tbb::parallel_reduce(tbb::blocked_range<int>(0, root->blockMutation.size()), 0, [&](tbb::blocked_range<int> r, int init) -> int{
-        for(int i = r.begin(); i != r.end(); i++) {
-            if(root->blockMutation[i].inversion == false && root->blockMutation[i].blockMutInfo == panmanUtils::BlockMutationType::BD) {
-                init++;
-            }
+    // Nucleotide mutations
+    size_t mutatedNucs = 0;
+    for(const auto& mutation: node->nucMutation) {
+        int len = mutation.length();
+        mutatedNucs += len;
+        switch(mutation.type()) {
+        case panmanUtils::NucMutationType::NS:
+            // Length of contiguous mutation in case of substitution
+            stats.substitutions += len;
+            break;
+        case panmanUtils::NucMutationType::NI:
+            stats.insertions++;
+            break;
+        case panmanUtils::NucMutationType::ND:
+            stats.deletions++;
+            break;
+        case panmanUtils::NucMutationType::NSNPS:
+            stats.snpSubstitutions++;
+            break;
+        case panmanUtils::NucMutationType::NSNPI:
+            stats.snpInsertions++;
+            break;
+        case panmanUtils::NucMutationType::NSNPD:
+            stats.snpDeletions++;
+            break;
+        default:
+            break;
         }
-        return init;
-    }, [&](int x, int y) {
-        return x + y;
-    });
-    
-    std::get<2>(muts) += tbb::parallel_reduce(tbb::blocked_range<int>(0, root->blockMutation.size()), 0, [&](tbb::blocked_range<int> r, int init) -> int{
-        for(int i = r.begin(); i != r.end(); i++) {
-            if(root->blockMutation[i].inversion == true && root->blockMutation[i].blockMutInfo == panmanUtils::BlockMutationType::BD) {
-                init++;
-            }
-        }
-        return init;
-    }, [&](int x, int y) {
-        return x + y;
-    });
-    
-
-    for (auto i=0; i< root->children.size(); i++) {
-        std::tuple<int, int, int> child_muts = getBlockMutationsParallelHelper(root->children[i]);
-        std::get<0>(muts) += std::get<0>(child_muts);
-        std::get<1>(muts) += std::get<1>(child_muts);
-        std::get<2>(muts) += std::get<2>(child_muts);
     }
+    stats.nucMutationHistogram[mutatedNucs]++;
+    stats.blockMutationHistogram[node->blockMutation.size()]++;
 
-    return muts;
-}
-
-std::tuple<int, int> getOtherBlockMutationsParallelHelper(
-    panmanUtils::Node* root, 
-    std::vector< bool >& blockExists,
-    std::vector< bool >& blockStrand,
-    std::vector<std::vector<uint32_t>>& dups,
-    std::vector<uint32_t>& dupsPos) {
-    
-    std::tuple<int, int> muts(0,0);
-    std::vector< bool > blockExistsParent = blockExists;
-    // For reversing block mutations - primary block id, secondary block id, old mutation, old strand, new mutation, new strand
-    std::vector< std::tuple< int32_t, bool, bool, bool, bool > > blockMutationInfo;
-
-    // Block Mutations
-    for(auto mutation: root->blockMutation) {
+    // Block mutations. For reversing them - primary block id, old existence
+    std::vector< std::pair< int32_t, bool > > blockMutationInfo;
+    for(const auto& mutation: node->blockMutation) {
         int32_t primaryBlockId = mutation.primaryBlockId;
-        bool type = mutation.blockMutInfo;
         bool inversion = mutation.inversion;
 
-        // std::vector<uint32_t> copies = map_[blocks[]]
-
-        if(type == 1) {
-            // insertion
-            bool oldStrand;
-            bool oldMut;
-            oldStrand = blockStrand[primaryBlockId];
-            oldMut = blockExists[primaryBlockId];
-            blockExists[primaryBlockId] = true;
-
-            // if insertion of inverted block takes place, the strand is backwards
-            blockStrand[primaryBlockId] = !inversion;
-            blockMutationInfo.push_back( std::make_tuple(mutation.primaryBlockId, oldMut, oldStrand, true, !inversion) );
+        if(inversion) {
+            stats.inversions++;
+        }
 
+        blockMutationInfo.push_back(std::make_pair(primaryBlockId,
+                                    state.blockExists[primaryBlockId]));
+        if(mutation.blockMutInfo == panmanUtils::BlockMutationType::BI) {
+            stats.blockInsertions++;
+            state.blockExists[primaryBlockId] = true;
+        } else if(inversion) {
+            // This is not actually a deletion but an inversion, so the block still exists
+            stats.blockInversions++;
         } else {
-            bool oldMut;
-            bool oldStrand;
-            if(inversion) {
-                // This means that this is not a deletion, but instead an inversion
-                oldStrand = blockStrand[primaryBlockId];
-                oldMut = blockExists[primaryBlockId];
-                blockStrand[primaryBlockId] = !oldStrand;
-                
-                if(oldMut != true) {
-                    // std::cout << "There was a problem in PanMAT generation. Please Report." << std::endl;
-                }
-                blockMutationInfo.push_back( std::make_tuple(mutation.primaryBlockId, oldMut, oldStrand, oldMut, !oldStrand) );
-            } else {
-                // Actually a deletion
-                oldStrand = blockStrand[primaryBlockId];
-                oldMut = blockExists[primaryBlockId];
-                blockExists[primaryBlockId] = false;
+            stats.blockDeletions++;
+            state.blockExists[primaryBlockId] = false;
+        }
+    }
 
-                // resetting strand to true during deletion
-                blockStrand[primaryBlockId] = true;
+    if(blockMutationInfo.size()) {
+        // State of the blocks changed at this node in the parent
+        std::unordered_map< int32_t, bool > parentBlockExists;
+        for(const auto& info: blockMutationInfo) {
+            parentBlockExists.insert(info);
+        }
+        auto existsInParent = [&](uint32_t blockId) {
+            auto it = parentBlockExists.find(blockId);
+            return (it != parentBlockExists.end()) ? it->second : (bool)state.blockExists[blockId];
+        };
+
+        // An inserted block is a duplication if an identical block is still present, and a
+        // translocation if an identical block was removed at this node
+        for(const auto& mutation: node->blockMutation) {
+            int32_t primaryBlockId = mutation.primaryBlockId;
+            if(mutation.blockMutInfo != panmanUtils::BlockMutationType::BI) {
+                continue;
+            }
+            for(auto d: state.dups[state.dupsPos[primaryBlockId]]) {
+                if(d == (uint32_t)primaryBlockId || !existsInParent(d)) {
+                    continue;
+                }
+                if(state.blockExists[d]) {
+                    stats.blockDuplications++;
+                } else {
+                    stats.blockTranslocations++;
+                }
+                break;
             }
-            blockMutationInfo.push_back( std::make_tuple(mutation.primaryBlockId, oldMut, oldStrand, false, true) );
         }
     }
 
-    // std::cout << (blockExists ==  blockExistsParent) << std::endl;
+    for(auto child: node->children) {
+        getSummaryStatisticsHelper(child, depth + 1, state, stats);
+    }
 
-    for(auto mutation: root->blockMutation) {
-        int32_t primaryBlockId = mutation.primaryBlockId;
-        bool type = mutation.blockMutInfo;
+    // Undo block mutations when current node and its subtree have been processed
+    for(auto it = blockMutationInfo.rbegin(); it != blockMutationInfo.rend(); it++) {
+        state.blockExists[it->first] = it->second;
+    }
+}
 
-        if (type==1) {
-            std::vector<uint32_t> localDups = dups[dupsPos[primaryBlockId]];
-            for (auto d: localDups){
-                if (d!=primaryBlockId & blockExists[d] & blockExistsParent[d]) {
-                    std::get<0>(muts) += 1;
-                    break;
-                }
+panmanUtils::SummaryStatistics panmanUtils::Tree::getSummaryStatistics() {
+    SummaryStatistics stats;
+    SummaryTraversalState state;
 
-                if (d!=primaryBlockId & !blockExists[d] & blockExistsParent[d]) {
-                    std::get<1>(muts) += 1;
-                    break;
-                }
-            }            
+    // get duplicate blocks mapping (consensus to blockIDs)
+    std::unordered_map<std::vector<uint32_t>, std::vector<uint32_t>, VectorHash> map_;
+    size_t numBlocks = 0;
+    for (size_t i = 0; i < blocks.size(); i++) {
+        map_[blocks[i].consensusSeq].push_back(blocks[i].primaryBlockId);
+        numBlocks = std::max(numBlocks, (size_t)blocks[i].primaryBlockId + 1);
+    }
+    state.dupsPos.resize(numBlocks);
+    for(auto &a: map_) {
+        for (auto &b: a.second) {
+            state.dupsPos[b] = state.dups.size();
         }
+        state.dups.push_back(std::move(a.second));
     }
+    state.blockExists.resize(numBlocks, false);
 
-    for(panmanUtils::Node* child: root->children) {
-        std::tuple<int, int> mutsChild = getOtherBlockMutationsParallelHelper(child, blockExists, blockStrand, dups, dupsPos);
-        std::get<0>(muts) += std::get<0>(mutsChild);
-        std::get<1>(muts) += std::get<1>(mutsChild);
+    getSummaryStatisticsHelper(root, 0, state, stats);
+
+    if(stats.totalLeaves) {
+        stats.meanDepth = (double)state.totalLeafDepth / stats.totalLeaves;
     }
+    return stats;
+}
 
-     // Undo block mutations when current node and its subtree have been processed
-    for(auto it = blockMutationInfo.rbegin(); it != blockMutationInfo.rend(); it++) {
-        auto mutation = *it;
-        blockExists[std::get<0>(mutation)] = std::get<1>(mutation);
-        blockStrand[std::get<0>(mutation)] = std::get<2>(mutation);
+// Write summary statistics as text or as a single line JSON object
+static void writeSummaryStatistics(const panmanUtils::SummaryStatistics& stats, std::ostream &out,
+                                   bool json) {
+    if(json) {
+        Json::Value summary;
+        summary["nodes"] = (Json::UInt64)stats.totalNodes;
+        summary["samples"] = (Json::UInt64)stats.totalLeaves;
+        summary["substitutions"] = (Json::Int64)stats.substitutions;
+        summary["insertions"] = (Json::Int64)(stats.insertions + stats.blockInsertions);
+        summary["deletions"] = (Json::Int64)(stats.deletions + stats.blockDeletions);
+        summary["inversions"] = (Json::Int64)stats.inversions;
+        summary["nuc_insertions"] = (Json::Int64)stats.insertions;
+        summary["nuc_deletions"] = (Json::Int64)stats.deletions;
+        summary["snp_substitutions"] = (Json::Int64)stats.snpSubstitutions;
+        summary["snp_insertions"] = (Json::Int64)stats.snpInsertions;
+        summary["snp_deletions"] = (Json::Int64)stats.snpDeletions;
+        summary["block_insertions"] = (Json::Int64)stats.blockInsertions;
+        summary["block_deletions"] = (Json::Int64)stats.blockDeletions;
+        summary["block_inversions"] = (Json::Int64)stats.blockInversions;
+        summary["block_duplications"] = (Json::Int64)stats.blockDuplications;
+        summary["block_translocations"] = (Json::Int64)stats.blockTranslocations;
+        summary["max_depth"] = (Json::UInt64)stats.maxDepth;
+        summary["mean_depth"] = stats.meanDepth;
+        for(const auto& bin: stats.nucMutationHistogram) {
+            summary["nuc_mutation_histogram"][std::to_string(bin.first)] = (Json::UInt64)bin.second;
+        }
+        for(const auto& bin: stats.blockMutationHistogram) {
+            summary["block_mutation_histogram"][std::to_string(bin.first)] = (Json::UInt64)bin.second;
+        }
+
+        // One object per line
+        Json::StreamWriterBuilder builder;
+        builder["indentation"] = "";
+        out << Json::writeString(builder, summary) << std::endl;
+        return;
     }
 
-    return muts;
+    out << "Total Nodes in Tree: " << stats.totalNodes << std::endl;
+    out << "Total Samples in Tree: " << stats.totalLeaves << std::endl;
+    out << "Total Substitutions: " << stats.substitutions << std::endl;
+    out << "Total Insertions: " << stats.insertions + stats.blockInsertions << std::endl;
+    out << "Total Deletions: " << stats.deletions + stats.blockDeletions << std::endl;
+    out << "Total Inversions: " << stats.inversions << std::endl;
+    out << "Max Tree Depth: " << stats.maxDepth << std::endl;
+    out << "Mean Tree Depth: " << stats.meanDepth << std::endl;
+    out << "Total Block Insertions: " << stats.blockInsertions << std::endl;
+    out << "Total Block Deletions: " << stats.blockDeletions << std::endl;
+    out << "Total Block Inversion: " << stats.blockInversions << std::endl;
+    out << "Total Block Duplications: " << stats.blockDuplications << std::endl;
+    out << "Total Block Translocation: " << stats.blockTranslocations << std::endl;
 }
 
-struct VectorHash {
-    std::size_t operator()(const std::vector<uint32_t>& vec) const {
-        std::size_t hash = 0;
-        for (uint32_t num : vec) {
-            hash ^= std::hash<int>()(num) + 0x9e3779b9 + (hash << 6) + (hash >> 2);
+void panmanUtils::Tree::printSummary(std::ostream &out, bool json) {
+    writeSummaryStatistics(getSummaryStatistics(), out, json);
+}
+
+// Parent of every node in preorder, read from a Newick string without building the tree. Returns
+// false if the parentheses don't match
+static bool scanNewickTopology(const std::string& newick, std::vector< int32_t >& parents) {
+    std::vector< int32_t > parentStack;
+    // Whether the current characters are part of a leaf name, or of a branch length or internal
+    // node label that should be skipped
+    bool inLeaf = false, skip = false;
+    for(char c: newick) {
+        if(c == '(') {
+            parents.push_back(parentStack.empty() ? -1 : parentStack.back());
+            parentStack.push_back(parents.size() - 1);
+            inLeaf = false;
+            skip = false;
+        } else if(c == ',') {
+            inLeaf = false;
+            skip = false;
+        } else if(c == ')') {
+            if(parentStack.empty()) {
+                return false;
+            }
+            parentStack.pop_back();
+            inLeaf = false;
+            skip = true;
+        } else if(c == ':') {
+            inLeaf = false;
+            skip = true;
+        } else if(c == ';') {
+            break;
+        } else if(!skip && !inLeaf && !isspace(c)) {
+            parents.push_back(parentStack.empty() ? -1 : parentStack.back());
+            inLeaf = true;
         }
-        return hash;
     }
-};
+    return parentStack.empty();
+}
 
-void panmanUtils::Tree::getBlockMutationsParallel() {
-    //insertions, deletions, inversions
-    std::tuple<int, int, int> muts = getBlockMutationsParallelHelper(root);
-    std::cout << "Total Block Insertions: " <<  std::get<0>(muts) << std::endl;
-    std::cout << "Total Block Deletions: " <<  std::get<1>(muts) << std::endl;
-    std::cout << "Total Block Inversion: " <<  std::get<2>(muts) << std::endl;
+bool panmanUtils::printSummaryFromReader(const panman::Tree::Reader& tree, std::ostream &out,
+        bool json) {
+    SummaryStatistics stats;
 
-    // get duplicate blocks mapping (consensus to blockIDs)
-    std::unordered_map<std::vector<uint32_t>, std::vector<uint32_t>, VectorHash> map_;
-    for (auto i=0; i<blocks.size(); i++) {
-        std::vector<uint32_t> consensus = blocks[i].consensusSeq;
-        map_[consensus].push_back(blocks[i].primaryBlockId);
+    std::vector< int32_t > parents;
+    if(!scanNewickTopology(tree.getNewick().cStr(), parents)) {
+        printError("Incorrect Newick format");
+        return false;
+    }
+    auto nodes = tree.getNodes();
+    if(parents.size() != nodes.size()) {
+        printError("Number of nodes in the Newick string does not match the mutation list");
+        return false;
     }
 
-    std::unordered_map<std::vector<uint32_t>, int, VectorHash> mapIndex;
-    std::vector<std::vector<uint32_t>> dups(map_.size());
-    std::vector<uint32_t> dupsPos(blocks.size());
-
-    int index = 0;
-    for(auto &a: map_){
-        mapIndex[a.first] = index;
-        for (auto &b: a.second){
-            dupsPos[b] = index;
+    // Blocks with identical consensus sequences are already grouped in the consensus map
+    SummaryTraversalState state;
+    size_t numBlocks = 0;
+    for(auto consensusMapElement: tree.getConsensusSeqMap()) {
+        std::vector< uint32_t > group;
+        for(auto blockId: consensusMapElement.getBlockId()) {
+            group.push_back(blockId >> 32);
+            numBlocks = std::max(numBlocks, (size_t)(blockId >> 32) + 1);
+        }
+        state.dups.push_back(std::move(group));
+    }
+    state.dupsPos.resize(numBlocks);
+    for(size_t i = 0; i < state.dups.size(); i++) {
+        for(auto b: state.dups[i]) {
+            state.dupsPos[b] = i;
+        }
+    }
+    state.blockExists.resize(numBlocks, false);
+
+    std::vector< size_t > numChildren(parents.size(), 0);
+    std::vector< size_t > depth(parents.size(), 0);
+    for(size_t i = 0; i < parents.size(); i++) {
+        if(parents[i] != -1) {
+            numChildren[parents[i]]++;
+            depth[i] = depth[parents[i]] + 1;
         }
-        dups[index] = a.second;
-        index++;
     }
 
-    // List of blocks. Each block has a nucleotide list. Along with each nucleotide is a gap list.
-    std::vector< bool >  blockExists(blocks.size(), false);
-    std::vector< bool >  blockStrand(blocks.size(), true);
+    // Nodes are stored in preorder, so the ancestors of the current node are kept on a stack
+    // along with the block mutations to undo when leaving them - primary block id, old existence
+    std::vector< std::pair< int32_t, std::vector< std::pair< int32_t, bool > > > > ancestors;
+    for(size_t i = 0; i < parents.size(); i++) {
+        while(ancestors.size() && ancestors.back().first != parents[i]) {
+            const auto& blockMutationInfo = ancestors.back().second;
+            for(auto it = blockMutationInfo.rbegin(); it != blockMutationInfo.rend(); it++) {
+                state.blockExists[it->first] = it->second;
+            }
+            ancestors.pop_back();
+        }
 
-    std::tuple<int, int> otherMuts = getOtherBlockMutationsParallelHelper(root, blockExists, blockStrand, dups, dupsPos);
-    std::cout << "Total Block Duplications: " <<  std::get<0>(otherMuts) << std::endl;
-    std::cout << "Total Block Translocation: " <<  std::get<1>(otherMuts) << std::endl;
-}
+        stats.totalNodes++;
+        if(numChildren[i] == 0) {
+            stats.totalLeaves++;
+            stats.maxDepth = std::max(stats.maxDepth, depth[i]);
+            state.totalLeafDepth += depth[i];
+        }
 
-void panmanUtils::Tree::printSummary(std::ostream &out) {
+        size_t mutatedNucs = 0, blockMutations = 0;
+        std::vector< std::pair< int32_t, bool > > blockMutationInfo;
+        std::vector< int32_t > insertedBlocks;
+        for(auto mutation: nodes[i].getMutations()) {
+            for(auto nucMut: mutation.getNucMutation()) {
+                // Lower 8 bits of mutInfo hold the length and type of the mutation
+                uint32_t mutInfo = (nucMut.getMutInfo() & 0xFF);
+                int len = (mutInfo >> 4);
+                mutatedNucs += len;
+                switch(mutInfo & 0x7) {
+                case panmanUtils::NucMutationType::NS:
+                    stats.substitutions += len;
+                    break;
+                case panmanUtils::NucMutationType::NI:
+                    stats.insertions++;
+                    break;
+                case panmanUtils::NucMutationType::ND:
+                    stats.deletions++;
+                    break;
+                case panmanUtils::NucMutationType::NSNPS:
+                    stats.snpSubstitutions++;
+                    break;
+                case panmanUtils::NucMutationType::NSNPI:
+                    stats.snpInsertions++;
+                    break;
+                case panmanUtils::NucMutationType::NSNPD:
+                    stats.snpDeletions++;
+                    break;
+                default:
+                    break;
+                }
+            }
 
-    out << "Total Nodes in Tree: " << m_currInternalNode + m_numLeaves << std::endl;
-    out << "Total Samples in Tree: " << m_numLeaves << std::endl;
-    out << "Total Substitutions: " << getTotalParsimonyParallel(panmanUtils::NucMutationType::NS) << std::endl;
-    out << "Total Insertions: " << getTotalParsimonyParallel(panmanUtils::NucMutationType::NI, panmanUtils::BlockMutationType::BI) << std::endl;
-    out << "Total Deletions: " << getTotalParsimonyParallel(panmanUtils::NucMutationType::ND, panmanUtils::BlockMutationType::BD) << std::endl;
-    out << "Total Inversions: " << getTotalParsimonyParallel(panmanUtils::NucMutationType::NNONE, panmanUtils::BlockMutationType::BIn) << std::endl;
-    // out << "Total SNP Substitutions: " << getTotalParsimonyParallel(panmanUtils::NucMutationType::NSNPS) << std::endl;
-    // out << "Total SNP Insertions: " << getTotalParsimonyParallel(panmanUtils::NucMutationType::NSNPI) << std::endl;
-    // out << "Total SNP Deletions: " << getTotalParsimonyParallel(panmanUtils::NucMutationType::NSNPD) << std::endl;
-    out << "Max Tree Depth: " << m_maxDepth << std::endl;
-    out << "Mean Tree Depth: " << m_meanDepth << std::endl;
+            if(!mutation.getBlockMutExist()) {
+                continue;
+            }
+            blockMutations++;
+            int32_t primaryBlockId = (mutation.getBlockId() >> 32);
+            bool inversion = mutation.getBlockInversion();
+            if(inversion) {
+                stats.inversions++;
+            }
+            blockMutationInfo.push_back(std::make_pair(primaryBlockId,
+                                        state.blockExists[primaryBlockId]));
+            if(mutation.getBlockMutInfo()) {
+                stats.blockInsertions++;
+                state.blockExists[primaryBlockId] = true;
+                insertedBlocks.push_back(primaryBlockId);
+            } else if(inversion) {
+                stats.blockInversions++;
+            } else {
+                stats.blockDeletions++;
+                state.blockExists[primaryBlockId] = false;
+            }
+        }
+        stats.nucMutationHistogram[mutatedNucs]++;
+        stats.blockMutationHistogram[blockMutations]++;
 
-    getBlockMutationsParallel();
+        if(insertedBlocks.size()) {
+            std::unordered_map< int32_t, bool > parentBlockExists;
+            for(const auto& info: blockMutationInfo) {
+                parentBlockExists.insert(info);
+            }
+            for(auto primaryBlockId: insertedBlocks) {
+                for(auto d: state.dups[state.dupsPos[primaryBlockId]]) {
+                    auto it = parentBlockExists.find(d);
+                    bool existsInParent = (it != parentBlockExists.end()) ? it->second
+                                          : (bool)state.blockExists[d];
+                    if(d == (uint32_t)primaryBlockId || !existsInParent) {
+                        continue;
+                    }
+                    if(state.blockExists[d]) {
+                        stats.blockDuplications++;
+                    } else {
+                        stats.blockTranslocations++;
+                    }
+                    break;
+                }
+            }
+        }
 
+        ancestors.push_back(std::make_pair(i, std::move(blockMutationInfo)));
+    }
+
+    if(stats.totalLeaves) {
+        stats.meanDepth = (double)state.totalLeafDepth / stats.totalLeaves;
+    }
+    writeSummaryStatistics(stats, out, json);
+    return true;
 }